@@ -1,317 +1,4708 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define PORT 8080
+#define BUFFER_SIZE 8192
+#define MAX_PATH_LEN 512
+#define MAX_HEADERS 64
+#define DEFAULT_BACKLOG 4096
+#define MAX_WORKERS 256
+#define MAX_EVENTS 256
+#define READ_CHUNK 4096
+#define DEFAULT_KEEPALIVE_TIMEOUT 5       // Seconds an idle connection is kept open
+#define MAX_BODY_SIZE (1024 * 1024)       // Largest request body accepted (and discarded)
+#define OUTPUT_HIGH_WATER (256 * 1024)    // Stop handling pipelined requests above this backlog
+#define MAX_PIPELINED_INPUT (64 * 1024)   // Stop reading while this much input waits on output
+#define SMALL_FILE_SIZE (16 * 1024)       // Files up to this size are copied in after their headers
+#define DEFAULT_CACHE_SIZE 64             // File cache budget per worker, in MB
+#define CACHE_MAX_ENTRIES 1024            // Per worker; each entry keeps a file open
+#define CACHE_BUCKETS 2048
+#define CACHE_REVALIDATE 1                // Seconds before a cached file is stat'ed again
+#define MAX_RANGES 16                     // Range requests asking for more get the whole file
+#define DEFAULT_GZIP_LEVEL 6              // 1-9, 0 turns off compressing files here
+#define DEFAULT_GZIP_MIN_SIZE 1024        // Smaller files aren't worth compressing
+#define GZIP_MAX_SIZE (1024 * 1024)       // Larger files are only sent precompressed
+#define POOL_MIN_BUFFER 4096              // Smallest connection buffer; each size class doubles it
+#define POOL_CLASSES 9                    // Pooled sizes, 4 KB to 1 MB; larger buffers are malloc'd
+#define POOL_MAX_FREE (1024 * 1024)       // Free bytes kept per size class, per worker
+#define SLAB_OBJECTS 64                   // Objects carved out of each slab block
+#define LOG_RING_SIZE (1024 * 1024)       // Access log buffer per worker; a power of two
+#define LOG_BATCH_SIZE (256 * 1024)       // Most the log writer gathers for one write
+#define LOG_FLUSH_INTERVAL 50             // Milliseconds the log writer waits between passes
+#define LOG_MAX_FIELD 1024                // Longer paths and headers are cut short in the log
+#define MAX_ROUTES 16                     // Proxied path prefixes
+#define MAX_UPSTREAMS 64                  // Upstream servers, over all routes
+#define PROXY_MAX_IDLE 64                 // Idle connections kept per upstream server, per worker
+#define PROXY_IDLE_TIMEOUT 4              // Seconds a pooled upstream connection is kept idle
+#define PROXY_TIMEOUT 60                  // Seconds an upstream may go quiet mid-request
+#define PROXY_MAX_HEAD (16 * 1024)        // Longest upstream response head
+
+// ANSI color codes
+#define COLOR_RESET   "\033[0m"
+#define COLOR_RED     "\033[31m"
+#define COLOR_GREEN   "\033[32m"
+#define COLOR_YELLOW  "\033[33m"
+#define COLOR_BLUE     "\033[34m"
+#define COLOR_CYAN    "\033[36m"
+#define COLOR_BOLD    "\033[1m"
+
+// Bytes of a request, as an offset from its first byte and a length
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} Span;
+
+typedef struct {
+    Span name;
+    Span value;
+} HttpHeader;
+
+// Parsed request head. Every span points into the receive buffer at base;
+// nothing is copied out of it.
+typedef struct {
+    const char *base;
+    size_t head_len;          // Request line and headers, through the blank line
+    Span method;
+    Span path;
+    int minor_version;        // HTTP/1.x
+    HttpHeader headers[MAX_HEADERS];
+    int header_count;
+    long content_length;      // -1 when absent
+    int transfer_encoding;    // Any Transfer-Encoding header was sent
+    int chunked;              // The last transfer coding is chunked
+    int keep_alive;
+    Span host;                // Headers the server looks at; empty when absent
+    Span range;
+    Span if_none_match;
+    Span if_modified_since;
+    Span if_range;
+    Span accept_encoding;
+    Span referer;
+    Span user_agent;
+} HttpRequest;
+
+typedef enum {
+    PARSE_INCOMPLETE,     // The head hasn't all arrived yet
+    PARSE_DONE,
+    PARSE_ERROR,          // Malformed request
+    PARSE_TOO_LARGE       // Head longer than BUFFER_SIZE or too many headers
+} ParseResult;
+
+// Command line settings
+typedef struct {
+    int port;
+    int workers;
+    int backlog;
+    int keepalive_timeout;
+    size_t cache_size;
+    int gzip_level;
+    size_t gzip_min_size;
+    const char *access_log;   // Path, "-" for stdout, NULL when off
+    int log_format;
+    int balance;              // How routes pick an upstream server
+    int server_status;        // Answer /server-status, to loopback clients only
+} ServerConfig;
+
+// Access log formats
+typedef enum {
+    LOG_COMMON,
+    LOG_COMBINED,
+    LOG_JSON
+} LogFormat;
+
+// How a route picks its upstream server
+typedef enum {
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONN
+} Balance;
+
+// What an epoll event's pointer refers to; the first member of each
+typedef enum {
+    KIND_CLIENT,
+    KIND_UPSTREAM,
+    KIND_CLOSED               // Closed during this batch of events, freed after it
+} ConnKind;
+
+// Chunked body framing, followed to find where a proxied request or
+// response ends
+typedef enum {
+    CHUNK_SIZE,               // Hex size line, extensions ignored
+    CHUNK_DATA,
+    CHUNK_DATA_END,           // CRLF after the data
+    CHUNK_TRAILER,            // Trailer lines up to a blank one
+    CHUNK_DONE,
+    CHUNK_ERROR
+} ChunkState;
+
+typedef struct {
+    ChunkState state;
+    uint64_t remaining;       // Of the current chunk
+    int digits;
+    int ext;
+    int line_len;
+} ChunkParser;
+
+struct Worker;
+struct UpstreamConn;
+
+// File body queued behind the output buffer, sent with sendfile
+typedef struct FileSend {
+    int fd;
+    off_t offset;
+    size_t remaining;
+    size_t at;                // Output buffer position the file follows
+    struct FileSend *next;
+} FileSend;
+
+// Client connection: requests read so far and the responses still to send
+typedef struct Conn {
+    ConnKind kind;
+    int fd;
+    struct Worker *worker;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    FileSend *files;      // In output order
+    FileSend *files_tail;
+    size_t file_pending;  // Bytes of queued files not yet sent
+    int keep_alive;       // The request being answered allows another one
+    int closing;          // Close once the responses are sent
+    int read_eof;         // Client finished sending
+    int read_paused;      // Stopped reading until the output drains
+    size_t parse_scanned; // How far the next request has been searched for its end
+    int status;           // Of the response being queued, for the access log
+    uint32_t peer_addr;   // Client IPv4 address, network order
+    uint64_t read_ns;     // When the last bytes arrived, for request latency
+    time_t last_active;
+    struct Conn *idle_prev;   // Worker's connections, least recently active first
+    struct Conn *idle_next;   // Also links closed connections until they are freed
+    struct UpstreamConn *upstream;  // Answering a proxied request; later requests wait
+    uint64_t body_remaining;  // Of the current request: still to pass on when proxied, else to drop
+    int body_chunked;         // The proxied request's chunked body isn't all passed on yet
+    ChunkParser body_chunks;
+    int scheduled;            // Waiting in the worker's ready list
+    struct Conn *ready_next;
+} Conn;
+
+// Upstream server a route forwards to, shared by every worker
+typedef struct {
+    char name[128];           // As given on the command line
+    char host[128];           // Host header for requests that came without one
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    _Atomic int active;       // Requests in flight, over all workers
+} Upstream;
+
+// Requests whose path starts with prefix go to upstreams[first..first+count)
+typedef struct {
+    const char *prefix;
+    size_t prefix_len;
+    int first;
+    int count;
+    _Atomic unsigned next;    // Round-robin position
+} Route;
+
+// How an upstream response body ends
+typedef enum {
+    FRAMING_NONE,
+    FRAMING_LENGTH,
+    FRAMING_CHUNKED,
+    FRAMING_CLOSE             // At end of stream; the connection can't be reused
+} Framing;
+
+// Connection to an upstream server. Between requests it waits in its
+// worker's pool for the server to be picked again.
+typedef struct UpstreamConn {
+    ConnKind kind;
+    int fd;
+    int server;               // Index into upstreams
+    struct Worker *worker;
+    struct UpstreamConn *prev;  // Worker's active list, or its server's pool
+    struct UpstreamConn *next;  // Also links closed connections until they are freed
+    int connecting;
+    int requests;             // Carried so far
+    // The rest describes the request being carried and is cleared for each
+    Conn *client;             // NULL while pooled
+    Route *route;
+    int reused;               // Carried an earlier request, so the server may have closed it
+    int attempts;             // Connections tried for this request
+    char *out;                // Request bytes for the server
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    int replayable;           // out holds the whole request and sending it again is safe
+    int idempotent;           // A GET or HEAD without a body, safe to send twice
+    char *in;                 // Response bytes not yet passed on
+    size_t in_len;
+    size_t in_cap;
+    size_t parse_scanned;
+    int response_started;     // Response bytes arrived, so the request can't be retried
+    int head_sent;            // The response head went to the client
+    int head_request;         // HEAD: the response has no body whatever it says
+    int strip_chunks;         // The client speaks HTTP/1.0, so chunked bodies go out plain
+    int keep_alive;           // The server will take another request
+    int read_paused;          // Stopped reading until the client's output drains
+    Framing framing;
+    uint64_t remaining;       // Body bytes left
+    ChunkParser chunks;
+    time_t deadline;          // While active: timeout. While pooled: when it was returned.
+    uint64_t start_ns;        // When the request arrived, for the access log
+    size_t bytes;             // Response bytes queued for the client
+    char *log_buf;            // Method, path, Referer and User-Agent for the access log
+    size_t log_cap;
+    Span log_fields[4];
+    int minor_version;
+} UpstreamConn;
+
+// A file being served: its descriptor, stat data and the headers that
+// describe it
+typedef struct {
+    int fd;                   // -1 when the body is only in memory
+    size_t size;
+    struct timespec mtime;
+    const char *mime_type;
+    char etag[56];            // Quoted, from the size, mtime and encoding
+    size_t etag_len;
+    char headers[384];        // ETag, Last-Modified, Content-Encoding and Vary, which a 304
+                              // repeats, then Accept-Ranges, Content-Type and Content-Length
+    size_t validators_len;
+    size_t headers_len;
+} FileInfo;
+
+// Forms of a file the cache can hold
+typedef enum {
+    VARIANT_IDENTITY,
+    VARIANT_BR_FILE,          // Precompressed .br sibling
+    VARIANT_GZIP_FILE,        // Precompressed .gz sibling
+    VARIANT_GZIP              // Compressed here and kept in memory
+} Variant;
+
+// Compressed copy of a file, made once by the compressor thread and shared
+// by every worker that caches it. The store holds a reference while it
+// keeps the copy, and so does each cache entry sending it.
+typedef struct GzipBody {
+    _Atomic int refs;
+    char *path;               // With the file's identity when it was read
+    uint64_t hash;
+    ino_t ino;
+    size_t disk_size;
+    struct timespec disk_mtime;
+    int state;                // GZIP_PENDING, GZIP_READY or GZIP_FAILED
+    char *data;
+    size_t len;
+    struct GzipBody *chain;
+    struct GzipBody *next;    // Compressor queue while pending, else the store's LRU list
+    struct GzipBody *prev;
+} GzipBody;
+
+#define GZIP_PENDING 0
+#define GZIP_READY 1
+#define GZIP_FAILED 2             // Compressing didn't pay, or the file changed
+
+// Compressed copies shared by the workers, and the queue of files waiting
+// for the compressor thread. Workers only take the lock to look a file up.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    GzipBody *buckets[CACHE_BUCKETS];
+    GzipBody *queue_head;
+    GzipBody *queue_tail;
+    GzipBody *lru_head;           // Ready or failed, least recently used first
+    GzipBody *lru_tail;
+    size_t count;
+    size_t bytes;
+    size_t capacity;
+    int level;
+    pthread_t thread;
+    _Atomic size_t compressions;
+    _Atomic size_t stored_bytes;  // For /server-status
+} GzipStore;
+
+// Cached file, with the body itself when it is small or was compressed here
+typedef struct CacheEntry {
+    char *path;               // File requested; sibling variants add a suffix
+    Variant variant;
+    uint64_t hash;
+    FileInfo file;            // What is sent
+    ino_t ino;                // The file on disk, to notice when it changes
+    size_t disk_size;
+    struct timespec disk_mtime;
+    time_t checked;           // When the file was last stat'ed
+    int has_br;               // Identity entries: a .br sibling exists
+    int has_gz;               // Identity entries: a .gz sibling exists
+    int gzip_failed;          // Identity entries: compressing didn't pay or fit
+    char *body;
+    GzipBody *gzip;           // VARIANT_GZIP: the shared copy body points into
+    size_t charge;            // Bytes counted against the cache budget
+    struct CacheEntry *chain;
+    struct CacheEntry *lru_prev;  // Least recently used first
+    struct CacheEntry *lru_next;
+} CacheEntry;
+
+// Counters written by the owning worker, read by /server-status
+typedef struct {
+    _Atomic size_t hits;
+    _Atomic size_t misses;
+    _Atomic size_t evictions;
+    _Atomic size_t entries;
+    _Atomic size_t bytes;
+} CacheStats;
+
+// Per-worker file cache; workers share nothing, so it takes no lock
+typedef struct {
+    CacheEntry *buckets[CACHE_BUCKETS];
+    CacheEntry *lru_head;
+    CacheEntry *lru_tail;
+    size_t count;
+    size_t bytes;
+    size_t capacity;
+    CacheStats stats;
+} FileCache;
+
+// Fixed-size objects carved from blocks of SLAB_OBJECTS and recycled
+// through a free list. Blocks are kept for the life of the worker.
+typedef struct {
+    size_t size;
+    void *free_list;
+} Slab;
+
+// Counters written by the owning worker, read by /server-status
+typedef struct {
+    _Atomic size_t connections;
+    _Atomic size_t buffer_bytes;  // Held by connections
+    _Atomic size_t mallocs;       // Slab blocks and buffers the pool had to allocate
+} PoolStats;
+
+// Per-worker allocator for connections, queued files and their buffers.
+// Only the owning worker touches it, so it takes no lock.
+typedef struct {
+    Slab conns;
+    Slab file_sends;
+    Slab upstreams;
+    void *buffers[POOL_CLASSES];  // Free buffers by size class, linked through their first bytes
+    size_t free_buffers[POOL_CLASSES];
+    PoolStats stats;
+} Pool;
+
+// Access log entry queued by a worker. The method, path, Referer and
+// User-Agent follow it, in that order.
+typedef struct {
+    uint32_t size;            // Including the strings
+    uint32_t addr;            // Client IPv4 address, network order
+    int64_t time;             // Wall clock seconds
+    uint64_t bytes;           // Response bytes, headers included
+    uint32_t latency_us;
+    uint16_t status;
+    uint16_t minor_version;
+    uint16_t field_len[4];    // 0 method length when the request didn't parse
+} LogRecord;
+
+// Ring of log records with one producer, the worker, which appends at head,
+// and one consumer, the log writer thread, which takes from tail
+typedef struct {
+    char *buf;                // NULL when access logging is off
+    _Atomic size_t head;
+    _Alignas(64) _Atomic size_t tail;  // Own cache line, apart from the worker's
+    _Alignas(64) _Atomic size_t records;
+    _Atomic size_t dropped;   // Records that didn't fit
+} LogRing;
+
+// Counters written by the owning worker, read by /server-status
+typedef struct {
+    _Atomic size_t requests;
+    _Atomic size_t connects;      // New upstream connections
+    _Atomic size_t reuses;        // Requests sent on pooled connections
+    _Atomic size_t errors;        // Requests answered with 502 or 504, or cut short
+    _Atomic size_t idle;          // Pooled connections
+} ProxyStats;
+
+// Worker thread with its own listening socket and event loop
+typedef struct Worker {
+    int id;
+    int listen_fd;
+    int epoll_fd;
+    pthread_t thread;
+    const ServerConfig *cfg;
+    Conn *idle_head;
+    Conn *idle_tail;
+    FileCache cache;
+    Pool pool;
+    char date[48];            // "Date: ...\r\n" for the current second
+    size_t date_len;
+    time_t date_time;
+    LogRing log;
+    Conn *ready;                  // Connections to service once this batch of events is done
+    Conn *closed_conns;           // Closed during this batch, freed after it
+    UpstreamConn *closed_upstreams;
+    UpstreamConn *upstream_active;
+    time_t upstreams_checked;
+    UpstreamConn *upstream_idle[MAX_UPSTREAMS];  // Pool of each upstream server, most recent first
+    int upstream_idle_count[MAX_UPSTREAMS];
+    ProxyStats proxy;
+} Worker;
+
+Worker workers[MAX_WORKERS];
+Upstream upstreams[MAX_UPSTREAMS];
+int upstream_count;
+Route routes[MAX_ROUTES];
+int route_count;
+
+// ---------------------------------------------------------------------------
+// Request parser
+// ---------------------------------------------------------------------------
+
+// Offset of the first byte in p[0..len) that is at most limit (unsigned) or
+// DEL, or len if there is none. Finds the end of a token, path or header
+// value 16 bytes at a time with SSE2.
+size_t scan_ctl(const char *p, size_t len, unsigned char limit) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i lim = _mm_set1_epi8((char)limit);
+    __m128i del = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i low = _mm_cmpeq_epi8(_mm_max_epu8(chunk, lim), lim);
+        int mask = _mm_movemask_epi8(_mm_or_si128(low, _mm_cmpeq_epi8(chunk, del)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char ch = (unsigned char)p[i];
+        if (ch <= limit || ch == 0x7f) {
+            break;
+        }
+    }
+    return i;
+}
+
+// Offset of the first ch in p[0..len), or len
+size_t scan_byte(const char *p, size_t len, char ch) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi8(ch);
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(p + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len && p[i] != ch; i++) {
+    }
+    return i;
+}
+
+// Look for the blank line that ends a request head. *scanned carries how far
+// earlier calls got, so bytes from earlier partial reads are not searched
+// again. Returns the length of the head, or 0 if it hasn't all arrived.
+size_t find_head_end(const char *buf, size_t len, size_t *scanned) {
+    size_t i = *scanned;
+    while ((i += scan_byte(buf + i, len - i, '\n')) < len) {
+        if (i + 1 == len || (buf[i + 1] == '\r' && i + 2 == len)) {
+            break;
+        }
+        if (buf[i + 1] == '\n') {
+            return i + 2;
+        }
+        if (buf[i + 1] == '\r' && buf[i + 2] == '\n') {
+            return i + 3;
+        }
+        i++;
+    }
+    *scanned = i < len ? i : len;
+    return 0;
+}
+
+// Whether the bytes at p match str, ignoring case
+int span_equals_nocase(const char *p, size_t len, const char *str) {
+    return strlen(str) == len && strncasecmp(p, str, len) == 0;
+}
+
+// Whether a comma-separated header value lists token, ignoring case
+int list_has_token(const char *p, size_t len, const char *token) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == ',')) i++;
+        size_t start = i;
+        while (i < len && p[i] != ',') i++;
+        size_t end = i;
+        while (end > start && (p[end - 1] == ' ' || p[end - 1] == '\t')) end--;
+        if (span_equals_nocase(p + start, end - start, token)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Note a header the server acts on. The name's length picks the one
+// candidate worth comparing.
+int note_header(HttpRequest *req, const char *name, size_t name_len, const char *value, Span span) {
+    switch (name_len) {
+        case 4:
+            if (strncasecmp(name, "Host", 4) == 0) req->host = span;
+            break;
+        case 5:
+            if (strncasecmp(name, "Range", 5) == 0) req->range = span;
+            break;
+        case 7:
+            if (strncasecmp(name, "Referer", 7) == 0) req->referer = span;
+            break;
+        case 8:
+            if (strncasecmp(name, "If-Range", 8) == 0) req->if_range = span;
+            break;
+        case 10:
+            if (strncasecmp(name, "Connection", 10) == 0) {
+                if (list_has_token(value, span.len, "close")) {
+                    req->keep_alive = 0;
+                } else if (list_has_token(value, span.len, "keep-alive")) {
+                    req->keep_alive = 1;
+                }
+            } else if (strncasecmp(name, "User-Agent", 10) == 0) {
+                req->user_agent = span;
+            }
+            break;
+        case 13:
+            if (strncasecmp(name, "If-None-Match", 13) == 0) req->if_none_match = span;
+            break;
+        case 14:
+            if (strncasecmp(name, "Content-Length", 14) == 0) {
+                // Digits only, few enough that they can't overflow
+                if (span.len == 0 || span.len > 18) {
+                    return 0;
+                }
+                long n = 0;
+                for (uint32_t i = 0; i < span.len; i++) {
+                    if (value[i] < '0' || value[i] > '9') {
+                        return 0;
+                    }
+                    n = n * 10 + (value[i] - '0');
+                }
+                // Repeated Content-Length headers must agree
+                if (req->content_length >= 0 && req->content_length != n) {
+                    return 0;
+                }
+                req->content_length = n;
+            }
+            break;
+        case 15:
+            if (strncasecmp(name, "Accept-Encoding", 15) == 0) req->accept_encoding = span;
+            break;
+        case 17:
+            if (strncasecmp(name, "Transfer-Encoding", 17) == 0) {
+                req->transfer_encoding = 1;
+                req->chunked = span.len >= 7 && strncasecmp(value + span.len - 7, "chunked", 7) == 0;
+            } else if (strncasecmp(name, "If-Modified-Since", 17) == 0) {
+                req->if_modified_since = span;
+            }
+            break;
+    }
+    return 1;
+}
+
+// Parse a complete request head of head_len bytes. Lines may end in CRLF or
+// a bare LF.
+ParseResult parse_head(const char *buf, size_t head_len, HttpRequest *req) {
+    const char *end = buf + head_len;
+    const char *p = buf;
+    
+    // Request line: method SP path SP HTTP/1.x
+    size_t n = scan_ctl(p, end - p, ' ');
+    if (n == 0 || p + n == end || p[n] != ' ') {
+        return PARSE_ERROR;
+    }
+    req->method = (Span){ 0, (uint32_t)n };
+    p += n + 1;
+    n = scan_ctl(p, end - p, ' ');
+    if (n == 0 || p + n == end || p[n] != ' ') {
+        return PARSE_ERROR;
+    }
+    req->path = (Span){ (uint32_t)(p - buf), (uint32_t)n };
+    p += n + 1;
+    if (end - p < 9 || memcmp(p, "HTTP/1.", 7) != 0 || p[7] < '0' || p[7] > '9') {
+        return PARSE_ERROR;
+    }
+    req->minor_version = p[7] - '0';
+    req->keep_alive = req->minor_version >= 1;
+    p += 8;
+    if (*p == '\r') p++;
+    if (*p++ != '\n') {
+        return PARSE_ERROR;
+    }
+    
+    // Header lines, up to the blank line
+    while (*p != '\n' && !(*p == '\r' && p[1] == '\n')) {
+        const char *name = p;
+        n = scan_ctl(p, end - p, ' ');
+        size_t colon = scan_byte(p, n, ':');
+        // Folded continuation lines and names with spaces are rejected
+        if (colon == 0 || colon == n) {
+            return PARSE_ERROR;
+        }
+        p += colon + 1;
+        while (*p == ' ' || *p == '\t') p++;
+        
+        // Value: anything up to the line end but control characters, tab aside
+        const char *value = p;
+        while (1) {
+            p += scan_ctl(p, end - p, 0x1f);
+            if (*p != '\t') {
+                break;
+            }
+            p++;
+        }
+        const char *value_end = p;
+        if (*p == '\r') p++;
+        if (*p++ != '\n') {
+            return PARSE_ERROR;
+        }
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
+        }
+        
+        if (req->header_count == MAX_HEADERS) {
+            return PARSE_TOO_LARGE;
+        }
+        HttpHeader *h = &req->headers[req->header_count++];
+        h->name = (Span){ (uint32_t)(name - buf), (uint32_t)colon };
+        h->value = (Span){ (uint32_t)(value - buf), (uint32_t)(value_end - value) };
+        if (!note_header(req, name, colon, value, h->value)) {
+            return PARSE_ERROR;
+        }
+    }
+    return PARSE_DONE;
+}
+
+// Parse the request at the start of buf[0..len), which may be only partly
+// received. Pass the same *scanned (0 for a new request) on every call for
+// the request so each call only searches the newly arrived bytes.
+ParseResult http_parse(const char *buf, size_t len, size_t *scanned, HttpRequest *req) {
+    size_t head_len = find_head_end(buf, len, scanned);
+    if (head_len == 0) {
+        return len >= BUFFER_SIZE ? PARSE_TOO_LARGE : PARSE_INCOMPLETE;
+    }
+    if (head_len > BUFFER_SIZE) {
+        return PARSE_TOO_LARGE;
+    }
+    // Everything but the header array, which is filled as far as it's used
+    memset(req, 0, offsetof(HttpRequest, headers));
+    memset(&req->header_count, 0, sizeof(HttpRequest) - offsetof(HttpRequest, header_count));
+    req->content_length = -1;
+    req->base = buf;
+    req->head_len = head_len;
+    return parse_head(buf, head_len, req);
+}
+
+// Pointer to the bytes of a span
+const char* span_ptr(const HttpRequest *req, Span span) {
+    return req->base + span.off;
+}
+
+// Whether a span of the request holds exactly str
+int span_equals(const HttpRequest *req, Span span, const char *str) {
+    size_t len = strlen(str);
+    return span.len == len && memcmp(req->base + span.off, str, len) == 0;
+}
+
+// Format a time as an HTTP date
+void format_http_date(time_t t, char *buf, size_t len) {
+    struct tm tm_info;
+    gmtime_r(&t, &tm_info);
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+}
+
+// A type served by file extension, with its Content-Type header line
+typedef struct {
+    const char *ext;
+    const char *type;
+    const char *header;
+    size_t header_len;
+} MimeType;
+
+#define MIME_TYPE(ext, type) \
+    { ext, type, "Content-Type: " type "\r\n", sizeof("Content-Type: " type "\r\n") - 1 }
+
+const MimeType MIME_TYPES[] = {
+    MIME_TYPE("html", "text/html"),
+    MIME_TYPE("htm", "text/html"),
+    MIME_TYPE("css", "text/css"),
+    MIME_TYPE("js", "application/javascript"),
+    MIME_TYPE("json", "application/json"),
+    MIME_TYPE("png", "image/png"),
+    MIME_TYPE("jpg", "image/jpeg"),
+    MIME_TYPE("jpeg", "image/jpeg"),
+    MIME_TYPE("gif", "image/gif"),
+    MIME_TYPE("pdf", "application/pdf"),
+    MIME_TYPE(NULL, "text/plain"),        // Anything else
+};
+#define NUM_MIME_TYPES (sizeof(MIME_TYPES) / sizeof(MIME_TYPES[0]))
+
+// Get MIME type based on file extension
+const char* get_mime_type(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (ext) {
+        ext++; // Skip the dot
+        for (size_t i = 0; i < NUM_MIME_TYPES - 1; i++) {
+            if (strcmp(ext, MIME_TYPES[i].ext) == 0) return MIME_TYPES[i].type;
+        }
+    }
+    return MIME_TYPES[NUM_MIME_TYPES - 1].type;
+}
+
+// Table entry for a MIME type, or NULL. Types from get_mime_type match by
+// pointer.
+const MimeType* find_mime_type(const char *type) {
+    for (size_t i = 0; i < NUM_MIME_TYPES; i++) {
+        if (MIME_TYPES[i].type == type) return &MIME_TYPES[i];
+    }
+    for (size_t i = 0; i < NUM_MIME_TYPES; i++) {
+        if (strcmp(MIME_TYPES[i].type, type) == 0) return &MIME_TYPES[i];
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Memory Pools
+// ---------------------------------------------------------------------------
+
+void slab_init(Slab *s, size_t size) {
+    s->size = (size + 15) & ~(size_t)15;  // Keep every object 16-byte aligned
+    s->free_list = NULL;
+}
+
+// Take an object from a slab, carving a new block when the free list is empty
+void* slab_alloc(Pool *pool, Slab *s) {
+    if (!s->free_list) {
+        char *block = (char*)malloc(s->size * SLAB_OBJECTS);
+        if (!block) {
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&pool->stats.mallocs, 1, memory_order_relaxed);
+        for (int i = SLAB_OBJECTS - 1; i >= 0; i--) {
+            void **obj = (void**)(block + i * s->size);
+            *obj = s->free_list;
+            s->free_list = obj;
+        }
+    }
+    void **obj = (void**)s->free_list;
+    s->free_list = *obj;
+    return obj;
+}
+
+void slab_free(Slab *s, void *obj) {
+    *(void**)obj = s->free_list;
+    s->free_list = obj;
+}
+
+// Size class of a buffer of cap bytes; POOL_CLASSES if it's too big to pool
+static inline int pool_class(size_t cap) {
+    int cls = 0;
+    while (cls < POOL_CLASSES && ((size_t)POOL_MIN_BUFFER << cls) < cap) cls++;
+    return cls;
+}
+
+// Get a buffer of at least need bytes, sized to a power of two, from the
+// free list of its class when it has one
+char* pool_get_buffer(Pool *pool, size_t need, size_t *cap) {
+    size_t size = POOL_MIN_BUFFER;
+    while (size < need) {
+        size *= 2;
+    }
+    int cls = pool_class(size);
+    char *buf;
+    if (cls < POOL_CLASSES && pool->buffers[cls]) {
+        buf = (char*)pool->buffers[cls];
+        pool->buffers[cls] = *(void**)buf;
+        pool->free_buffers[cls]--;
+    } else {
+        buf = (char*)malloc(size);
+        if (!buf) {
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&pool->stats.mallocs, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&pool->stats.buffer_bytes, size, memory_order_relaxed);
+    *cap = size;
+    return buf;
+}
+
+// Give a buffer back. Each class keeps up to POOL_MAX_FREE bytes for reuse;
+// the rest, and buffers too big to pool, are freed.
+void pool_put_buffer(Pool *pool, char *buf, size_t cap) {
+    if (!buf) {
+        return;
+    }
+    atomic_fetch_sub_explicit(&pool->stats.buffer_bytes, cap, memory_order_relaxed);
+    int cls = pool_class(cap);
+    if (cls < POOL_CLASSES && (pool->free_buffers[cls] + 1) * cap <= POOL_MAX_FREE) {
+        *(void**)buf = pool->buffers[cls];
+        pool->buffers[cls] = buf;
+        pool->free_buffers[cls]++;
+    } else {
+        free(buf);
+    }
+}
+
+// Grow one of a connection's buffers to hold need bytes, moving the first
+// used bytes into a bigger buffer from the worker's pool
+int pool_reserve(Pool *pool, char **buf, size_t *cap, size_t used, size_t need) {
+    if (need <= *cap) {
+        return 1;
+    }
+    size_t new_cap;
+    char *grown = pool_get_buffer(pool, need, &new_cap);
+    if (!grown) {
+        return 0;
+    }
+    if (used > 0) {
+        memcpy(grown, *buf, used);
+    }
+    pool_put_buffer(pool, *buf, *cap);
+    *buf = grown;
+    *cap = new_cap;
+    return 1;
+}
+
+// Grow a buffer so it can hold at least need bytes
+int buffer_reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) {
+        return 1;
+    }
+    size_t new_cap = *cap ? *cap : READ_CHUNK;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    char *grown = (char*)realloc(*buf, new_cap);
+    if (!grown) {
+        return 0;
+    }
+    *buf = grown;
+    *cap = new_cap;
+    return 1;
+}
+
+// Queue bytes for the client; they go out as the socket accepts them
+void conn_write(Conn *c, const char *data, size_t len) {
+    if (!pool_reserve(&c->worker->pool, &c->out, &c->out_cap, c->out_len, c->out_len + len)) {
+        c->closing = 1;
+        return;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+// Status line and Server header, the same for every response with a status
+typedef struct {
+    int code;
+    const char *text;
+    const char *line;
+    size_t len;
+} StatusLine;
+
+#define STATUS_LINE(code, text) \
+    { code, text, "HTTP/1.1 " #code " " text "\r\nServer: Simple-HTTP-Server/1.0\r\n", \
+      sizeof("HTTP/1.1 " #code " " text "\r\nServer: Simple-HTTP-Server/1.0\r\n") - 1 }
+
+// Every status the server sends
+const StatusLine STATUS_LINES[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(414, "URI Too Long"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(431, "Request Header Fields Too Large"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(502, "Bad Gateway"),
+    STATUS_LINE(504, "Gateway Timeout"),
+};
+#define NUM_STATUS_LINES (sizeof(STATUS_LINES) / sizeof(STATUS_LINES[0]))
+
+// Status line for a code; one missing from the table is a 500
+const StatusLine* status_line(int status_code) {
+    for (size_t i = 0; i < NUM_STATUS_LINES; i++) {
+        if (STATUS_LINES[i].code == status_code) return &STATUS_LINES[i];
+    }
+    return status_line(500);
+}
+
+// Refresh the worker's Date header once the second has changed. The event
+// loop calls this each time it wakes, at least once a second, so responses
+// only copy the string.
+void worker_update_date(Worker *w) {
+    time_t now = time(NULL);
+    if (now == w->date_time) {
+        return;
+    }
+    char date[40];
+    format_http_date(now, date, sizeof(date));
+    w->date_len = snprintf(w->date, sizeof(w->date), "Date: %s\r\n", date);
+    w->date_time = now;
+}
+
+// Queue a status line and the headers every response carries
+void send_status(Conn *c, int status_code) {
+    const StatusLine *s = status_line(status_code);
+    c->status = status_code;
+    conn_write(c, s->line, s->len);
+    conn_write(c, c->worker->date, c->worker->date_len);
+}
+
+// Finish the header block
+void end_headers(Conn *c) {
+    if (c->keep_alive) {
+        conn_write(c, "Connection: keep-alive\r\n\r\n", 26);
+    } else {
+        conn_write(c, "Connection: close\r\n\r\n", 21);
+    }
+}
+
+// Write a Content-Length header line to buf, which has room for 40 bytes
+size_t format_content_length(char *buf, size_t body_len) {
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + body_len % 10);
+        body_len /= 10;
+    } while (body_len > 0);
+    
+    memcpy(buf, "Content-Length: ", 16);
+    size_t len = 16;
+    while (count > 0) {
+        buf[len++] = digits[--count];
+    }
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return len;
+}
+
+// Format the headers describing a body. Known types copy their prepared
+// Content-Type line.
+size_t format_content_headers(char *buf, size_t size, const char *content_type, size_t body_len) {
+    const MimeType *m = find_mime_type(content_type);
+    if (!m || m->header_len + 40 > size) {
+        return snprintf(buf, size, "Content-Type: %s\r\nContent-Length: %zu\r\n", content_type, body_len);
+    }
+    memcpy(buf, m->header, m->header_len);
+    return m->header_len + format_content_length(buf + m->header_len, body_len);
+}
+
+// Queue the header block of an HTTP response
+void send_headers(Conn *c, int status_code, const char *content_type, size_t body_len) {
+    char headers[256];
+    size_t len = format_content_headers(headers, sizeof(headers), content_type, body_len);
+    
+    send_status(c, status_code);
+    conn_write(c, headers, len);
+    end_headers(c);
+}
+
+// Queue an HTTP response
+void send_response(Conn *c, int status_code, const char *content_type, const char *body, size_t body_len) {
+    send_headers(c, status_code, content_type, body_len);
+    if (body && body_len > 0) {
+        conn_write(c, body, body_len);
+    }
+}
+
+// Send error response
+void send_error(Conn *c, int status_code, const char *message) {
+    char body[512];
+    int len = snprintf(body, sizeof(body),
+        "<!DOCTYPE html>\n"
+        "<html><head><title>%d %s</title></head>\n"
+        "<body><h1>%d %s</h1><p>%s</p></body></html>\n",
+        status_code, message, status_code, message, message);
+    
+    send_response(c, status_code, "text/html", body, len);
+}
+
+// Monotonic seconds, for idle timeouts
+time_t now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Monotonic nanoseconds, for request latency
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------
+// Compression
+// ---------------------------------------------------------------------------
+
+#define ACCEPT_GZIP 1
+#define ACCEPT_BR 2
+
+// Deflate (RFC 1951) parameters
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_BLOCK_TOKENS 16384
+
+uint32_t crc_table[256];
+pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+void crc_table_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+// CRC-32 (IEEE 802.3), as the gzip trailer carries
+uint32_t crc32(const void *data, size_t len, uint32_t crc) {
+    pthread_once(&crc_table_once, crc_table_init);
+    const uint8_t *p = (const uint8_t*)data;
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Output of the deflate encoder, filled least significant bit first
+typedef struct {
+    uint8_t *out;
+    size_t len;
+    size_t cap;
+    uint64_t bits;
+    int bit_count;
+} BitWriter;
+
+// Append count bits; returns 0 once the output is full
+static inline int bits_put(BitWriter *w, uint32_t value, int count) {
+    w->bits |= (uint64_t)value << w->bit_count;
+    w->bit_count += count;
+    while (w->bit_count >= 8) {
+        if (w->len == w->cap) {
+            return 0;
+        }
+        w->out[w->len++] = (uint8_t)w->bits;
+        w->bits >>= 8;
+        w->bit_count -= 8;
+    }
+    return 1;
+}
+
+// Huffman codes go out most significant bit first
+static inline uint32_t reverse_bits(uint32_t code, int len) {
+    uint32_t r = 0;
+    while (len--) {
+        r = (r << 1) | (code & 1);
+        code >>= 1;
+    }
+    return r;
+}
+
+const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                   35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                   3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t DIST_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                                 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// Order the code length code lengths are sent in
+const uint8_t CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// A literal (dist 0) or a back reference found by the matcher
+typedef struct {
+    uint16_t litlen;
+    uint16_t dist;
+} Token;
+
+static inline int length_code(int len) {
+    int l = 28;
+    while (LENGTH_BASE[l] > len) l--;
+    return l;
+}
+
+static inline int dist_code(int dist) {
+    int d = 29;
+    while (DIST_BASE[d] > dist) d--;
+    return d;
+}
+
+// Huffman code lengths for freq[0..n), none longer than max_bits. Leaves
+// sorted by frequency build the tree with two queues; lengths past max_bits
+// are then folded back in, keeping the code complete. Fewer than two used
+// symbols still get a two-code tree, which decoders require.
+void huffman_lengths(const uint32_t *freq, int n, int max_bits, uint8_t *lengths) {
+    int syms[288], count = 0;
+    for (int i = 0; i < n; i++) {
+        lengths[i] = 0;
+        if (freq[i] > 0) {
+            // Insertion sort by frequency; there are at most 288 symbols
+            int j = count++;
+            while (j > 0 && freq[syms[j - 1]] > freq[i]) {
+                syms[j] = syms[j - 1];
+                j--;
+            }
+            syms[j] = i;
+        }
+    }
+    if (count < 2) {
+        int a = count ? syms[0] : 0;
+        lengths[a] = 1;
+        lengths[a == 0 ? 1 : 0] = 1;
+        return;
+    }
+    
+    uint32_t weight[2 * 288];
+    int parent[2 * 288], depth[2 * 288];
+    int leaf = 0, node = count, next = count;
+    for (int i = 0; i < count; i++) {
+        weight[i] = freq[syms[i]];
+    }
+    for (int k = 0; k < count - 1; k++) {
+        int pick[2];
+        for (int j = 0; j < 2; j++) {
+            if (leaf < count && (node == next || weight[leaf] <= weight[node])) {
+                pick[j] = leaf++;
+            } else {
+                pick[j] = node++;
+            }
+        }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = next;
+        next++;
+    }
+    depth[next - 1] = 0;
+    for (int i = next - 2; i >= 0; i--) {
+        depth[i] = depth[parent[i]] + 1;
+    }
+    
+    int bl_count[16] = {0};
+    for (int i = 0; i < count; i++) {
+        bl_count[depth[i] < max_bits ? depth[i] : max_bits]++;
+    }
+    uint32_t total = 0;
+    for (int i = 1; i <= max_bits; i++) {
+        total += (uint32_t)bl_count[i] << (max_bits - i);
+    }
+    while (total != (1u << max_bits)) {
+        bl_count[max_bits]--;
+        for (int i = max_bits - 1; i > 0; i--) {
+            if (bl_count[i]) {
+                bl_count[i]--;
+                bl_count[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+    // Rarest symbols get the longest codes
+    int idx = 0;
+    for (int len = max_bits; len > 0; len--) {
+        for (int j = 0; j < bl_count[len]; j++) {
+            lengths[syms[idx++]] = (uint8_t)len;
+        }
+    }
+}
+
+// Canonical codes for a set of lengths, bit-reversed for the writer
+void huffman_codes(const uint8_t *lengths, int n, uint16_t *codes) {
+    int bl_count[16] = {0}, next_code[16];
+    for (int i = 0; i < n; i++) {
+        if (lengths[i]) bl_count[lengths[i]]++;
+    }
+    int code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + bl_count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    for (int i = 0; i < n; i++) {
+        codes[i] = lengths[i] ? (uint16_t)reverse_bits(next_code[lengths[i]]++, lengths[i]) : 0;
+    }
+}
+
+// Write one block with Huffman codes built for its tokens
+int deflate_block(BitWriter *w, const Token *tokens, size_t count, int final) {
+    uint32_t freq_ll[286] = {0}, freq_d[30] = {0}, freq_cl[19] = {0};
+    for (size_t i = 0; i < count; i++) {
+        if (tokens[i].dist == 0) {
+            freq_ll[tokens[i].litlen]++;
+        } else {
+            freq_ll[257 + length_code(tokens[i].litlen)]++;
+            freq_d[dist_code(tokens[i].dist)]++;
+        }
+    }
+    freq_ll[256] = 1;
+    
+    uint8_t len_ll[286], len_d[30], len_cl[19];
+    uint16_t code_ll[286], code_d[30], code_cl[19];
+    huffman_lengths(freq_ll, 286, 15, len_ll);
+    huffman_lengths(freq_d, 30, 15, len_d);
+    huffman_codes(len_ll, 286, code_ll);
+    huffman_codes(len_d, 30, code_d);
+    int hlit = 286, hdist = 30;
+    while (hlit > 257 && len_ll[hlit - 1] == 0) hlit--;
+    while (hdist > 1 && len_d[hdist - 1] == 0) hdist--;
+    
+    // Both sets of lengths, run-length coded: 16 repeats the previous length
+    // 3-6 times, 17 and 18 are runs of 3-10 and 11-138 zeros
+    uint8_t all[316], rle_sym[316], rle_extra[316];
+    int total = hlit + hdist, rle_count = 0;
+    memcpy(all, len_ll, hlit);
+    memcpy(all + hlit, len_d, hdist);
+    for (int i = 0; i < total;) {
+        int len = all[i], run = 1;
+        while (i + run < total && all[i + run] == len) run++;
+        if (len == 0 && run >= 3) {
+            int n = run < 138 ? run : 138;
+            rle_sym[rle_count] = n >= 11 ? 18 : 17;
+            rle_extra[rle_count++] = (uint8_t)(n - (n >= 11 ? 11 : 3));
+            i += n;
+            continue;
+        }
+        rle_sym[rle_count] = (uint8_t)len;
+        rle_extra[rle_count++] = 0;
+        i++;
+        run--;
+        while (len != 0 && run >= 3) {
+            int n = run < 6 ? run : 6;
+            rle_sym[rle_count] = 16;
+            rle_extra[rle_count++] = (uint8_t)(n - 3);
+            i += n;
+            run -= n;
+        }
+    }
+    for (int i = 0; i < rle_count; i++) {
+        freq_cl[rle_sym[i]]++;
+    }
+    huffman_lengths(freq_cl, 19, 7, len_cl);
+    huffman_codes(len_cl, 19, code_cl);
+    int hclen = 19;
+    while (hclen > 4 && len_cl[CODE_LENGTH_ORDER[hclen - 1]] == 0) hclen--;
+    
+    static const int RLE_EXTRA_BITS[3] = { 2, 3, 7 };
+    int ok = bits_put(w, final, 1) && bits_put(w, 2, 2) &&  // Dynamic codes
+             bits_put(w, hlit - 257, 5) && bits_put(w, hdist - 1, 5) && bits_put(w, hclen - 4, 4);
+    for (int i = 0; ok && i < hclen; i++) {
+        ok = bits_put(w, len_cl[CODE_LENGTH_ORDER[i]], 3);
+    }
+    for (int i = 0; ok && i < rle_count; i++) {
+        int sym = rle_sym[i];
+        ok = bits_put(w, code_cl[sym], len_cl[sym]) &&
+             (sym < 16 || bits_put(w, rle_extra[i], RLE_EXTRA_BITS[sym - 16]));
+    }
+    
+    for (size_t i = 0; ok && i < count; i++) {
+        const Token *t = &tokens[i];
+        if (t->dist == 0) {
+            ok = bits_put(w, code_ll[t->litlen], len_ll[t->litlen]);
+        } else {
+            int l = length_code(t->litlen), d = dist_code(t->dist);
+            ok = bits_put(w, code_ll[257 + l], len_ll[257 + l]) &&
+                 bits_put(w, t->litlen - LENGTH_BASE[l], LENGTH_EXTRA[l]) &&
+                 bits_put(w, code_d[d], len_d[d]) &&
+                 bits_put(w, t->dist - DIST_BASE[d], DIST_EXTRA[d]);
+        }
+    }
+    return ok && bits_put(w, code_ll[256], len_ll[256]);
+}
+
+static inline uint32_t deflate_hash(const uint8_t *p) {
+    return (((uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2]) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Deflate src in blocks with dynamic Huffman codes. Matches come from hash
+// chains over the 32 KB window, followed further the higher the level.
+// Returns the compressed length, or 0 if it doesn't fit in cap bytes.
+size_t deflate_compress(const uint8_t *in, size_t len, uint8_t *dst, size_t cap, int level) {
+    static const int CHAIN_LIMITS[10] = { 1, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+    int32_t *head = (int32_t*)malloc(sizeof(int32_t) << DEFLATE_HASH_BITS);
+    int32_t *prev = (int32_t*)malloc(sizeof(int32_t) * DEFLATE_WINDOW);
+    Token *tokens = (Token*)malloc(sizeof(Token) * DEFLATE_BLOCK_TOKENS);
+    int ok = head && prev && tokens && len <= INT32_MAX;
+    if (ok) {
+        memset(head, 0xff, sizeof(int32_t) << DEFLATE_HASH_BITS);
+    }
+    
+    BitWriter w = { dst, 0, cap, 0, 0 };
+    size_t i = 0, count = 0;
+    while (ok && i < len) {
+        size_t best_len = 0, best_dist = 0;
+        if (i + DEFLATE_MIN_MATCH <= len) {
+            uint32_t h = deflate_hash(in + i);
+            size_t max_len = len - i < DEFLATE_MAX_MATCH ? len - i : DEFLATE_MAX_MATCH;
+            int32_t cand = head[h];
+            for (int chain = CHAIN_LIMITS[level]; cand >= 0 && i - cand <= DEFLATE_WINDOW && chain > 0; chain--) {
+                if (in[cand + best_len] == in[i + best_len]) {
+                    size_t n = 0;
+                    while (n < max_len && in[cand + n] == in[i + n]) n++;
+                    if (n > best_len) {
+                        best_len = n;
+                        best_dist = i - cand;
+                        if (n == max_len) break;
+                    }
+                }
+                cand = prev[cand & (DEFLATE_WINDOW - 1)];
+            }
+            prev[i & (DEFLATE_WINDOW - 1)] = head[h];
+            head[h] = (int32_t)i;
+        }
+        
+        if (best_len >= DEFLATE_MIN_MATCH) {
+            tokens[count++] = (Token){ (uint16_t)best_len, (uint16_t)best_dist };
+            // Index the positions the match covers
+            for (size_t j = i + 1; j < i + best_len && j + DEFLATE_MIN_MATCH <= len; j++) {
+                uint32_t h = deflate_hash(in + j);
+                prev[j & (DEFLATE_WINDOW - 1)] = head[h];
+                head[h] = (int32_t)j;
+            }
+            i += best_len;
+        } else {
+            tokens[count++] = (Token){ in[i], 0 };
+            i++;
+        }
+        if (count == DEFLATE_BLOCK_TOKENS && i < len) {
+            ok = deflate_block(&w, tokens, count, 0);
+            count = 0;
+        }
+    }
+    ok = ok && deflate_block(&w, tokens, count, 1) && bits_put(&w, 0, 7);  // Pad the last byte
+    
+    free(head);
+    free(prev);
+    free(tokens);
+    return ok ? w.len : 0;
+}
+
+// Compress src into a gzip member (RFC 1952). Returns a malloc'd buffer, or
+// NULL if compressing doesn't make it smaller.
+char* gzip_compress(const char *src, size_t len, int level, size_t *out_len) {
+    uint8_t *out = (uint8_t*)malloc(len);
+    if (!out || len < 32) {
+        free(out);
+        return NULL;
+    }
+    static const uint8_t header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    memcpy(out, header, sizeof(header));
+    size_t n = deflate_compress((const uint8_t*)src, len, out + 10, len - 18, level);
+    if (n == 0) {
+        free(out);
+        return NULL;
+    }
+    uint32_t crc = crc32(src, len, 0), size = (uint32_t)len;
+    for (int i = 0; i < 4; i++) {
+        out[10 + n + i] = (uint8_t)(crc >> (8 * i));
+        out[14 + n + i] = (uint8_t)(size >> (8 * i));
+    }
+    *out_len = n + 18;
+    return (char*)out;
+}
+
+// Whether a type is text that compresses well
+int is_compressible(const char *mime_type) {
+    return strncmp(mime_type, "text/", 5) == 0 ||
+           strcmp(mime_type, "application/javascript") == 0 ||
+           strcmp(mime_type, "application/json") == 0;
+}
+
+// Encodings the client takes, from its Accept-Encoding header. A q of 0
+// rules one out; "*" stands for any not listed.
+int accepted_encodings(const char *p, size_t len) {
+    int accepted = 0, refused = 0, any = 0;
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == ',')) i++;
+        size_t start = i;
+        while (i < len && p[i] != ',' && p[i] != ';' && p[i] != ' ' && p[i] != '\t') i++;
+        size_t name_len = i - start;
+        
+        // Only q=0, 0. or 0.000 refuse; other parameters are ignored
+        int zero = 0;
+        while (i < len && p[i] != ',') {
+            if ((p[i] == 'q' || p[i] == 'Q') && i + 2 < len && p[i + 1] == '=' && p[i + 2] == '0') {
+                size_t j = i + 3;
+                if (j < len && p[j] == '.') j++;
+                while (j < len && p[j] == '0') j++;
+                zero = j == len || p[j] == ',' || p[j] == ' ' || p[j] == ';';
+            }
+            i++;
+        }
+        
+        int flag = 0;
+        if (span_equals_nocase(p + start, name_len, "gzip") || span_equals_nocase(p + start, name_len, "x-gzip")) {
+            flag = ACCEPT_GZIP;
+        } else if (span_equals_nocase(p + start, name_len, "br")) {
+            flag = ACCEPT_BR;
+        } else if (name_len == 1 && p[start] == '*') {
+            any = zero ? 0 : 1;
+            continue;
+        }
+        if (zero) {
+            refused |= flag;
+        } else {
+            accepted |= flag;
+        }
+    }
+    if (any) {
+        accepted |= (ACCEPT_GZIP | ACCEPT_BR) & ~refused;
+    }
+    return accepted & ~refused;
+}
+
+// Queue size bytes of a file from offset with sendfile; takes ownership of fd
+void queue_file(Conn *c, int fd, off_t offset, size_t size) {
+    FileSend *f = (FileSend*)slab_alloc(&c->worker->pool, &c->worker->pool.file_sends);
+    if (!f) {
+        close(fd);
+        c->closing = 1;
+        return;
+    }
+    f->fd = fd;
+    f->offset = offset;
+    f->remaining = size;
+    f->at = c->out_len;
+    f->next = NULL;
+    if (c->files_tail) {
+        c->files_tail->next = f;
+    } else {
+        c->files = f;
+    }
+    c->files_tail = f;
+    c->file_pending += size;
+}
+
+// Fill in a FileInfo for the body to send. encoding is NULL for the file as
+// it is; compressible types get a Vary header either way.
+void file_info_init(FileInfo *f, int fd, size_t size, const struct timespec *mtime,
+                    const char *mime_type, const char *encoding) {
+    f->fd = fd;
+    f->size = size;
+    f->mtime = *mtime;
+    f->mime_type = mime_type;
+    
+    unsigned long long mtime_ns = (unsigned long long)mtime->tv_sec * 1000000000ULL + mtime->tv_nsec;
+    f->etag_len = snprintf(f->etag, sizeof(f->etag), "\"%zx-%llx%s%s\"", size, mtime_ns,
+                           encoding ? "-" : "", encoding ? encoding : "");
+    
+    char modified[64];
+    format_http_date(mtime->tv_sec, modified, sizeof(modified));
+    int len = snprintf(f->headers, sizeof(f->headers), "ETag: %s\r\nLast-Modified: %s\r\n", f->etag, modified);
+    if (encoding) {
+        len += snprintf(f->headers + len, sizeof(f->headers) - len, "Content-Encoding: %s\r\n", encoding);
+    }
+    if (is_compressible(mime_type)) {
+        len += snprintf(f->headers + len, sizeof(f->headers) - len, "Vary: Accept-Encoding\r\n");
+    }
+    f->validators_len = len;
+    memcpy(f->headers + len, "Accept-Ranges: bytes\r\n", 22);
+    len += 22;
+    f->headers_len = len + format_content_headers(f->headers + len, sizeof(f->headers) - len, mime_type, size);
+}
+
+// ---------------------------------------------------------------------------
+// File cache
+// ---------------------------------------------------------------------------
+
+// Update a counter that only its owning worker writes
+void stat_inc(_Atomic size_t *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+void stat_set(_Atomic size_t *counter, size_t value) {
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+// FNV-1a hash of a path
+uint64_t hash_path(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char*)path; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Drop a reference to a shared compressed copy, freeing it with the last
+void gzip_body_release(GzipBody *g) {
+    if (atomic_fetch_sub_explicit(&g->refs, 1, memory_order_acq_rel) == 1) {
+        free(g->path);
+        free(g->data);
+        free(g);
+    }
+}
+
+void cache_entry_free(CacheEntry *e) {
+    if (e->file.fd >= 0) close(e->file.fd);
+    free(e->path);
+    if (e->gzip) {
+        gzip_body_release(e->gzip);
+    } else {
+        free(e->body);
+    }
+    free(e);
+}
+
+// Unlink an entry from its bucket and the LRU list and free it
+void cache_remove(FileCache *cache, CacheEntry *e) {
+    CacheEntry **p = &cache->buckets[e->hash % CACHE_BUCKETS];
+    while (*p != e) {
+        p = &(*p)->chain;
+    }
+    *p = e->chain;
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else cache->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else cache->lru_tail = e->lru_prev;
+    
+    cache->count--;
+    cache->bytes -= e->charge;
+    stat_set(&cache->stats.entries, cache->count);
+    stat_set(&cache->stats.bytes, cache->bytes);
+    cache_entry_free(e);
+}
+
+// Append an entry at the most recently used end of the LRU list
+void cache_lru_append(FileCache *cache, CacheEntry *e) {
+    e->lru_prev = cache->lru_tail;
+    e->lru_next = NULL;
+    if (cache->lru_tail) {
+        cache->lru_tail->lru_next = e;
+    } else {
+        cache->lru_head = e;
+    }
+    cache->lru_tail = e;
+}
+
+// Suffix of the file a variant is read from, and the encoding it is sent with
+const char *VARIANT_SUFFIX[] = { "", ".br", ".gz", "" };
+const char *VARIANT_ENCODING[] = { NULL, "br", "gzip", "gzip" };
+
+// Hash of a cache key: the path and which form of the file
+uint64_t cache_key_hash(const char *path, Variant variant) {
+    return hash_path(path) ^ (uint64_t)variant * 0x9E3779B97F4A7C15ULL;
+}
+
+// Whether a regular file exists at path + suffix
+int sibling_exists(const char *path, const char *suffix) {
+    char sibling[MAX_PATH_LEN + 8];
+    struct stat st;
+    snprintf(sibling, sizeof(sibling), "%s%s", path, suffix);
+    return stat(sibling, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Look for precompressed siblings of a compressible file
+void cache_probe_siblings(CacheEntry *e) {
+    if (e->variant == VARIANT_IDENTITY && is_compressible(e->file.mime_type)) {
+        e->has_br = sibling_exists(e->path, VARIANT_SUFFIX[VARIANT_BR_FILE]);
+        e->has_gz = sibling_exists(e->path, VARIANT_SUFFIX[VARIANT_GZIP_FILE]);
+    }
+}
+
+// Whether the file on disk is still the one that was cached
+int cache_entry_valid(const CacheEntry *e, const struct stat *st) {
+    return S_ISREG(st->st_mode) && st->st_ino == e->ino && (size_t)st->st_size == e->disk_size &&
+           st->st_mtim.tv_sec == e->disk_mtime.tv_sec && st->st_mtim.tv_nsec == e->disk_mtime.tv_nsec;
+}
+
+// Find a cached file. Entries are stat'ed again at most every
+// CACHE_REVALIDATE seconds and dropped if the file changed or went away.
+CacheEntry* cache_lookup(FileCache *cache, const char *path, Variant variant) {
+    if (cache->capacity == 0) {
+        return NULL;
+    }
+    uint64_t hash = cache_key_hash(path, variant);
+    CacheEntry *e = cache->buckets[hash % CACHE_BUCKETS];
+    while (e && (e->hash != hash || e->variant != variant || strcmp(e->path, path) != 0)) {
+        e = e->chain;
+    }
+    if (!e) {
+        stat_inc(&cache->stats.misses);
+        return NULL;
+    }
+    
+    time_t now = now_seconds();
+    if (now - e->checked >= CACHE_REVALIDATE) {
+        char source[MAX_PATH_LEN + 8];
+        struct stat st;
+        snprintf(source, sizeof(source), "%s%s", path, VARIANT_SUFFIX[variant]);
+        if (stat(source, &st) != 0 || !cache_entry_valid(e, &st)) {
+            cache_remove(cache, e);
+            stat_inc(&cache->stats.misses);
+            return NULL;
+        }
+        e->checked = now;
+        cache_probe_siblings(e);
+    }
+    
+    if (cache->lru_tail != e) {
+        if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else cache->lru_head = e->lru_next;
+        e->lru_next->lru_prev = e->lru_prev;
+        cache_lru_append(cache, e);
+    }
+    stat_inc(&cache->stats.hits);
+    return e;
+}
+
+// Cache a form of a file, evicting the least recently used entries (other
+// than keep) to make room. st describes the file on disk. Either fd is the
+// open file, whose body is kept too if it is small, or fd is -1 and gzip
+// is the shared compressed copy to send. Takes a reference to gzip either
+// way, and ownership of fd on success; on failure returns NULL and leaves
+// fd to the caller.
+CacheEntry* cache_insert(FileCache *cache, const char *path, Variant variant, int fd, const struct stat *st,
+                         GzipBody *gzip, const CacheEntry *keep) {
+    size_t size = gzip ? gzip->len : (size_t)st->st_size;
+    size_t path_len = strlen(path);
+    size_t body_len = size <= SMALL_FILE_SIZE || gzip ? size : 0;
+    size_t charge = sizeof(CacheEntry) + path_len + 1 + body_len;
+    CacheEntry *e = charge <= cache->capacity ? (CacheEntry*)calloc(1, sizeof(CacheEntry)) : NULL;
+    if (!e) {
+        if (gzip) gzip_body_release(gzip);
+        return NULL;
+    }
+    e->file.fd = -1;
+    e->path = (char*)malloc(path_len + 1);
+    e->gzip = gzip;
+    if (gzip) {
+        e->body = gzip->data;
+    } else if (body_len > 0) {
+        e->body = (char*)malloc(body_len);
+        if (e->body && pread(fd, e->body, body_len, 0) != (ssize_t)body_len) {
+            free(e->body);
+            e->body = NULL;
+        }
+    }
+    if (!e->path || (body_len > 0 && !e->body)) {
+        cache_entry_free(e);
+        return NULL;
+    }
+    memcpy(e->path, path, path_len + 1);
+    e->variant = variant;
+    e->hash = cache_key_hash(path, variant);
+    file_info_init(&e->file, fd, size, &st->st_mtim, get_mime_type(path), VARIANT_ENCODING[variant]);
+    e->ino = st->st_ino;
+    e->disk_size = (size_t)st->st_size;
+    e->disk_mtime = st->st_mtim;
+    e->checked = now_seconds();
+    e->charge = charge;
+    cache_probe_siblings(e);
+    
+    while (cache->count >= CACHE_MAX_ENTRIES || cache->bytes + charge > cache->capacity) {
+        CacheEntry *victim = cache->lru_head == keep ? keep->lru_next : cache->lru_head;
+        if (!victim) {
+            e->file.fd = -1;
+            cache_entry_free(e);
+            return NULL;
+        }
+        cache_remove(cache, victim);
+        stat_inc(&cache->stats.evictions);
+    }
+    CacheEntry **bucket = &cache->buckets[e->hash % CACHE_BUCKETS];
+    e->chain = *bucket;
+    *bucket = e;
+    cache_lru_append(cache, e);
+    
+    cache->count++;
+    cache->bytes += charge;
+    stat_set(&cache->stats.entries, cache->count);
+    stat_set(&cache->stats.bytes, cache->bytes);
+    return e;
+}
+
+// Find or open a precompressed sibling of a cached file
+CacheEntry* cache_sibling(FileCache *cache, CacheEntry *e, Variant variant) {
+    CacheEntry *v = cache_lookup(cache, e->path, variant);
+    if (v) {
+        return v;
+    }
+    char source[MAX_PATH_LEN + 8];
+    struct stat st;
+    snprintf(source, sizeof(source), "%s%s", e->path, VARIANT_SUFFIX[variant]);
+    int fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        if (variant == VARIANT_BR_FILE) e->has_br = 0; else e->has_gz = 0;
+        return NULL;
+    }
+    v = cache_insert(cache, e->path, variant, fd, &st, NULL, e);
+    if (!v) {
+        close(fd);
+    }
+    return v;
+}
+
+GzipStore gzip_store = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+// Append a copy at the most recently used end of the store's LRU list.
+// Called with the lock held, as are the other gzip_store functions.
+void gzip_store_lru_append(GzipStore *store, GzipBody *g) {
+    g->prev = store->lru_tail;
+    g->next = NULL;
+    if (store->lru_tail) {
+        store->lru_tail->next = g;
+    } else {
+        store->lru_head = g;
+    }
+    store->lru_tail = g;
+}
+
+// Unlink a ready or failed copy and drop the store's reference to it;
+// workers that still cache it keep theirs
+void gzip_store_remove(GzipStore *store, GzipBody *g) {
+    GzipBody **p = &store->buckets[g->hash % CACHE_BUCKETS];
+    while (*p != g) {
+        p = &(*p)->chain;
+    }
+    *p = g->chain;
+    if (g->prev) g->prev->next = g->next; else store->lru_head = g->next;
+    if (g->next) g->next->prev = g->prev; else store->lru_tail = g->prev;
+    store->count--;
+    store->bytes -= g->len;
+    gzip_body_release(g);
+}
+
+// The shared compressed copy of a cached file, with a reference taken for
+// the caller. A file not seen before is queued for the compressor thread,
+// and NULL is returned until its copy is ready; *failed is set once
+// compressing it has turned out not to pay.
+GzipBody* gzip_store_get(GzipStore *store, const CacheEntry *e, int *failed) {
+    uint64_t hash = hash_path(e->path);
+    pthread_mutex_lock(&store->lock);
+    GzipBody *g = store->buckets[hash % CACHE_BUCKETS];
+    while (g && (g->hash != hash || g->ino != e->ino || g->disk_size != e->disk_size ||
+                 g->disk_mtime.tv_sec != e->disk_mtime.tv_sec || g->disk_mtime.tv_nsec != e->disk_mtime.tv_nsec ||
+                 strcmp(g->path, e->path) != 0)) {
+        g = g->chain;
+    }
+    if (g && g->state != GZIP_PENDING) {
+        if (store->lru_tail != g) {
+            if (g->prev) g->prev->next = g->next; else store->lru_head = g->next;
+            g->next->prev = g->prev;
+            gzip_store_lru_append(store, g);
+        }
+        if (g->state == GZIP_READY) {
+            atomic_fetch_add_explicit(&g->refs, 1, memory_order_relaxed);
+        } else {
+            *failed = 1;
+            g = NULL;
+        }
+        pthread_mutex_unlock(&store->lock);
+        return g;
+    }
+    
+    if (!g) {
+        if (store->count >= CACHE_MAX_ENTRIES && store->lru_head) {
+            gzip_store_remove(store, store->lru_head);
+        }
+        size_t path_len = strlen(e->path);
+        g = store->count < CACHE_MAX_ENTRIES ? (GzipBody*)calloc(1, sizeof(GzipBody)) : NULL;
+        if (g && (g->path = (char*)malloc(path_len + 1))) {
+            memcpy(g->path, e->path, path_len + 1);
+            atomic_init(&g->refs, 1);
+            g->hash = hash;
+            g->ino = e->ino;
+            g->disk_size = e->disk_size;
+            g->disk_mtime = e->disk_mtime;
+            g->state = GZIP_PENDING;
+            g->chain = store->buckets[hash % CACHE_BUCKETS];
+            store->buckets[hash % CACHE_BUCKETS] = g;
+            if (store->queue_tail) {
+                store->queue_tail->next = g;
+            } else {
+                store->queue_head = g;
+            }
+            store->queue_tail = g;
+            store->count++;
+            pthread_cond_signal(&store->wake);
+        } else {
+            free(g);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+// Compressor thread: reads and compresses the queued files one at a time,
+// so a large file never stalls a worker's event loop, and each version of
+// a file is compressed once however many workers serve it. The oldest
+// copies are dropped to keep the store within one worker's cache budget.
+void* gzip_store_run(void *arg) {
+    GzipStore *store = (GzipStore*)arg;
+    while (1) {
+        pthread_mutex_lock(&store->lock);
+        while (!store->queue_head) {
+            pthread_cond_wait(&store->wake, &store->lock);
+        }
+        GzipBody *g = store->queue_head;
+        store->queue_head = g->next;
+        if (!store->queue_head) store->queue_tail = NULL;
+        pthread_mutex_unlock(&store->lock);
+        
+        // What identifies a pending copy doesn't change, so it is read
+        // without the lock. A file that changed since is left uncompressed.
+        size_t len = 0;
+        char *gz = NULL;
+        char *src = NULL;
+        struct stat st;
+        int fd = open(g->path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_ino == g->ino && (size_t)st.st_size == g->disk_size &&
+            st.st_mtim.tv_sec == g->disk_mtime.tv_sec && st.st_mtim.tv_nsec == g->disk_mtime.tv_nsec &&
+            (src = (char*)malloc(g->disk_size)) && pread(fd, src, g->disk_size, 0) == (ssize_t)g->disk_size) {
+            gz = gzip_compress(src, g->disk_size, store->level, &len);
+        }
+        free(src);
+        if (fd >= 0) close(fd);
+        atomic_fetch_add_explicit(&store->compressions, 1, memory_order_relaxed);
+        
+        pthread_mutex_lock(&store->lock);
+        if (gz && len <= store->capacity) {
+            g->data = gz;
+            g->len = len;
+            g->state = GZIP_READY;
+            store->bytes += len;
+        } else {
+            free(gz);
+            g->state = GZIP_FAILED;
+        }
+        gzip_store_lru_append(store, g);
+        while (store->bytes > store->capacity && store->lru_head != g) {
+            gzip_store_remove(store, store->lru_head);
+        }
+        atomic_store_explicit(&store->stored_bytes, store->bytes, memory_order_relaxed);
+        pthread_mutex_unlock(&store->lock);
+    }
+    return NULL;
+}
+
+// Find the gzip form of a cached file, in the worker's cache or else the
+// shared store. Until the compressor thread has made it the file goes out
+// as it is. When compressing doesn't pay, or the result doesn't fit in the
+// cache, the file is marked so it isn't asked for again.
+CacheEntry* cache_gzip(FileCache *cache, CacheEntry *e) {
+    CacheEntry *v = cache_lookup(cache, e->path, VARIANT_GZIP);
+    if (v) {
+        return v;
+    }
+    int failed = 0;
+    GzipBody *g = gzip_store_get(&gzip_store, e, &failed);
+    if (!g) {
+        e->gzip_failed = failed;
+        return NULL;
+    }
+    
+    struct stat st = {0};
+    st.st_mode = S_IFREG;
+    st.st_ino = e->ino;
+    st.st_size = (off_t)e->disk_size;
+    st.st_mtim = e->disk_mtime;
+    v = cache_insert(cache, e->path, VARIANT_GZIP, -1, &st, g, e);
+    if (!v) {
+        e->gzip_failed = 1;
+    }
+    return v;
+}
+
+// The compressed form of a cached file to send this client, or NULL to
+// send it as is. Precompressed siblings come first, brotli before gzip.
+CacheEntry* cache_encoded(FileCache *cache, const ServerConfig *cfg, const HttpRequest *req, CacheEntry *e) {
+    if (e->variant != VARIANT_IDENTITY || !is_compressible(e->file.mime_type) || req->accept_encoding.len == 0) {
+        return NULL;
+    }
+    int accepted = accepted_encodings(span_ptr(req, req->accept_encoding), req->accept_encoding.len);
+    CacheEntry *v = NULL;
+    if ((accepted & ACCEPT_BR) && e->has_br) {
+        v = cache_sibling(cache, e, VARIANT_BR_FILE);
+    }
+    if (!v && (accepted & ACCEPT_GZIP) && e->has_gz) {
+        v = cache_sibling(cache, e, VARIANT_GZIP_FILE);
+    }
+    if (!v && (accepted & ACCEPT_GZIP) && cfg->gzip_level > 0 && !e->gzip_failed &&
+        e->file.size >= cfg->gzip_min_size && e->file.size <= GZIP_MAX_SIZE) {
+        v = cache_gzip(cache, e);
+    }
+    return v;
+}
+
+// ---------------------------------------------------------------------------
+// Conditional and range requests
+// ---------------------------------------------------------------------------
+
+// Byte range of a file, end inclusive
+typedef struct {
+    size_t start;
+    size_t end;
+} ByteRange;
+
+// Parse an HTTP date in the preferred format
+int parse_http_date(const char *p, size_t len, time_t *t) {
+    char buf[64];
+    struct tm tm_info = {0};
+    if (len >= sizeof(buf)) {
+        return 0;
+    }
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+    if (!end || *end != '\0') {
+        return 0;
+    }
+    *t = timegm(&tm_info);
+    return 1;
+}
+
+// Whether a comma-separated list of entity tags names ours. Weak tags
+// match too, as If-None-Match asks.
+int etag_list_matches(const char *p, size_t len, const FileInfo *f) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == ',')) i++;
+        size_t start = i;
+        while (i < len && p[i] != ',') i++;
+        size_t end = i;
+        while (end > start && (p[end - 1] == ' ' || p[end - 1] == '\t')) end--;
+        if (end - start == 1 && p[start] == '*') {
+            return 1;
+        }
+        if (end - start > 2 && p[start] == 'W' && p[start + 1] == '/') {
+            start += 2;
+        }
+        if (end - start == f->etag_len && memcmp(p + start, f->etag, f->etag_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether the client's copy is current. If-None-Match wins over
+// If-Modified-Since when both are sent.
+int not_modified(const HttpRequest *req, const FileInfo *f) {
+    if (req->if_none_match.len > 0) {
+        return etag_list_matches(span_ptr(req, req->if_none_match), req->if_none_match.len, f);
+    }
+    time_t since;
+    return req->if_modified_since.len > 0 &&
+           parse_http_date(span_ptr(req, req->if_modified_since), req->if_modified_since.len, &since) &&
+           f->mtime.tv_sec <= since;
+}
+
+// Whether a Range applies: without If-Range it always does; with it, only if
+// the client's copy is exactly this version
+int if_range_matches(const HttpRequest *req, const FileInfo *f) {
+    const char *p = span_ptr(req, req->if_range);
+    size_t len = req->if_range.len;
+    if (len == 0) {
+        return 1;
+    }
+    if (p[0] == '"') {
+        return len == f->etag_len && memcmp(p, f->etag, len) == 0;
+    }
+    time_t t;
+    return p[0] != 'W' && parse_http_date(p, len, &t) && t == f->mtime.tv_sec;
+}
+
+// Parse up to 18 digits
+size_t parse_range_number(const char *p, size_t len, size_t *i, int *ok) {
+    size_t n = 0, digits = 0;
+    while (*i < len && p[*i] >= '0' && p[*i] <= '9') {
+        n = n * 10 + (p[(*i)++] - '0');
+        digits++;
+    }
+    *ok = digits > 0 && digits <= 18;
+    return n;
+}
+
+// Parse a "bytes=" Range header against a file of the given size. Returns
+// the number of satisfiable ranges, 0 if the header should be ignored
+// (malformed or asking for more than MAX_RANGES), or -1 if no range can be
+// satisfied.
+int parse_ranges(const char *p, size_t len, size_t size, ByteRange *ranges) {
+    if (len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+        return 0;
+    }
+    size_t i = 6;
+    int count = 0, specs = 0, ok;
+    while (1) {
+        while (i < len && (p[i] == ' ' || p[i] == '\t')) i++;
+        size_t start, end;
+        if (i < len && p[i] == '-') {
+            // Suffix: the last n bytes
+            i++;
+            size_t n = parse_range_number(p, len, &i, &ok);
+            if (!ok) return 0;
+            start = n < size ? size - n : 0;
+            end = n > 0 ? size - 1 : 0;
+            ok = n > 0 && size > 0;
+        } else {
+            start = parse_range_number(p, len, &i, &ok);
+            if (!ok || i == len || p[i++] != '-') return 0;
+            end = size - 1;
+            if (i < len && p[i] >= '0' && p[i] <= '9') {
+                end = parse_range_number(p, len, &i, &ok);
+                if (!ok || end < start) return 0;
+                if (end >= size) end = size - 1;
+            }
+            ok = start < size;
+        }
+        if (++specs > MAX_RANGES) {
+            return 0;
+        }
+        if (ok) {
+            ranges[count].start = start;
+            ranges[count].end = end;
+            count++;
+        }
+        
+        while (i < len && (p[i] == ' ' || p[i] == '\t')) i++;
+        if (i == len) break;
+        if (p[i++] != ',') return 0;
+    }
+    return count > 0 ? count : -1;
+}
+
+// Queue len bytes of a file from offset: from the cached body if there is
+// one, read into the output buffer if short, otherwise with sendfile
+void send_file_part(Conn *c, const FileInfo *f, const char *body, size_t offset, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (body) {
+        conn_write(c, body + offset, len);
+        return;
+    }
+    if (len <= SMALL_FILE_SIZE) {
+        if (!pool_reserve(&c->worker->pool, &c->out, &c->out_cap, c->out_len, c->out_len + len) ||
+            pread(f->fd, c->out + c->out_len, len, offset) != (ssize_t)len) {
+            // The headers are already queued, so the response cannot be fixed
+            c->closing = 1;
+        } else {
+            c->out_len += len;
+        }
+        return;
+    }
+    // A descriptor of its own, since the cache may close f->fd before a
+    // slow client is done
+    int fd = fcntl(f->fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        c->closing = 1;
+        return;
+    }
+    queue_file(c, fd, (off_t)offset, len);
+}
+
+// Queue the response to a GET for a file: 304 if the client's copy is
+// current, 206 for satisfiable ranges (multipart/byteranges for several),
+// 416 if none is, otherwise the whole file. body is the cached contents of
+// a small file, or NULL.
+void serve_file(Conn *c, const HttpRequest *req, const FileInfo *f, const char *body) {
+    if (not_modified(req, f)) {
+        send_status(c, 304);
+        conn_write(c, f->headers, f->validators_len);
+        end_headers(c);
+        return;
+    }
+    
+    ByteRange ranges[MAX_RANGES];
+    int count = 0;
+    if (req->range.len > 0 && if_range_matches(req, f)) {
+        count = parse_ranges(span_ptr(req, req->range), req->range.len, f->size, ranges);
+    }
+    char headers[512];
+    int len;
+    
+    if (count < 0) {
+        len = snprintf(headers, sizeof(headers), "Content-Range: bytes */%zu\r\nContent-Length: 0\r\n", f->size);
+        send_status(c, 416);
+        conn_write(c, headers, len);
+        end_headers(c);
+    } else if (count == 0) {
+        send_status(c, 200);
+        conn_write(c, f->headers, f->headers_len);
+        end_headers(c);
+        send_file_part(c, f, body, 0, f->size);
+    } else if (count == 1) {
+        len = snprintf(headers, sizeof(headers),
+                       "Content-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\n",
+                       f->mime_type, ranges[0].start, ranges[0].end, f->size, ranges[0].end - ranges[0].start + 1);
+        send_status(c, 206);
+        conn_write(c, f->headers, f->validators_len);
+        conn_write(c, headers, len);
+        end_headers(c);
+        send_file_part(c, f, body, ranges[0].start, ranges[0].end - ranges[0].start + 1);
+    } else {
+        // Each part gets its own headers after the boundary; the total
+        // length has to be known before the first is sent
+        char boundary[24];
+        snprintf(boundary, sizeof(boundary), "%016llx",
+                 (unsigned long long)(hash_path(f->etag) ^ (uint64_t)(uintptr_t)c ^ (uint64_t)c->out_len));
+        char part[256];
+        size_t total = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            if (pass == 1) {
+                len = snprintf(headers, sizeof(headers),
+                               "Content-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %zu\r\n",
+                               boundary, total);
+                send_status(c, 206);
+                conn_write(c, f->headers, f->validators_len);
+                conn_write(c, headers, len);
+                end_headers(c);
+            }
+            for (int i = 0; i < count; i++) {
+                size_t part_len = ranges[i].end - ranges[i].start + 1;
+                len = snprintf(part, sizeof(part), "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                               boundary, f->mime_type, ranges[i].start, ranges[i].end, f->size);
+                if (pass == 0) {
+                    total += len + part_len;
+                } else {
+                    conn_write(c, part, len);
+                    send_file_part(c, f, body, ranges[i].start, part_len);
+                }
+            }
+            len = snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+            if (pass == 0) {
+                total += len;
+            } else {
+                conn_write(c, part, len);
+            }
+        }
+    }
+}
+
+// Plain-text counters summed over all workers
+void send_server_status(Conn *c) {
+    const ServerConfig *cfg = c->worker->cfg;
+    size_t hits = 0, misses = 0, evictions = 0, entries = 0, bytes = 0;
+    size_t connections = 0, buffer_bytes = 0, mallocs = 0, logged = 0, dropped = 0;
+    size_t proxied = 0, connects = 0, reuses = 0, idle = 0, errors = 0;
+    for (int i = 0; i < cfg->workers; i++) {
+        const ProxyStats *px = &workers[i].proxy;
+        proxied += atomic_load_explicit(&px->requests, memory_order_relaxed);
+        connects += atomic_load_explicit(&px->connects, memory_order_relaxed);
+        reuses += atomic_load_explicit(&px->reuses, memory_order_relaxed);
+        idle += atomic_load_explicit(&px->idle, memory_order_relaxed);
+        errors += atomic_load_explicit(&px->errors, memory_order_relaxed);
+        logged += atomic_load_explicit(&workers[i].log.records, memory_order_relaxed);
+        dropped += atomic_load_explicit(&workers[i].log.dropped, memory_order_relaxed);
+        const PoolStats *ps = &workers[i].pool.stats;
+        connections += atomic_load_explicit(&ps->connections, memory_order_relaxed);
+        buffer_bytes += atomic_load_explicit(&ps->buffer_bytes, memory_order_relaxed);
+        mallocs += atomic_load_explicit(&ps->mallocs, memory_order_relaxed);
+        const CacheStats *st = &workers[i].cache.stats;
+        hits += atomic_load_explicit(&st->hits, memory_order_relaxed);
+        misses += atomic_load_explicit(&st->misses, memory_order_relaxed);
+        evictions += atomic_load_explicit(&st->evictions, memory_order_relaxed);
+        entries += atomic_load_explicit(&st->entries, memory_order_relaxed);
+        bytes += atomic_load_explicit(&st->bytes, memory_order_relaxed);
+    }
+    
+    char body[1024];
+    int len = snprintf(body, sizeof(body),
+        "workers: %d\n"
+        "connections: %zu\n"
+        "connection_buffer_bytes: %zu\n"
+        "pool_mallocs: %zu\n"
+        "file_cache_entries: %zu\n"
+        "file_cache_bytes: %zu\n"
+        "file_cache_hits: %zu\n"
+        "file_cache_misses: %zu\n"
+        "file_cache_evictions: %zu\n"
+        "gzip_compressions: %zu\n"
+        "gzip_shared_bytes: %zu\n"
+        "access_log_records: %zu\n"
+        "access_log_dropped: %zu\n"
+        "proxy_requests: %zu\n"
+        "proxy_errors: %zu\n"
+        "upstream_connects: %zu\n"
+        "upstream_reuses: %zu\n"
+        "upstream_idle: %zu\n",
+        cfg->workers, connections, buffer_bytes, mallocs, entries, bytes, hits, misses, evictions,
+        atomic_load_explicit(&gzip_store.compressions, memory_order_relaxed),
+        atomic_load_explicit(&gzip_store.stored_bytes, memory_order_relaxed), logged, dropped, proxied, errors, connects, reuses, idle);
+    send_response(c, 200, "text/plain", body, len);
+}
+
+// Handle HTTP request
+void handle_request(Conn *c, const HttpRequest *req) {
+    // Only support GET method for now
+    if (!span_equals(req, req->method, "GET")) {
+        send_error(c, 501, "Not Implemented");
+        return;
+    }
+    
+    // Handle root path
+    if (span_equals(req, req->path, "/")) {
+        const char *html = 
+            "<!DOCTYPE html>\n"
+            "<html><head><title>Simple HTTP Server</title></head>\n"
+            "<body><h1>Welcome to Simple HTTP Server</h1>\n"
+            "<p>Server is running successfully!</p>\n"
+            "<p>Try accessing a file like <a href=\"/index.html\">index.html</a></p>\n"
+            "</body></html>\n";
+        send_response(c, 200, "text/html", html, strlen(html));
+        return;
+    }
+    
+    // The counters are only for local monitoring; everyone else gets the
+    // file of that name, if there is one
+    if (c->worker->cfg->server_status && (ntohl(c->peer_addr) >> 24) == 127 &&
+        span_equals(req, req->path, "/server-status")) {
+        send_server_status(c);
+        return;
+    }
+    
+    // Remove leading slashes, all of them so "//etc/passwd" can't name an
+    // absolute path, and check for directory traversal
+    char file_path[MAX_PATH_LEN];
+    const char *path = span_ptr(req, req->path);
+    size_t path_len = req->path.len;
+    while (path_len > 0 && path[0] == '/') {
+        path++;
+        path_len--;
+    }
+    if (path_len >= sizeof(file_path)) {
+        send_error(c, 414, "URI Too Long");
+        return;
+    }
+    memcpy(file_path, path, path_len);
+    file_path[path_len] = '\0';
+    
+    // Security: prevent directory traversal
+    if (strstr(file_path, "..") != NULL) {
+        send_error(c, 403, "Forbidden");
+        return;
+    }
+    
+    // Try to serve file, from the cache when it has it
+    FileCache *cache = &c->worker->cache;
+    CacheEntry *e = cache_lookup(cache, file_path, VARIANT_IDENTITY);
+    if (e) {
+        CacheEntry *encoded = cache_encoded(cache, c->worker->cfg, req, e);
+        if (encoded) {
+            e = encoded;
+        }
+        serve_file(c, req, &e->file, e->body);
+        return;
+    }
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        if (fd < 0 && errno != ENOENT && errno != ENOTDIR && errno != EACCES) {
+            send_error(c, 500, "Internal Server Error");
+        } else {
+            send_error(c, 404, "Not Found");
+        }
+        return;
+    }
+    e = cache_insert(cache, file_path, VARIANT_IDENTITY, fd, &st, NULL, NULL);
+    if (e) {
+        CacheEntry *encoded = cache_encoded(cache, c->worker->cfg, req, e);
+        if (encoded) {
+            e = encoded;
+        }
+        serve_file(c, req, &e->file, e->body);
+        return;
+    }
+    // Without the cache the file goes out as it is
+    FileInfo f;
+    file_info_init(&f, fd, (size_t)st.st_size, &st.st_mtim, get_mime_type(file_path), NULL);
+    serve_file(c, req, &f, NULL);
+    close(fd);
+}
+
+// ---------------------------------------------------------------------------
+// Access log
+// ---------------------------------------------------------------------------
+
+// Longest formatted entry: escaping turns a byte into at most six
+#define LOG_MAX_LINE (4 * 6 * LOG_MAX_FIELD + 512)
+
+// Copy len bytes into a log ring at position pos, wrapping at the end
+static inline void ring_copy_in(LogRing *r, size_t pos, const void *src, size_t len) {
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+    memcpy(r->buf + off, src, first);
+    memcpy(r->buf, (const char*)src + first, len - first);
+}
+
+static inline void ring_copy_out(const LogRing *r, size_t pos, void *dst, size_t len) {
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+    memcpy(dst, r->buf + off, first);
+    memcpy((char*)dst + first, r->buf, len - first);
+}
+
+// Queue a log entry for a response bytes long. fields are the method, path,
+// Referer and User-Agent, as spans of base, or NULL if the request couldn't
+// be parsed; start_ns is when it arrived. Only the raw fields are copied,
+// the log writer formats them. When the ring is full the entry is dropped
+// and counted rather than holding up the request.
+void access_log_entry(Conn *c, const char *base, const Span *fields, int minor_version, uint64_t start_ns,
+                      size_t bytes) {
+    Worker *w = c->worker;
+    LogRing *r = &w->log;
+    if (!r->buf) {
+        return;
+    }
+    
+    LogRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.size = sizeof(rec);
+    for (int i = 0; fields && i < 4; i++) {
+        rec.field_len[i] = (uint16_t)(fields[i].len < LOG_MAX_FIELD ? fields[i].len : LOG_MAX_FIELD);
+        rec.size += rec.field_len[i];
+    }
+    uint64_t latency = (now_ns() - start_ns) / 1000;
+    rec.addr = c->peer_addr;
+    rec.time = w->date_time;
+    rec.bytes = bytes;
+    rec.latency_us = latency < UINT32_MAX ? (uint32_t)latency : UINT32_MAX;
+    rec.status = (uint16_t)c->status;
+    rec.minor_version = (uint16_t)minor_version;
+    
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < rec.size) {
+        stat_inc(&r->dropped);
+        return;
+    }
+    ring_copy_in(r, head, &rec, sizeof(rec));
+    size_t pos = head + sizeof(rec);
+    for (int i = 0; fields && i < 4; i++) {
+        ring_copy_in(r, pos, base + fields[i].off, rec.field_len[i]);
+        pos += rec.field_len[i];
+    }
+    atomic_store_explicit(&r->head, pos, memory_order_release);
+    stat_inc(&r->records);
+}
+
+// Queue the log entry of the response just queued, bytes long; req is NULL
+// if the request couldn't be parsed
+void access_log(Conn *c, const HttpRequest *req, size_t bytes) {
+    if (!req) {
+        access_log_entry(c, NULL, NULL, 0, c->read_ns, bytes);
+        return;
+    }
+    Span fields[4] = { req->method, req->path, req->referer, req->user_agent };
+    access_log_entry(c, req->base, fields, req->minor_version, c->read_ns, bytes);
+}
+
+// Copy a request field into a log line. Quotes, backslashes, control
+// characters and bytes outside ASCII are escaped: \xHH in the text formats,
+// \u00HH in JSON.
+size_t log_escape(char *out, const char *s, size_t len, int json) {
+    static const char HEX[] = "0123456789abcdef";
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)s[i];
+        if (ch == '"' || ch == '\\') {
+            out[n++] = '\\';
+            out[n++] = (char)ch;
+        } else if (ch < 0x20 || ch >= 0x7f) {
+            if (json) {
+                memcpy(out + n, "\\u00", 4);
+                n += 4;
+            } else {
+                out[n++] = '\\';
+                out[n++] = 'x';
+            }
+            out[n++] = HEX[ch >> 4];
+            out[n++] = HEX[ch & 15];
+        } else {
+            out[n++] = (char)ch;
+        }
+    }
+    return n;
+}
+
+// Timestamps of the last second a log entry was formatted for
+typedef struct {
+    time_t time;
+    char clf[32];             // 17/Oct/2026:09:30:00 +0000
+    char iso[24];             // 2026-10-17T09:30:00Z
+} LogClock;
+
+// Format one entry into out, which has room for LOG_MAX_LINE bytes
+size_t format_log_record(char *out, const LogRecord *rec, const char *strings, int format, LogClock *clock) {
+    if (rec->time != clock->time) {
+        time_t t = (time_t)rec->time;
+        struct tm tm_info;
+        gmtime_r(&t, &tm_info);
+        strftime(clock->clf, sizeof(clock->clf), "%d/%b/%Y:%H:%M:%S +0000", &tm_info);
+        strftime(clock->iso, sizeof(clock->iso), "%Y-%m-%dT%H:%M:%SZ", &tm_info);
+        clock->time = t;
+    }
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &rec->addr, addr, sizeof(addr));
+    const char *field[4];
+    const char *p = strings;
+    for (int i = 0; i < 4; i++) {
+        field[i] = p;
+        p += rec->field_len[i];
+    }
+    int json = format == LOG_JSON;
+    size_t n;
+    
+    if (json) {
+        n = snprintf(out, LOG_MAX_LINE, "{\"time\":\"%s\",\"remote\":\"%s\",\"method\":\"", clock->iso, addr);
+        n += log_escape(out + n, field[0], rec->field_len[0], 1);
+        memcpy(out + n, "\",\"path\":\"", 10);
+        n += 10;
+        n += log_escape(out + n, field[1], rec->field_len[1], 1);
+        n += snprintf(out + n, LOG_MAX_LINE - n,
+                      "\",\"protocol\":\"HTTP/1.%u\",\"status\":%u,\"bytes\":%llu,\"latency_us\":%u,\"referer\":\"",
+                      rec->minor_version, rec->status, (unsigned long long)rec->bytes, rec->latency_us);
+        n += log_escape(out + n, field[2], rec->field_len[2], 1);
+        memcpy(out + n, "\",\"user_agent\":\"", 16);
+        n += 16;
+        n += log_escape(out + n, field[3], rec->field_len[3], 1);
+        memcpy(out + n, "\"}\n", 3);
+        return n + 3;
+    }
+    
+    // Common Log Format; combined adds Referer and User-Agent. Both end with
+    // the latency in microseconds, like Apache's %D.
+    n = snprintf(out, LOG_MAX_LINE, "%s - - [%s] \"", addr, clock->clf);
+    if (rec->field_len[0] > 0) {
+        n += log_escape(out + n, field[0], rec->field_len[0], 0);
+        out[n++] = ' ';
+        n += log_escape(out + n, field[1], rec->field_len[1], 0);
+        n += snprintf(out + n, LOG_MAX_LINE - n, " HTTP/1.%u", rec->minor_version);
+    } else {
+        out[n++] = '-';
+    }
+    n += snprintf(out + n, LOG_MAX_LINE - n, "\" %u %llu", rec->status, (unsigned long long)rec->bytes);
+    if (format == LOG_COMBINED) {
+        for (int i = 2; i < 4; i++) {
+            memcpy(out + n, " \"", 2);
+            n += 2;
+            if (rec->field_len[i] > 0) {
+                n += log_escape(out + n, field[i], rec->field_len[i], 0);
+            } else {
+                out[n++] = '-';
+            }
+            out[n++] = '"';
+        }
+    }
+    n += snprintf(out + n, LOG_MAX_LINE - n, " %u\n", rec->latency_us);
+    return n;
+}
+
+// Write a batch of log lines, giving up on it if the log can't be written
+void log_write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Log writer thread, started with the log's descriptor
+typedef struct {
+    const ServerConfig *cfg;
+    int fd;
+    pthread_t thread;
+} LogWriter;
+
+LogWriter log_writer;
+
+// Drain every worker's ring, formatting entries into batches of up to
+// LOG_BATCH_SIZE bytes that each go out in one write. Between passes that
+// found little it sleeps, so entries are written within LOG_FLUSH_INTERVAL
+// ms in batches rather than line by line.
+void* log_writer_run(void *arg) {
+    LogWriter *lw = (LogWriter*)arg;
+    const ServerConfig *cfg = lw->cfg;
+    char *batch = (char*)malloc(LOG_BATCH_SIZE);
+    char *record = (char*)malloc(sizeof(LogRecord) + 4 * LOG_MAX_FIELD);
+    if (!batch || !record) {
+        printf("%sError:%s Out of memory for the access log writer.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        free(batch);
+        free(record);
+        return NULL;
+    }
+    LogClock clock = { -1, "", "" };
+    const LogRecord *rec = (const LogRecord*)record;
+    const struct timespec interval = { 0, LOG_FLUSH_INTERVAL * 1000000L };
+    
+    while (1) {
+        size_t len = 0, written = 0;
+        for (int i = 0; i < cfg->workers; i++) {
+            LogRing *r = &workers[i].log;
+            size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+            while (tail != head) {
+                ring_copy_out(r, tail, record, sizeof(LogRecord));
+                ring_copy_out(r, tail + sizeof(LogRecord), record + sizeof(LogRecord), rec->size - sizeof(LogRecord));
+                tail += rec->size;
+                atomic_store_explicit(&r->tail, tail, memory_order_release);
+                
+                if (len + LOG_MAX_LINE > LOG_BATCH_SIZE) {
+                    log_write_all(lw->fd, batch, len);
+                    written += len;
+                    len = 0;
+                }
+                len += format_log_record(batch + len, rec, record + sizeof(LogRecord), cfg->log_format, &clock);
+            }
+        }
+        if (len > 0) {
+            log_write_all(lw->fd, batch, len);
+            written += len;
+        }
+        if (written < LOG_BATCH_SIZE / 2) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Reverse proxy
+// ---------------------------------------------------------------------------
+
+// Parse a --proxy route, "PREFIX=SERVER[,SERVER...]" where a server is
+// host:port or unix:/path/to/socket. Host names are resolved once, here.
+// Returns 0 after saying what is wrong.
+int add_route(char *spec) {
+    char *eq = strchr(spec, '=');
+    if (spec[0] != '/' || !eq || !eq[1]) {
+        printf("%sError:%s Proxy routes look like /prefix=host:port[,unix:/path/to/socket...].\n",
+               COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 0;
+    }
+    if (route_count == MAX_ROUTES) {
+        printf("%sError:%s At most %d proxy routes.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, MAX_ROUTES);
+        return 0;
+    }
+    *eq = '\0';
+    Route *r = &routes[route_count];
+    r->prefix = spec;
+    r->prefix_len = eq - spec;
+    r->first = upstream_count;
+    r->count = 0;
+    
+    char *save;
+    for (char *name = strtok_r(eq + 1, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if (upstream_count == MAX_UPSTREAMS) {
+            printf("%sError:%s At most %d upstream servers.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, MAX_UPSTREAMS);
+            return 0;
+        }
+        Upstream *up = &upstreams[upstream_count];
+        snprintf(up->name, sizeof(up->name), "%s", name);
+        if (strncmp(name, "unix:", 5) == 0) {
+            struct sockaddr_un *addr = (struct sockaddr_un*)&up->addr;
+            const char *path = name + 5;
+            if (!path[0] || strlen(path) >= sizeof(addr->sun_path)) {
+                printf("%sError:%s Invalid Unix socket path in %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, up->name);
+                return 0;
+            }
+            addr->sun_family = AF_UNIX;
+            strcpy(addr->sun_path, path);
+            up->addr_len = sizeof(*addr);
+            snprintf(up->host, sizeof(up->host), "localhost");
+        } else {
+            char *colon = strrchr(name, ':');
+            if (!colon || colon == name || !colon[1]) {
+                printf("%sError:%s Upstream %s needs a port.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, up->name);
+                return 0;
+            }
+            *colon = '\0';
+            struct addrinfo hints, *res;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            int rc = getaddrinfo(name, colon + 1, &hints, &res);
+            if (rc != 0) {
+                printf("%sError:%s Cannot resolve upstream %s: %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET,
+                       up->name, gai_strerror(rc));
+                return 0;
+            }
+            memcpy(&up->addr, res->ai_addr, res->ai_addrlen);
+            up->addr_len = res->ai_addrlen;
+            freeaddrinfo(res);
+            memcpy(up->host, up->name, sizeof(up->host));
+        }
+        upstream_count++;
+        r->count++;
+    }
+    if (r->count == 0) {
+        printf("%sError:%s Proxy route %s has no upstream servers.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, spec);
+        return 0;
+    }
+    route_count++;
+    return 1;
+}
+
+// Route for a request: the longest prefix that matches whole path segments,
+// so /api takes /api, /api/users and /api?q=1 but not /apix. NULL when the
+// path is served from files.
+Route* proxy_route(const HttpRequest *req) {
+    const char *path = span_ptr(req, req->path);
+    size_t len = req->path.len;
+    Route *best = NULL;
+    for (int i = 0; i < route_count; i++) {
+        Route *r = &routes[i];
+        size_t n = r->prefix_len;
+        if (n > len || memcmp(path, r->prefix, n) != 0) {
+            continue;
+        }
+        if (r->prefix[n - 1] != '/' && n < len && path[n] != '/' && path[n] != '?') {
+            continue;
+        }
+        if (!best || n > best->prefix_len) {
+            best = r;
+        }
+    }
+    return best;
+}
+
+// Pick a route's server for a request: the next in turn, or the one with
+// the fewest requests in flight over all workers. Ties go round-robin too.
+int proxy_pick(Route *r, int balance) {
+    unsigned turn = atomic_fetch_add_explicit(&r->next, 1, memory_order_relaxed);
+    int best = r->first + (int)(turn % r->count);
+    if (balance == BALANCE_LEAST_CONN) {
+        int best_active = atomic_load_explicit(&upstreams[best].active, memory_order_relaxed);
+        for (int i = 1; i < r->count; i++) {
+            int s = r->first + (int)((turn + i) % r->count);
+            int active = atomic_load_explicit(&upstreams[s].active, memory_order_relaxed);
+            if (active < best_active) {
+                best = s;
+                best_active = active;
+            }
+        }
+    }
+    return best;
+}
+
+// Queue a client connection to be serviced once the current batch of events
+// is done. The proxy hands control back to clients this way rather than
+// calling into them, so neither side is changed under the other.
+void conn_schedule(Conn *c) {
+    if (c->scheduled) {
+        return;
+    }
+    c->scheduled = 1;
+    c->ready_next = c->worker->ready;
+    c->worker->ready = c;
+}
+
+static inline void upstream_link(UpstreamConn **head, UpstreamConn *u) {
+    u->prev = NULL;
+    u->next = *head;
+    if (*head) (*head)->prev = u;
+    *head = u;
+}
+
+// Take an upstream connection off its list: the worker's active list while
+// it carries a request, its server's pool otherwise
+void upstream_unlink(UpstreamConn *u) {
+    Worker *w = u->worker;
+    UpstreamConn **head = u->client ? &w->upstream_active : &w->upstream_idle[u->server];
+    if (u->prev) {
+        u->prev->next = u->next;
+    } else if (*head == u) {
+        *head = u->next;
+    }
+    if (u->next) u->next->prev = u->prev;
+    u->prev = u->next = NULL;
+}
+
+// Close an upstream connection once it is off its list. Like client
+// connections, the object is only freed after the current batch of events,
+// which may still hold an event for it.
+void upstream_close(UpstreamConn *u) {
+    Worker *w = u->worker;
+    close(u->fd);
+    pool_put_buffer(&w->pool, u->in, u->in_cap);
+    pool_put_buffer(&w->pool, u->out, u->out_cap);
+    pool_put_buffer(&w->pool, u->log_buf, u->log_cap);
+    u->kind = KIND_CLOSED;
+    u->next = w->closed_upstreams;
+    w->closed_upstreams = u;
+}
+
+// Close a pooled connection: it idled too long, or the server closed it
+void upstream_drop_idle(UpstreamConn *u) {
+    Worker *w = u->worker;
+    upstream_unlink(u);
+    w->upstream_idle_count[u->server]--;
+    atomic_fetch_sub_explicit(&w->proxy.idle, 1, memory_order_relaxed);
+    upstream_close(u);
+}
+
+// Start connecting to an upstream server. The socket is non-blocking, so
+// the connection is usually still being made on return; the event loop
+// reports when it is. NULL if it failed outright.
+UpstreamConn* upstream_connect(Worker *w, int server) {
+    const Upstream *up = &upstreams[server];
+    int fd = socket(up->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (up->addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    int connected = connect(fd, (const struct sockaddr*)&up->addr, up->addr_len) == 0;
+    if (connected || errno == EINPROGRESS) {
+        UpstreamConn *u = (UpstreamConn*)slab_alloc(&w->pool, &w->pool.upstreams);
+        if (u) {
+            memset(u, 0, sizeof(UpstreamConn));
+            u->kind = KIND_UPSTREAM;
+            u->fd = fd;
+            u->server = server;
+            u->worker = w;
+            u->connecting = !connected;
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = u };
+            if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+                stat_inc(&w->proxy.connects);
+                return u;
+            }
+            slab_free(&w->pool.upstreams, u);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+// Connect to *server, or when that fails to the route's next servers in
+// turn, until *attempts connections have been tried for the request. With
+// advance set, *server already failed and the next one is tried first.
+UpstreamConn* upstream_connect_any(Worker *w, const Route *r, int *server, int *attempts, int advance) {
+    while (*attempts < r->count) {
+        if (advance) {
+            *server = r->first + (*server - r->first + 1) % r->count;
+        }
+        advance = 1;
+        (*attempts)++;
+        UpstreamConn *u = upstream_connect(w, *server);
+        if (u) {
+            return u;
+        }
+    }
+    return NULL;
+}
+
+// Give an upstream connection a client's request
+void upstream_attach(UpstreamConn *u, Conn *c, Route *route) {
+    Worker *w = u->worker;
+    memset(&u->client, 0, sizeof(UpstreamConn) - offsetof(UpstreamConn, client));
+    u->client = c;
+    u->route = route;
+    u->reused = u->requests++ > 0;
+    u->deadline = now_seconds() + PROXY_TIMEOUT;
+    c->upstream = u;
+    upstream_link(&w->upstream_active, u);
+    atomic_fetch_add_explicit(&upstreams[u->server].active, 1, memory_order_relaxed);
+}
+
+// Return a connection that finished its request to its server's pool,
+// without its buffers, or close it if the pool is full. It is off the
+// active list already.
+void upstream_release(UpstreamConn *u) {
+    Worker *w = u->worker;
+    pool_put_buffer(&w->pool, u->in, u->in_cap);
+    pool_put_buffer(&w->pool, u->out, u->out_cap);
+    pool_put_buffer(&w->pool, u->log_buf, u->log_cap);
+    u->in = u->out = u->log_buf = NULL;
+    u->in_cap = u->out_cap = u->log_cap = 0;
+    u->client = NULL;
+    if (w->upstream_idle_count[u->server] >= PROXY_MAX_IDLE) {
+        upstream_close(u);
+        return;
+    }
+    u->deadline = now_seconds();
+    upstream_link(&w->upstream_idle[u->server], u);
+    w->upstream_idle_count[u->server]++;
+    atomic_fetch_add_explicit(&w->proxy.idle, 1, memory_order_relaxed);
+}
+
+// Done with a proxied request, whether or not the response is complete:
+// log it, pool the upstream connection if it can take another request or
+// else close it, and schedule the client to go on with its next request
+void proxy_finish(UpstreamConn *u, int reusable) {
+    Conn *c = u->client;
+    access_log_entry(c, u->log_buf, u->log_buf ? u->log_fields : NULL, u->minor_version, u->start_ns, u->bytes);
+    if (c->body_remaining > 0 || c->body_chunked || !c->keep_alive) {
+        // The rest of the body would be read as the next request
+        c->keep_alive = 0;
+        c->closing = 1;
+        c->body_remaining = 0;
+        c->body_chunked = 0;
+    }
+    c->upstream = NULL;
+    conn_schedule(c);
+    
+    upstream_unlink(u);
+    atomic_fetch_sub_explicit(&upstreams[u->server].active, 1, memory_order_relaxed);
+    if (reusable) {
+        upstream_release(u);
+    } else {
+        upstream_close(u);
+    }
+}
+
+// The request can't be completed. A client still waiting for the response
+// head gets status instead; one that has part of the response can only be
+// disconnected.
+void proxy_error(UpstreamConn *u, int status) {
+    Conn *c = u->client;
+    stat_inc(&u->worker->proxy.errors);
+    if (u->head_sent) {
+        c->keep_alive = 0;
+        c->closing = 1;
+    } else {
+        if (c->body_remaining > 0 || c->body_chunked) {
+            c->keep_alive = 0;
+        }
+        size_t queued = c->out_len;
+        send_error(c, status, status == 504 ? "Gateway Timeout" : status == 400 ? "Bad Request" : "Bad Gateway");
+        u->bytes = c->out_len - queued;
+    }
+    proxy_finish(u, 0);
+}
+
+// The client went away mid-request, leaving the upstream connection
+// somewhere in the middle of it, so it is closed too
+void proxy_abort(UpstreamConn *u) {
+    u->client->upstream = NULL;
+    upstream_unlink(u);
+    atomic_fetch_sub_explicit(&upstreams[u->server].active, 1, memory_order_relaxed);
+    upstream_close(u);
+}
+
+// The connection failed before any of the response arrived. If the request
+// can go again, it moves to a new connection: to the same server when a
+// pooled connection turned out to be closed, to the route's next server
+// when connecting failed. Returns 0 when it can't.
+int proxy_retry(UpstreamConn *u, int connect_failed) {
+    if (u->response_started || !u->replayable || !(connect_failed || u->reused)) {
+        return 0;
+    }
+    Worker *w = u->worker;
+    int server = u->server;
+    int attempts = u->attempts;
+    UpstreamConn *n = upstream_connect_any(w, u->route, &server, &attempts, connect_failed);
+    if (!n) {
+        return 0;
+    }
+    
+    // The new connection takes over the request and its buffers
+    Conn *c = u->client;
+    upstream_attach(n, c, u->route);
+    size_t from = offsetof(UpstreamConn, route);
+    memcpy((char*)n + from, (char*)u + from, sizeof(UpstreamConn) - from);
+    n->reused = 0;
+    n->attempts = attempts;
+    n->out_sent = 0;
+    n->deadline = now_seconds() + PROXY_TIMEOUT;
+    u->in = u->out = u->log_buf = NULL;
+    u->in_cap = u->out_cap = u->log_cap = 0;
+    
+    upstream_unlink(u);
+    atomic_fetch_sub_explicit(&upstreams[u->server].active, 1, memory_order_relaxed);
+    upstream_close(u);
+    return 1;
+}
+
+// Retry the request, or answer it with a 502
+void proxy_failed(UpstreamConn *u, int connect_failed) {
+    if (!proxy_retry(u, connect_failed)) {
+        proxy_error(u, 502);
+    }
+}
+
+// Send what the server hasn't had of the request. Returns 0 if the
+// connection failed; the request has been retried or answered then.
+int upstream_flush(UpstreamConn *u) {
+    while (u->out_sent < u->out_len) {
+        ssize_t n = send(u->fd, u->out + u->out_sent, u->out_len - u->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            proxy_failed(u, 0);
+            return 0;
+        }
+        u->out_sent += n;
+        u->deadline = now_seconds() + PROXY_TIMEOUT;
+        if (!u->idempotent) {
+            u->replayable = 0;
+        }
+    }
+    if (!u->replayable) {
+        u->out_len = u->out_sent = 0;
+    }
+    if (u->client->body_remaining > 0 || u->client->body_chunked) {
+        // Room for more of the body
+        conn_schedule(u->client);
+    }
+    return 1;
+}
+
+// Append len bytes to out at *pos
+static inline void put_bytes(char *out, size_t *pos, const char *data, size_t len) {
+    memcpy(out + *pos, data, len);
+    *pos += len;
+}
+
+// Headers that describe one connection rather than the message, which a
+// proxy doesn't pass on
+int is_hop_header(const char *name, size_t len) {
+    return span_equals_nocase(name, len, "Connection") || span_equals_nocase(name, len, "Keep-Alive") ||
+           span_equals_nocase(name, len, "Proxy-Connection") || span_equals_nocase(name, len, "TE") ||
+           span_equals_nocase(name, len, "Trailer") || span_equals_nocase(name, len, "Transfer-Encoding") ||
+           span_equals_nocase(name, len, "Upgrade");
+}
+
+// Write the request head for the server: the request line as HTTP/1.1, the
+// client's headers but the hop-by-hop ones, X-Forwarded-For, and a Host
+// header if the client sent none. Sets *expect_continue if the client waits
+// for a 100 Continue before sending the body. Returns 0 if out of memory.
+int proxy_write_head(UpstreamConn *u, const HttpRequest *req, int *expect_continue) {
+    // Lines may grow a CR each; the headers added are bounded
+    size_t need = req->head_len + req->header_count + 2 + 64 + INET6_ADDRSTRLEN + sizeof(upstreams[0].host);
+    if (!pool_reserve(&u->worker->pool, &u->out, &u->out_cap, 0, need)) {
+        return 0;
+    }
+    char *out = u->out;
+    size_t len = 0;
+    char ip[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET, &u->client->peer_addr, ip, sizeof(ip));
+    size_t ip_len = strlen(ip);
+    
+    put_bytes(out, &len, span_ptr(req, req->method), req->method.len);
+    put_bytes(out, &len, " ", 1);
+    put_bytes(out, &len, span_ptr(req, req->path), req->path.len);
+    put_bytes(out, &len, " HTTP/1.1\r\n", 11);
+    int forwarded = 0;
+    for (int i = 0; i < req->header_count; i++) {
+        const HttpHeader *h = &req->headers[i];
+        const char *name = span_ptr(req, h->name);
+        const char *value = span_ptr(req, h->value);
+        if (span_equals_nocase(name, h->name.len, "Expect")) {
+            // Answered here; the body is streamed as soon as it comes
+            *expect_continue = list_has_token(value, h->value.len, "100-continue");
+            continue;
+        }
+        // A chunked body is passed on as it came, so its codings still apply
+        if (is_hop_header(name, h->name.len) &&
+            !(req->chunked && span_equals_nocase(name, h->name.len, "Transfer-Encoding"))) {
+            continue;
+        }
+        put_bytes(out, &len, name, h->name.len);
+        put_bytes(out, &len, ": ", 2);
+        put_bytes(out, &len, value, h->value.len);
+        if (span_equals_nocase(name, h->name.len, "X-Forwarded-For")) {
+            put_bytes(out, &len, ", ", 2);
+            put_bytes(out, &len, ip, ip_len);
+            forwarded = 1;
+        }
+        put_bytes(out, &len, "\r\n", 2);
+    }
+    if (!forwarded) {
+        put_bytes(out, &len, "X-Forwarded-For: ", 17);
+        put_bytes(out, &len, ip, ip_len);
+        put_bytes(out, &len, "\r\n", 2);
+    }
+    if (req->host.len == 0) {
+        const char *host = upstreams[u->server].host;
+        put_bytes(out, &len, "Host: ", 6);
+        put_bytes(out, &len, host, strlen(host));
+        put_bytes(out, &len, "\r\n", 2);
+    }
+    put_bytes(out, &len, "\r\n", 2);
+    u->out_len = len;
+    return 1;
+}
+
+// Keep a copy of the fields the access log wants, since the request's
+// buffer moves on long before the response is done
+void proxy_save_log_fields(UpstreamConn *u, const HttpRequest *req) {
+    Span fields[4] = { req->method, req->path, req->referer, req->user_agent };
+    size_t total = 0;
+    for (int i = 0; i < 4; i++) {
+        total += fields[i].len < LOG_MAX_FIELD ? fields[i].len : LOG_MAX_FIELD;
+    }
+    if (!pool_reserve(&u->worker->pool, &u->log_buf, &u->log_cap, 0, total)) {
+        return;
+    }
+    uint32_t pos = 0;
+    for (int i = 0; i < 4; i++) {
+        uint32_t len = fields[i].len < LOG_MAX_FIELD ? fields[i].len : LOG_MAX_FIELD;
+        memcpy(u->log_buf + pos, span_ptr(req, fields[i]), len);
+        u->log_fields[i] = (Span){ pos, len };
+        pos += len;
+    }
+    u->minor_version = req->minor_version;
+}
+
+// Start forwarding a request to one of the route's servers, on a pooled
+// connection when there is one. The head goes now and the body as it
+// arrives; the client's later requests wait for the response. Returns 0
+// if no server could be reached and a 502 was queued instead.
+int proxy_start(Conn *c, const HttpRequest *req, Route *route) {
+    Worker *w = c->worker;
+    stat_inc(&w->proxy.requests);
+    int server = proxy_pick(route, w->cfg->balance);
+    int attempts = 0;
+    UpstreamConn *u = w->upstream_idle[server];
+    if (u) {
+        upstream_unlink(u);
+        w->upstream_idle_count[server]--;
+        atomic_fetch_sub_explicit(&w->proxy.idle, 1, memory_order_relaxed);
+        stat_inc(&w->proxy.reuses);
+    } else if (!(u = upstream_connect_any(w, route, &server, &attempts, 0))) {
+        stat_inc(&w->proxy.errors);
+        if (req->content_length > 0 || req->chunked) {
+            c->keep_alive = 0;
+        }
+        send_error(c, 502, "Bad Gateway");
+        return 0;
+    }
+    
+    upstream_attach(u, c, route);
+    u->attempts = attempts;
+    u->replayable = 1;
+    u->head_request = span_equals(req, req->method, "HEAD");
+    u->idempotent = (u->head_request || span_equals(req, req->method, "GET")) && req->content_length <= 0 &&
+                    !req->chunked;
+    u->strip_chunks = req->minor_version == 0;
+    u->start_ns = c->read_ns;
+    c->body_remaining = req->content_length > 0 ? (uint64_t)req->content_length : 0;
+    c->body_chunked = req->chunked;
+    c->body_chunks = (ChunkParser){ CHUNK_SIZE, 0, 0, 0, 0 };
+    if (w->log.buf) {
+        proxy_save_log_fields(u, req);
+    }
+    int expect_continue = 0;
+    if (!proxy_write_head(u, req, &expect_continue)) {
+        proxy_error(u, 502);
+        return 1;
+    }
+    if (expect_continue && (c->body_remaining > 0 || c->body_chunked) && req->minor_version >= 1) {
+        conn_write(c, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    }
+    if (!u->connecting) {
+        upstream_flush(u);
+    }
+    return 1;
+}
+
+// Follow a chunked body through len bytes at p, stopping where a run of
+// chunk data starts or ends so callers can tell data from framing. Returns
+// how many bytes it went through.
+size_t chunk_step(ChunkParser *cp, const char *p, size_t len) {
+    if (cp->state == CHUNK_DATA) {
+        size_t n = len < cp->remaining ? len : cp->remaining;
+        cp->remaining -= n;
+        if (cp->remaining == 0) cp->state = CHUNK_DATA_END;
+        return n;
+    }
+    size_t i = 0;
+    while (i < len && cp->state != CHUNK_DATA && cp->state < CHUNK_DONE) {
+        char ch = p[i++];
+        switch (cp->state) {
+            case CHUNK_SIZE:
+                if (ch == '\n') {
+                    if (cp->digits == 0) {
+                        cp->state = CHUNK_ERROR;
+                    } else {
+                        cp->state = cp->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                    }
+                    cp->digits = cp->ext = cp->line_len = 0;
+                } else if (ch == ';' || ch == ' ' || ch == '\t' || ch == '\r') {
+                    cp->ext = 1;
+                } else if (!cp->ext) {
+                    int digit = ch >= '0' && ch <= '9' ? ch - '0' :
+                                ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 :
+                                ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+                    // 15 hex digits can't overflow
+                    if (digit < 0 || cp->digits++ == 15) {
+                        cp->state = CHUNK_ERROR;
+                    } else {
+                        cp->remaining = cp->remaining * 16 + digit;
+                    }
+                }
+                break;
+            case CHUNK_DATA_END:
+                if (ch == '\n') {
+                    cp->state = CHUNK_SIZE;
+                } else if (ch != '\r') {
+                    cp->state = CHUNK_ERROR;
+                }
+                break;
+            case CHUNK_TRAILER:
+                if (ch == '\n') {
+                    if (cp->line_len == 0) cp->state = CHUNK_DONE;
+                    cp->line_len = 0;
+                } else if (ch != '\r') {
+                    cp->line_len++;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return i;
+}
+
+// Pass on the part of the proxied request's body that is in the input
+// buffer from *off, while the server keeps up. A chunked body goes as it
+// came, up to the end of its framing.
+void proxy_body(Conn *c, size_t *off) {
+    UpstreamConn *u = c->upstream;
+    size_t n = c->in_len - *off;
+    if (!c->body_chunked && n > c->body_remaining) n = c->body_remaining;
+    if (n == 0 || u->out_len - u->out_sent >= OUTPUT_HIGH_WATER) {
+        return;
+    }
+    if (c->body_chunked) {
+        size_t used = 0;
+        while (used < n && c->body_chunks.state < CHUNK_DONE) {
+            used += chunk_step(&c->body_chunks, c->in + *off + used, n - used);
+        }
+        if (c->body_chunks.state == CHUNK_ERROR) {
+            proxy_error(u, 400);
+            return;
+        }
+        c->body_chunked = c->body_chunks.state != CHUNK_DONE;
+        n = used;
+    } else {
+        c->body_remaining -= n;
+    }
+    if (u->out_sent > 0 && !u->replayable) {
+        memmove(u->out, u->out + u->out_sent, u->out_len - u->out_sent);
+        u->out_len -= u->out_sent;
+        u->out_sent = 0;
+    }
+    if (!pool_reserve(&c->worker->pool, &u->out, &u->out_cap, u->out_len, u->out_len + n)) {
+        proxy_error(u, 502);
+        return;
+    }
+    memcpy(u->out + u->out_len, c->in + *off, n);
+    u->out_len += n;
+    *off += n;
+    if (!u->connecting) {
+        upstream_flush(u);
+    }
+}
+
+// Next header line of a response head, from *p up to end: its name and
+// trimmed value. Returns 0 at the blank line ending the head, -1 for a line
+// without a name.
+int next_header(const char **p, const char *end, const char **name, size_t *name_len, const char **value,
+                size_t *value_len) {
+    const char *line = *p;
+    const char *eol = (const char*)memchr(line, '\n', end - line);
+    if (!eol) {
+        return 0;
+    }
+    *p = eol + 1;
+    if (eol > line && eol[-1] == '\r') eol--;
+    if (eol == line) {
+        return 0;
+    }
+    const char *colon = (const char*)memchr(line, ':', eol - line);
+    if (!colon || colon == line) {
+        return -1;
+    }
+    const char *v = colon + 1;
+    while (v < eol && (*v == ' ' || *v == '\t')) v++;
+    const char *v_end = eol;
+    while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) v_end--;
+    *name = line;
+    *name_len = colon - line;
+    *value = v;
+    *value_len = v_end - v;
+    return 1;
+}
+
+// Parse the head of an upstream response: its status, whether the server
+// keeps the connection, and how the body is framed. Returns 0 if malformed.
+int proxy_parse_head(UpstreamConn *u, const char *buf, size_t head_len, int *status) {
+    if (head_len < 13 || memcmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ') {
+        return 0;
+    }
+    for (int i = 9; i < 12; i++) {
+        if (buf[i] < '0' || buf[i] > '9') {
+            return 0;
+        }
+    }
+    *status = (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+    
+    int keep_alive = buf[7] != '0';
+    int transfer_encoding = 0, chunked = 0;
+    long long length = -1;
+    const char *end = buf + head_len;
+    const char *p = (const char*)memchr(buf, '\n', head_len) + 1;
+    const char *name, *value;
+    size_t name_len, value_len;
+    int line;
+    while ((line = next_header(&p, end, &name, &name_len, &value, &value_len)) > 0) {
+        if (span_equals_nocase(name, name_len, "Content-Length")) {
+            if (value_len == 0 || value_len > 18) {
+                return 0;
+            }
+            long long n = 0;
+            for (size_t i = 0; i < value_len; i++) {
+                if (value[i] < '0' || value[i] > '9') {
+                    return 0;
+                }
+                n = n * 10 + (value[i] - '0');
+            }
+            if (length >= 0 && length != n) {
+                return 0;
+            }
+            length = n;
+        } else if (span_equals_nocase(name, name_len, "Transfer-Encoding")) {
+            // Only a final chunked coding frames the body
+            transfer_encoding = 1;
+            chunked = value_len >= 7 && strncasecmp(value + value_len - 7, "chunked", 7) == 0;
+        } else if (span_equals_nocase(name, name_len, "Connection")) {
+            if (list_has_token(value, value_len, "close")) {
+                keep_alive = 0;
+            } else if (list_has_token(value, value_len, "keep-alive")) {
+                keep_alive = 1;
+            }
+        }
+    }
+    if (line < 0) {
+        return 0;
+    }
+    
+    u->keep_alive = keep_alive;
+    u->remaining = 0;
+    u->chunks = (ChunkParser){ CHUNK_SIZE, 0, 0, 0, 0 };
+    if (u->head_request || *status < 200 || *status == 204 || *status == 304) {
+        u->framing = FRAMING_NONE;
+    } else if (transfer_encoding) {
+        u->framing = chunked ? FRAMING_CHUNKED : FRAMING_CLOSE;
+    } else if (length >= 0) {
+        u->framing = FRAMING_LENGTH;
+        u->remaining = (uint64_t)length;
+    } else {
+        u->framing = FRAMING_CLOSE;
+    }
+    if (u->framing == FRAMING_CLOSE) {
+        u->keep_alive = 0;
+    }
+    return 1;
+}
+
+// Queue the response head for the client: the server's status line and
+// headers, less the hop-by-hop ones, then this connection's own
+void proxy_send_head(UpstreamConn *u, const char *buf, size_t head_len, int status) {
+    Conn *c = u->client;
+    size_t queued = c->out_len;
+    const char *end = buf + head_len;
+    const char *p = (const char*)memchr(buf, '\n', head_len);
+    size_t status_len = p - buf - (p[-1] == '\r');
+    p++;
+    
+    conn_write(c, "HTTP/1.1", 8);
+    conn_write(c, buf + 8, status_len - 8);
+    conn_write(c, "\r\n", 2);
+    const char *name, *value;
+    size_t name_len, value_len;
+    while (next_header(&p, end, &name, &name_len, &value, &value_len) > 0) {
+        if (!is_hop_header(name, name_len)) {
+            // Value and all, as the server sent it
+            conn_write(c, name, value + value_len - name);
+            conn_write(c, "\r\n", 2);
+        }
+    }
+    if (u->framing == FRAMING_CHUNKED && !u->strip_chunks) {
+        conn_write(c, "Transfer-Encoding: chunked\r\n", 28);
+    }
+    if (u->framing == FRAMING_CLOSE || (u->framing == FRAMING_CHUNKED && u->strip_chunks)) {
+        // The body ends when the connection does
+        c->keep_alive = 0;
+    }
+    end_headers(c);
+    c->status = status;
+    u->bytes += c->out_len - queued;
+    u->head_sent = 1;
+}
+
+// Follow a chunked body through len bytes at p, queueing them for the
+// client as they are, or only the data for a client that can't take chunked
+// bodies. Returns how many belong to the body: fewer than len once it ends.
+size_t proxy_chunked(UpstreamConn *u, const char *p, size_t len) {
+    Conn *c = u->client;
+    size_t i = 0;
+    while (i < len && u->chunks.state < CHUNK_DONE) {
+        int data = u->chunks.state == CHUNK_DATA;
+        size_t n = chunk_step(&u->chunks, p + i, len - i);
+        if (data && u->strip_chunks) {
+            conn_write(c, p + i, n);
+            u->bytes += n;
+        }
+        i += n;
+    }
+    if (!u->strip_chunks) {
+        conn_write(c, p, i);
+        u->bytes += i;
+    }
+    return i;
+}
+
+// Pass on what has arrived of the response. Returns 0 once it is complete
+// or the request failed; u is finished with then.
+int proxy_process(UpstreamConn *u) {
+    Conn *c = u->client;
+    size_t off = 0;
+    while (!u->head_sent) {
+        size_t head_len = find_head_end(u->in, u->in_len, &u->parse_scanned);
+        if (head_len == 0) {
+            if (u->in_len < PROXY_MAX_HEAD) {
+                return 1;
+            }
+            proxy_error(u, 502);
+            return 0;
+        }
+        int status;
+        if (head_len > PROXY_MAX_HEAD || !proxy_parse_head(u, u->in, head_len, &status) || status == 101) {
+            proxy_error(u, 502);
+            return 0;
+        }
+        if (status < 200) {
+            // Interim response; the final one follows
+            memmove(u->in, u->in + head_len, u->in_len - head_len);
+            u->in_len -= head_len;
+            u->parse_scanned = 0;
+            continue;
+        }
+        proxy_send_head(u, u->in, head_len, status);
+        off = head_len;
+    }
+    
+    const char *p = u->in + off;
+    size_t avail = u->in_len - off;
+    size_t used = 0;
+    if (u->framing == FRAMING_LENGTH || u->framing == FRAMING_CLOSE) {
+        used = u->framing == FRAMING_CLOSE || avail < u->remaining ? avail : u->remaining;
+        conn_write(c, p, used);
+        u->bytes += used;
+        if (u->framing == FRAMING_LENGTH) u->remaining -= used;
+    } else if (u->framing == FRAMING_CHUNKED) {
+        used = proxy_chunked(u, p, avail);
+        if (u->chunks.state == CHUNK_ERROR) {
+            proxy_error(u, 502);
+            return 0;
+        }
+    }
+    off += used;
+    
+    if (u->framing == FRAMING_NONE || (u->framing == FRAMING_LENGTH && u->remaining == 0) ||
+        (u->framing == FRAMING_CHUNKED && u->chunks.state == CHUNK_DONE)) {
+        // Bytes past the end of the response would pass for the next one
+        proxy_finish(u, u->keep_alive && off == u->in_len && c->body_remaining == 0 && !c->body_chunked &&
+                        u->out_sent == u->out_len);
+        return 0;
+    }
+    memmove(u->in, u->in + off, u->in_len - off);
+    u->in_len -= off;
+    return 1;
+}
+
+// Read the response as fast as the client takes it. Reading stops while the
+// client's output backlog is above OUTPUT_HIGH_WATER and conn_service picks
+// it up again once that drains, so a body is never held whole.
+void proxy_read(UpstreamConn *u) {
+    Conn *c = u->client;
+    u->read_paused = 0;
+    while (1) {
+        if (c->out_len - c->out_sent + c->file_pending >= OUTPUT_HIGH_WATER) {
+            u->read_paused = 1;
+            conn_schedule(c);
+            return;
+        }
+        if (!pool_reserve(&u->worker->pool, &u->in, &u->in_cap, u->in_len, u->in_len + READ_CHUNK)) {
+            proxy_error(u, 502);
+            return;
+        }
+        ssize_t n = recv(u->fd, u->in + u->in_len, u->in_cap - u->in_len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (c->out_sent < c->out_len) {
+                conn_schedule(c);
+            }
+            return;
+        }
+        if (n == 0 && u->head_sent && u->framing == FRAMING_CLOSE) {
+            proxy_finish(u, 0);
+            return;
+        }
+        if (n <= 0) {
+            proxy_failed(u, 0);
+            return;
+        }
+        u->in_len += n;
+        u->response_started = 1;
+        u->deadline = now_seconds() + PROXY_TIMEOUT;
+        if (!proxy_process(u)) {
+            return;
+        }
+    }
+}
+
+// Event on an upstream connection
+void upstream_service(UpstreamConn *u, uint32_t events) {
+    if (!u->client) {
+        // Pooled: the server closing it, or sending anything at all, ends it
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            upstream_drop_idle(u);
+        }
+        return;
+    }
+    if (u->connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            proxy_failed(u, 1);
+            return;
+        }
+        u->connecting = 0;
+    }
+    if ((events & EPOLLOUT) && !upstream_flush(u)) {
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !u->read_paused) {
+        proxy_read(u);
+    }
+}
+
+// Time out requests whose upstream went quiet, and close pooled connections
+// that idled longer than PROXY_IDLE_TIMEOUT. Runs once a second.
+void worker_expire_upstreams(Worker *w) {
+    time_t now = now_seconds();
+    if (now == w->upstreams_checked) {
+        return;
+    }
+    w->upstreams_checked = now;
+    UpstreamConn *next;
+    for (UpstreamConn *u = w->upstream_active; u; u = next) {
+        next = u->next;
+        if (u->deadline <= now) {
+            proxy_error(u, 504);
+        }
+    }
+    for (int s = 0; s < upstream_count; s++) {
+        for (UpstreamConn *u = w->upstream_idle[s]; u; u = next) {
+            next = u->next;
+            if (u->deadline + PROXY_IDLE_TIMEOUT <= now) {
+                upstream_drop_idle(u);
+            }
+        }
+    }
+}
+
+// Move a connection to the back of its worker's idle list
+void conn_touch(Conn *c) {
+    Worker *w = c->worker;
+    c->last_active = now_seconds();
+    if (w->idle_tail == c) {
+        return;
+    }
+    if (c->idle_prev) c->idle_prev->idle_next = c->idle_next;
+    if (c->idle_next) c->idle_next->idle_prev = c->idle_prev;
+    if (w->idle_head == c) w->idle_head = c->idle_next;
+    c->idle_prev = w->idle_tail;
+    c->idle_next = NULL;
+    if (w->idle_tail) {
+        w->idle_tail->idle_next = c;
+    } else {
+        w->idle_head = c;
+    }
+    w->idle_tail = c;
+}
+
+// Close a connection and hand its memory back to the worker's pool. The
+// Conn itself is freed after the current batch of events, since a later
+// event in the batch may still point at it.
+void conn_close(Conn *c) {
+    Worker *w = c->worker;
+    if (c->idle_prev) c->idle_prev->idle_next = c->idle_next;
+    if (c->idle_next) c->idle_next->idle_prev = c->idle_prev;
+    if (w->idle_head == c) w->idle_head = c->idle_next;
+    if (w->idle_tail == c) w->idle_tail = c->idle_prev;
+    if (c->upstream) {
+        proxy_abort(c->upstream);
+    }
+    while (c->files) {
+        FileSend *next = c->files->next;
+        close(c->files->fd);
+        slab_free(&w->pool.file_sends, c->files);
+        c->files = next;
+    }
+    close(c->fd);
+    pool_put_buffer(&w->pool, c->in, c->in_cap);
+    pool_put_buffer(&w->pool, c->out, c->out_cap);
+    c->kind = KIND_CLOSED;
+    c->idle_next = w->closed_conns;
+    w->closed_conns = c;
+    atomic_fetch_sub_explicit(&w->pool.stats.connections, 1, memory_order_relaxed);
+}
+
+// Send as much of the queued output as the socket takes, buffered bytes and
+// files in order. Headers followed by a file go with MSG_MORE so they share
+// a segment with its first bytes. Returns 0 if the connection was closed.
+int conn_flush(Conn *c) {
+    while (c->out_sent < c->out_len || c->files) {
+        FileSend *f = c->files;
+        size_t limit = f ? f->at : c->out_len;
+        ssize_t n;
+        if (c->out_sent < limit) {
+            n = send(c->fd, c->out + c->out_sent, limit - c->out_sent, MSG_NOSIGNAL | (f ? MSG_MORE : 0));
+            if (n >= 0) c->out_sent += n;
+        } else if (f->remaining > 0) {
+            n = sendfile(c->fd, f->fd, &f->offset, f->remaining);
+            if (n == 0) {
+                // The file shrank under us; the promised length can't be met
+                errno = EIO;
+                n = -1;
+            }
+            if (n > 0) {
+                f->remaining -= n;
+                c->file_pending -= n;
+            }
+        } else {
+            c->files = f->next;
+            if (!c->files) c->files_tail = NULL;
+            close(f->fd);
+            slab_free(&c->worker->pool.file_sends, f);
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            conn_close(c);
+            return 0;
+        }
+    }
+    
+    // Everything went out: the buffer goes back to the pool until the next
+    // response
+    pool_put_buffer(&c->worker->pool, c->out, c->out_cap);
+    c->out = NULL;
+    c->out_sent = c->out_len = c->out_cap = 0;
+    if (c->closing) {
+        conn_close(c);
+        return 0;
+    }
+    return 1;
+}
+
+// Read what the socket has, up to MAX_PIPELINED_INPUT waiting in the buffer.
+// The socket is edge-triggered, so unless reading is paused this continues
+// to EAGAIN. Returns 0 if the connection was closed.
+int conn_read(Conn *c) {
+    c->read_paused = 0;
+    while (!c->read_eof) {
+        if (c->in_len >= MAX_PIPELINED_INPUT + BUFFER_SIZE) {
+            c->read_paused = 1;
+            return 1;
+        }
+        if (!pool_reserve(&c->worker->pool, &c->in, &c->in_cap, c->in_len, c->in_len + READ_CHUNK)) {
+            conn_close(c);
+            return 0;
+        }
+        ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        if (n < 0) {
+            conn_close(c);
+            return 0;
+        }
+        if (n == 0) {
+            c->read_eof = 1;
+        } else if (c->worker->log.buf) {
+            c->read_ns = now_ns();
+        }
+        c->in_len += n;
+    }
+    return 1;
+}
+
+// Handle every complete request in the input buffer, in order, until the
+// output backlog is large enough to wait for the client to catch up.
+// Returns 1 if requests may be left waiting for that.
+int conn_process(Conn *c) {
+    int throttled = 0;
+    size_t off = 0;
+    if (!c->in) {
+        return 0;
+    }
+    
+    while (!c->closing) {
+        if (c->upstream) {
+            // Later requests wait for the proxied response
+            if (c->body_remaining > 0 || c->body_chunked) {
+                proxy_body(c, &off);
+            }
+            break;
+        }
+        if (c->body_remaining > 0) {
+            // Body of a request already answered: drop what has arrived
+            size_t n = c->in_len - off;
+            if (n > c->body_remaining) n = c->body_remaining;
+            off += n;
+            c->body_remaining -= n;
+            if (c->body_remaining > 0) {
+                break;
+            }
+        }
+        if (c->out_len - c->out_sent + c->file_pending >= OUTPUT_HIGH_WATER) {
+            throttled = 1;
+            break;
+        }
+        size_t queued = c->out_len + c->file_pending;
+        const char *start = c->in + off;
+        size_t avail = c->in_len - off;
+        HttpRequest req;
+        ParseResult result = http_parse(start, avail, &c->parse_scanned, &req);
+        if (result == PARSE_INCOMPLETE) {
+            break;
+        }
+        if (result != PARSE_DONE) {
+            c->keep_alive = 0;
+            if (result == PARSE_TOO_LARGE) {
+                send_error(c, 431, "Request Header Fields Too Large");
+            } else {
+                send_error(c, 400, "Bad Request");
+            }
+            access_log(c, NULL, c->out_len + c->file_pending - queued);
+            c->closing = 1;
+            break;
+        }
+        
+        c->keep_alive = req.keep_alive;
+        Route *route = proxy_route(&req);
+        if (route && (!req.transfer_encoding ||
+                      (req.chunked && req.content_length < 0 && req.minor_version >= 1))) {
+            // The body, however long, streams through as it arrives
+            if (!proxy_start(c, &req, route)) {
+                access_log(c, &req, c->out_len + c->file_pending - queued);
+                if (!c->keep_alive) {
+                    c->closing = 1;
+                }
+            }
+            off += req.head_len;
+            c->parse_scanned = 0;
+            continue;
+        }
+        long body_len = req.content_length > 0 ? req.content_length : 0;
+        if (body_len > MAX_BODY_SIZE || req.transfer_encoding) {
+            c->keep_alive = 0;
+            send_error(c, req.transfer_encoding ? 501 : 413, req.transfer_encoding ? "Not Implemented" : "Payload Too Large");
+            access_log(c, &req, c->out_len + c->file_pending - queued);
+            c->closing = 1;
+            break;
+        }
+        
+        // No handler reads a body, so it is dropped as it arrives rather
+        // than waited for, which the input limit wouldn't allow
+        handle_request(c, &req);
+        access_log(c, &req, c->out_len + c->file_pending - queued);
+        off += req.head_len;
+        c->body_remaining = (uint64_t)body_len;
+        c->parse_scanned = 0;
+        if (!c->keep_alive) {
+            c->closing = 1;
+        }
+    }
+    
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    if (c->in_len == 0) {
+        // Nothing left of a partial request, so an idle connection holds no buffer
+        pool_put_buffer(&c->worker->pool, c->in, c->in_cap);
+        c->in = NULL;
+        c->in_cap = 0;
+    }
+    return throttled;
+}
 
-#define PORT 8080
-#define BUFFER_SIZE 8192
-#define MAX_PATH_LEN 512
+// Read, handle and reply until the connection would block. Pipelined
+// requests that had to wait for the output to drain are picked up again
+// once it has.
+void conn_service(Conn *c, int readable) {
+    conn_touch(c);
+    while (1) {
+        if ((readable || c->read_paused) && !conn_read(c)) {
+            return;
+        }
+        readable = 0;
+        
+        int throttled = conn_process(c);
+        if (c->read_eof && !throttled) {
+            if (c->upstream && (c->in_len < c->body_remaining || (c->body_chunked && c->in_len == 0))) {
+                // The proxied request's body was cut short
+                conn_close(c);
+                return;
+            }
+            if (!c->upstream) {
+                // Nothing more will arrive: answer what came in, then close
+                c->closing = 1;
+            }
+        }
+        if (!conn_flush(c)) {
+            return;
+        }
+        UpstreamConn *u = c->upstream;
+        if (u && u->read_paused && c->out_len - c->out_sent + c->file_pending < OUTPUT_HIGH_WATER) {
+            // Caught up with the proxied response: read on
+            proxy_read(u);
+            continue;
+        }
+        if (c->read_paused && !throttled && c->in_len >= MAX_PIPELINED_INPUT + BUFFER_SIZE) {
+            // Nothing could be taken out of the full input. When it waits on
+            // an upstream, that schedules this connection once it can take
+            // more; otherwise reading again won't help, and the idle timeout
+            // closes the connection.
+            return;
+        }
+        if (c->out_len > 0 || c->files || (!throttled && !c->read_paused)) {
+            return;
+        }
+    }
+}
 
-// ANSI color codes
-#define COLOR_RESET   "\033[0m"
-#define COLOR_RED     "\033[31m"
-#define COLOR_GREEN   "\033[32m"
-#define COLOR_YELLOW  "\033[33m"
-#define COLOR_BLUE     "\033[34m"
-#define COLOR_CYAN    "\033[36m"
-#define COLOR_BOLD    "\033[1m"
+// Close connections that have been idle longer than the keep-alive timeout
+void worker_expire_idle(Worker *w) {
+    time_t deadline = now_seconds() - w->cfg->keepalive_timeout;
+    while (w->idle_head && w->idle_head->last_active <= deadline) {
+        if (w->idle_head->upstream) {
+            // Waiting on an upstream, which has its own timeout
+            conn_touch(w->idle_head);
+            continue;
+        }
+        conn_close(w->idle_head);
+    }
+}
 
-// HTTP Request structure
-typedef struct {
-    char method[16];
-    char path[MAX_PATH_LEN];
-    char version[16];
-    char headers[BUFFER_SIZE];
-} HttpRequest;
+// Service the connections scheduled during the batch. Servicing one may
+// schedule others, or itself again.
+void worker_run_ready(Worker *w) {
+    while (w->ready) {
+        Conn *c = w->ready;
+        w->ready = c->ready_next;
+        c->scheduled = 0;
+        if (c->kind == KIND_CLIENT) {
+            conn_service(c, 0);
+        }
+    }
+}
+
+// Free what was closed during the batch; no event refers to it any more
+void worker_free_closed(Worker *w) {
+    while (w->closed_conns) {
+        Conn *c = w->closed_conns;
+        w->closed_conns = c->idle_next;
+        slab_free(&w->pool.conns, c);
+    }
+    while (w->closed_upstreams) {
+        UpstreamConn *u = w->closed_upstreams;
+        w->closed_upstreams = u->next;
+        slab_free(&w->pool.upstreams, u);
+    }
+}
+
+// Accept every pending connection; the listening socket is edge-triggered too
+void worker_accept(Worker *w) {
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(w->listen_fd, (struct sockaddr*)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                printf("%sError:%s Out of file descriptors; connection refused.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            }
+            return;
+        }
+        
+        Conn *c = (Conn*)slab_alloc(&w->pool, &w->pool.conns);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        memset(c, 0, sizeof(Conn));
+        c->kind = KIND_CLIENT;
+        atomic_fetch_add_explicit(&w->pool.stats.connections, 1, memory_order_relaxed);
+        c->fd = fd;
+        c->worker = w;
+        c->peer_addr = addr.sin_addr.s_addr;
+        conn_touch(c);
+        
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            conn_close(c);
+        }
+    }
+}
 
-// Parse HTTP request line
-int parse_request(const char *buffer, HttpRequest *req) {
-    char method[16], path[MAX_PATH_LEN], version[16];
+// Event loop of one worker. Connections stay on the worker that accepted
+// them, and so do the upstream connections made for them, so workers share
+// nothing and never take a lock.
+void* worker_run(void *arg) {
+    Worker *w = (Worker*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    worker_update_date(w);
     
-    if (sscanf(buffer, "%15s %511s %15s", method, path, version) != 3) {
-        return 0;
+    while (1) {
+        // Idle connections are checked once a second
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            printf("%sError:%s Worker %d event loop failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, w->id);
+            return NULL;
+        }
+        
+        worker_update_date(w);
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            if (ptr == NULL) {
+                worker_accept(w);
+            } else if (*(ConnKind*)ptr == KIND_CLIENT) {
+                conn_service((Conn*)ptr, (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0);
+            } else if (*(ConnKind*)ptr == KIND_UPSTREAM) {
+                upstream_service((UpstreamConn*)ptr, ev);
+            }
+        }
+        worker_expire_idle(w);
+        worker_expire_upstreams(w);
+        worker_run_ready(w);
+        worker_free_closed(w);
+    }
+    return NULL;
+}
+
+// Create a listening socket. With SO_REUSEPORT every worker binds its own
+// and the kernel spreads incoming connections across them.
+int create_listener(int port, int backlog) {
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0) {
+        printf("%sError:%s Failed to create socket.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return -1;
     }
     
-    strncpy(req->method, method, sizeof(req->method) - 1);
-    req->method[sizeof(req->method) - 1] = '\0';
+    // Set socket options (reuse address and port)
+    int opt = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        printf("%sError:%s Failed to set socket options.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        close(server_fd);
+        return -1;
+    }
     
-    strncpy(req->path, path, sizeof(req->path) - 1);
-    req->path[sizeof(req->path) - 1] = '\0';
+    // Bind socket
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
     
-    strncpy(req->version, version, sizeof(req->version) - 1);
-    req->version[sizeof(req->version) - 1] = '\0';
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        printf("%sError:%s Failed to bind to port %d. Port may be in use.\n", 
+               COLOR_RED COLOR_BOLD, COLOR_RESET, port);
+        close(server_fd);
+        return -1;
+    }
     
-    return 1;
+    // Listen for connections
+    if (listen(server_fd, backlog) < 0) {
+        printf("%sError:%s Failed to listen on socket.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
 }
 
-// Get current time in HTTP format
-void get_http_time(char *time_str, size_t len) {
-    time_t now = time(NULL);
-    struct tm *tm_info = gmtime(&now);
-    strftime(time_str, len, "%a, %d %b %Y %H:%M:%S GMT", tm_info);
+// Raise the open file limit as far as allowed; each connection costs a descriptor
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 }
 
-// Get MIME type based on file extension
-const char* get_mime_type(const char *path) {
-    const char *ext = strrchr(path, '.');
-    if (!ext) return "text/plain";
+// ---------------------------------------------------------------------------
+// Parser fuzzing and benchmark
+// ---------------------------------------------------------------------------
+
+// Requests the fuzzer mutates
+const char *FUZZ_SEEDS[] = {
+    "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n",
+    "GET /index.html HTTP/1.0\r\nConnection: keep-alive\r\nRange: bytes=0-99,200-\r\n\r\n",
+    "POST /form HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\nhello",
+    "GET /x HTTP/1.1\nHost: a\n\n",
+    "GET /a%20b?q=1 HTTP/1.1\r\nIf-None-Match: \"abc\"\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    "Accept-Encoding: gzip, br\r\nX-Tab:\tv\t \r\n\r\n",
+    "GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nConnection: Upgrade, close\r\n\r\n",
+};
+#define NUM_FUZZ_SEEDS (sizeof(FUZZ_SEEDS) / sizeof(FUZZ_SEEDS[0]))
+#define FUZZ_MAX_INPUT (2 * BUFFER_SIZE + 256)
+
+// Bytes the mutator inserts: mostly the ones the parser branches on
+const char FUZZ_BYTES[] = "\r\n\r\n :\t,0123456789\x7f\x80HTTP/1.";
+
+// xorshift64* generator, so a run can be repeated from its seed
+uint64_t fuzz_rand(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+// Apply a few random edits to buf[0..len) and return the new length
+size_t fuzz_mutate(char *buf, size_t len, uint64_t *rng) {
+    int edits = 1 + fuzz_rand(rng) % 4;
+    for (int i = 0; i < edits; i++) {
+        size_t pos = len > 0 ? fuzz_rand(rng) % len : 0;
+        switch (fuzz_rand(rng) % 6) {
+            case 0:
+                if (len > 0) buf[pos] ^= (char)(1 << (fuzz_rand(rng) % 8));
+                break;
+            case 1:
+                if (len > 0) buf[pos] = FUZZ_BYTES[fuzz_rand(rng) % (sizeof(FUZZ_BYTES) - 1)];
+                break;
+            case 2:
+                if (len < FUZZ_MAX_INPUT) {
+                    memmove(buf + pos + 1, buf + pos, len - pos);
+                    buf[pos] = FUZZ_BYTES[fuzz_rand(rng) % (sizeof(FUZZ_BYTES) - 1)];
+                    len++;
+                }
+                break;
+            case 3:
+                if (len > 0) {
+                    memmove(buf + pos, buf + pos + 1, len - pos - 1);
+                    len--;
+                }
+                break;
+            case 4: {
+                // Repeat a stretch, which builds long lines and many headers
+                size_t from = len > 0 ? fuzz_rand(rng) % len : 0;
+                size_t n = len > from ? fuzz_rand(rng) % (len - from + 1) : 0;
+                size_t times = 1 + fuzz_rand(rng) % 64;
+                while (times-- > 0 && len + n <= FUZZ_MAX_INPUT) {
+                    memmove(buf + pos + n, buf + pos, len - pos);
+                    memmove(buf + pos, buf + (from < pos ? from : from + n), n);
+                    len += n;
+                }
+                break;
+            }
+            default:
+                len = pos;
+                break;
+        }
+    }
+    return len;
+}
+
+// Whether two parses of the same bytes found the same request
+int same_request(const HttpRequest *a, const HttpRequest *b) {
+    return memcmp(a, b, offsetof(HttpRequest, headers)) == 0 &&
+           memcmp(a->headers, b->headers, a->header_count * sizeof(HttpHeader)) == 0 &&
+           memcmp(&a->header_count, &b->header_count, sizeof(HttpRequest) - offsetof(HttpRequest, header_count)) == 0;
+}
+
+// Parse input whole and then as it would arrive over random partial reads,
+// and check the two agree and that every span stays inside the head
+int fuzz_check(const char *input, size_t len, uint64_t *rng) {
+    // An exact-size copy, so an overread shows up under AddressSanitizer
+    char *buf = (char*)malloc(len ? len : 1);
+    if (!buf) {
+        return 0;
+    }
+    memcpy(buf, input, len);
+    
+    HttpRequest whole, split;
+    size_t scanned = 0;
+    ParseResult r1 = http_parse(buf, len, &scanned, &whole);
     
-    ext++; // Skip the dot
+    ParseResult r2 = PARSE_INCOMPLETE;
+    size_t fed = 0;
+    scanned = 0;
+    while (r2 == PARSE_INCOMPLETE && fed < len) {
+        fed += 1 + fuzz_rand(rng) % 64;
+        if (fed > len) fed = len;
+        r2 = http_parse(buf, fed, &scanned, &split);
+    }
+    if (len == 0) {
+        r2 = http_parse(buf, 0, &scanned, &split);
+    }
+    
+    int ok = r1 == r2;
+    if (ok && r1 == PARSE_DONE) {
+        ok = same_request(&whole, &split) && whole.head_len <= len && whole.method.len > 0 &&
+             whole.path.off + whole.path.len <= whole.head_len;
+        for (int i = 0; ok && i < whole.header_count; i++) {
+            ok = whole.headers[i].name.len > 0 &&
+                 whole.headers[i].value.off + whole.headers[i].value.len <= whole.head_len;
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+// Run the parser on mutated requests looking for crashes and disagreements
+int run_parser_fuzz(long iterations, uint64_t seed) {
+    static char buf[FUZZ_MAX_INPUT];
+    uint64_t rng = seed ? seed : 1;
+    long results[4] = {0};
+    
+    for (long i = 0; i < iterations; i++) {
+        const char *src = FUZZ_SEEDS[fuzz_rand(&rng) % NUM_FUZZ_SEEDS];
+        size_t len = strlen(src);
+        memcpy(buf, src, len);
+        len = fuzz_mutate(buf, len, &rng);
+        
+        HttpRequest req;
+        size_t scanned = 0;
+        results[http_parse(buf, len, &scanned, &req)]++;
+        if (!fuzz_check(buf, len, &rng)) {
+            printf("%sError:%s Parser disagreed with itself at iteration %ld (seed %llu).\n",
+                   COLOR_RED COLOR_BOLD, COLOR_RESET, i, (unsigned long long)seed);
+            return 1;
+        }
+    }
     
-    if (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0) return "text/html";
-    if (strcmp(ext, "css") == 0) return "text/css";
-    if (strcmp(ext, "js") == 0) return "application/javascript";
-    if (strcmp(ext, "json") == 0) return "application/json";
-    if (strcmp(ext, "png") == 0) return "image/png";
-    if (strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0) return "image/jpeg";
-    if (strcmp(ext, "gif") == 0) return "image/gif";
-    if (strcmp(ext, "pdf") == 0) return "application/pdf";
+    printf("%s%ld inputs%s: %ld parsed, %ld incomplete, %ld malformed, %ld too large\n",
+           COLOR_BOLD, iterations, COLOR_RESET, results[PARSE_DONE], results[PARSE_INCOMPLETE],
+           results[PARSE_ERROR], results[PARSE_TOO_LARGE]);
+    printf("%sNo failures%s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET);
+    return 0;
+}
+
+// Request from a browser loading a script, for the parser benchmark
+const char *BENCH_REQUEST =
+    "GET /assets/app.js?v=3 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://localhost:8080/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "If-None-Match: \"5f3a-1b2c\"\r\n"
+    "If-Modified-Since: Tue, 15 Oct 2024 08:12:31 GMT\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "\r\n";
+
+// Time the parser on whole requests and on requests arriving in three reads
+int run_parser_bench(long iterations) {
+    size_t len = strlen(BENCH_REQUEST);
+    const size_t cuts[2][3] = { { len, 0, 0 }, { len / 3, 2 * len / 3, len } };
+    const char *labels[2] = { "whole", "in 3 reads" };
+    HttpRequest req;
+    volatile long sink = 0;
     
-    return "text/plain";
+    printf("%sParser benchmark%s: %zu-byte request, %ld iterations\n", COLOR_BOLD, COLOR_RESET, len, iterations);
+    for (int mode = 0; mode < 2; mode++) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (long i = 0; i < iterations; i++) {
+            size_t scanned = 0;
+            for (int j = 0; j < 3 && cuts[mode][j] > 0; j++) {
+                if (http_parse(BENCH_REQUEST, cuts[mode][j], &scanned, &req) == PARSE_DONE) {
+                    sink += req.header_count;
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("  %-11s %s%.0f requests/sec/core%s (%.0f ns each)\n", labels[mode],
+               COLOR_GREEN COLOR_BOLD, iterations / elapsed, COLOR_RESET, elapsed * 1e9 / iterations);
+    }
+    return sink == (long)iterations * 2 * req.header_count ? 0 : 1;
 }
 
-// Send HTTP response
-void send_response(int client_fd, int status_code, const char *status_text, 
-                   const char *content_type, const char *body, size_t body_len) {
+// Queue a status line and Date header the way every response did before
+// they were cached, formatting both with snprintf. bench-headers times it
+// as the baseline.
+void send_status_formatted(Conn *c, int status_code, const char *status_text) {
     char time_str[64];
-    get_http_time(time_str, sizeof(time_str));
+    format_http_date(time(NULL), time_str, sizeof(time_str));
     
-    char response[BUFFER_SIZE];
+    char response[256];
     int len = snprintf(response, sizeof(response),
         "HTTP/1.1 %d %s\r\n"
         "Server: Simple-HTTP-Server/1.0\r\n"
-        "Date: %s\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %zu\r\n"
-        "Connection: close\r\n"
-        "\r\n",
-        status_code, status_text, time_str, content_type, body_len);
-    
-    send(client_fd, response, len, 0);
-    if (body && body_len > 0) {
-        send(client_fd, body, body_len, 0);
-    }
-}
-
-// Send error response
-void send_error(int client_fd, int status_code, const char *message) {
-    char body[512];
-    int len = snprintf(body, sizeof(body),
-        "<!DOCTYPE html>\n"
-        "<html><head><title>%d %s</title></head>\n"
-        "<body><h1>%d %s</h1><p>%s</p></body></html>\n",
-        status_code, message, status_code, message, message);
+        "Date: %s\r\n",
+        status_code, status_text, time_str);
     
-    send_response(client_fd, status_code, message, "text/html", body, len);
+    conn_write(c, response, len);
 }
 
-// Read file content
-int read_file(const char *path, char **content, size_t *size) {
-    FILE *f = fopen(path, "rb");
-    if (!f) {
-        return 0;
-    }
+// Time building response headers: a 200 for a cached file, whose headers
+// were rendered when it was cached, and a generated 200 with a type and
+// length. Each is timed against formatting the same headers with snprintf.
+int run_header_bench(long iterations) {
+    Worker *w = &workers[0];
+    Conn c;
+    memset(&c, 0, sizeof(c));
+    c.worker = w;
+    c.keep_alive = 1;
+    worker_update_date(w);
     
-    // Get file size
-    fseek(f, 0, SEEK_END);
-    long file_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    FileInfo f;
+    struct timespec mtime = { 1700000000, 123456789 };
+    file_info_init(&f, -1, 48213, &mtime, get_mime_type("app.css"), NULL);
+    const char *labels[4] = { "cached file, snprintf", "cached file", "generated, snprintf", "generated" };
+    volatile size_t sink = 0;
     
-    if (file_size < 0 || file_size > 10 * 1024 * 1024) { // Max 10MB
-        fclose(f);
-        return 0;
+    printf("%sHeader benchmark%s: %ld responses of each kind\n", COLOR_BOLD, COLOR_RESET, iterations);
+    for (int mode = 0; mode < 4; mode++) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (long i = 0; i < iterations; i++) {
+            c.out_len = 0;
+            if (mode == 0) {
+                send_status_formatted(&c, 200, "OK");
+                conn_write(&c, f.headers, f.headers_len);
+                end_headers(&c);
+            } else if (mode == 1) {
+                send_status(&c, 200);
+                conn_write(&c, f.headers, f.headers_len);
+                end_headers(&c);
+            } else if (mode == 2) {
+                char headers[256];
+                int len = snprintf(headers, sizeof(headers), "Content-Type: %s\r\nContent-Length: %zu\r\n",
+                                   "text/html", 1234 + (size_t)(i & 1023));
+                send_status_formatted(&c, 200, "OK");
+                conn_write(&c, headers, len);
+                end_headers(&c);
+            } else {
+                send_headers(&c, 200, "text/html", 1234 + (size_t)(i & 1023));
+            }
+            sink += c.out_len;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("  %-22s %s%.0f headers/sec/core%s (%.0f ns each, %zu bytes)\n", labels[mode],
+               COLOR_GREEN COLOR_BOLD, iterations / elapsed, COLOR_RESET, elapsed * 1e9 / iterations, c.out_len);
     }
-    
-    *size = (size_t)file_size;
-    *content = (char*)malloc(*size + 1);
-    if (!*content) {
-        fclose(f);
+    pool_put_buffer(&w->pool, c.out, c.out_cap);
+    return sink > 0 ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------
+// Load generator
+// ---------------------------------------------------------------------------
+
+// Client connection driven by the load generator
+typedef struct {
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    int outstanding;      // Requests sent whose responses have not arrived
+} LoadConn;
+
+typedef struct {
+    const char *host;
+    int port;
+    const char *path;
+    int conns;
+    long requests;
+    int pipeline;
+    int keep_alive;
+    size_t body_size;     // Content-Length of each request, 0 for none
+} LoadConfig;
+
+// Length of the first complete response in buf (NUL-terminated), or 0
+size_t response_length(const char *buf, size_t len) {
+    const char *end = strstr(buf, "\r\n\r\n");
+    if (!end) {
         return 0;
     }
-    
-    size_t read = fread(*content, 1, *size, f);
-    fclose(f);
-    
-    if (read != *size) {
-        free(*content);
-        return 0;
+    size_t header_len = end + 4 - buf;
+    const char *cl = strcasestr(buf, "\r\nContent-Length:");
+    size_t body_len = cl && cl < end ? strtoul(cl + 17, NULL, 10) : 0;
+    return len >= header_len + body_len ? header_len + body_len : 0;
+}
+
+// Send all of data, waiting for the socket when its buffer is full
+int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd p = { .fd = fd, .events = POLLOUT };
+            if (poll(&p, 1, 5000) <= 0) {
+                return 0;
+            }
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        len -= n;
     }
-    
-    (*content)[*size] = '\0';
     return 1;
 }
 
-// Check if file exists and is readable
-int file_exists(const char *path) {
-    struct stat st;
-    return (stat(path, &st) == 0 && S_ISREG(st.st_mode));
+// Send n requests, as many to a write as fit in the batch buffer
+int load_send(LoadConn *lc, const char *request, size_t request_len, int n) {
+    static char batch[64 * 1024];
+    int sent = 0;
+    while (sent < n) {
+        if (request_len > sizeof(batch)) {
+            if (!send_all(lc->fd, request, request_len)) {
+                return 0;
+            }
+            sent++;
+            continue;
+        }
+        size_t len = 0;
+        for (; sent < n && len + request_len <= sizeof(batch); sent++) {
+            memcpy(batch + len, request, request_len);
+            len += request_len;
+        }
+        if (!send_all(lc->fd, batch, len)) {
+            return 0;
+        }
+    }
+    lc->outstanding += n;
+    return 1;
 }
 
-// Handle HTTP request
-void handle_request(int client_fd, const char *request_buffer) {
-    HttpRequest req = {0};
-    
-    if (!parse_request(request_buffer, &req)) {
-        send_error(client_fd, 400, "Bad Request");
-        return;
+// Connect a client and send up to n requests. Returns how many were sent,
+// or -1 if the server cannot be reached.
+int load_start(LoadConn *lc, const LoadConfig *cfg, int epoll_fd, const char *request, size_t request_len, long n) {
+    if (n <= 0) {
+        lc->fd = -1;
+        return 0;
     }
-    
-    // Log request
-    printf("%s[%s]%s %s%s%s %s%s%s\n", 
-           COLOR_CYAN, req.method, COLOR_RESET,
-           COLOR_YELLOW, req.path, COLOR_RESET,
-           COLOR_BLUE, req.version, COLOR_RESET);
-    
-    // Only support GET method for now
-    if (strcmp(req.method, "GET") != 0) {
-        send_error(client_fd, 501, "Not Implemented");
-        return;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(cfg->port) };
+    if (inet_pton(AF_INET, cfg->host, &addr.sin_addr) != 1) {
+        return -1;
+    }
+    lc->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lc->fd < 0 || connect(lc->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        return -1;
     }
+    int one = 1;
+    setsockopt(lc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(lc->fd, F_SETFL, fcntl(lc->fd, F_GETFL, 0) | O_NONBLOCK);
     
-    // Handle root path
-    if (strcmp(req.path, "/") == 0) {
-        const char *html = 
-            "<!DOCTYPE html>\n"
-            "<html><head><title>Simple HTTP Server</title></head>\n"
-            "<body><h1>Welcome to Simple HTTP Server</h1>\n"
-            "<p>Server is running successfully!</p>\n"
-            "<p>Try accessing a file like <a href=\"/index.html\">index.html</a></p>\n"
-            "</body></html>\n";
-        send_response(client_fd, 200, "OK", "text/html", html, strlen(html));
-        return;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = lc };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, lc->fd, &ev) != 0 || !load_send(lc, request, request_len, (int)n)) {
+        return -1;
+    }
+    return (int)n;
+}
+
+// Drive a running server with GET requests over persistent connections
+// (pipelined -P deep) or, with --close, a new connection per request.
+// With --body each request carries that many bytes, which the server drops.
+int run_loadgen(const LoadConfig *cfg) {
+    char head[1024];
+    char length[48] = "";
+    if (cfg->body_size > 0) {
+        snprintf(length, sizeof(length), "Content-Length: %zu\r\n", cfg->body_size);
+    }
+    int head_len = snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n%s\r\n",
+                            cfg->path, cfg->host, cfg->keep_alive ? "keep-alive" : "close", length);
+    size_t request_len = (size_t)head_len + cfg->body_size;
+    char *request = (char*)malloc(request_len);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    LoadConn *conns = (LoadConn*)calloc(cfg->conns, sizeof(LoadConn));
+    if (epoll_fd < 0 || !conns || !request || head_len >= (int)sizeof(head)) {
+        printf("%sError:%s Failed to set up the load generator.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        free(conns);
+        free(request);
+        return 1;
     }
+    memcpy(request, head, head_len);
+    memset(request + head_len, 'x', cfg->body_size);
     
-    // Remove leading slash and check for directory traversal
-    char file_path[MAX_PATH_LEN];
-    if (req.path[0] == '/') {
-        strncpy(file_path, req.path + 1, sizeof(file_path) - 1);
-    } else {
-        strncpy(file_path, req.path, sizeof(file_path) - 1);
+    for (int i = 0; i < cfg->conns; i++) {
+        conns[i].fd = -1;
     }
-    file_path[sizeof(file_path) - 1] = '\0';
     
-    // Security: prevent directory traversal
-    if (strstr(file_path, "..") != NULL) {
-        send_error(client_fd, 403, "Forbidden");
-        return;
+    int per_conn = cfg->keep_alive ? cfg->pipeline : 1;
+    long sent = 0, done = 0, errors = 0, connects = 0;
+    int ok = 1;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    
+    for (int i = 0; i < cfg->conns && ok; i++) {
+        long n = cfg->requests - sent < per_conn ? cfg->requests - sent : per_conn;
+        int started = load_start(&conns[i], cfg, epoll_fd, request, request_len, n);
+        ok = started >= 0;
+        sent += started;
+        connects += started > 0;
     }
     
-    // Try to serve file
-    if (file_exists(file_path)) {
-        char *content = NULL;
-        size_t content_size = 0;
-        
-        if (read_file(file_path, &content, &content_size)) {
-            const char *mime_type = get_mime_type(file_path);
-            send_response(client_fd, 200, "OK", mime_type, content, content_size);
-            free(content);
-        } else {
-            send_error(client_fd, 500, "Internal Server Error");
+    struct epoll_event events[MAX_EVENTS];
+    while (ok && done + errors < sent) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 5000);
+        if (n <= 0) {
+            printf("%sError:%s Server stopped responding.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            ok = 0;
+            break;
+        }
+        for (int i = 0; i < n && ok; i++) {
+            LoadConn *lc = (LoadConn*)events[i].data.ptr;
+            int eof = 0;
+            while (buffer_reserve(&lc->in, &lc->in_cap, lc->in_len + READ_CHUNK + 1)) {
+                ssize_t r = recv(lc->fd, lc->in + lc->in_len, lc->in_cap - lc->in_len - 1, 0);
+                if (r <= 0) {
+                    eof = r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                    break;
+                }
+                lc->in_len += r;
+            }
+            lc->in[lc->in_len] = '\0';
+            
+            size_t off = 0, len;
+            int finished = 0;
+            while ((len = response_length(lc->in + off, lc->in_len - off)) > 0) {
+                if (strncmp(lc->in + off, "HTTP/1.1 200", 12) == 0) {
+                    done++;
+                } else {
+                    errors++;
+                }
+                off += len;
+                finished++;
+            }
+            memmove(lc->in, lc->in + off, lc->in_len - off);
+            lc->in_len -= off;
+            lc->outstanding -= finished;
+            
+            // Keep the pipeline full, one new request per response
+            long more = cfg->requests - sent < finished ? cfg->requests - sent : finished;
+            if (cfg->keep_alive && !eof && more > 0) {
+                if (load_send(lc, request, request_len, (int)more)) {
+                    sent += more;
+                } else {
+                    eof = 1;
+                }
+            }
+            if (eof || (!cfg->keep_alive && lc->outstanding == 0)) {
+                // Requests lost with the connection count as errors
+                errors += lc->outstanding;
+                lc->outstanding = 0;
+                lc->in_len = 0;
+                close(lc->fd);
+                
+                long next = cfg->requests - sent < per_conn ? cfg->requests - sent : per_conn;
+                int started = load_start(lc, cfg, epoll_fd, request, request_len, next);
+                ok = started >= 0;
+                sent += started;
+                connects += started > 0;
+            }
         }
-    } else {
-        send_error(client_fd, 404, "Not Found");
     }
-}
-
-// Handle client connection
-void handle_client(int client_fd, struct sockaddr_in *client_addr __attribute__((unused))) {
-    char buffer[BUFFER_SIZE];
-    
-    // Read request
-    ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_read <= 0) {
-        close(client_fd);
-        return;
+    if (!ok) {
+        printf("%sError:%s Lost contact with %s:%d.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, cfg->host, cfg->port);
     }
     
-    buffer[bytes_read] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%s%ld requests%s in %.2f s over %d connections (%s, pipeline %d), %ld connects\n",
+           COLOR_BOLD, done + errors, COLOR_RESET, elapsed, cfg->conns,
+           cfg->keep_alive ? "keep-alive" : "close", per_conn, connects);
+    printf("%s%.0f requests/sec%s, %ld errors\n", COLOR_GREEN COLOR_BOLD, (done + errors) / elapsed, COLOR_RESET, errors);
     
-    // Handle request
-    handle_request(client_fd, buffer);
-    
-    close(client_fd);
+    for (int i = 0; i < cfg->conns; i++) {
+        if (conns[i].fd >= 0) close(conns[i].fd);
+        free(conns[i].in);
+    }
+    free(conns);
+    free(request);
+    close(epoll_fd);
+    return ok && errors == 0 ? 0 : 1;
 }
 
 // Print server info
-void print_server_info(int port) {
+void print_server_info(const ServerConfig *cfg) {
     printf("\n%s%s========================================%s\n", COLOR_BOLD, COLOR_GREEN, COLOR_RESET);
     printf("%s%s  Simple HTTP Server Running%s\n", COLOR_BOLD, COLOR_GREEN, COLOR_RESET);
     printf("%s%s========================================%s\n\n", COLOR_BOLD, COLOR_GREEN, COLOR_RESET);
-    printf("Server listening on %shttp://localhost:%d%s\n", COLOR_CYAN, port, COLOR_RESET);
+    printf("Server listening on %shttp://localhost:%d%s\n", COLOR_CYAN, cfg->port, COLOR_RESET);
+    printf("Workers: %s%d%s, backlog: %s%d%s, keep-alive timeout: %s%d s%s\n", COLOR_CYAN, cfg->workers, COLOR_RESET,
+           COLOR_CYAN, cfg->backlog, COLOR_RESET, COLOR_CYAN, cfg->keepalive_timeout, COLOR_RESET);
+    if (cfg->cache_size > 0) {
+        printf("File cache: %s%zu MB%s per worker\n", COLOR_CYAN, cfg->cache_size / (1024 * 1024), COLOR_RESET);
+    } else {
+        printf("File cache: %sdisabled%s\n", COLOR_CYAN, COLOR_RESET);
+    }
+    if (cfg->gzip_level > 0 && cfg->cache_size > 0) {
+        printf("Compression: %sgzip level %d%s for files of %zu bytes to %d MB\n", COLOR_CYAN, cfg->gzip_level,
+               COLOR_RESET, cfg->gzip_min_size, GZIP_MAX_SIZE / (1024 * 1024));
+    } else {
+        printf("Compression: %sprecompressed files only%s\n", COLOR_CYAN, COLOR_RESET);
+    }
+    if (cfg->access_log) {
+        static const char *FORMATS[] = { "common", "combined", "json" };
+        printf("Access log: %s%s%s, %s format\n", COLOR_CYAN, strcmp(cfg->access_log, "-") == 0 ? "stdout" : cfg->access_log,
+               COLOR_RESET, FORMATS[cfg->log_format]);
+    } else {
+        printf("Access log: %sdisabled%s\n", COLOR_CYAN, COLOR_RESET);
+    }
+    for (int i = 0; i < route_count; i++) {
+        const Route *r = &routes[i];
+        printf("Proxy: %s%s%s ->", COLOR_CYAN, r->prefix, COLOR_RESET);
+        for (int s = r->first; s < r->first + r->count; s++) {
+            printf(" %s%s", upstreams[s].name, s + 1 < r->first + r->count ? "," : "");
+        }
+        printf(" (%s)\n", cfg->balance == BALANCE_LEAST_CONN ? "least-conn" : "round-robin");
+    }
+    if (cfg->server_status) {
+        printf("Status: %shttp://localhost:%d/server-status%s, loopback clients only\n", COLOR_CYAN, cfg->port,
+               COLOR_RESET);
+    }
     printf("Press %sCtrl+C%s to stop the server\n\n", COLOR_YELLOW, COLOR_RESET);
 }
 
 int main(int argc, char *argv[]) {
-    int port = PORT;
+    if (argc >= 2 && (strcmp(argv[1], "fuzz-parser") == 0 || strcmp(argv[1], "bench-parser") == 0 ||
+                      strcmp(argv[1], "bench-headers") == 0)) {
+        long iterations = 1000000;
+        uint64_t seed = (uint64_t)time(NULL);
+        for (int i = 2; i + 1 < argc; i++) {
+            if (strcmp(argv[i], "-n") == 0) iterations = atol(argv[++i]);
+            else if (strcmp(argv[i], "--seed") == 0) seed = strtoull(argv[++i], NULL, 10);
+        }
+        if (iterations <= 0) {
+            printf("%sError:%s Iteration count must be positive.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
+        }
+        if (strcmp(argv[1], "bench-parser") == 0) {
+            return run_parser_bench(iterations);
+        }
+        if (strcmp(argv[1], "bench-headers") == 0) {
+            return run_header_bench(iterations);
+        }
+        printf("Fuzzing the request parser with seed %llu\n", (unsigned long long)seed);
+        return run_parser_fuzz(iterations, seed);
+    }
     
-    // Parse port from command line if provided
-    if (argc > 1) {
-        port = atoi(argv[1]);
-        if (port <= 0 || port > 65535) {
-            printf("%sError:%s Invalid port number. Using default port %d.\n", 
-                   COLOR_RED COLOR_BOLD, COLOR_RESET, PORT);
-            port = PORT;
+    if (argc >= 2 && strcmp(argv[1], "loadgen") == 0) {
+        LoadConfig cfg = { "127.0.0.1", PORT, "/", 50, 100000, 1, 1, 0 };
+        long body_size = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--close") == 0) cfg.keep_alive = 0;
+            else if (i + 1 >= argc) break;
+            else if (strcmp(argv[i], "--host") == 0) cfg.host = argv[++i];
+            else if (strcmp(argv[i], "--port") == 0) cfg.port = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--path") == 0) cfg.path = argv[++i];
+            else if (strcmp(argv[i], "-c") == 0) cfg.conns = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-n") == 0) cfg.requests = atol(argv[++i]);
+            else if (strcmp(argv[i], "-P") == 0) cfg.pipeline = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--body") == 0) body_size = atol(argv[++i]);
         }
+        if (cfg.conns <= 0 || cfg.requests <= 0 || cfg.pipeline <= 0 || cfg.pipeline > 256 ||
+            body_size < 0 || body_size > MAX_BODY_SIZE) {
+            printf("%sError:%s Invalid load generator options.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
+        }
+        cfg.body_size = (size_t)body_size;
+        signal(SIGPIPE, SIG_IGN);
+        raise_fd_limit();
+        return run_loadgen(&cfg);
     }
     
-    // Create socket
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        printf("%sError:%s Failed to create socket.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ServerConfig cfg = { PORT, cpus > 0 ? (int)cpus : 1, DEFAULT_BACKLOG, DEFAULT_KEEPALIVE_TIMEOUT,
+                         (size_t)DEFAULT_CACHE_SIZE * 1024 * 1024, DEFAULT_GZIP_LEVEL, DEFAULT_GZIP_MIN_SIZE,
+                         "-", LOG_COMMON, BALANCE_ROUND_ROBIN, 0 };
+    const char *log_format = "common";
+    const char *balance = "round-robin";
+    long cache_mb = DEFAULT_CACHE_SIZE;
+    long gzip_min_size = DEFAULT_GZIP_MIN_SIZE;
+    
+    // Parse the port and options from the command line
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            cfg.workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            cfg.backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--keepalive-timeout") == 0 && i + 1 < argc) {
+            cfg.keepalive_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--gzip-level") == 0 && i + 1 < argc) {
+            cfg.gzip_level = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--gzip-min-size") == 0 && i + 1 < argc) {
+            gzip_min_size = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--access-log") == 0 && i + 1 < argc) {
+            cfg.access_log = argv[++i];
+        } else if (strcmp(argv[i], "--log-format") == 0 && i + 1 < argc) {
+            log_format = argv[++i];
+        } else if (strcmp(argv[i], "--proxy") == 0 && i + 1 < argc) {
+            if (!add_route(argv[++i])) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--proxy-balance") == 0 && i + 1 < argc) {
+            balance = argv[++i];
+        } else if (strcmp(argv[i], "--server-status") == 0) {
+            cfg.server_status = 1;
+        } else {
+            cfg.port = atoi(argv[i]);
+            if (cfg.port <= 0 || cfg.port > 65535) {
+                printf("%sError:%s Invalid port number. Using default port %d.\n", 
+                       COLOR_RED COLOR_BOLD, COLOR_RESET, PORT);
+                cfg.port = PORT;
+            }
+        }
+    }
+    if (cfg.workers <= 0 || cfg.workers > MAX_WORKERS) {
+        printf("%sError:%s Worker count must be between 1 and %d.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, MAX_WORKERS);
         return 1;
     }
-    
-    // Set socket options (reuse address)
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        printf("%sError:%s Failed to set socket options.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
-        close(server_fd);
+    if (cfg.backlog <= 0 || cfg.keepalive_timeout <= 0) {
+        printf("%sError:%s Backlog and keep-alive timeout must be positive.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
         return 1;
     }
-    
-    // Bind socket
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        printf("%sError:%s Failed to bind to port %d. Port may be in use.\n", 
-               COLOR_RED COLOR_BOLD, COLOR_RESET, port);
-        close(server_fd);
+    if (cache_mb < 0) {
+        printf("%sError:%s Cache size must not be negative.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
         return 1;
     }
-    
-    // Listen for connections
-    if (listen(server_fd, 10) < 0) {
-        printf("%sError:%s Failed to listen on socket.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
-        close(server_fd);
+    cfg.cache_size = (size_t)cache_mb * 1024 * 1024;
+    if (cfg.gzip_level < 0 || cfg.gzip_level > 9 || gzip_min_size < 0) {
+        printf("%sError:%s Gzip level must be 0-9 and the minimum size not negative.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
         return 1;
     }
+    cfg.gzip_min_size = (size_t)gzip_min_size;
+    if (strcmp(log_format, "common") == 0) {
+        cfg.log_format = LOG_COMMON;
+    } else if (strcmp(log_format, "combined") == 0) {
+        cfg.log_format = LOG_COMBINED;
+    } else if (strcmp(log_format, "json") == 0) {
+        cfg.log_format = LOG_JSON;
+    } else {
+        printf("%sError:%s Log format must be common, combined or json.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 1;
+    }
+    if (strcmp(balance, "round-robin") == 0) {
+        cfg.balance = BALANCE_ROUND_ROBIN;
+    } else if (strcmp(balance, "least-conn") == 0) {
+        cfg.balance = BALANCE_LEAST_CONN;
+    } else {
+        printf("%sError:%s Proxy balancing must be round-robin or least-conn.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 1;
+    }
+    if (strcmp(cfg.access_log, "off") == 0) {
+        cfg.access_log = NULL;
+    } else if (strcmp(cfg.access_log, "-") == 0) {
+        log_writer.fd = STDOUT_FILENO;
+    } else {
+        log_writer.fd = open(cfg.access_log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_writer.fd < 0) {
+            printf("%sError:%s Cannot open access log %s: %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET,
+                   cfg.access_log, strerror(errno));
+            return 1;
+        }
+    }
     
-    print_server_info(port);
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
     
-    // Accept connections
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd < 0) {
-            printf("%sError:%s Failed to accept connection.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
-            continue;
+    for (int i = 0; i < cfg.workers; i++) {
+        Worker *w = &workers[i];
+        w->id = i;
+        w->cfg = &cfg;
+        w->cache.capacity = cfg.cache_size;
+        slab_init(&w->pool.conns, sizeof(Conn));
+        slab_init(&w->pool.file_sends, sizeof(FileSend));
+        slab_init(&w->pool.upstreams, sizeof(UpstreamConn));
+        if (cfg.access_log && !(w->log.buf = (char*)malloc(LOG_RING_SIZE))) {
+            printf("%sError:%s Out of memory for the access log.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
+        }
+        w->listen_fd = create_listener(cfg.port, cfg.backlog);
+        if (w->listen_fd < 0) {
+            return 1;
+        }
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+        if (w->epoll_fd < 0 || epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev) != 0) {
+            printf("%sError:%s Failed to create event loop.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
         }
-        
-        handle_client(client_fd, &client_addr);
     }
     
-    close(server_fd);
+    print_server_info(&cfg);
+    fflush(stdout);
+    
+    if (cfg.access_log) {
+        log_writer.cfg = &cfg;
+        if (pthread_create(&log_writer.thread, NULL, log_writer_run, &log_writer) != 0) {
+            printf("%sError:%s Failed to start the access log writer.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
+        }
+    }
+    if (cfg.gzip_level > 0 && cfg.cache_size > 0) {
+        gzip_store.level = cfg.gzip_level;
+        gzip_store.capacity = cfg.cache_size;
+        if (pthread_create(&gzip_store.thread, NULL, gzip_store_run, &gzip_store) != 0) {
+            printf("%sError:%s Failed to start the compressor thread.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
+        }
+    }
+    for (int i = 0; i < cfg.workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            printf("%sError:%s Failed to start worker %d.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < cfg.workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
     return 0;
 }
-
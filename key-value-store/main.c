@@ -1,12 +1,89 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
-#define HASH_TABLE_SIZE 101
+#define INITIAL_CAPACITY 16     // Must be a power of two
+#define MAX_LOAD_NUM 7          // Grow once slots in use exceed 7/8 of capacity
+#define MAX_LOAD_DEN 8
+#define REHASH_STEP 64          // Slots migrated per operation during a resize
+#define SHARD_BITS 6            // 64 independently locked shards
+#define NUM_SHARDS (1 << SHARD_BITS)
+#define CACHE_LINE 64
+#define ARENA_CHUNK_SIZE (1 << 20)  // Records are carved out of chunks of up to 1 MB
+#define ARENA_MIN_CHUNK 4096        // First chunk; each new one doubles the arena
 #define MAX_KEY_LEN 256
-#define MAX_VAL_LEN 1024
+#define MAX_VAL_LEN 65536       // Lengths are stored as uint16 on disk
+#define SKIP_MAX_LEVEL 32       // Ordered index levels; each is 1/4 as dense as the one below
+#define SCAN_PAGE 128           // Keys copied out of the ordered index per lock hold
 #define STORAGE_FILE "kvstore.dat"
+#define STORAGE_TMP_FILE "kvstore.dat.tmp"
+#define LOG_FILE "kvstore.log"            // Mutations since the last snapshot
+#define LOG_OLD_FILE "kvstore.log.old"    // Log being folded into a snapshot
+#define LOCK_FILE "kvstore.lock"          // Held by the process writing a snapshot
+#define COMPACT_MIN_RECORDS 1000          // Never compact logs shorter than this
+#define DEFAULT_COMPACT_RATIO 0.5         // Compact once half the log is dead
+#define DEFAULT_FSYNC_MS 1000
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 6          // 1 ms ticks; six levels of 64 slots span about two years
+#define EVICTION_SAMPLES 5      // Keys compared to pick each eviction victim
+#define LFU_INIT_VAL 5          // Starting frequency, so new keys are not evicted first
+#define LFU_LOG_FACTOR 10       // Higher values make the counter saturate more slowly
+#define LFU_DECAY_MINUTES 1     // Idle minutes per counter decrement
+#define HIST_SUB_BITS 4         // 16 latency buckets per power of two, so within 1/16 of the value
+#define HIST_MAX_BITS 40        // Latencies are capped at 2^40 ns (about 18 minutes)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define STATS_MAX_OPS 32        // Commands that can have a latency histogram
+#define PROBE_BUCKETS 7         // Probe distances 0, 1, 2, 3, 4-7, 8-15, 16+
+
+#define SNAPSHOT_MAGIC "KVSTORE2"
+#define SNAPSHOT_VERSION 6
+#define SNAPSHOT_MIN_VERSION 2  // Version 2 indexes used the unmixed djb2 hash
+#define SNAPSHOT_HASH_VERSION 3 // First version indexed with djb2 plus a finalizer
+#define SNAPSHOT_TTL_VERSION 4  // First version storing an expiry time per record
+#define SNAPSHOT_SEED_VERSION 5 // First version indexed with seeded wyhash
+#define SNAPSHOT_BLOCK_VERSION 6 // First version storing records in compressed blocks
+#define SNAPSHOT_BLOCK_SIZE (64 * 1024) // Records are added to a block until it reaches this size
+#define SNAPSHOT_RECORD_HEAD (2 * sizeof(uint32_t) + sizeof(int64_t))
+#define SNAPSHOT_BLOCK_CAP (SNAPSHOT_BLOCK_SIZE + SNAPSHOT_RECORD_HEAD + MAX_KEY_LEN + MAX_VAL_LEN + 2)
+#define CODEC_RAW 0
+#define CODEC_LZ4 1
+
+// Log record operations
+#define LOG_SET    1
+#define LOG_DELETE 2
+#define LOG_CLEAR  3
+#define LOG_EXPIRE 4            // Value is the absolute expiry time in ms, as text
+
+// Control byte values for each slot
+#define CTRL_EMPTY   0x00
+#define CTRL_DELETED 0x01
+#define CTRL_FULL    0x80       // Low 7 bits hold the hash fingerprint
 
 // ANSI color codes
 #define COLOR_RESET   "\033[0m"
@@ -17,291 +94,5931 @@
 #define COLOR_CYAN    "\033[36m"
 #define COLOR_BOLD    "\033[1m"
 
-// Key-Value pair structure
-typedef struct KVPair {
-    char key[MAX_KEY_LEN];
-    char value[MAX_VAL_LEN];
-    struct KVPair *next;  // For collision chaining
-} KVPair;
+// Length-prefixed key-value record stored in an arena chunk
+typedef struct {
+    uint32_t key_len;
+    uint32_t val_len;
+    uint32_t val_cap;     // Bytes reserved for the value, so shorter updates stay in place
+    _Atomic uint32_t access;  // LRU clock or LFU counter; updated under read locks
+    int64_t expire_at;    // Wall-clock ms after which the key is gone, or 0
+    char data[];          // key '\0' value '\0'
+} Record;
 
-// Hash table structure
+// Chunk of arena memory; records are bump-allocated and never freed one by one
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+// Arena owning every record of a table
 typedef struct {
-    KVPair *buckets[HASH_TABLE_SIZE];
-    int count;
+    ArenaChunk *head;
+    size_t live_bytes;    // Bytes held by records still referenced by the index
+    size_t dead_bytes;    // Bytes of replaced or deleted records
+    size_t total_bytes;   // Bytes allocated for chunks
+} Arena;
+
+// Slot in the open-addressing index
+typedef struct {
+    uint32_t hash;        // Full hash, kept so resizing never rehashes keys
+    Record *rec;
+} Slot;
+
+// Open-addressing index with linear probing and one control byte per slot
+typedef struct {
+    uint8_t *ctrl;
+    Slot *slots;
+    size_t capacity;      // Always a power of two (0 when unallocated)
+    size_t used;          // Full plus deleted slots
+    size_t live;          // Full slots only
+} Index;
+
+// One shard of the table: an independent index and arena behind its own lock
+typedef struct {
+    pthread_rwlock_t lock;
+    Index cur;            // Receives all inserts
+    Index old;            // Drained into cur while a resize is in progress
+    size_t rehash_pos;    // Next slot of old to migrate
+    Arena arena;
+    size_t count;
+    int ordered;          // Writes are mirrored into the ordered index
+} __attribute__((aligned(CACHE_LINE))) Shard;
+
+// Skip list node holding its own copy of the key. Values stay in the hash
+// table, so records are free to move when arenas are compacted.
+typedef struct SkipNode {
+    uint32_t key_len;
+    uint32_t level;
+    struct SkipNode *next[];  // level forward pointers, followed by the key
+} SkipNode;
+
+// Keys in byte order for scans. Built on the first range query, then kept
+// current by every write; its lock is always taken after a shard's lock.
+typedef struct {
+    pthread_rwlock_t lock;
+    atomic_int built;
+    SkipNode *head;
+    int level;            // Levels in use
+    size_t count;
+    uint64_t rng;         // Draws node levels
+} OrderedIndex;
+
+// Pending expiry of one key. Entries are never cancelled: one whose key has
+// since been deleted, overwritten or given another TTL is dropped when it fires.
+typedef struct TimerEntry {
+    struct TimerEntry *next;
+    int64_t expire_at;
+    char key[];
+} TimerEntry;
+
+// Hierarchical timer wheel with 1 ms ticks. Level l slots each cover 64^l
+// ticks; entries cascade one level down as their slot comes up, so an
+// expiry pass only touches entries that are due or about to be.
+typedef struct {
+    pthread_mutex_t lock;
+    int64_t now;          // Every tick up to here has been processed
+    size_t count;
+    TimerEntry *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+// Hash table structure: keys are spread over shards by the top hash bits, so
+// threads touching different shards never contend
+typedef struct {
+    Shard shards[NUM_SHARDS];
+    OrderedIndex ordered;
+    TimerWheel wheel;
+    atomic_size_t expired;    // Keys removed because their TTL ran out
+    atomic_size_t evicted;    // Keys removed to stay under maxmemory
 } HashTable;
 
+// What happens once maxmemory is reached
+typedef enum {
+    EVICT_LRU,            // Drop the least recently used of a few sampled keys
+    EVICT_LFU,            // Drop the least frequently used of a few sampled keys
+    EVICT_NONE            // Refuse writes instead
+} EvictionPolicy;
+
+// Memory cap, read from KVSTORE_MAXMEMORY and KVSTORE_EVICTION
+typedef struct {
+    size_t maxmemory;     // 0 for no limit
+    EvictionPolicy policy;
+} CacheConfig;
+
+// Bounds of a scan; NULL fields are unbounded
+typedef struct {
+    const char *from;     // Inclusive lower bound
+    const char *to;       // Inclusive upper bound
+    const char *prefix;   // Keys must start with this
+    const char *after;    // Cursor from a previous page: resume after this key
+} KeyRange;
+
+// Receives each pair visited by a scan
+typedef void (*ScanFn)(const char *key, const char *value, size_t val_len, void *ctx);
+
+// Iterator over every record in every shard
+typedef struct {
+    int shard;
+    int which;
+    size_t pos;
+} TableIter;
+
+// When the log is flushed to stable storage
+typedef enum {
+    FSYNC_ALWAYS,         // After every commit
+    FSYNC_INTERVAL,       // At most once every interval_ms
+    FSYNC_NEVER           // Left to the operating system
+} FsyncPolicy;
+
+// Append-only log of set/delete/clear records
+typedef struct {
+    int fd;
+    char *buf;            // Records appended but not yet committed
+    size_t len;
+    size_t cap;
+    FsyncPolicy policy;
+    int interval_ms;
+    double compact_ratio;
+    double last_sync;
+    int dirty;            // Written since the last fsync
+    size_t records;       // Records across both log files
+    // Sees every appended record; the server uses it to feed replicas
+    void (*observer)(uint8_t op, const char *key, const char *value);
+} Wal;
+
+// Snapshot file header. A snapshot is the header, the records (in blocks
+// since version 6), then an open-addressing index over them, so it can be
+// probed in place.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t data_offset;
+    uint64_t index_offset;
+    uint64_t index_capacity;  // Power of two
+    uint64_t hash_seed;       // Seed the index was hashed with (version 5)
+    uint64_t block_count;     // Blocks and the table of their offsets (version 6)
+    uint64_t block_table_offset;
+} SnapshotHeader;
+
+// On-disk index slot; offset 0 marks an empty slot. From version 6 the
+// offset is (block number + 1) << 32 | offset within the uncompressed block.
+typedef struct {
+    uint64_t offset;
+    uint32_t hash;
+    uint32_t key_len;
+} SnapshotSlot;
+
+// Header in front of each block's stored bytes
+typedef struct {
+    uint32_t raw_len;         // Length once decompressed
+    uint32_t stored_len;
+    uint32_t crc;             // CRC-32 of the stored bytes
+    uint32_t codec;           // CODEC_RAW or CODEC_LZ4
+} SnapshotBlock;
+
+// A snapshot mapped into memory
+typedef struct {
+    const char *base;
+    size_t size;
+    const SnapshotHeader *header;
+    const SnapshotSlot *slots;
+    const uint64_t *blocks;   // File offset of each block (version 6)
+} Snapshot;
+
+// Log-linear latency histogram in the style of HdrHistogram: values up to
+// 15 ns get a bucket each, then every power of two is split into 16 buckets
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} LatencyHist;
+
+// One thread's latency histograms, indexed by command. Only the owning
+// thread writes them, so recording needs no lock or atomic; a reader merges
+// every thread's copy and may see counts a moment out of date.
+typedef struct ThreadStats {
+    struct ThreadStats *next;
+    LatencyHist ops[STATS_MAX_OPS];
+} ThreadStats;
+
+// Runs of one persistence step
+typedef struct {
+    uint64_t runs;
+    uint64_t last_ns;
+    uint64_t max_ns;
+    uint64_t total_ns;
+} Timing;
+
+typedef struct {
+    Timing load;          // Loading the snapshot and replaying the logs
+    Timing save;          // Snapshots written by this process (not by forked children)
+    Timing fork;          // Forking a child to write a snapshot
+    Timing fsync;         // Flushing the log to stable storage
+} PersistStats;
+
+// Shape and memory of the hash table, gathered by walking it
+typedef struct {
+    size_t keys;
+    size_t capacity;      // Slots across both indexes of every shard
+    size_t tombstones;
+    size_t resizing;      // Shards with a resize in progress
+    size_t shard_min;
+    size_t shard_max;
+    size_t probes[PROBE_BUCKETS];
+    size_t probe_sum;     // Distance of each key from its home slot, summed
+    size_t probe_max;
+    size_t key_bytes;
+    size_t value_bytes;
+    size_t value_slack;   // Reserved beyond each value's length
+    size_t header_bytes;  // Record headers, terminators and alignment
+    size_t dead_bytes;    // Replaced or deleted records awaiting compaction
+    size_t unused_bytes;  // Arena space not handed out yet
+    size_t index_bytes;
+    size_t ordered_bytes;
+    size_t timer_bytes;
+} TableStats;
+
 HashTable *table = NULL;
+CacheConfig cache = { 0, EVICT_LRU };
+_Atomic uint32_t cache_clock;   // Milliseconds (wrapping), refreshed by cache_tick()
+_Atomic uint32_t cache_minutes; // Minutes, for LFU decay
+Wal wal = { .fd = -1 };
+int compress_snapshots = 1;
+ThreadStats *thread_stats_list = NULL;
+pthread_mutex_t thread_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local ThreadStats *thread_stats = NULL;
+PersistStats persist_stats;
 
-// Hash function (djb2 algorithm)
-uint32_t hash(const char *key) {
+// Hash functions all take the key's length and a seed, so they can be
+// swapped for one another (see HASH_FUNCTIONS and bench hash)
+typedef uint32_t (*HashFn)(const char *key, size_t len, uint64_t seed);
+
+// The original djb2 hash, one byte at a time. Only the baseline table in the
+// benchmarks still uses it as is.
+uint32_t hash_djb2(const char *key, size_t len, uint64_t seed) {
+    (void)seed;
     uint32_t hash = 5381;
-    int c;
-    while ((c = *key++)) {
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
+    for (size_t i = 0; i < len; i++) {
+        hash = ((hash << 5) + hash) + (unsigned char)key[i]; // hash * 33 + c
+    }
+    return hash;
+}
+
+// djb2 with the MurmurHash3 finalizer, so every bit of the result depends on
+// every key byte. Snapshots before version 5 are indexed with it.
+uint32_t hash_djb2_mixed(const char *key, size_t len, uint64_t seed) {
+    uint32_t hash = hash_djb2(key, len, seed);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static inline uint64_t read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// 64x64 -> 128 bit multiply, folded back to 64 bits
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// wyhash: reads the key 8 or 16 bytes at a time and mixes with full-width
+// multiplies, so a 64-byte key costs a handful of instructions rather than
+// 64 dependent steps. The result depends on the seed, so colliding keys
+// cannot be precomputed without knowing it.
+uint32_t hash_wyhash(const char *key, size_t len, uint64_t seed) {
+    static const uint64_t p0 = 0xa0761d6478bd642full, p1 = 0xe7037ed1a0b428dbull,
+                          p2 = 0x8ebc6af09c88c6e3ull, p3 = 0x589965cc75374cc3ull;
+    const char *p = key;
+    uint64_t a, b;
+    
+    seed ^= wymix(seed ^ p0, p1);
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;
+            a = read32(p) << 32 | read32(p + mid);
+            b = read32(p + len - 4) << 32 | read32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = (uint64_t)(unsigned char)p[0] << 16 | (uint64_t)(unsigned char)p[len >> 1] << 8 |
+                (unsigned char)p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(read64(p) ^ p1, read64(p + 8) ^ seed);
+                see1 = wymix(read64(p + 16) ^ p2, read64(p + 24) ^ see1);
+                see2 = wymix(read64(p + 32) ^ p3, read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(read64(p) ^ p1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    
+    __uint128_t r = (__uint128_t)(a ^ p1) * (b ^ seed);
+    uint64_t h = wymix((uint64_t)r ^ p0 ^ len, (uint64_t)(r >> 64) ^ p1);
+    return (uint32_t)(h ^ h >> 32);
+}
+
+typedef struct {
+    const char *name;
+    HashFn fn;
+} HashFunction;
+
+static const HashFunction HASH_FUNCTIONS[] = {
+    { "wyhash", hash_wyhash },
+    { "djb2+fmix", hash_djb2_mixed },
+    { "djb2", hash_djb2 },
+};
+
+// Random per process, so clients cannot pick keys that collide
+uint64_t hash_seed;
+
+void init_hash_seed() {
+    if (getrandom(&hash_seed, sizeof(hash_seed), GRND_NONBLOCK) != sizeof(hash_seed)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        hash_seed = (uint64_t)ts.tv_nsec * 0x9E3779B97F4A7C15ull ^ (uint64_t)getpid() << 32 ^ (uint64_t)ts.tv_sec;
+    }
+}
+
+// Hash of a key in the table; shards use the top bits
+static inline uint32_t hash(const char *key, size_t len) {
+    return hash_wyhash(key, len, hash_seed);
+}
+
+// Control byte stored for a full slot: the low 7 bits of the hash
+static inline uint8_t fingerprint(uint32_t h) {
+    return CTRL_FULL | (uint8_t)(h & 0x7f);
+}
+
+// Home slot of a hash; skips the fingerprint bits so they stay informative
+static inline size_t home_slot(uint32_t h, size_t mask) {
+    return (h >> 7) & mask;
+}
+
+// Shard owning a hash: the top bits, which the home slot rarely reaches
+static inline Shard* shard_for(HashTable *ht, uint32_t h) {
+    return &ht->shards[h >> (32 - SHARD_BITS)];
+}
+
+static inline uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Wall-clock time in ms. Expiry times are absolute so they survive restarts.
+int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Refresh the clock access times are stamped with, so that clock reads stay
+// off the get path
+void cache_tick() {
+    int64_t now = now_ms();
+    atomic_store_explicit(&cache_clock, (uint32_t)now, memory_order_relaxed);
+    atomic_store_explicit(&cache_minutes, (uint32_t)(now / 60000) & 0xffff, memory_order_relaxed);
+}
+
+// Has the record's TTL run out? The clock is only read for keys with a TTL.
+static inline int record_expired(const Record *rec) {
+    return rec->expire_at != 0 && rec->expire_at <= now_ms();
+}
+
+// LFU counter after decaying it for the time since it was last touched. The
+// top bits of access hold that time in minutes, the low 8 bits a counter
+// that grows logarithmically with the number of accesses (as in Redis).
+static inline uint32_t lfu_counter(uint32_t access, uint32_t minutes) {
+    uint32_t counter = access & 0xff;
+    uint32_t decay = ((minutes - (access >> 8)) & 0xffff) / LFU_DECAY_MINUTES;
+    return decay < counter ? counter - decay : 0;
+}
+
+// Access stamp for a new record
+static inline uint32_t access_init() {
+    if (cache.policy == EVICT_LFU) {
+        return atomic_load_explicit(&cache_minutes, memory_order_relaxed) << 8 | LFU_INIT_VAL;
+    }
+    return atomic_load_explicit(&cache_clock, memory_order_relaxed);
+}
+
+// Note a read or write for the eviction policy; free without a memory cap
+void record_touch(Record *rec) {
+    if (cache.maxmemory == 0) {
+        return;
+    }
+    uint32_t access = atomic_load_explicit(&cache_clock, memory_order_relaxed);
+    if (cache.policy == EVICT_LFU) {
+        static _Thread_local uint64_t rng = 0x9E3779B97F4A7C15ull;
+        uint32_t minutes = atomic_load_explicit(&cache_minutes, memory_order_relaxed);
+        uint32_t counter = lfu_counter(atomic_load_explicit(&rec->access, memory_order_relaxed), minutes);
+        // Each access bumps the counter with probability 1 / (excess * factor + 1)
+        uint32_t excess = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+        if (counter < 255 && xorshift64(&rng) % (excess * LFU_LOG_FACTOR + 1) == 0) {
+            counter++;
+        }
+        access = minutes << 8 | counter;
+    }
+    atomic_store_explicit(&rec->access, access, memory_order_relaxed);
+}
+
+// How good an eviction victim a record is: idle milliseconds for LRU, rarity
+// for LFU
+static inline long eviction_score(const Record *rec) {
+    uint32_t access = atomic_load_explicit(&rec->access, memory_order_relaxed);
+    if (cache.policy == EVICT_LFU) {
+        return 255 - lfu_counter(access, atomic_load_explicit(&cache_minutes, memory_order_relaxed));
+    }
+    return (uint32_t)(atomic_load_explicit(&cache_clock, memory_order_relaxed) - access);
+}
+
+// Bytes a record occupies in its chunk, rounded up to keep records aligned
+static inline size_t record_size(uint32_t key_len, uint32_t val_cap) {
+    size_t size = sizeof(Record) + key_len + 1 + val_cap + 1;
+    return (size + 7) & ~(size_t)7;
+}
+
+static inline const char* record_key(const Record *rec) {
+    return rec->data;
+}
+
+static inline char* record_value(Record *rec) {
+    return rec->data + rec->key_len + 1;
+}
+
+// Start a new chunk with room for at least size bytes
+ArenaChunk* arena_reserve(Arena *arena, size_t size) {
+    // Grow geometrically so small shards stay small; oversized records get
+    // a chunk of their own
+    size_t chunk_size = arena->total_bytes < ARENA_MIN_CHUNK ? ARENA_MIN_CHUNK : arena->total_bytes;
+    if (chunk_size > ARENA_CHUNK_SIZE) {
+        chunk_size = ARENA_CHUNK_SIZE;
+    }
+    if (size > chunk_size) {
+        chunk_size = size;
+    }
+    ArenaChunk *chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + chunk_size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->used = 0;
+    chunk->size = chunk_size;
+    chunk->next = arena->head;
+    arena->head = chunk;
+    arena->total_bytes += sizeof(ArenaChunk) + chunk_size;
+    return chunk;
+}
+
+// Bump-allocate size bytes, starting a new chunk when the current one is full
+void* arena_alloc(Arena *arena, size_t size) {
+    ArenaChunk *chunk = arena->head;
+    
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk = arena_reserve(arena, size);
+        if (!chunk) {
+            return NULL;
+        }
+    }
+    
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->live_bytes += size;
+    return ptr;
+}
+
+// Release every chunk at once
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+// Mark a record's bytes as garbage; they are reclaimed by compaction
+void arena_release(Arena *arena, const Record *rec) {
+    size_t size = record_size(rec->key_len, rec->val_cap);
+    arena->live_bytes -= size;
+    arena->dead_bytes += size;
+}
+
+// Allocate a record holding copies of key and value
+Record* create_record(Arena *arena, const char *key, size_t key_len, const char *value, size_t val_len) {
+    Record *rec = (Record*)arena_alloc(arena, record_size(key_len, val_len));
+    if (!rec) {
+        return NULL;
+    }
+    
+    rec->key_len = key_len;
+    rec->val_len = val_len;
+    rec->val_cap = val_len;
+    atomic_init(&rec->access, access_init());
+    rec->expire_at = 0;
+    memcpy(rec->data, key, key_len + 1);
+    memcpy(record_value(rec), value, val_len + 1);
+    return rec;
+}
+
+// Allocate an empty index with the given power-of-two capacity
+int index_init(Index *idx, size_t capacity) {
+    idx->ctrl = (uint8_t*)calloc(capacity, sizeof(uint8_t));
+    idx->slots = (Slot*)malloc(capacity * sizeof(Slot));
+    if (!idx->ctrl || !idx->slots) {
+        free(idx->ctrl);
+        free(idx->slots);
+        memset(idx, 0, sizeof(*idx));
+        return 0;
+    }
+    idx->capacity = capacity;
+    idx->used = 0;
+    idx->live = 0;
+    return 1;
+}
+
+void index_free(Index *idx) {
+    free(idx->ctrl);
+    free(idx->slots);
+    memset(idx, 0, sizeof(*idx));
+}
+
+// Find the slot holding key, or SIZE_MAX. Keys are only compared on
+// fingerprint hits, and then by length before memcmp.
+size_t index_find(const Index *idx, const char *key, size_t key_len, uint32_t h) {
+    if (idx->capacity == 0) {
+        return SIZE_MAX;
+    }
+    
+    size_t mask = idx->capacity - 1;
+    uint8_t fp = fingerprint(h);
+    
+    for (size_t pos = home_slot(h, mask), probes = 0; probes < idx->capacity; pos = (pos + 1) & mask, probes++) {
+        uint8_t c = idx->ctrl[pos];
+        if (c == CTRL_EMPTY) {
+            return SIZE_MAX;
+        }
+        if (c == fp && idx->slots[pos].hash == h) {
+            const Record *rec = idx->slots[pos].rec;
+            if (rec->key_len == key_len && memcmp(record_key(rec), key, key_len) == 0) {
+                return pos;
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Place a record known to be absent into the first free slot of its probe run
+void index_insert(Index *idx, uint32_t h, Record *rec) {
+    size_t mask = idx->capacity - 1;
+    size_t pos = home_slot(h, mask);
+    
+    while (idx->ctrl[pos] & CTRL_FULL) {
+        pos = (pos + 1) & mask;
+    }
+    
+    if (idx->ctrl[pos] == CTRL_EMPTY) {
+        idx->used++;
+    }
+    idx->ctrl[pos] = fingerprint(h);
+    idx->slots[pos].hash = h;
+    idx->slots[pos].rec = rec;
+    idx->live++;
+}
+
+// Vacate a slot. It only needs a tombstone if a probe run continues past it.
+void index_remove_at(Index *idx, size_t pos) {
+    size_t mask = idx->capacity - 1;
+    
+    if (idx->ctrl[(pos + 1) & mask] == CTRL_EMPTY) {
+        idx->ctrl[pos] = CTRL_EMPTY;
+        idx->used--;
+    } else {
+        idx->ctrl[pos] = CTRL_DELETED;
+    }
+    idx->live--;
+}
+
+// Move up to max_slots slots from the old index into the current one
+void rehash_step(Shard *sh, size_t max_slots) {
+    if (sh->old.capacity == 0) {
+        return;
+    }
+    
+    while (max_slots-- > 0 && sh->rehash_pos < sh->old.capacity) {
+        size_t pos = sh->rehash_pos++;
+        if (sh->old.ctrl[pos] & CTRL_FULL) {
+            index_insert(&sh->cur, sh->old.slots[pos].hash, sh->old.slots[pos].rec);
+            sh->old.ctrl[pos] = CTRL_DELETED;
+            sh->old.live--;
+        }
+    }
+    
+    if (sh->rehash_pos == sh->old.capacity) {
+        index_free(&sh->old);
+        sh->rehash_pos = 0;
+    }
+}
+
+// Start an incremental resize if one more insert would exceed the load factor
+int maybe_grow(Shard *sh) {
+    Index *cur = &sh->cur;
+    
+    // Entries still waiting in the old index will land in cur as well
+    if ((cur->used + sh->old.live + 1) * MAX_LOAD_DEN <= cur->capacity * MAX_LOAD_NUM) {
+        return 1;
+    }
+    
+    // Never run two resizes at once; finish the previous one first
+    rehash_step(sh, SIZE_MAX);
+    
+    // Double when mostly live, otherwise rebuild at the same size to drop tombstones
+    size_t new_capacity = cur->capacity;
+    if (new_capacity == 0) {
+        new_capacity = INITIAL_CAPACITY;
+    } else if (cur->live * 2 >= cur->capacity) {
+        new_capacity *= 2;
+    }
+    
+    Index fresh;
+    if (!index_init(&fresh, new_capacity)) {
+        return 0;
+    }
+    
+    sh->old = *cur;
+    sh->cur = fresh;
+    sh->rehash_pos = 0;
+    rehash_step(sh, REHASH_STEP);
+    return 1;
+}
+
+// Make room for n entries up front. Bulk loads need this: inserting keys in
+// another table's slot order into a smaller index clusters badly under
+// linear probing.
+int shard_reserve(Shard *sh, size_t n) {
+    rehash_step(sh, SIZE_MAX);
+    
+    size_t capacity = sh->cur.capacity ? sh->cur.capacity : INITIAL_CAPACITY;
+    while (n * MAX_LOAD_DEN > capacity * MAX_LOAD_NUM) {
+        capacity *= 2;
+    }
+    if (capacity == sh->cur.capacity) {
+        return 1;
+    }
+    
+    Index fresh;
+    if (!index_init(&fresh, capacity)) {
+        return 0;
     }
-    return hash % HASH_TABLE_SIZE;
+    for (size_t pos = 0; pos < sh->cur.capacity; pos++) {
+        if (sh->cur.ctrl[pos] & CTRL_FULL) {
+            index_insert(&fresh, sh->cur.slots[pos].hash, sh->cur.slots[pos].rec);
+        }
+    }
+    index_free(&sh->cur);
+    sh->cur = fresh;
+    return 1;
+}
+
+// Reserve room for n entries spread evenly over the shards
+int table_reserve(HashTable *ht, size_t n) {
+    size_t per_shard = n / NUM_SHARDS;
+    per_shard += per_shard / 8 + 16;  // Slack for uneven spread
+    
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        if (!shard_reserve(&ht->shards[i], per_shard)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 // Initialize hash table
 HashTable* create_table() {
-    HashTable *ht = (HashTable*)calloc(1, sizeof(HashTable));
+    HashTable *ht = (HashTable*)aligned_alloc(CACHE_LINE, sizeof(HashTable));
     if (!ht) {
         printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
         return NULL;
     }
+    memset(ht, 0, sizeof(HashTable));
+    
+    pthread_rwlock_init(&ht->ordered.lock, NULL);
+    pthread_mutex_init(&ht->wheel.lock, NULL);
+    ht->wheel.now = now_ms();
+    ht->ordered.level = 1;
+    ht->ordered.rng = 0x9E3779B97F4A7C15ull;
+    
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        Shard *sh = &ht->shards[i];
+        pthread_rwlock_init(&sh->lock, NULL);
+        if (!index_init(&sh->cur, INITIAL_CAPACITY)) {
+            printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            for (int j = 0; j < i; j++) {
+                index_free(&ht->shards[j].cur);
+            }
+            free(ht);
+            return NULL;
+        }
+    }
     return ht;
 }
 
-// Create a new key-value pair
-KVPair* create_pair(const char *key, const char *value) {
-    KVPair *pair = (KVPair*)malloc(sizeof(KVPair));
-    if (!pair) {
-        return NULL;
+// Number of entries across all shards
+size_t table_count(HashTable *ht) {
+    size_t count = 0;
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        count += ht->shards[i].count;
     }
+    return count;
+}
+
+// Copy every live record into a fresh arena and drop the old chunks in bulk
+int compact_arena(Shard *sh) {
+    Arena fresh = {0};
+    Index *indexes[2] = { &sh->cur, &sh->old };
     
-    strncpy(pair->key, key, MAX_KEY_LEN - 1);
-    pair->key[MAX_KEY_LEN - 1] = '\0';
-    strncpy(pair->value, value, MAX_VAL_LEN - 1);
-    pair->value[MAX_VAL_LEN - 1] = '\0';
-    pair->next = NULL;
+    // Reserve room for every live record up front so copying cannot fail halfway
+    if (sh->arena.live_bytes > 0 && !arena_reserve(&fresh, sh->arena.live_bytes)) {
+        return 0;
+    }
+    
+    for (int i = 0; i < 2; i++) {
+        Index *idx = indexes[i];
+        for (size_t pos = 0; pos < idx->capacity; pos++) {
+            if (!(idx->ctrl[pos] & CTRL_FULL)) {
+                continue;
+            }
+            Record *rec = idx->slots[pos].rec;
+            Record *copy = create_record(&fresh, record_key(rec), rec->key_len, record_value(rec), rec->val_len);
+            atomic_init(&copy->access, atomic_load_explicit(&rec->access, memory_order_relaxed));
+            copy->expire_at = rec->expire_at;
+            idx->slots[pos].rec = copy;
+        }
+    }
     
-    return pair;
+    arena_free(&sh->arena);
+    sh->arena = fresh;
+    return 1;
 }
 
-// Insert or update a key-value pair
-int set_value(const char *key, const char *value) {
-    if (!table || !key || !value) {
-        return 0;
+// Compact once garbage outweighs live data and amounts to at least a chunk
+void maybe_compact(Shard *sh) {
+    Arena *arena = &sh->arena;
+    if (arena->dead_bytes > arena->live_bytes && arena->dead_bytes >= ARENA_CHUNK_SIZE) {
+        compact_arena(sh);
+    }
+}
+
+// Look a key up in both indexes
+Record* find_record(Shard *sh, const char *key, size_t key_len, uint32_t h) {
+    size_t pos = index_find(&sh->cur, key, key_len, h);
+    if (pos != SIZE_MAX) {
+        return sh->cur.slots[pos].rec;
     }
     
-    if (strlen(key) == 0 || strlen(key) >= MAX_KEY_LEN) {
-        printf("%sError:%s Key length must be between 1 and %d characters.\n", 
-               COLOR_RED COLOR_BOLD, COLOR_RESET, MAX_KEY_LEN - 1);
-        return 0;
+    pos = index_find(&sh->old, key, key_len, h);
+    if (pos != SIZE_MAX) {
+        return sh->old.slots[pos].rec;
+    }
+    return NULL;
+}
+
+// Point the slot holding key at a new record
+void replace_record(Shard *sh, const char *key, size_t key_len, uint32_t h, Record *rec) {
+    Index *indexes[2] = { &sh->cur, &sh->old };
+    
+    for (int i = 0; i < 2; i++) {
+        size_t pos = index_find(indexes[i], key, key_len, h);
+        if (pos != SIZE_MAX) {
+            indexes[i]->slots[pos].rec = rec;
+            return;
+        }
+    }
+}
+
+// Key stored after a node's forward pointers
+static inline char* skip_key(SkipNode *node) {
+    return (char*)&node->next[node->level];
+}
+
+// Level for a new node: 1, then one more with probability 1/4 each time
+int skip_random_level(OrderedIndex *oi) {
+    int level = 1;
+    while (level < SKIP_MAX_LEVEL) {
+        oi->rng ^= oi->rng << 13;
+        oi->rng ^= oi->rng >> 7;
+        oi->rng ^= oi->rng << 17;
+        if ((oi->rng & 3) != 0) {
+            break;
+        }
+        level++;
+    }
+    return level;
+}
+
+SkipNode* skip_node_new(const char *key, size_t key_len, int level) {
+    SkipNode *node = (SkipNode*)malloc(sizeof(SkipNode) + level * sizeof(SkipNode*) + key_len + 1);
+    if (!node) {
+        return NULL;
+    }
+    node->key_len = key_len;
+    node->level = level;
+    for (int l = 0; l < level; l++) {
+        node->next[l] = NULL;
+    }
+    memcpy(skip_key(node), key, key_len + 1);
+    return node;
+}
+
+// First node whose key is >= key (> key if exclusive). When update is given
+// it receives the last node before that point on every level.
+SkipNode* skip_seek(OrderedIndex *oi, const char *key, int exclusive, SkipNode **update) {
+    SkipNode *x = oi->head;
+    for (int l = oi->level - 1; l >= 0; l--) {
+        while (x->next[l]) {
+            int cmp = strcmp(skip_key(x->next[l]), key);
+            if (cmp > 0 || (cmp == 0 && !exclusive)) {
+                break;
+            }
+            x = x->next[l];
+        }
+        if (update) {
+            update[l] = x;
+        }
+    }
+    return x->next[0];
+}
+
+// Add a key the table has just gained. Called with its shard locked.
+int ordered_insert(OrderedIndex *oi, const char *key, size_t key_len) {
+    SkipNode *update[SKIP_MAX_LEVEL];
+    int ok = 1;
+    
+    pthread_rwlock_wrlock(&oi->lock);
+    SkipNode *found = skip_seek(oi, key, 0, update);
+    if (!found || strcmp(skip_key(found), key) != 0) {
+        int level = skip_random_level(oi);
+        SkipNode *node = skip_node_new(key, key_len, level);
+        if (node) {
+            for (int l = oi->level; l < level; l++) {
+                update[l] = oi->head;
+            }
+            if (level > oi->level) {
+                oi->level = level;
+            }
+            for (int l = 0; l < level; l++) {
+                node->next[l] = update[l]->next[l];
+                update[l]->next[l] = node;
+            }
+            oi->count++;
+        } else {
+            ok = 0;
+        }
+    }
+    pthread_rwlock_unlock(&oi->lock);
+    return ok;
+}
+
+// Drop a key the table has just lost. Called with its shard locked.
+void ordered_remove(OrderedIndex *oi, const char *key) {
+    SkipNode *update[SKIP_MAX_LEVEL];
+    
+    pthread_rwlock_wrlock(&oi->lock);
+    SkipNode *node = skip_seek(oi, key, 0, update);
+    if (node && strcmp(skip_key(node), key) == 0) {
+        for (uint32_t l = 0; l < node->level; l++) {
+            update[l]->next[l] = node->next[l];
+        }
+        free(node);
+        oi->count--;
+        while (oi->level > 1 && !oi->head->next[oi->level - 1]) {
+            oi->level--;
+        }
+    }
+    pthread_rwlock_unlock(&oi->lock);
+}
+
+// Put an entry in the slot matching its distance from the wheel's time.
+// Entries already due go on the due list, or to the next tick without one.
+// Called with the wheel locked.
+void wheel_place(TimerWheel *w, TimerEntry *e, TimerEntry **due) {
+    int64_t when = e->expire_at;
+    if (when <= w->now) {
+        if (due) {
+            e->next = *due;
+            *due = e;
+            w->count--;
+            return;
+        }
+        when = w->now + 1;
+    }
+    
+    // Beyond the top level's reach: park it at the far end, where it is
+    // placed again against its real time once it cascades
+    int64_t span = (int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS);
+    if (when - w->now >= span) {
+        when = w->now + span - 1;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && when - w->now >= (int64_t)1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    size_t slot = (when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    e->next = w->slots[level][slot];
+    w->slots[level][slot] = e;
+}
+
+void wheel_add(TimerWheel *w, const char *key, int64_t expire_at) {
+    size_t key_len = strlen(key);
+    TimerEntry *e = (TimerEntry*)malloc(sizeof(TimerEntry) + key_len + 1);
+    if (!e) {
+        // The key still expires lazily, on its next read
+        return;
+    }
+    e->expire_at = expire_at;
+    memcpy(e->key, key, key_len + 1);
+    
+    pthread_mutex_lock(&w->lock);
+    wheel_place(w, e, NULL);
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Advance the wheel to now, returning the entries that fell due. Each tick
+// first cascades the higher-level slots whose period starts there, then
+// empties its level 0 slot; idle stretches with no entries are skipped.
+TimerEntry* wheel_advance(TimerWheel *w, int64_t now) {
+    TimerEntry *due = NULL;
+    
+    pthread_mutex_lock(&w->lock);
+    while (w->now < now) {
+        if (w->count == 0) {
+            w->now = now;
+            break;
+        }
+        int64_t t = ++w->now;
+        
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if (t & (((int64_t)1 << (WHEEL_BITS * level)) - 1)) {
+                continue;
+            }
+            size_t slot = (t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            TimerEntry *e = w->slots[level][slot];
+            w->slots[level][slot] = NULL;
+            while (e) {
+                TimerEntry *next = e->next;
+                wheel_place(w, e, &due);
+                e = next;
+            }
+        }
+        
+        TimerEntry **slot = &w->slots[0][t & (WHEEL_SLOTS - 1)];
+        while (*slot) {
+            TimerEntry *e = *slot;
+            *slot = e->next;
+            e->next = due;
+            due = e;
+            w->count--;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return due;
+}
+
+// Drop every pending entry
+void wheel_clear(TimerWheel *w) {
+    pthread_mutex_lock(&w->lock);
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            TimerEntry *e = w->slots[level][slot];
+            while (e) {
+                TimerEntry *next = e->next;
+                free(e);
+                e = next;
+            }
+            w->slots[level][slot] = NULL;
+        }
+    }
+    w->count = 0;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Check that a key and value fit the table's limits, reporting why not
+int check_pair(size_t key_len, size_t val_len) {
+    if (key_len == 0 || key_len >= MAX_KEY_LEN) {
+        printf("%sError:%s Key length must be between 1 and %d characters.\n", 
+               COLOR_RED COLOR_BOLD, COLOR_RESET, MAX_KEY_LEN - 1);
+        return 0;
+    }
+    
+    if (val_len >= MAX_VAL_LEN) {
+        printf("%sError:%s Value length must be less than %d characters.\n", 
+               COLOR_RED COLOR_BOLD, COLOR_RESET, MAX_VAL_LEN);
+        return 0;
+    }
+    return 1;
+}
+
+// Insert or update a key-value pair that expires at expire_at (wall-clock
+// ms), or never if it is 0. Setting a key always replaces its old TTL.
+int set_value_expire(const char *key, const char *value, int64_t expire_at) {
+    if (!table || !key || !value) {
+        return 0;
+    }
+    
+    size_t key_len = strlen(key);
+    size_t val_len = strlen(value);
+    
+    if (!check_pair(key_len, val_len)) {
+        return 0;
+    }
+    
+    uint32_t h = hash(key, key_len);
+    Shard *sh = shard_for(table, h);
+    int ok = 1;
+    
+    pthread_rwlock_wrlock(&sh->lock);
+    rehash_step(sh, REHASH_STEP);
+    
+    Record *existing = find_record(sh, key, key_len, h);
+    
+    // Check if key already exists
+    if (existing) {
+        if (val_len <= existing->val_cap) {
+            // Update in place when the new value fits in the reserved space
+            memcpy(record_value(existing), value, val_len + 1);
+            existing->val_len = val_len;
+            existing->expire_at = expire_at;
+            record_touch(existing);
+        } else {
+            Record *rec = create_record(&sh->arena, key, key_len, value, val_len);
+            if (rec) {
+                rec->expire_at = expire_at;
+                arena_release(&sh->arena, existing);
+                replace_record(sh, key, key_len, h, rec);
+                maybe_compact(sh);
+            } else {
+                ok = 0;
+            }
+        }
+    } else {
+        // Key doesn't exist, create new record
+        Record *rec = NULL;
+        if (maybe_grow(sh)) {
+            rec = create_record(&sh->arena, key, key_len, value, val_len);
+        }
+        if (rec) {
+            rec->expire_at = expire_at;
+            index_insert(&sh->cur, h, rec);
+            sh->count++;
+            if (sh->ordered && !ordered_insert(&table->ordered, key, key_len)) {
+                ok = 0;
+            }
+        } else {
+            ok = 0;
+        }
+    }
+    
+    pthread_rwlock_unlock(&sh->lock);
+    
+    if (!ok) {
+        printf("%sError:%s Failed to store key-value pair.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+    } else if (expire_at) {
+        wheel_add(&table->wheel, key, expire_at);
+    }
+    return ok;
+}
+
+int set_value(const char *key, const char *value) {
+    return set_value_expire(key, value, 0);
+}
+
+// Get value by key. The pointer stays valid only until the next write to
+// the table, so threaded callers should use get_value_copy instead.
+const char* get_value(const char *key) {
+    if (!table || !key) {
+        return NULL;
+    }
+    
+    size_t key_len = strlen(key);
+    uint32_t h = hash(key, key_len);
+    Shard *sh = shard_for(table, h);
+    
+    pthread_rwlock_rdlock(&sh->lock);
+    Record *rec = find_record(sh, key, key_len, h);
+    if (rec && record_expired(rec)) {
+        // Expired keys read as missing until the timer wheel removes them
+        rec = NULL;
+    } else if (rec) {
+        record_touch(rec);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    
+    return rec ? record_value(rec) : NULL;
+}
+
+// Copy the value of key into buf while holding the shard's read lock.
+// Returns the value length, or -1 if the key is missing. The copy is
+// truncated (but still terminated) when buf is too small.
+long get_value_copy(const char *key, char *buf, size_t buf_size) {
+    if (!table || !key) {
+        return -1;
+    }
+    
+    size_t key_len = strlen(key);
+    uint32_t h = hash(key, key_len);
+    Shard *sh = shard_for(table, h);
+    long len = -1;
+    
+    pthread_rwlock_rdlock(&sh->lock);
+    Record *rec = find_record(sh, key, key_len, h);
+    if (rec && !record_expired(rec)) {
+        record_touch(rec);
+        len = rec->val_len;
+        size_t n = rec->val_len < buf_size ? rec->val_len : buf_size - 1;
+        memcpy(buf, record_value(rec), n);
+        buf[n] = '\0';
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    
+    return len;
+}
+
+// Remove a key from a shard whose write lock is held
+void remove_record(Shard *sh, const char *key, size_t key_len, uint32_t h) {
+    Index *indexes[2] = { &sh->cur, &sh->old };
+    
+    for (int i = 0; i < 2; i++) {
+        size_t pos = index_find(indexes[i], key, key_len, h);
+        if (pos != SIZE_MAX) {
+            arena_release(&sh->arena, indexes[i]->slots[pos].rec);
+            index_remove_at(indexes[i], pos);
+            sh->count--;
+            maybe_compact(sh);
+            if (sh->ordered) {
+                ordered_remove(&table->ordered, key);
+            }
+            return;
+        }
+    }
+}
+
+// Delete a key-value pair. A key whose TTL has run out is removed too, but
+// reported as missing, like every other read of it.
+int delete_value(const char *key) {
+    if (!table || !key) {
+        return 0;
+    }
+    
+    size_t key_len = strlen(key);
+    uint32_t h = hash(key, key_len);
+    Shard *sh = shard_for(table, h);
+    int deleted = 0;
+    
+    pthread_rwlock_wrlock(&sh->lock);
+    rehash_step(sh, REHASH_STEP);
+    
+    Record *rec = find_record(sh, key, key_len, h);
+    if (rec) {
+        deleted = !record_expired(rec);
+        remove_record(sh, key, key_len, h);
+    }
+    
+    pthread_rwlock_unlock(&sh->lock);
+    return deleted;
+}
+
+// Give an existing key a TTL ending at expire_at (wall-clock ms); a time in
+// the past deletes it. Returns 0 if the key does not exist.
+int expire_value(const char *key, int64_t expire_at) {
+    if (!table || !key) {
+        return 0;
+    }
+    
+    size_t key_len = strlen(key);
+    uint32_t h = hash(key, key_len);
+    Shard *sh = shard_for(table, h);
+    int found = 0;
+    
+    pthread_rwlock_wrlock(&sh->lock);
+    Record *rec = find_record(sh, key, key_len, h);
+    if (rec && !record_expired(rec)) {
+        found = 1;
+        if (expire_at <= now_ms()) {
+            remove_record(sh, key, key_len, h);
+        } else {
+            rec->expire_at = expire_at;
+        }
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    
+    if (found && expire_at > now_ms()) {
+        wheel_add(&table->wheel, key, expire_at);
+    }
+    return found;
+}
+
+// Time to live of a key in ms: -1 without a TTL, -2 if the key is missing
+int64_t ttl_value(const char *key) {
+    if (!table || !key) {
+        return -2;
+    }
+    
+    size_t key_len = strlen(key);
+    uint32_t h = hash(key, key_len);
+    Shard *sh = shard_for(table, h);
+    int64_t ttl = -2;
+    
+    pthread_rwlock_rdlock(&sh->lock);
+    Record *rec = find_record(sh, key, key_len, h);
+    if (rec && !record_expired(rec)) {
+        ttl = rec->expire_at ? rec->expire_at - now_ms() : -1;
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    return ttl;
+}
+
+// Remove every key whose TTL has run out since the last pass. Only entries
+// that fall due are touched, so the cost follows the number of expiries
+// rather than the table size. Returns the number of keys removed.
+size_t expire_cycle() {
+    int64_t now = now_ms();
+    TimerEntry *e = wheel_advance(&table->wheel, now);
+    size_t removed = 0;
+    
+    while (e) {
+        TimerEntry *next = e->next;
+        size_t key_len = strlen(e->key);
+        uint32_t h = hash(e->key, key_len);
+        Shard *sh = shard_for(table, h);
+        
+        // Skip entries made stale by a later set, expire or delete
+        pthread_rwlock_wrlock(&sh->lock);
+        Record *rec = find_record(sh, e->key, key_len, h);
+        if (rec && rec->expire_at == e->expire_at && rec->expire_at <= now) {
+            remove_record(sh, e->key, key_len, h);
+            removed++;
+        }
+        pthread_rwlock_unlock(&sh->lock);
+        
+        free(e);
+        e = next;
+    }
+    atomic_fetch_add(&table->expired, removed);
+    return removed;
+}
+
+// Return the next record in the table, or NULL when done.
+// Iteration takes no locks; it is meant for single-threaded callers.
+Record* table_next(HashTable *ht, TableIter *it) {
+    while (it->shard < NUM_SHARDS) {
+        Shard *sh = &ht->shards[it->shard];
+        Index *indexes[2] = { &sh->cur, &sh->old };
+        
+        while (it->which < 2) {
+            Index *idx = indexes[it->which];
+            while (it->pos < idx->capacity) {
+                size_t pos = it->pos++;
+                if (idx->ctrl[pos] & CTRL_FULL) {
+                    return idx->slots[pos].rec;
+                }
+            }
+            it->which++;
+            it->pos = 0;
+        }
+        it->shard++;
+        it->which = 0;
+    }
+    return NULL;
+}
+
+// Bytes used by the table: arena chunks plus both indexes of every shard
+size_t table_memory(HashTable *ht) {
+    size_t per_slot = sizeof(Slot) + sizeof(uint8_t);
+    size_t bytes = sizeof(HashTable);
+    
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        Shard *sh = &ht->shards[i];
+        bytes += sh->arena.total_bytes + (sh->cur.capacity + sh->old.capacity) * per_slot;
+    }
+    return bytes;
+}
+
+// List all key-value pairs
+void list_all() {
+    if (!table) {
+        return;
+    }
+    
+    size_t count = table_count(table);
+    if (count == 0) {
+        printf("%sNo entries in store.%s\n", COLOR_YELLOW, COLOR_RESET);
+        return;
+    }
+    
+    printf("\n%s%s--- Key-Value Store (%zu entries) ---%s\n", COLOR_BOLD, COLOR_CYAN, count, COLOR_RESET);
+    
+    TableIter it = {0};
+    Record *current;
+    while ((current = table_next(table, &it)) != NULL) {
+        if (record_expired(current)) {
+            continue;
+        }
+        printf("%s%s%s: %s%s%s\n", 
+               COLOR_YELLOW COLOR_BOLD, record_key(current), COLOR_RESET,
+               COLOR_CYAN, record_value(current), COLOR_RESET);
+    }
+    printf("\n");
+}
+
+void print_pair(const char *key, const char *value, size_t val_len, void *ctx) {
+    (void)val_len;
+    (void)ctx;
+    printf("%s%s%s: %s%s%s\n", 
+           COLOR_YELLOW COLOR_BOLD, key, COLOR_RESET,
+           COLOR_CYAN, value, COLOR_RESET);
+}
+
+// Clear all entries, releasing the arena in bulk
+void clear_all() {
+    if (!table) {
+        return;
+    }
+    
+    wheel_clear(&table->wheel);
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        Shard *sh = &table->shards[i];
+        pthread_rwlock_wrlock(&sh->lock);
+        // The ordered index stays built, so drop this shard's keys from it
+        if (sh->ordered) {
+            Index *indexes[2] = { &sh->cur, &sh->old };
+            for (int j = 0; j < 2; j++) {
+                for (size_t pos = 0; pos < indexes[j]->capacity; pos++) {
+                    if (indexes[j]->ctrl[pos] & CTRL_FULL) {
+                        ordered_remove(&table->ordered, record_key(indexes[j]->slots[pos].rec));
+                    }
+                }
+            }
+        }
+        arena_free(&sh->arena);
+        index_free(&sh->old);
+        index_free(&sh->cur);
+        index_init(&sh->cur, INITIAL_CAPACITY);
+        sh->rehash_pos = 0;
+        sh->count = 0;
+        pthread_rwlock_unlock(&sh->lock);
+    }
+}
+
+int compare_nodes(const void *a, const void *b) {
+    return strcmp(skip_key(*(SkipNode* const*)a), skip_key(*(SkipNode* const*)b));
+}
+
+// Build the ordered index from the whole table. The keys are sorted once and
+// linked on every level in a single pass, which is far cheaper than inserting
+// them one by one. Every shard is locked while its keys are mirrored; no
+// writer can be waiting on the index lock meanwhile, since no shard mirrors
+// its writes until the build marks it.
+int ordered_build(HashTable *ht) {
+    OrderedIndex *oi = &ht->ordered;
+    if (atomic_load(&oi->built)) {
+        return 1;
+    }
+    
+    pthread_rwlock_wrlock(&oi->lock);
+    if (atomic_load(&oi->built)) {
+        pthread_rwlock_unlock(&oi->lock);
+        return 1;
+    }
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        pthread_rwlock_wrlock(&ht->shards[i].lock);
+    }
+    
+    size_t n = table_count(ht);
+    SkipNode **nodes = (SkipNode**)malloc((n ? n : 1) * sizeof(SkipNode*));
+    oi->head = nodes ? skip_node_new("", 0, SKIP_MAX_LEVEL) : NULL;
+    size_t made = 0;
+    if (oi->head) {
+        TableIter it = {0};
+        Record *rec;
+        while ((rec = table_next(ht, &it)) != NULL) {
+            nodes[made] = skip_node_new(record_key(rec), rec->key_len, skip_random_level(oi));
+            if (!nodes[made]) {
+                break;
+            }
+            made++;
+        }
+    }
+    
+    int ok = oi->head && made == n;
+    if (ok) {
+        qsort(nodes, n, sizeof(SkipNode*), compare_nodes);
+        
+        SkipNode *last[SKIP_MAX_LEVEL];
+        for (int l = 0; l < SKIP_MAX_LEVEL; l++) {
+            last[l] = oi->head;
+        }
+        for (size_t i = 0; i < n; i++) {
+            for (uint32_t l = 0; l < nodes[i]->level; l++) {
+                last[l]->next[l] = nodes[i];
+                last[l] = nodes[i];
+            }
+            if ((int)nodes[i]->level > oi->level) {
+                oi->level = nodes[i]->level;
+            }
+        }
+        oi->count = n;
+        for (int i = 0; i < NUM_SHARDS; i++) {
+            ht->shards[i].ordered = 1;
+        }
+        atomic_store(&oi->built, 1);
+    } else {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        for (size_t i = 0; i < made; i++) {
+            free(nodes[i]);
+        }
+        free(oi->head);
+        oi->head = NULL;
+    }
+    
+    for (int i = NUM_SHARDS - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&ht->shards[i].lock);
+    }
+    pthread_rwlock_unlock(&oi->lock);
+    free(nodes);
+    return ok;
+}
+
+void ordered_free(OrderedIndex *oi) {
+    SkipNode *node = oi->head;
+    while (node) {
+        SkipNode *next = node->next[0];
+        free(node);
+        node = next;
+    }
+    oi->head = NULL;
+    pthread_rwlock_destroy(&oi->lock);
+}
+
+// Visit the pairs of a range in key order, at most limit of them (0 for no
+// limit). Keys are copied out a page at a time under the index's read lock
+// and their values fetched afterwards, so no result set is ever built and
+// writers are held up only briefly. Returns the number of pairs visited, or
+// -1 if the index could not be built. cursor (MAX_KEY_LEN bytes) receives the
+// key to resume after when the limit cut the scan short, or "" otherwise.
+long scan_range(HashTable *ht, const KeyRange *range, size_t limit, ScanFn fn, void *ctx, char *cursor) {
+    cursor[0] = '\0';
+    char (*page)[MAX_KEY_LEN] = malloc(SCAN_PAGE * MAX_KEY_LEN);
+    char *value = (char*)malloc(MAX_VAL_LEN);
+    if (!page || !value || !ordered_build(ht)) {
+        free(page);
+        free(value);
+        return -1;
+    }
+    
+    // Start at the tightest of the lower bound, the prefix and the cursor
+    char start[MAX_KEY_LEN] = "";
+    int exclusive = 0;
+    const char *lower = range->from;
+    if (range->prefix && (!lower || strcmp(range->prefix, lower) > 0)) {
+        lower = range->prefix;
+    }
+    if (range->after && (!lower || strcmp(range->after, lower) >= 0)) {
+        lower = range->after;
+        exclusive = 1;
+    }
+    if (lower) {
+        snprintf(start, sizeof(start), "%s", lower);
+    }
+    size_t prefix_len = range->prefix ? strlen(range->prefix) : 0;
+    
+    OrderedIndex *oi = &ht->ordered;
+    long visited = 0;
+    int done = 0;
+    while (!done) {
+        // Copy no more keys than the limit can still use
+        size_t want = limit && limit - visited < SCAN_PAGE ? limit - visited : SCAN_PAGE;
+        size_t n = 0;
+        pthread_rwlock_rdlock(&oi->lock);
+        SkipNode *node = skip_seek(oi, start, exclusive, NULL);
+        for (; node && n < want; node = node->next[0]) {
+            const char *key = skip_key(node);
+            if ((range->to && strcmp(key, range->to) > 0) ||
+                (range->prefix && strncmp(key, range->prefix, prefix_len) != 0)) {
+                break;
+            }
+            memcpy(page[n++], key, node->key_len + 1);
+        }
+        done = n < want;
+        pthread_rwlock_unlock(&oi->lock);
+        
+        for (size_t i = 0; i < n; i++) {
+            // A key deleted since its page was copied is simply skipped
+            long len = get_value_copy(page[i], value, MAX_VAL_LEN);
+            if (len < 0) {
+                continue;
+            }
+            fn(page[i], value, len, ctx);
+            visited++;
+            if (limit && (size_t)visited == limit) {
+                if (i + 1 < n || !done) {
+                    memcpy(cursor, page[i], strlen(page[i]) + 1);
+                }
+                free(page);
+                free(value);
+                return visited;
+            }
+        }
+        if (n > 0) {
+            memcpy(start, page[n - 1], strlen(page[n - 1]) + 1);
+            exclusive = 1;
+        }
+    }
+    
+    free(page);
+    free(value);
+    return visited;
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ---------------------------------------------------------------------------
+// Statistics
+// ---------------------------------------------------------------------------
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Bucket of a latency: its top five significant bits pick one of 16
+// buckets within its power of two
+static inline int hist_bucket(uint64_t ns) {
+    if (ns >> HIST_MAX_BITS) {
+        ns = (1ULL << HIST_MAX_BITS) - 1;
+    }
+    if (ns < (1 << HIST_SUB_BITS)) {
+        return (int)ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((ns >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// Largest latency that falls in a bucket
+static inline uint64_t hist_bucket_top(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t sub = (bucket & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void hist_record(LatencyHist *h, uint64_t ns) {
+    h->counts[hist_bucket(ns)]++;
+    h->total++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns) {
+        h->max_ns = ns;
+    }
+}
+
+void hist_merge(LatencyHist *into, const LatencyHist *h) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += h->counts[i];
+    }
+    into->total += h->total;
+    into->sum_ns += h->sum_ns;
+    if (h->max_ns > into->max_ns) {
+        into->max_ns = h->max_ns;
+    }
+}
+
+// Latency at or below which a fraction q of the samples fall
+uint64_t hist_quantile(const LatencyHist *h, double q) {
+    uint64_t rank = (uint64_t)(q * h->total + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t top = hist_bucket_top(i);
+            return top < h->max_ns ? top : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+// Record how long a command took, in the calling thread's histograms. The
+// first call from a thread allocates them and adds them to the list.
+void stats_record_op(int op, uint64_t ns) {
+    if (!thread_stats) {
+        thread_stats = (ThreadStats*)calloc(1, sizeof(ThreadStats));
+        if (!thread_stats) {
+            return;
+        }
+        pthread_mutex_lock(&thread_stats_lock);
+        thread_stats->next = thread_stats_list;
+        thread_stats_list = thread_stats;
+        pthread_mutex_unlock(&thread_stats_lock);
+    }
+    hist_record(&thread_stats->ops[op], ns);
+}
+
+// Every thread's histograms for one command, merged
+void stats_op_latency(int op, LatencyHist *out) {
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&thread_stats_lock);
+    for (ThreadStats *ts = thread_stats_list; ts != NULL; ts = ts->next) {
+        hist_merge(out, &ts->ops[op]);
+    }
+    pthread_mutex_unlock(&thread_stats_lock);
+}
+
+void stats_reset() {
+    pthread_mutex_lock(&thread_stats_lock);
+    for (ThreadStats *ts = thread_stats_list; ts != NULL; ts = ts->next) {
+        memset(ts->ops, 0, sizeof(ts->ops));
+    }
+    pthread_mutex_unlock(&thread_stats_lock);
+    memset(&persist_stats, 0, sizeof(persist_stats));
+}
+
+void timing_record(Timing *t, uint64_t start_ns) {
+    uint64_t ns = now_ns() - start_ns;
+    t->runs++;
+    t->last_ns = ns;
+    t->total_ns += ns;
+    if (ns > t->max_ns) {
+        t->max_ns = ns;
+    }
+}
+
+// Bucket of a key's distance from its home slot
+static inline int probe_bucket(size_t distance) {
+    if (distance < 4) {
+        return (int)distance;
+    }
+    if (distance < 8) {
+        return 4;
+    }
+    return distance < 16 ? 5 : 6;
+}
+
+// Walk every shard, index slot and record. This is O(n) and only runs when
+// stats are asked for, so the table itself keeps no extra counters.
+void table_stats(HashTable *ht, TableStats *st) {
+    memset(st, 0, sizeof(*st));
+    st->shard_min = SIZE_MAX;
+    
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        Shard *sh = &ht->shards[i];
+        pthread_rwlock_rdlock(&sh->lock);
+        Index *indexes[2] = { &sh->cur, &sh->old };
+        for (int j = 0; j < 2; j++) {
+            Index *idx = indexes[j];
+            size_t mask = idx->capacity - 1;
+            for (size_t pos = 0; pos < idx->capacity; pos++) {
+                if (!(idx->ctrl[pos] & CTRL_FULL)) {
+                    st->tombstones += idx->ctrl[pos] == CTRL_DELETED;
+                    continue;
+                }
+                Slot *slot = &idx->slots[pos];
+                size_t distance = (pos - home_slot(slot->hash, mask)) & mask;
+                st->probes[probe_bucket(distance)]++;
+                st->probe_sum += distance;
+                if (distance > st->probe_max) {
+                    st->probe_max = distance;
+                }
+                st->key_bytes += slot->rec->key_len;
+                st->value_bytes += slot->rec->val_len;
+                st->value_slack += slot->rec->val_cap - slot->rec->val_len;
+                st->header_bytes += record_size(slot->rec->key_len, slot->rec->val_cap) -
+                                    slot->rec->key_len - slot->rec->val_cap;
+            }
+            st->capacity += idx->capacity;
+            st->index_bytes += idx->capacity * (sizeof(Slot) + sizeof(uint8_t));
+        }
+        st->resizing += sh->old.capacity > 0;
+        st->keys += sh->count;
+        if (sh->count < st->shard_min) st->shard_min = sh->count;
+        if (sh->count > st->shard_max) st->shard_max = sh->count;
+        st->dead_bytes += sh->arena.dead_bytes;
+        st->unused_bytes += sh->arena.total_bytes - sh->arena.live_bytes - sh->arena.dead_bytes;
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    
+    OrderedIndex *oi = &ht->ordered;
+    if (atomic_load(&oi->built)) {
+        pthread_rwlock_rdlock(&oi->lock);
+        for (SkipNode *node = oi->head; node != NULL; node = node->next[0]) {
+            st->ordered_bytes += sizeof(SkipNode) + node->level * sizeof(SkipNode*) + node->key_len + 1;
+        }
+        pthread_rwlock_unlock(&oi->lock);
+    }
+    
+    TimerWheel *w = &ht->wheel;
+    pthread_mutex_lock(&w->lock);
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            for (TimerEntry *e = w->slots[level][slot]; e != NULL; e = e->next) {
+                st->timer_bytes += sizeof(TimerEntry) + strlen(e->key) + 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+int format_timing(char *buf, size_t size, const char *name, const Timing *t, const char *eol) {
+    return snprintf(buf, size, "%s:runs=%llu,last_ms=%.3f,max_ms=%.3f,mean_ms=%.3f%s",
+                    name, (unsigned long long)t->runs, t->last_ns / 1e6, t->max_ns / 1e6,
+                    t->runs ? t->total_ns / 1e6 / t->runs : 0.0, eol);
+}
+
+// Table shape, memory breakdown and persistence timings as INFO-style
+// "field:value" lines
+int format_stats(char *buf, size_t size, const char *eol) {
+    TableStats st;
+    table_stats(table, &st);
+    static const char *probe_names[PROBE_BUCKETS] = { "0", "1", "2", "3", "4-7", "8-15", "16+" };
+    
+    int len = snprintf(buf, size,
+                       "# Table%s"
+                       "keys:%zu%s"
+                       "shards:%d%s"
+                       "slots:%zu%s"
+                       "load_factor:%.3f%s"
+                       "tombstones:%zu%s"
+                       "resizing_shards:%zu%s"
+                       "shard_keys_min:%zu%s"
+                       "shard_keys_max:%zu%s"
+                       "# Probes%s"
+                       "probe_mean:%.3f%s"
+                       "probe_max:%zu%s",
+                       eol,
+                       st.keys, eol,
+                       NUM_SHARDS, eol,
+                       st.capacity, eol,
+                       st.capacity ? (double)st.keys / st.capacity : 0.0, eol,
+                       st.tombstones, eol,
+                       st.resizing, eol,
+                       st.shard_min, eol,
+                       st.shard_max, eol,
+                       eol,
+                       st.keys ? (double)st.probe_sum / st.keys : 0.0, eol,
+                       st.probe_max, eol);
+    for (int i = 0; i < PROBE_BUCKETS && len < (int)size; i++) {
+        len += snprintf(buf + len, size - len, "probe_%s:%zu%s", probe_names[i], st.probes[i], eol);
+    }
+    if (len >= (int)size) {
+        return len;
+    }
+    
+    size_t total = st.key_bytes + st.value_bytes + st.value_slack + st.header_bytes + st.dead_bytes +
+                   st.unused_bytes + st.index_bytes + st.ordered_bytes + st.timer_bytes;
+    len += snprintf(buf + len, size - len,
+                    "# Memory%s"
+                    "key_bytes:%zu%s"
+                    "value_bytes:%zu%s"
+                    "value_slack_bytes:%zu%s"
+                    "record_header_bytes:%zu%s"
+                    "arena_dead_bytes:%zu%s"
+                    "arena_unused_bytes:%zu%s"
+                    "index_bytes:%zu%s"
+                    "ordered_index_bytes:%zu%s"
+                    "timer_bytes:%zu%s"
+                    "total_bytes:%zu%s"
+                    "# Persistence%s",
+                    eol,
+                    st.key_bytes, eol,
+                    st.value_bytes, eol,
+                    st.value_slack, eol,
+                    st.header_bytes, eol,
+                    st.dead_bytes, eol,
+                    st.unused_bytes, eol,
+                    st.index_bytes, eol,
+                    st.ordered_bytes, eol,
+                    st.timer_bytes, eol,
+                    total, eol,
+                    eol);
+    const char *names[4] = { "load_from_disk", "save_to_disk", "fork", "wal_fsync" };
+    const Timing *timings[4] = { &persist_stats.load, &persist_stats.save, &persist_stats.fork, &persist_stats.fsync };
+    for (int i = 0; i < 4 && len < (int)size; i++) {
+        len += format_timing(buf + len, size - len, names[i], timings[i], eol);
+    }
+    return len;
+}
+
+// CRC-32 (IEEE 802.3) used to detect torn or corrupted log records
+uint32_t crc32(const void *data, size_t len, uint32_t crc) {
+    static uint32_t crc_table[256];
+    static int ready = 0;
+    
+    if (!ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crc_table[i] = c;
+        }
+        ready = 1;
+    }
+    
+    const uint8_t *p = (const uint8_t*)data;
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// LZ4 block format codec. A compressed block is a series of sequences, each
+// a token (literal count << 4 | match length - 4), the literals, and a
+// 2-byte back offset to copy the match from. Lengths of 15 or more continue
+// in extra bytes of 255. Matches are found through a single hash table of
+// recent 4-byte sequences, trading some ratio for speed like LZ4 itself.
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5      // The format ends every block with literals...
+#define LZ_MATCH_LIMIT 12       // ...and starts no match this close to the end
+
+static inline uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t* lz_put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Worst-case output size for len input bytes
+static inline size_t lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+// Compress src into dst. Returns the compressed length, or 0 if it does not
+// fit in cap bytes.
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap) {
+    const uint8_t *in = (const uint8_t*)src;
+    uint8_t *op = (uint8_t*)dst, *op_end = op + cap;
+    uint32_t positions[1 << LZ_HASH_BITS];
+    size_t anchor = 0;
+    
+    memset(positions, 0, sizeof(positions));
+    if (len > LZ_MATCH_LIMIT) {
+        size_t limit = len - LZ_MATCH_LIMIT, match_limit = len - LZ_LAST_LITERALS;
+        size_t i = 1;
+        while (i < limit) {
+            uint32_t sequence = (uint32_t)read32(src + i);
+            uint32_t h = lz_hash(sequence);
+            size_t ref = positions[h];
+            positions[h] = (uint32_t)i;
+            if (ref >= i || i - ref > LZ_MAX_OFFSET || (uint32_t)read32(src + ref) != sequence) {
+                // Step faster through data that keeps failing to match
+                i += 1 + ((i - anchor) >> 6);
+                continue;
+            }
+            
+            // Extend the match backwards over pending literals, then forwards
+            while (i > anchor && ref > 0 && in[i - 1] == in[ref - 1]) {
+                i--;
+                ref--;
+            }
+            size_t end = i + LZ_MIN_MATCH;
+            for (size_t r = ref + LZ_MIN_MATCH; end < match_limit && in[end] == in[r]; r++) {
+                end++;
+            }
+            
+            size_t literals = i - anchor, match = end - i - LZ_MIN_MATCH;
+            if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) {
+                return 0;
+            }
+            uint8_t *token = op++;
+            *token = (uint8_t)((literals < 15 ? literals : 15) << 4 | (match < 15 ? match : 15));
+            if (literals >= 15) {
+                op = lz_put_length(op, literals - 15);
+            }
+            memcpy(op, in + anchor, literals);
+            op += literals;
+            *op++ = (uint8_t)(i - ref);
+            *op++ = (uint8_t)((i - ref) >> 8);
+            if (match >= 15) {
+                op = lz_put_length(op, match - 15);
+            }
+            
+            // Remember a position inside the match for the next search
+            positions[lz_hash((uint32_t)read32(src + end - 2))] = (uint32_t)(end - 2);
+            i = anchor = end;
+        }
+    }
+    
+    size_t literals = len - anchor;
+    if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    *op++ = (uint8_t)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        op = lz_put_length(op, literals - 15);
+    }
+    memcpy(op, in + anchor, literals);
+    op += literals;
+    return op - (uint8_t*)dst;
+}
+
+// Copy len bytes 8 at a time, writing up to 7 bytes past dst + len. Short
+// fixed-size copies beat a memcpy call for the many short runs of a block.
+static inline void lz_wild_copy(uint8_t *dst, const uint8_t *src, size_t len) {
+    for (size_t i = 0; i < len; i += 8) {
+        memcpy(dst + i, src + i, 8);
+    }
+}
+
+// Read a length continuation; returns 0 if it runs past the input
+static inline int lz_get_length(const uint8_t **ip, const uint8_t *ip_end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= ip_end) {
+            return 0;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+// Decompress src into dst. Every length and offset is checked, so corrupt
+// input fails with -1 instead of reading or writing out of bounds.
+long lz_decompress(const char *src, size_t len, char *dst, size_t cap) {
+    const uint8_t *ip = (const uint8_t*)src, *ip_end = ip + len;
+    uint8_t *op = (uint8_t*)dst, *op_end = op + cap;
+    
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !lz_get_length(&ip, ip_end, &literals)) {
+            return -1;
+        }
+        if ((size_t)(ip_end - ip) < literals || (size_t)(op_end - op) < literals) {
+            return -1;
+        }
+        if ((size_t)(ip_end - ip) >= literals + 8 && (size_t)(op_end - op) >= literals + 8) {
+            lz_wild_copy(op, ip, literals);
+        } else {
+            memcpy(op, ip, literals);
+        }
+        op += literals;
+        ip += literals;
+        if (ip == ip_end) {
+            break;      // The last sequence has no match
+        }
+        
+        if (ip_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !lz_get_length(&ip, ip_end, &match)) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t*)dst) || (size_t)(op_end - op) < match) {
+            return -1;
+        }
+        
+        const uint8_t *ref = op - offset;
+        if (offset >= 8 && (size_t)(op_end - op) >= match + 8) {
+            lz_wild_copy(op, ref, match);
+        } else if (offset >= match) {
+            memcpy(op, ref, match);
+        } else {
+            // Overlapping copy: repeats the last offset bytes
+            for (size_t i = 0; i < match; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += match;
+    }
+    return op - (uint8_t*)dst;
+}
+
+// Records of a snapshot being written, gathered into one block at a time
+typedef struct {
+    FILE *f;
+    char *raw;
+    char *stored;
+    size_t raw_len;
+    uint64_t offset;          // File offset of the next block
+    uint64_t *blocks;
+    size_t block_count;
+    size_t block_cap;
+} BlockWriter;
+
+// Compress the pending records (unless compression is off or does not pay)
+// and write them out as one block
+int flush_block(BlockWriter *w) {
+    if (w->raw_len == 0) {
+        return 1;
+    }
+    if (w->block_count == w->block_cap) {
+        size_t cap = w->block_cap ? w->block_cap * 2 : 64;
+        uint64_t *blocks = (uint64_t*)realloc(w->blocks, cap * sizeof(uint64_t));
+        if (!blocks) {
+            return 0;
+        }
+        w->blocks = blocks;
+        w->block_cap = cap;
+    }
+    
+    SnapshotBlock block = { (uint32_t)w->raw_len, 0, 0, CODEC_RAW };
+    const char *data = w->raw;
+    size_t stored = compress_snapshots ? lz_compress(w->raw, w->raw_len, w->stored, w->raw_len - 1) : 0;
+    if (stored > 0) {
+        block.codec = CODEC_LZ4;
+        data = w->stored;
+    } else {
+        stored = w->raw_len;
+    }
+    block.stored_len = (uint32_t)stored;
+    block.crc = crc32(data, stored, 0);
+    
+    fwrite(&block, sizeof(block), 1, w->f);
+    fwrite(data, 1, stored, w->f);
+    w->blocks[w->block_count++] = w->offset;
+    w->offset += sizeof(block) + stored;
+    w->raw_len = 0;
+    return 1;
+}
+
+// Save hash table to disk as a snapshot at path, atomically replacing the
+// old one. Each record is key length, value length (both uint32), expiry
+// time (int64 ms, 0 for none), key '\0', value '\0'; records are gathered
+// into blocks of about SNAPSHOT_BLOCK_SIZE bytes, each compressed on its own
+// so a lookup only has to decompress one.
+int save_snapshot(const char *path, const char *tmp_path) {
+    uint64_t start = now_ns();
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) {
+        printf("%sError:%s Failed to open storage file for writing.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 0;
+    }
+    
+    // Size the index for a load factor of at most 1/2
+    SnapshotHeader header = {0};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.hash_seed = hash_seed;
+    header.count = table_count(table);
+    header.data_offset = sizeof(SnapshotHeader);
+    header.index_capacity = INITIAL_CAPACITY;
+    while (header.index_capacity < header.count * 2) {
+        header.index_capacity *= 2;
+    }
+    
+    SnapshotSlot *slots = (SnapshotSlot*)calloc(header.index_capacity, sizeof(SnapshotSlot));
+    BlockWriter w = { f, (char*)malloc(SNAPSHOT_BLOCK_CAP), (char*)malloc(SNAPSHOT_BLOCK_CAP),
+                      0, header.data_offset, NULL, 0, 0 };
+    if (!slots || !w.raw || !w.stored) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        free(slots);
+        free(w.raw);
+        free(w.stored);
+        fclose(f);
+        unlink(tmp_path);
+        return 0;
+    }
+    
+    // Header is rewritten once the index position is known
+    fwrite(&header, sizeof(header), 1, f);
+    
+    // Write all key-value pairs, indexing each by its block and position in it
+    int ok = 1;
+    size_t mask = header.index_capacity - 1;
+    TableIter it = {0};
+    Record *current;
+    while (ok && (current = table_next(table, &it)) != NULL) {
+        if (w.raw_len >= SNAPSHOT_BLOCK_SIZE) {
+            ok = flush_block(&w);
+        }
+        
+        uint32_t lens[2] = { current->key_len, current->val_len };
+        char *rec = w.raw + w.raw_len;
+        memcpy(rec, lens, sizeof(lens));
+        memcpy(rec + sizeof(lens), &current->expire_at, sizeof(int64_t));
+        // The record already holds key '\0' value '\0' back to back
+        memcpy(rec + SNAPSHOT_RECORD_HEAD, current->data, current->key_len + 1 + current->val_len + 1);
+        
+        uint32_t h = hash(record_key(current), current->key_len);
+        size_t pos = h & mask;
+        while (slots[pos].offset != 0) {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos].offset = (uint64_t)(w.block_count + 1) << 32 | w.raw_len;
+        slots[pos].hash = h;
+        slots[pos].key_len = current->key_len;
+        
+        w.raw_len += SNAPSHOT_RECORD_HEAD + current->key_len + 1 + current->val_len + 1;
+    }
+    ok = ok && flush_block(&w);
+    
+    // Align the block table and index so they can be read in place
+    static const char padding[sizeof(SnapshotSlot)];
+    size_t pad = (sizeof(SnapshotSlot) - w.offset % sizeof(SnapshotSlot)) % sizeof(SnapshotSlot);
+    fwrite(padding, 1, pad, f);
+    header.block_count = w.block_count;
+    header.block_table_offset = w.offset + pad;
+    if (w.block_count > 0) {
+        fwrite(w.blocks, sizeof(uint64_t), w.block_count, f);
+    }
+    
+    uint64_t offset = header.block_table_offset + w.block_count * sizeof(uint64_t);
+    pad = (sizeof(SnapshotSlot) - offset % sizeof(SnapshotSlot)) % sizeof(SnapshotSlot);
+    fwrite(padding, 1, pad, f);
+    header.index_offset = offset + pad;
+    fwrite(slots, sizeof(SnapshotSlot), header.index_capacity, f);
+    free(slots);
+    free(w.raw);
+    free(w.stored);
+    free(w.blocks);
+    
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
+    
+    // Make the snapshot durable before it replaces the old one
+    ok = ok && !ferror(f) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        printf("%sError:%s Failed to write storage file.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        unlink(tmp_path);
+        return 0;
+    }
+    timing_record(&persist_stats.save, start);
+    return 1;
+}
+
+int save_to_disk() {
+    return save_snapshot(STORAGE_FILE, STORAGE_TMP_FILE);
+}
+
+// Map a snapshot into memory. Returns 0 if it is missing or not in the
+// indexed format (e.g. a count-prefixed file from older versions).
+int snapshot_open(Snapshot *snap, const char *path) {
+    memset(snap, 0, sizeof(*snap));
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return 0;
+    }
+    
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    
+    const SnapshotHeader *header = (const SnapshotHeader*)base;
+    size_t size = st.st_size;
+    int valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+                header->version >= SNAPSHOT_MIN_VERSION &&
+                header->version <= SNAPSHOT_VERSION &&
+                header->index_capacity > 0 &&
+                (header->index_capacity & (header->index_capacity - 1)) == 0 &&
+                header->index_offset <= size &&
+                header->index_capacity <= (size - header->index_offset) / sizeof(SnapshotSlot);
+    if (valid && header->version >= SNAPSHOT_BLOCK_VERSION) {
+        valid = header->block_table_offset % sizeof(uint64_t) == 0 &&
+                header->block_table_offset <= header->index_offset &&
+                header->block_count <= (header->index_offset - header->block_table_offset) / sizeof(uint64_t);
+    }
+    if (!valid) {
+        munmap(base, size);
+        return 0;
+    }
+    
+    snap->base = (const char*)base;
+    snap->size = size;
+    snap->header = header;
+    snap->slots = (const SnapshotSlot*)(snap->base + header->index_offset);
+    if (header->version >= SNAPSHOT_BLOCK_VERSION) {
+        snap->blocks = (const uint64_t*)(snap->base + header->block_table_offset);
+    }
+    return 1;
+}
+
+void snapshot_close(Snapshot *snap) {
+    if (snap->base) {
+        munmap((void*)snap->base, snap->size);
+    }
+    memset(snap, 0, sizeof(*snap));
+}
+
+// Bytes in front of each record's key: the lengths, then the expiry time
+// in snapshots new enough to store one
+static inline size_t snapshot_record_head(const Snapshot *snap) {
+    return 2 * sizeof(uint32_t) + (snap->header->version >= SNAPSHOT_TTL_VERSION ? sizeof(int64_t) : 0);
+}
+
+// Decode the record at offset of buf, whose records end at end; returns 0
+// if it runs past them. head is the size of the fields in front of the key.
+int decode_record(const char *buf, uint64_t offset, uint64_t end, size_t head, const char **key,
+                  uint32_t *key_len, const char **value, uint32_t *val_len, int64_t *expire_at) {
+    uint32_t lens[2];
+    
+    if (offset + head > end) {
+        return 0;
+    }
+    memcpy(lens, buf + offset, sizeof(lens));
+    if (lens[0] >= MAX_KEY_LEN || lens[1] >= MAX_VAL_LEN ||
+        offset + head + lens[0] + 1 + lens[1] + 1 > end) {
+        return 0;
+    }
+    
+    *expire_at = 0;
+    if (head > sizeof(lens)) {
+        memcpy(expire_at, buf + offset + sizeof(lens), sizeof(int64_t));
+    }
+    *key = buf + offset + head;
+    *key_len = lens[0];
+    *value = *key + lens[0] + 1;
+    *val_len = lens[1];
+    return (*key)[lens[0]] == '\0' && (*value)[lens[1]] == '\0';
+}
+
+// Decode the record at a file offset of a snapshot older than version 6
+int snapshot_record(const Snapshot *snap, uint64_t offset, const char **key, uint32_t *key_len,
+                    const char **value, uint32_t *val_len, int64_t *expire_at) {
+    if (offset < snap->header->data_offset) {
+        return 0;
+    }
+    return decode_record(snap->base, offset, snap->header->index_offset, snapshot_record_head(snap),
+                         key, key_len, value, val_len, expire_at);
+}
+
+// Return the records of block n of a version 6 snapshot, straight from the
+// mapping if it is stored raw, else decompressed into buf (of
+// SNAPSHOT_BLOCK_CAP bytes). Returns NULL if the block is corrupt. Only
+// verify checks the CRC; without it a corrupt block may still decode, but
+// never out of bounds.
+const char* snapshot_block(const Snapshot *snap, uint64_t n, char *buf, size_t *len, int verify) {
+    if (n >= snap->header->block_count) {
+        return NULL;
+    }
+    uint64_t offset = snap->blocks[n];
+    uint64_t end = snap->header->block_table_offset;
+    SnapshotBlock block;
+    if (offset < snap->header->data_offset || offset + sizeof(block) > end) {
+        return NULL;
+    }
+    memcpy(&block, snap->base + offset, sizeof(block));
+    
+    const char *data = snap->base + offset + sizeof(block);
+    if (block.stored_len > end - offset - sizeof(block) || block.raw_len > SNAPSHOT_BLOCK_CAP ||
+        (verify && crc32(data, block.stored_len, 0) != block.crc)) {
+        return NULL;
+    }
+    *len = block.raw_len;
+    if (block.codec == CODEC_RAW) {
+        return block.stored_len == block.raw_len ? data : NULL;
+    }
+    if (block.codec != CODEC_LZ4 || lz_decompress(data, block.stored_len, buf, SNAPSHOT_BLOCK_CAP) != block.raw_len) {
+        return NULL;
+    }
+    return buf;
+}
+
+// Probe the on-disk index; only the slots and the one record (or block)
+// touched are paged in. A value from a compressed block stays valid until
+// the next call.
+const char* snapshot_find(const Snapshot *snap, const char *key, int64_t *expire_at) {
+    static char block_buf[SNAPSHOT_BLOCK_CAP];
+    uint32_t len = strlen(key);
+    uint32_t h = snap->header->version >= SNAPSHOT_SEED_VERSION
+        ? hash_wyhash(key, len, snap->header->hash_seed)
+        : hash_djb2_mixed(key, len, 0);
+    size_t mask = snap->header->index_capacity - 1;
+    
+    for (size_t pos = h & mask, probes = 0; probes <= mask; pos = (pos + 1) & mask, probes++) {
+        const SnapshotSlot *slot = &snap->slots[pos];
+        if (slot->offset == 0) {
+            return NULL;
+        }
+        if (slot->hash != h || slot->key_len != len) {
+            continue;
+        }
+        
+        const char *rec_key, *value;
+        uint32_t key_len, val_len;
+        int found;
+        if (snap->header->version >= SNAPSHOT_BLOCK_VERSION) {
+            size_t block_len;
+            const char *block = snapshot_block(snap, (slot->offset >> 32) - 1, block_buf, &block_len, 0);
+            found = block && decode_record(block, slot->offset & 0xffffffff, block_len, SNAPSHOT_RECORD_HEAD,
+                                           &rec_key, &key_len, &value, &val_len, expire_at);
+        } else {
+            found = snapshot_record(snap, slot->offset, &rec_key, &key_len, &value, &val_len, expire_at);
+        }
+        if (found && memcmp(rec_key, key, len) == 0) {
+            return value;
+        }
+    }
+    return NULL;
+}
+
+// Insert one record read from a snapshot. Keys that expired while stored
+// are never loaded.
+void load_record(const char *key, const char *value, int64_t expire_at, int64_t now) {
+    if (expire_at && expire_at <= now) {
+        atomic_fetch_add(&table->expired, 1);
+    } else {
+        set_value_expire(key, value, expire_at);
+    }
+}
+
+// Load every block of a version 6 snapshot, decompressing one at a time.
+// Returns 0 if any record was lost to a corrupt or truncated block.
+int load_mapped_blocks(const Snapshot *snap) {
+    char *buf = (char*)malloc(SNAPSHOT_BLOCK_CAP);
+    if (!buf) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 0;
+    }
+    
+    int64_t now = now_ms();
+    uint64_t loaded = 0;
+    for (uint64_t n = 0; n < snap->header->block_count; n++) {
+        size_t len;
+        const char *block = snapshot_block(snap, n, buf, &len, 1);
+        if (!block) {
+            // Blocks are independent, so one bad block loses only its own records
+            continue;
+        }
+        
+        const char *key, *value;
+        uint32_t key_len, val_len;
+        int64_t expire_at;
+        for (uint64_t offset = 0; offset < len; offset += SNAPSHOT_RECORD_HEAD + key_len + 1 + val_len + 1) {
+            if (!decode_record(block, offset, len, SNAPSHOT_RECORD_HEAD, &key, &key_len, &value, &val_len, &expire_at)) {
+                break;
+            }
+            load_record(key, value, expire_at, now);
+            loaded++;
+        }
+    }
+    free(buf);
+    
+    if (loaded != snap->header->count) {
+        printf("%sWarning:%s Storage file is corrupt or truncated.\n", COLOR_YELLOW COLOR_BOLD, COLOR_RESET);
+        return 0;
+    }
+    return 1;
+}
+
+// Load every record of a mapped snapshot into the table
+int load_mapped_snapshot(const Snapshot *snap) {
+    madvise((void*)snap->base, snap->size, MADV_SEQUENTIAL);
+    table_reserve(table, table_count(table) + snap->header->count);
+    if (snap->header->version >= SNAPSHOT_BLOCK_VERSION) {
+        return load_mapped_blocks(snap);
+    }
+    
+    uint64_t offset = snap->header->data_offset;
+    int64_t now = now_ms();
+    for (uint64_t i = 0; i < snap->header->count; i++) {
+        const char *key, *value;
+        uint32_t key_len, val_len;
+        int64_t expire_at;
+        if (!snapshot_record(snap, offset, &key, &key_len, &value, &val_len, &expire_at)) {
+            printf("%sWarning:%s Storage file is truncated.\n", COLOR_YELLOW COLOR_BOLD, COLOR_RESET);
+            return 0;
+        }
+        load_record(key, value, expire_at, now);
+        offset += snapshot_record_head(snap) + key_len + 1 + val_len + 1;
+    }
+    return 1;
+}
+
+// Load the original count-prefixed format with uint16 lengths
+int load_legacy_snapshot() {
+    FILE *f = fopen(STORAGE_FILE, "rb");
+    if (!f) {
+        // File doesn't exist yet, that's okay
+        return 0;
+    }
+    
+    int count;
+    if (fread(&count, sizeof(int), 1, f) != 1) {
+        fclose(f);
+        return 0;
+    }
+    if (count > 0) {
+        table_reserve(table, table_count(table) + count);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        uint16_t key_len, val_len;
+        
+        if (fread(&key_len, sizeof(uint16_t), 1, f) != 1) break;
+        if (key_len >= MAX_KEY_LEN) {
+            fclose(f);
+            return 0;
+        }
+        
+        char key[MAX_KEY_LEN];
+        if (fread(key, sizeof(char), key_len, f) != key_len) break;
+        key[key_len] = '\0';
+        
+        // A uint16 length always fits below MAX_VAL_LEN
+        if (fread(&val_len, sizeof(uint16_t), 1, f) != 1) break;
+        
+        static char value[MAX_VAL_LEN];
+        if (fread(value, sizeof(char), val_len, f) != val_len) break;
+        value[val_len] = '\0';
+        
+        set_value(key, value);
+    }
+    
+    fclose(f);
+    return 1;
+}
+
+// Load the snapshot in whichever format it was written
+int load_snapshot() {
+    Snapshot snap;
+    if (snapshot_open(&snap, STORAGE_FILE)) {
+        int loaded = load_mapped_snapshot(&snap);
+        snapshot_close(&snap);
+        return loaded;
+    }
+    return load_legacy_snapshot();
+}
+
+// Read the next log record into key/value. Returns 0 at the end of the log
+// or at the first torn or corrupt record.
+int read_log_record(FILE *f, uint8_t *op, char *key, char *value) {
+    uint32_t crc;
+    uint8_t header[9];
+    uint32_t key_len, val_len;
+    
+    if (fread(&crc, sizeof(crc), 1, f) != 1 || fread(header, sizeof(header), 1, f) != 1) return 0;
+    memcpy(&key_len, header + 1, sizeof(key_len));
+    memcpy(&val_len, header + 5, sizeof(val_len));
+    if (key_len >= MAX_KEY_LEN || val_len >= MAX_VAL_LEN) return 0;
+    if (fread(key, 1, key_len, f) != key_len || fread(value, 1, val_len, f) != val_len) return 0;
+    
+    uint32_t check = crc32(header, sizeof(header), 0);
+    check = crc32(key, key_len, check);
+    check = crc32(value, val_len, check);
+    if (check != crc) return 0;
+    
+    *op = header[0];
+    key[key_len] = '\0';
+    value[val_len] = '\0';
+    return 1;
+}
+
+// Replay a log file. A torn or corrupt tail ends the replay and, when
+// truncate_tail is set, is cut off so new records follow the last good one.
+size_t replay_log(const char *path, int truncate_tail) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    
+    static char key[MAX_KEY_LEN];
+    static char value[MAX_VAL_LEN];
+    size_t records = 0;
+    long good_end = 0;
+    uint8_t op;
+    
+    while (read_log_record(f, &op, key, value)) {
+        switch (op) {
+            case LOG_SET:    set_value(key, value); break;
+            case LOG_DELETE: delete_value(key); break;
+            case LOG_CLEAR:  clear_all(); break;
+            case LOG_EXPIRE: expire_value(key, strtoll(value, NULL, 10)); break;
+        }
+        records++;
+        good_end = ftell(f);
+    }
+    
+    int torn = !feof(f) || ftell(f) != good_end;
+    fclose(f);
+    
+    if (torn && truncate_tail && truncate(path, good_end) == 0) {
+        printf("%sWarning:%s Discarded a corrupt tail of %s.\n", COLOR_YELLOW COLOR_BOLD, COLOR_RESET, path);
+    }
+    return records;
+}
+
+// Key state after scanning a log for one key
+#define LOOKUP_UNKNOWN 0    // The log never mentions the key
+#define LOOKUP_FOUND   1    // Last record set it; value holds its value
+#define LOOKUP_REMOVED 2    // Last record deleted it or cleared the store
+
+// Find the last record in a log that decides key's value and expiry
+int log_lookup(const char *path, const char *key, char *value, int64_t *expire_at, int state) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return state;
+    }
+    
+    static char rec_key[MAX_KEY_LEN];
+    static char rec_value[MAX_VAL_LEN];
+    uint8_t op;
+    
+    while (read_log_record(f, &op, rec_key, rec_value)) {
+        if (op == LOG_CLEAR) {
+            state = LOOKUP_REMOVED;
+        } else if (strcmp(rec_key, key) != 0) {
+            continue;
+        } else if (op == LOG_SET) {
+            state = LOOKUP_FOUND;
+            strcpy(value, rec_value);
+            *expire_at = 0;
+        } else if (op == LOG_EXPIRE) {
+            *expire_at = strtoll(rec_value, NULL, 10);
+        } else {
+            state = LOOKUP_REMOVED;
+        }
+    }
+    
+    fclose(f);
+    return state;
+}
+
+// Look one key up without loading the store: probe the mapped snapshot,
+// then let the logs override it. Startup cost is independent of the
+// snapshot size; only the (compacted) logs are read in full.
+// Returns -1 if the snapshot's index cannot be probed by this version.
+int lookup_from_disk(const char *key, char *value) {
+    Snapshot snap;
+    int have_snapshot = snapshot_open(&snap, STORAGE_FILE);
+    if (!have_snapshot && access(STORAGE_FILE, F_OK) == 0) {
+        return -1;
+    }
+    if (have_snapshot && snap.header->version < SNAPSHOT_HASH_VERSION) {
+        // Its index was built with the unmixed djb2 hash
+        snapshot_close(&snap);
+        return -1;
+    }
+    
+    int state = LOOKUP_UNKNOWN;
+    int64_t expire_at = 0;
+    if (have_snapshot) {
+        madvise((void*)snap.base, snap.size, MADV_RANDOM);
+        const char *found = snapshot_find(&snap, key, &expire_at);
+        if (found) {
+            strcpy(value, found);
+            state = LOOKUP_FOUND;
+        } else {
+            expire_at = 0;
+        }
+        snapshot_close(&snap);
+    }
+    
+    state = log_lookup(LOG_OLD_FILE, key, value, &expire_at, state);
+    state = log_lookup(LOG_FILE, key, value, &expire_at, state);
+    return state == LOOKUP_FOUND && (expire_at == 0 || expire_at > now_ms());
+}
+
+// Load hash table from disk: the snapshot, then every logged mutation since.
+// Replaying records the snapshot already covers is harmless, because each
+// record overwrites or removes a whole key.
+int load_from_disk() {
+    uint64_t start = now_ns();
+    int loaded = load_snapshot();
+    
+    wal.records = replay_log(LOG_OLD_FILE, 0);
+    wal.records += replay_log(LOG_FILE, 1);
+    
+    timing_record(&persist_stats.load, start);
+    return loaded || wal.records > 0;
+}
+
+// Read the fsync policy, compaction threshold and snapshot compression from
+// the environment: KVSTORE_FSYNC=always|never|<N>ms,
+// KVSTORE_COMPACT_RATIO=<0..1> and KVSTORE_COMPRESSION=lz4|none
+void configure_wal() {
+    wal.policy = FSYNC_INTERVAL;
+    wal.interval_ms = DEFAULT_FSYNC_MS;
+    wal.compact_ratio = DEFAULT_COMPACT_RATIO;
+    
+    const char *fsync_env = getenv("KVSTORE_FSYNC");
+    if (fsync_env) {
+        if (strcmp(fsync_env, "always") == 0) {
+            wal.policy = FSYNC_ALWAYS;
+        } else if (strcmp(fsync_env, "never") == 0) {
+            wal.policy = FSYNC_NEVER;
+        } else if (atoi(fsync_env) > 0) {
+            wal.interval_ms = atoi(fsync_env);
+        }
+    }
+    
+    const char *ratio_env = getenv("KVSTORE_COMPACT_RATIO");
+    if (ratio_env && atof(ratio_env) > 0) {
+        wal.compact_ratio = atof(ratio_env);
+    }
+    
+    const char *compression_env = getenv("KVSTORE_COMPRESSION");
+    if (compression_env) {
+        compress_snapshots = strcmp(compression_env, "none") != 0;
+    }
+}
+
+int wal_open() {
+    wal.fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (wal.fd < 0) {
+        printf("%sError:%s Failed to open log file.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 0;
+    }
+    wal.last_sync = now_seconds();
+    return 1;
+}
+
+// Buffer one record; it reaches the log on the next wal_commit
+int wal_append(uint8_t op, const char *key, const char *value) {
+    key = key ? key : "";
+    value = value ? value : "";
+    uint32_t key_len = strlen(key);
+    uint32_t val_len = strlen(value);
+    size_t need = sizeof(uint32_t) + 9 + key_len + val_len;
+    
+    if (wal.len + need > wal.cap) {
+        size_t cap = wal.cap ? wal.cap : 4096;
+        while (cap < wal.len + need) {
+            cap *= 2;
+        }
+        char *buf = (char*)realloc(wal.buf, cap);
+        if (!buf) {
+            return 0;
+        }
+        wal.buf = buf;
+        wal.cap = cap;
+    }
+    
+    // crc | op | key length | value length | key | value
+    char *rec = wal.buf + wal.len;
+    char *header = rec + sizeof(uint32_t);
+    header[0] = op;
+    memcpy(header + 1, &key_len, sizeof(key_len));
+    memcpy(header + 5, &val_len, sizeof(val_len));
+    memcpy(header + 9, key, key_len);
+    memcpy(header + 9 + key_len, value, val_len);
+    
+    uint32_t crc = crc32(header, 9 + key_len + val_len, 0);
+    memcpy(rec, &crc, sizeof(crc));
+    
+    wal.len += need;
+    wal.records++;
+    if (wal.observer) {
+        wal.observer(op, key, value);
+    }
+    return 1;
+}
+
+// Log a set, followed by its expiry time when it has one
+int wal_append_set(const char *key, const char *value, int64_t expire_at) {
+    if (!wal_append(LOG_SET, key, value)) {
+        return 0;
+    }
+    if (expire_at == 0) {
+        return 1;
+    }
+    char text[24];
+    snprintf(text, sizeof(text), "%lld", (long long)expire_at);
+    return wal_append(LOG_EXPIRE, key, text);
+}
+
+// Write every buffered record with one write and fsync according to policy.
+// Batching several appends before a commit gives group commit for free.
+int wal_commit() {
+    if (wal.fd < 0 && !wal_open()) {
+        return 0;
+    }
+    
+    size_t off = 0;
+    while (off < wal.len) {
+        ssize_t n = write(wal.fd, wal.buf + off, wal.len - off);
+        if (n < 0) {
+            printf("%sError:%s Failed to write log file.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 0;
+        }
+        off += n;
+    }
+    if (wal.len > 0) {
+        wal.dirty = 1;
+    }
+    wal.len = 0;
+    
+    double now = now_seconds();
+    int due = wal.policy == FSYNC_ALWAYS ||
+              (wal.policy == FSYNC_INTERVAL && (now - wal.last_sync) * 1000 >= wal.interval_ms);
+    if (wal.dirty && due) {
+        uint64_t start = now_ns();
+        fdatasync(wal.fd);
+        timing_record(&persist_stats.fsync, start);
+        wal.last_sync = now;
+        wal.dirty = 0;
+    }
+    return 1;
+}
+
+// Flush anything pending; a short-lived process syncs on the way out
+// instead of leaving its last write to the next interval
+void wal_close() {
+    if (wal.fd >= 0) {
+        wal_commit();
+        if (wal.dirty && wal.policy != FSYNC_NEVER) {
+            fdatasync(wal.fd);
+        }
+        close(wal.fd);
+        wal.fd = -1;
+    }
+    free(wal.buf);
+    wal.buf = NULL;
+    wal.len = wal.cap = 0;
+}
+
+// Fold the log into a fresh snapshot once most of its records are dead.
+// The log is rotated to LOG_OLD_FILE and a forked child writes the snapshot
+// from its copy-on-write view of the table, so the caller never waits.
+void maybe_compact_log() {
+    // Reap a child left over from an earlier compaction
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+    }
+    
+    if (wal.records < COMPACT_MIN_RECORDS) {
+        return;
+    }
+    size_t live = table_count(table);
+    double dead = wal.records > live ? (double)(wal.records - live) / wal.records : 0;
+    if (dead < wal.compact_ratio) {
+        return;
+    }
+    
+    // Only one snapshot writer at a time; the lock is inherited by the child
+    int lock_fd = open(LOCK_FILE, O_WRONLY | O_CREAT, 0644);
+    if (lock_fd < 0) {
+        return;
+    }
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        close(lock_fd);
+        return;
+    }
+    
+    // A leftover old log means a previous compaction died before finishing.
+    // The new snapshot covers it too, so it is simply removed afterwards.
+    wal_commit();
+    if (access(LOG_OLD_FILE, F_OK) != 0) {
+        if (wal.fd >= 0) {
+            close(wal.fd);
+            wal.fd = -1;
+        }
+        if (rename(LOG_FILE, LOG_OLD_FILE) == 0) {
+            wal.records = 0;
+        }
+        wal_open();
+    }
+    
+    fflush(stdout);
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (save_to_disk()) {
+            unlink(LOG_OLD_FILE);
+        }
+        _exit(0);
+    }
+    if (pid > 0) {
+        timing_record(&persist_stats.fork, start);
+    }
+    if (pid < 0 && save_to_disk()) {
+        // Could not fork; compact in the foreground instead
+        unlink(LOG_OLD_FILE);
+    }
+    close(lock_fd);
+}
+
+// Bytes held by live records and index slots. Garbage awaiting compaction
+// is left out, since evicting more keys would not reclaim it any sooner.
+// Like table_count it reads the shards without locking them.
+size_t memory_used(HashTable *ht) {
+    size_t per_slot = sizeof(Slot) + sizeof(uint8_t);
+    size_t bytes = 0;
+    
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        Shard *sh = &ht->shards[i];
+        bytes += sh->arena.live_bytes + (sh->cur.capacity + sh->old.capacity) * per_slot;
+    }
+    return bytes;
+}
+
+int over_memory_limit() {
+    return cache.maxmemory > 0 && memory_used(table) > cache.maxmemory;
+}
+
+// Copy a random key into key and return its eviction score, or -1 if the
+// sampled shard was empty. Expired keys make the best victims of all.
+long sample_key(uint64_t *rng, char *key) {
+    Shard *sh = &table->shards[xorshift64(rng) % NUM_SHARDS];
+    long score = -1;
+    
+    pthread_rwlock_rdlock(&sh->lock);
+    Index *idx = sh->cur.live > 0 ? &sh->cur : &sh->old;
+    if (idx->live > 0) {
+        size_t mask = idx->capacity - 1;
+        size_t pos = xorshift64(rng) & mask;
+        while (!(idx->ctrl[pos] & CTRL_FULL)) {
+            pos = (pos + 1) & mask;
+        }
+        Record *rec = idx->slots[pos].rec;
+        memcpy(key, record_key(rec), rec->key_len + 1);
+        score = record_expired(rec) ? LONG_MAX : eviction_score(rec);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    return score;
+}
+
+// Evict keys until memory use is back under maxmemory. Like Redis, each
+// victim is the best of a few randomly sampled keys, which approximates
+// true LRU/LFU closely without keeping any list of keys in access order.
+// Evictions are logged, so the caller commits them with its own writes.
+size_t evict_if_needed() {
+    static uint64_t rng = 0x2545F4914F6CDD1Dull;
+    char key[MAX_KEY_LEN], victim[MAX_KEY_LEN];
+    size_t evicted = 0;
+    
+    if (cache.maxmemory == 0 || cache.policy == EVICT_NONE) {
+        return 0;
+    }
+    while (memory_used(table) > cache.maxmemory && table_count(table) > 0) {
+        long best = -1;
+        for (int samples = 0, tries = 0; samples < EVICTION_SAMPLES && tries < 4 * EVICTION_SAMPLES; tries++) {
+            long score = sample_key(&rng, key);
+            if (score < 0) {
+                continue;
+            }
+            samples++;
+            if (score > best) {
+                best = score;
+                memcpy(victim, key, strlen(key) + 1);
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        if (delete_value(victim)) {
+            wal_append(LOG_DELETE, victim, NULL);
+            evicted++;
+        }
+    }
+    atomic_fetch_add(&table->evicted, evicted);
+    return evicted;
+}
+
+// Parse a size such as 1048576, 512k, 100mb or 2g
+size_t parse_size(const char *text) {
+    char *end;
+    double n = strtod(text, &end);
+    switch (tolower((unsigned char)*end)) {
+        case 'k': n *= 1024; break;
+        case 'm': n *= 1024 * 1024; break;
+        case 'g': n *= 1024.0 * 1024 * 1024; break;
+    }
+    return n > 0 ? (size_t)n : 0;
+}
+
+// Read the memory cap from the environment:
+// KVSTORE_MAXMEMORY=<bytes>[k|m|g] and KVSTORE_EVICTION=lru|lfu|noeviction
+void configure_cache() {
+    const char *max_env = getenv("KVSTORE_MAXMEMORY");
+    if (max_env) {
+        cache.maxmemory = parse_size(max_env);
+    }
+    
+    const char *policy_env = getenv("KVSTORE_EVICTION");
+    if (policy_env) {
+        if (strcmp(policy_env, "lfu") == 0) {
+            cache.policy = EVICT_LFU;
+        } else if (strcmp(policy_env, "noeviction") == 0) {
+            cache.policy = EVICT_NONE;
+        } else {
+            cache.policy = EVICT_LRU;
+        }
+    }
+    cache_tick();
+}
+
+const char* eviction_policy_name() {
+    switch (cache.policy) {
+        case EVICT_LFU:  return "lfu";
+        case EVICT_NONE: return "noeviction";
+        default:         return "lru";
+    }
+}
+
+// Absolute expiry time for an EX <seconds> or PX <ms> option, or -1
+int64_t parse_expiry(const char *unit, const char *amount) {
+    char *end;
+    long long n = strtoll(amount, &end, 10);
+    if (*end != '\0' || n <= 0) {
+        return -1;
+    }
+    if (strcasecmp(unit, "EX") == 0) {
+        return now_ms() + n * 1000;
+    }
+    if (strcasecmp(unit, "PX") == 0) {
+        return now_ms() + n;
+    }
+    return -1;
+}
+
+// Memory and expiry figures as INFO-style "field:value" lines
+int format_info(char *buf, size_t size, const char *eol) {
+    return snprintf(buf, size,
+                    "# Memory%s"
+                    "used_memory:%zu%s"
+                    "maxmemory:%zu%s"
+                    "maxmemory_policy:%s%s"
+                    "# Stats%s"
+                    "expired_keys:%zu%s"
+                    "evicted_keys:%zu%s"
+                    "# Keyspace%s"
+                    "keys:%zu%s"
+                    "pending_expiries:%zu%s",
+                    eol,
+                    memory_used(table), eol,
+                    cache.maxmemory, eol,
+                    eviction_policy_name(), eol,
+                    eol,
+                    atomic_load(&table->expired), eol,
+                    atomic_load(&table->evicted), eol,
+                    eol,
+                    table_count(table), eol,
+                    table->wheel.count, eol);
+}
+
+// Write the records appended so far, as one group, and compact if due
+int commit_log() {
+    if (!wal_commit()) {
+        return 0;
+    }
+    maybe_compact_log();
+    return 1;
+}
+
+// Log a mutation that has been applied to the table
+int persist(uint8_t op, const char *key, const char *value) {
+    return wal_append(op, key, value) && commit_log();
+}
+
+// Write the whole table as a fresh snapshot and drop the logs it covers.
+// After a bulk load this is far cheaper than one log record per key.
+int checkpoint() {
+    // Wait for a compaction child so two snapshot writers never race
+    int lock_fd = open(LOCK_FILE, O_WRONLY | O_CREAT, 0644);
+    if (lock_fd >= 0) {
+        flock(lock_fd, LOCK_EX);
+    }
+    
+    int ok = save_to_disk();
+    if (ok) {
+        if (wal.fd >= 0) {
+            close(wal.fd);
+            wal.fd = -1;
+        }
+        wal.len = 0;
+        unlink(LOG_OLD_FILE);
+        truncate(LOG_FILE, 0);
+        wal.records = 0;
+    }
+    
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+    return ok;
+}
+
+// Free all memory
+void free_table() {
+    if (!table) {
+        return;
+    }
+    
+    wal_close();
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        Shard *sh = &table->shards[i];
+        arena_free(&sh->arena);
+        index_free(&sh->old);
+        index_free(&sh->cur);
+        pthread_rwlock_destroy(&sh->lock);
+    }
+    ordered_free(&table->ordered);
+    wheel_clear(&table->wheel);
+    pthread_mutex_destroy(&table->wheel.lock);
+    free(table);
+    table = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Import and export
+// ---------------------------------------------------------------------------
+
+#define IO_BUFFER_SIZE (1 << 20)
+
+// Line formats for import and export. TSV is key<TAB>value with \t, \n, \r
+// and \\ escaped; JSONL is one {"key": "...", "value": "..."} object per line.
+typedef enum {
+    FORMAT_TSV,
+    FORMAT_JSONL
+} DataFormat;
+
+// Pick a format from --format, falling back to the file extension
+int parse_format(const char *name, const char *path, DataFormat *format) {
+    if (name) {
+        if (strcmp(name, "tsv") == 0) {
+            *format = FORMAT_TSV;
+        } else if (strcmp(name, "jsonl") == 0 || strcmp(name, "json") == 0) {
+            *format = FORMAT_JSONL;
+        } else {
+            printf("%sError:%s Unknown format: %s%s%s\n", COLOR_RED COLOR_BOLD, COLOR_RESET, COLOR_YELLOW, name, COLOR_RESET);
+            return 0;
+        }
+        return 1;
+    }
+    const char *ext = path ? strrchr(path, '.') : NULL;
+    *format = ext && (strcmp(ext, ".jsonl") == 0 || strcmp(ext, ".json") == 0) ? FORMAT_JSONL : FORMAT_TSV;
+    return 1;
+}
+
+// Undo TSV escaping in place. Returns the new length, or -1 on an escaped NUL.
+long tsv_unescape(char *s, size_t len) {
+    // Most fields have no escapes; skip straight to the first one
+    char *first = (char*)memchr(s, '\\', len);
+    if (!first) {
+        s[len] = '\0';
+        return len;
+    }
+    char *w = first;
+    for (size_t i = first - s; i < len; i++) {
+        if (s[i] != '\\' || i + 1 == len) {
+            *w++ = s[i];
+            continue;
+        }
+        switch (s[++i]) {
+            case 't': *w++ = '\t'; break;
+            case 'n': *w++ = '\n'; break;
+            case 'r': *w++ = '\r'; break;
+            case '\\': *w++ = '\\'; break;
+            case '0': return -1;
+            default: *w++ = '\\'; *w++ = s[i]; break;
+        }
+    }
+    *w = '\0';
+    return w - s;
+}
+
+// Split a TSV line into key and value, decoding both in place
+int parse_tsv_line(char *line, size_t len, char **key, size_t *key_len, char **value, size_t *val_len) {
+    char *tab = (char*)memchr(line, '\t', len);
+    if (!tab) {
+        return 0;
+    }
+    long k = tsv_unescape(line, tab - line);
+    long v = tsv_unescape(tab + 1, len - (tab + 1 - line));
+    if (k < 0 || v < 0) {
+        return 0;
+    }
+    *key = line;
+    *key_len = k;
+    *value = tab + 1;
+    *val_len = v;
+    return 1;
+}
+
+static const char* skip_space(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static long parse_hex4(const char *p) {
+    long v = 0;
+    for (int i = 0; i < 4; i++) {
+        int d = hex_value(p[i]);
+        if (d < 0) {
+            return -1;
+        }
+        v = v * 16 + d;
+    }
+    return v;
+}
+
+// Decode a JSON string starting at the opening quote, in place. The decoded
+// text never outgrows its escaped form, so it is written over the input and
+// terminated. Returns the position after the closing quote, or NULL.
+char* json_parse_string(char *p, char **out, size_t *out_len) {
+    if (*p != '"') {
+        return NULL;
+    }
+    char *r = ++p;
+    char *w = p;
+    while (*r != '"') {
+        unsigned char c = *r;
+        if (c == '\0' || c < 0x20) {
+            return NULL;
+        }
+        if (c != '\\') {
+            *w++ = *r++;
+            continue;
+        }
+        r++;
+        switch (*r++) {
+            case '"': *w++ = '"'; break;
+            case '\\': *w++ = '\\'; break;
+            case '/': *w++ = '/'; break;
+            case 'b': *w++ = '\b'; break;
+            case 'f': *w++ = '\f'; break;
+            case 'n': *w++ = '\n'; break;
+            case 'r': *w++ = '\r'; break;
+            case 't': *w++ = '\t'; break;
+            case 'u': {
+                long cp = parse_hex4(r);
+                if (cp <= 0) {
+                    return NULL;
+                }
+                r += 4;
+                if (cp >= 0xD800 && cp <= 0xDBFF && r[0] == '\\' && r[1] == 'u') {
+                    long lo = parse_hex4(r + 2);
+                    if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        r += 6;
+                    }
+                }
+                // Encode as UTF-8
+                if (cp < 0x80) {
+                    *w++ = cp;
+                } else if (cp < 0x800) {
+                    *w++ = 0xC0 | (cp >> 6);
+                    *w++ = 0x80 | (cp & 0x3F);
+                } else if (cp < 0x10000) {
+                    *w++ = 0xE0 | (cp >> 12);
+                    *w++ = 0x80 | ((cp >> 6) & 0x3F);
+                    *w++ = 0x80 | (cp & 0x3F);
+                } else {
+                    *w++ = 0xF0 | (cp >> 18);
+                    *w++ = 0x80 | ((cp >> 12) & 0x3F);
+                    *w++ = 0x80 | ((cp >> 6) & 0x3F);
+                    *w++ = 0x80 | (cp & 0x3F);
+                }
+                break;
+            }
+            default:
+                return NULL;
+        }
+    }
+    *out = p;
+    *out_len = w - p;
+    *w = '\0';
+    return r + 1;
+}
+
+// Parse {"key": "...", "value": ...}. Numbers and booleans are stored as
+// their text; other members are ignored as long as they are scalars.
+int parse_jsonl_line(char *line, char **key, size_t *key_len, char **value, size_t *val_len) {
+    char *p = (char*)skip_space(line);
+    if (*p++ != '{') {
+        return 0;
+    }
+    *key = *value = NULL;
+    
+    p = (char*)skip_space(p);
+    while (*p != '}') {
+        char *name;
+        size_t name_len;
+        p = json_parse_string(p, &name, &name_len);
+        if (!p) {
+            return 0;
+        }
+        p = (char*)skip_space(p);
+        if (*p++ != ':') {
+            return 0;
+        }
+        p = (char*)skip_space(p);
+        
+        char *text;
+        size_t text_len;
+        if (*p == '"') {
+            p = json_parse_string(p, &text, &text_len);
+            if (!p) {
+                return 0;
+            }
+        } else {
+            text = p;
+            while (*p && *p != ',' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+                p++;
+            }
+            text_len = p - text;
+            if (text_len == 0 || *text == '{' || *text == '[' || strncmp(text, "null", 4) == 0) {
+                return 0;
+            }
+        }
+        
+        // Terminate a bare token only after looking at the character it ends on
+        p = (char*)skip_space(p);
+        char next = *p;
+        text[text_len] = '\0';
+        if (strcmp(name, "key") == 0) {
+            *key = text;
+            *key_len = text_len;
+        } else if (strcmp(name, "value") == 0) {
+            *value = text;
+            *val_len = text_len;
+        }
+        
+        if (next == ',') {
+            p = (char*)skip_space(p + 1);
+        } else if (next != '}') {
+            return 0;
+        }
+    }
+    return *skip_space(p + 1) == '\0' && *key && *value;
+}
+
+// Bulk-insert pairs from a file or stdin ("-"). Nothing is logged per key:
+// the whole table is written as one snapshot at the end, and a crash before
+// that leaves the store as it was.
+int import_pairs(const char *path, DataFormat format) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        printf("%sError:%s Cannot open %s%s%s\n", COLOR_RED COLOR_BOLD, COLOR_RESET, COLOR_YELLOW, path, COLOR_RESET);
+        return 0;
+    }
+    setvbuf(f, NULL, _IOFBF, IO_BUFFER_SIZE);
+    
+    double start = now_seconds();
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    size_t line_no = 0, imported = 0, skipped = 0, first_bad = 0;
+    int ok = 1;
+    
+    while ((len = getline(&line, &line_cap, f)) >= 0) {
+        line_no++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        
+        char *key, *value;
+        size_t key_len, val_len;
+        int parsed = format == FORMAT_TSV
+            ? parse_tsv_line(line, len, &key, &key_len, &value, &val_len)
+            : parse_jsonl_line(line, &key, &key_len, &value, &val_len);
+        
+        // Embedded NULs would silently truncate a C-string key or value
+        if (!parsed || key_len == 0 || key_len >= MAX_KEY_LEN || val_len >= MAX_VAL_LEN ||
+            strlen(key) != key_len || strlen(value) != val_len) {
+            if (skipped++ == 0) {
+                first_bad = line_no;
+            }
+            continue;
+        }
+        // Nothing is logged here, so evicting mid-import only costs table space
+        if ((imported & 1023) == 0 && over_memory_limit()) {
+            if (cache.policy == EVICT_NONE) {
+                printf("%sError:%s Memory limit reached after %zu pairs.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, imported);
+                break;
+            }
+            evict_if_needed();
+        }
+        if (!set_value(key, value)) {
+            ok = 0;
+            break;
+        }
+        imported++;
+    }
+    
+    if (ferror(f)) {
+        printf("%sError:%s Failed to read %s%s%s\n", COLOR_RED COLOR_BOLD, COLOR_RESET, COLOR_YELLOW, path, COLOR_RESET);
+        ok = 0;
+    }
+    free(line);
+    if (f != stdin) {
+        fclose(f);
+    }
+    
+    if (ok && imported > 0) {
+        ok = checkpoint();
+    }
+    if (ok) {
+        printf("%s✓ Imported%s %zu pairs in %.2f s (%zu entries in store).\n",
+               COLOR_GREEN COLOR_BOLD, COLOR_RESET, imported, now_seconds() - start, table_count(table));
+    }
+    if (skipped > 0) {
+        printf("%sSkipped %zu malformed lines (first at line %zu).%s\n", COLOR_YELLOW, skipped, first_bad, COLOR_RESET);
+    }
+    return ok;
+}
+
+void write_tsv_escaped(FILE *f, const char *s, size_t len) {
+    const char *run = s;
+    for (size_t i = 0; i < len; i++) {
+        const char *esc = NULL;
+        switch (s[i]) {
+            case '\t': esc = "\\t"; break;
+            case '\n': esc = "\\n"; break;
+            case '\r': esc = "\\r"; break;
+            case '\\': esc = "\\\\"; break;
+        }
+        if (esc) {
+            fwrite(run, 1, s + i - run, f);
+            fwrite(esc, 1, 2, f);
+            run = s + i + 1;
+        }
+    }
+    fwrite(run, 1, s + len - run, f);
+}
+
+void write_json_string(FILE *f, const char *s, size_t len) {
+    const char *run = s;
+    putc('"', f);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        fwrite(run, 1, s + i - run, f);
+        switch (c) {
+            case '"': fputs("\\\"", f); break;
+            case '\\': fputs("\\\\", f); break;
+            case '\n': fputs("\\n", f); break;
+            case '\r': fputs("\\r", f); break;
+            case '\t': fputs("\\t", f); break;
+            default: fprintf(f, "\\u%04x", c); break;
+        }
+        run = s + i + 1;
+    }
+    fwrite(run, 1, s + len - run, f);
+    putc('"', f);
+}
+
+// Stream every pair straight from the arenas to a file or stdout ("-")
+int export_pairs(const char *path, DataFormat format) {
+    int to_stdout = strcmp(path, "-") == 0;
+    FILE *f = to_stdout ? stdout : fopen(path, "w");
+    if (!f) {
+        printf("%sError:%s Cannot create %s%s%s\n", COLOR_RED COLOR_BOLD, COLOR_RESET, COLOR_YELLOW, path, COLOR_RESET);
+        return 0;
+    }
+    setvbuf(f, NULL, _IOFBF, IO_BUFFER_SIZE);
+    
+    TableIter it = {0};
+    Record *rec;
+    size_t exported = 0;
+    while ((rec = table_next(table, &it)) != NULL) {
+        if (record_expired(rec)) {
+            continue;
+        }
+        if (format == FORMAT_TSV) {
+            write_tsv_escaped(f, record_key(rec), rec->key_len);
+            putc('\t', f);
+            write_tsv_escaped(f, record_value(rec), rec->val_len);
+        } else {
+            fputs("{\"key\":", f);
+            write_json_string(f, record_key(rec), rec->key_len);
+            fputs(",\"value\":", f);
+            write_json_string(f, record_value(rec), rec->val_len);
+            putc('}', f);
+        }
+        putc('\n', f);
+        exported++;
+    }
+    
+    int ok = fflush(f) == 0 && !ferror(f);
+    if (!to_stdout && fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        printf("%sError:%s Failed to write %s%s%s\n", COLOR_RED COLOR_BOLD, COLOR_RESET, COLOR_YELLOW, path, COLOR_RESET);
+    } else if (!to_stdout) {
+        printf("%s✓ Exported%s %zu pairs to %s%s%s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET, exported, COLOR_YELLOW, path, COLOR_RESET);
+    }
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Server mode
+// ---------------------------------------------------------------------------
+
+#define DEFAULT_SERVER_PORT 6380
+#define MAX_EVENTS 256
+#define MAX_ARGS 1024
+#define READ_CHUNK 16384
+#define MAX_QUERY_LEN (64 * 1024 * 1024)  // Drop clients buffering more than this
+#define SERVER_SCAN_LIMIT 100             // Pairs per SCAN/RANGE reply without LIMIT
+#define EXPIRE_CYCLE_MS 100               // Longest wait between expiry passes
+#define REPL_SYNC_FILE "kvstore.sync.dat"         // Snapshot being sent to replicas
+#define REPL_SYNC_TMP_FILE "kvstore.sync.dat.tmp"
+#define REPL_RECV_FILE "kvstore.recv.dat"         // Snapshot being received from the primary
+#define REPL_RETRY_MS 1000                        // Wait between attempts to reach the primary
+#define REPL_READ_BATCH (1024 * 1024)             // Bytes read from the primary per event
+#define MAX_REPLICA_BACKLOG (256 * 1024 * 1024)   // Drop replicas that fall this far behind
+
+typedef enum {
+    CONN_CLIENT,
+    CONN_REPLICA,         // A replica of this server
+    CONN_PRIMARY          // This replica's link to its primary
+} ConnRole;
+
+// Progress of a replica of this server
+typedef enum {
+    REPL_WAIT_START,      // Needs a snapshot taken after it asked
+    REPL_WAIT_SNAPSHOT,   // Snapshot being written; writes are buffered meanwhile
+    REPL_ONLINE           // Receiving writes as they happen
+} ReplicaState;
+
+// Progress of the link to the primary
+typedef enum {
+    LINK_HANDSHAKE,       // Waiting for the snapshot's length
+    LINK_TRANSFER,        // Receiving the snapshot
+    LINK_STREAM           // Applying writes
+} LinkState;
+
+// Client connection with its input and reply buffers
+typedef struct Conn {
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    int want_write;       // EPOLLOUT is armed
+    int read_eof;         // Peer finished sending
+    int closing;          // Close once the replies are flushed
+    int pending;          // Queued for the post-commit flush
+    struct Conn *next_pending;
+    ConnRole role;
+    int repl_state;       // ReplicaState or LinkState, depending on role
+    struct Conn *next_replica;
+    FILE *sync_file;      // Snapshot being received (primary link)
+    uint64_t sync_left;
+} Conn;
+
+// A parsed command; arguments point into the connection's input buffer
+typedef struct {
+    int argc;
+    char *argv[MAX_ARGS];
+    size_t argl[MAX_ARGS];
+} Request;
+
+typedef struct {
+    const char *name;
+    int min_args;         // Including the command name
+    int max_args;         // -1 for no limit
+    void (*handler)(Conn *c, Request *req);
+    int write;            // Modifies the store, so replicas refuse it from clients
+} Command;
+
+// Server-wide state
+typedef struct {
+    int epoll_fd;
+    int listen_fd;
+    const char *unix_path;
+    Conn *pending;        // Connections with replies waiting on the next commit
+    Conn *replicas;
+    int sync_fd;          // Pipe from the child writing a snapshot for replicas
+    pid_t sync_pid;
+    const char *primary_host;   // Set when this server is a replica
+    int primary_port;
+    Conn *primary;
+    int64_t next_connect;
+    const Command *commands;    // The command table, for naming latency histograms
+    size_t command_count;
+} Server;
+
+Server server = { .epoll_fd = -1, .listen_fd = -1, .sync_fd = -1 };
+volatile sig_atomic_t server_stop = 0;
+
+void handle_stop_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+// Grow a buffer so it can hold at least need bytes
+int buffer_reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) {
+        return 1;
+    }
+    size_t new_cap = *cap ? *cap : READ_CHUNK;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    char *grown = (char*)realloc(*buf, new_cap);
+    if (!grown) {
+        return 0;
+    }
+    *buf = grown;
+    *cap = new_cap;
+    return 1;
+}
+
+void reply_raw(Conn *c, const char *data, size_t len) {
+    if (!buffer_reserve(&c->out, &c->out_cap, c->out_len + len)) {
+        c->closing = 1;
+        return;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+void reply_status(Conn *c, const char *status) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "+%s\r\n", status);
+    reply_raw(c, line, len);
+}
+
+void reply_error(Conn *c, const char *message) {
+    char line[256];
+    int len = snprintf(line, sizeof(line), "-ERR %s\r\n", message);
+    reply_raw(c, line, len);
+}
+
+void reply_int(Conn *c, long long n) {
+    char line[32];
+    int len = snprintf(line, sizeof(line), ":%lld\r\n", n);
+    reply_raw(c, line, len);
+}
+
+void reply_bulk(Conn *c, const char *data, size_t data_len) {
+    char line[32];
+    int len = snprintf(line, sizeof(line), "$%zu\r\n", data_len);
+    reply_raw(c, line, len);
+    reply_raw(c, data, data_len);
+    reply_raw(c, "\r\n", 2);
+}
+
+void reply_nil(Conn *c) {
+    reply_raw(c, "$-1\r\n", 5);
+}
+
+void reply_array(Conn *c, long long n) {
+    char line[32];
+    int len = snprintf(line, sizeof(line), "*%lld\r\n", n);
+    reply_raw(c, line, len);
+}
+
+// Insert data ahead of the replies written since mark, for headers whose
+// counts are only known once the body is written
+void reply_insert(Conn *c, size_t mark, const char *data, size_t len) {
+    if (!buffer_reserve(&c->out, &c->out_cap, c->out_len + len)) {
+        c->closing = 1;
+        return;
+    }
+    memmove(c->out + mark + len, c->out + mark, c->out_len - mark);
+    memcpy(c->out + mark, data, len);
+    c->out_len += len;
+}
+
+// Queue a connection for the flush after the next commit
+void conn_queue(Conn *c) {
+    if (!c->pending) {
+        c->pending = 1;
+        c->next_pending = server.pending;
+        server.pending = c;
+    }
+}
+
+int connect_to_server(const char *host, int port, const char *unix_path) {
+    int fd;
+    if (unix_path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+        if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// ---------------------------------------------------------------------------
+// Replication
+// ---------------------------------------------------------------------------
+// A replica sends SYNC. The primary forks a child that writes a snapshot
+// (the same copy-on-write trick compaction uses) and, from that moment,
+// buffers every logged write for the replica as the command that repeats
+// it. Once the child is done the replica gets the snapshot as one bulk
+// string, followed by the buffered writes and then each new one as it is
+// committed.
+
+// Give up on a replica: drop whatever it has not been sent and close it
+// at the next flush. It reconnects and starts over with a fresh snapshot.
+void replica_drop(Conn *r) {
+    r->closing = 1;
+    r->out_len = r->out_sent;
+    conn_queue(r);
+}
+
+// Log observer on the primary: forward a record to every replica. Replicas
+// waiting for a snapshot that has not been started yet will find the write
+// in it, so they skip it.
+void replicate_record(uint8_t op, const char *key, const char *value) {
+    for (Conn *r = server.replicas; r != NULL; r = r->next_replica) {
+        if (r->repl_state == REPL_WAIT_START || r->closing) {
+            continue;
+        }
+        switch (op) {
+            case LOG_SET:
+                reply_array(r, 3);
+                reply_bulk(r, "SET", 3);
+                reply_bulk(r, key, strlen(key));
+                reply_bulk(r, value, strlen(value));
+                break;
+            case LOG_DELETE:
+                reply_array(r, 2);
+                reply_bulk(r, "DEL", 3);
+                reply_bulk(r, key, strlen(key));
+                break;
+            case LOG_CLEAR:
+                reply_array(r, 1);
+                reply_bulk(r, "FLUSHALL", 8);
+                break;
+            case LOG_EXPIRE:
+                // Expiry times are absolute, so replicas expire keys in step
+                reply_array(r, 3);
+                reply_bulk(r, "PEXPIREAT", 9);
+                reply_bulk(r, key, strlen(key));
+                reply_bulk(r, value, strlen(value));
+                break;
+        }
+        // A replica this far behind is cheaper to resync from scratch
+        if (r->out_len > MAX_REPLICA_BACKLOG) {
+            replica_drop(r);
+        } else if (r->repl_state == REPL_ONLINE) {
+            conn_queue(r);
+        }
+    }
+}
+
+// Fork a child that writes a snapshot for the replicas waiting to start.
+// It reports success through a pipe the event loop watches.
+void sync_start() {
+    int fds[2];
+    if (server.sync_fd >= 0 || pipe(fds) != 0) {
+        return;
+    }
+    
+    fflush(stdout);
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        char ok = save_snapshot(REPL_SYNC_FILE, REPL_SYNC_TMP_FILE);
+        _exit(write(fds[1], &ok, 1) == 1 ? 0 : 1);
+    }
+    if (pid > 0) {
+        timing_record(&persist_stats.fork, start);
+    }
+    if (pid < 0) {
+        // Could not fork; write the snapshot in the foreground instead. A
+        // failed write leaves the pipe empty, which fails the sync.
+        char ok = save_snapshot(REPL_SYNC_FILE, REPL_SYNC_TMP_FILE);
+        write(fds[1], &ok, 1);
+    }
+    close(fds[1]);
+    server.sync_fd = fds[0];
+    server.sync_pid = pid;
+    
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &server.sync_fd };
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.sync_fd, &ev);
+    for (Conn *r = server.replicas; r != NULL; r = r->next_replica) {
+        if (r->repl_state == REPL_WAIT_START) {
+            r->repl_state = REPL_WAIT_SNAPSHOT;
+        }
+    }
+}
+
+// The snapshot child is done: send the snapshot ahead of the writes each
+// waiting replica has buffered since, and start over for late arrivals
+void sync_finish() {
+    char ok = 0;
+    if (read(server.sync_fd, &ok, 1) != 1) {
+        ok = 0;
+    }
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, server.sync_fd, NULL);
+    close(server.sync_fd);
+    server.sync_fd = -1;
+    if (server.sync_pid > 0) {
+        waitpid(server.sync_pid, NULL, WNOHANG);
+    }
+    
+    char *data = NULL;
+    size_t len = 0;
+    int fd = ok ? open(REPL_SYNC_FILE, O_RDONLY) : -1;
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (data = (char*)malloc(st.st_size + 1)) != NULL) {
+        while (len < (size_t)st.st_size) {
+            ssize_t n = read(fd, data + len, st.st_size - len);
+            if (n <= 0) {
+                break;
+            }
+            len += n;
+        }
+        ok = len == (size_t)st.st_size;
+    } else {
+        ok = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(REPL_SYNC_FILE);
+    
+    int restart = 0;
+    for (Conn *r = server.replicas; r != NULL; r = r->next_replica) {
+        if (r->repl_state == REPL_WAIT_START) {
+            restart = 1;
+        }
+        if (r->repl_state != REPL_WAIT_SNAPSHOT) {
+            continue;
+        }
+        if (ok) {
+            char head[32];
+            int head_len = snprintf(head, sizeof(head), "$%zu\r\n", len);
+            reply_insert(r, 0, data, len);
+            reply_insert(r, 0, head, head_len);
+            r->repl_state = REPL_ONLINE;
+            conn_queue(r);
+        } else {
+            replica_drop(r);
+        }
+    }
+    free(data);
+    
+    if (restart) {
+        sync_start();
+    }
+}
+
+// SYNC: turn this connection into a replica
+void cmd_sync(Conn *c, Request *req) {
+    (void)req;
+    if (c->role != CONN_CLIENT || c->out_len > 0) {
+        reply_error(c, "SYNC must be the only command on its connection");
+        return;
+    }
+    c->role = CONN_REPLICA;
+    c->repl_state = REPL_WAIT_START;
+    c->next_replica = server.replicas;
+    server.replicas = c;
+    sync_start();
+}
+
+// Keys and values are C strings in the table, so reject what it cannot hold
+int check_key(Conn *c, Request *req, int i) {
+    if (req->argl[i] == 0 || req->argl[i] >= MAX_KEY_LEN || memchr(req->argv[i], '\0', req->argl[i])) {
+        reply_error(c, "invalid key");
+        return 0;
+    }
+    return 1;
+}
+
+int check_value(Conn *c, Request *req, int i) {
+    if (req->argl[i] >= MAX_VAL_LEN || memchr(req->argv[i], '\0', req->argl[i])) {
+        reply_error(c, "invalid value");
+        return 0;
+    }
+    return 1;
+}
+
+void cmd_ping(Conn *c, Request *req) {
+    if (req->argc > 1) {
+        reply_bulk(c, req->argv[1], req->argl[1]);
+    } else {
+        reply_status(c, "PONG");
+    }
+}
+
+void reply_value(Conn *c, const char *key) {
+    const char *value = get_value(key);
+    if (value) {
+        reply_bulk(c, value, strlen(value));
+    } else {
+        reply_nil(c);
+    }
+}
+
+void cmd_get(Conn *c, Request *req) {
+    reply_value(c, req->argv[1]);
+}
+
+// With the noeviction policy, writes fail once memory is over the cap
+int check_memory(Conn *c) {
+    if (cache.policy == EVICT_NONE && over_memory_limit()) {
+        reply_error(c, "command not allowed when used memory > 'maxmemory'");
+        return 0;
+    }
+    return 1;
+}
+
+// SET key value [EX seconds | PX milliseconds]
+void cmd_set(Conn *c, Request *req) {
+    if (!check_key(c, req, 1) || !check_value(c, req, 2)) {
+        return;
+    }
+    int64_t expire_at = 0;
+    if (req->argc == 5) {
+        expire_at = parse_expiry(req->argv[3], req->argv[4]);
+        if (expire_at < 0) {
+            reply_error(c, "invalid expire time or option");
+            return;
+        }
+    } else if (req->argc != 3) {
+        reply_error(c, "syntax error");
+        return;
+    }
+    if (!check_memory(c)) {
+        return;
+    }
+    if (!set_value_expire(req->argv[1], req->argv[2], expire_at) ||
+        !wal_append_set(req->argv[1], req->argv[2], expire_at)) {
+        reply_error(c, "out of memory");
+        return;
+    }
+    reply_status(c, "OK");
+}
+
+void cmd_expire(Conn *c, Request *req) {
+    char *end;
+    long long seconds = strtoll(req->argv[2], &end, 10);
+    if (*end != '\0' || end == req->argv[2]) {
+        reply_error(c, "value is not an integer");
+        return;
+    }
+    int64_t expire_at = now_ms() + seconds * 1000;
+    int found = expire_value(req->argv[1], expire_at);
+    if (found) {
+        char text[24];
+        snprintf(text, sizeof(text), "%lld", (long long)expire_at);
+        wal_append(LOG_EXPIRE, req->argv[1], text);
+    }
+    reply_int(c, found);
+}
+
+// PEXPIREAT key ms: expire at an absolute time, as replicas are told to
+void cmd_pexpireat(Conn *c, Request *req) {
+    char *end;
+    long long expire_at = strtoll(req->argv[2], &end, 10);
+    if (*end != '\0' || end == req->argv[2]) {
+        reply_error(c, "value is not an integer");
+        return;
+    }
+    int found = expire_value(req->argv[1], expire_at);
+    if (found) {
+        wal_append(LOG_EXPIRE, req->argv[1], req->argv[2]);
+    }
+    reply_int(c, found);
+}
+
+// Seconds left, rounded up; -1 without a TTL, -2 for a missing key
+void cmd_ttl(Conn *c, Request *req) {
+    int64_t ttl = ttl_value(req->argv[1]);
+    reply_int(c, ttl < 0 ? ttl : (ttl + 999) / 1000);
+}
+
+void cmd_info(Conn *c, Request *req) {
+    (void)req;
+    char text[1024];
+    int len = format_info(text, sizeof(text), "\r\n");
+    
+    int replicas = 0;
+    for (Conn *r = server.replicas; r != NULL; r = r->next_replica) {
+        replicas++;
+    }
+    len += snprintf(text + len, sizeof(text) - len, "# Replication\r\nrole:%s\r\nconnected_replicas:%d\r\n",
+                    server.primary_host ? "replica" : "primary", replicas);
+    if (server.primary_host) {
+        len += snprintf(text + len, sizeof(text) - len, "primary_host:%s\r\nprimary_port:%d\r\nprimary_link_status:%s\r\n",
+                        server.primary_host, server.primary_port,
+                        server.primary && server.primary->repl_state == LINK_STREAM ? "up" : "down");
+    }
+    reply_bulk(c, text, len);
+}
+
+void cmd_mget(Conn *c, Request *req) {
+    reply_array(c, req->argc - 1);
+    for (int i = 1; i < req->argc; i++) {
+        reply_value(c, req->argv[i]);
+    }
+}
+
+// All pairs are checked first so a bad one leaves the table untouched
+void cmd_mset(Conn *c, Request *req) {
+    if (req->argc % 2 == 0) {
+        reply_error(c, "wrong number of arguments for 'MSET'");
+        return;
+    }
+    for (int i = 1; i < req->argc; i += 2) {
+        if (!check_key(c, req, i) || !check_value(c, req, i + 1)) {
+            return;
+        }
+    }
+    if (!check_memory(c)) {
+        return;
+    }
+    for (int i = 1; i < req->argc; i += 2) {
+        if (!set_value(req->argv[i], req->argv[i + 1]) || !wal_append(LOG_SET, req->argv[i], req->argv[i + 1])) {
+            reply_error(c, "out of memory");
+            return;
+        }
+    }
+    reply_status(c, "OK");
+}
+
+void reply_pair(const char *key, const char *value, size_t val_len, void *ctx) {
+    Conn *c = (Conn*)ctx;
+    reply_bulk(c, key, strlen(key));
+    reply_bulk(c, value, val_len);
+}
+
+// Shared tail of SCAN and RANGE: parse [LIMIT n] [AFTER cursor] and reply
+// with [next cursor or nil, [key, value, ...]]
+void reply_scan(Conn *c, Request *req, KeyRange *range, int first_option) {
+    size_t limit = SERVER_SCAN_LIMIT;
+    for (int i = first_option; i < req->argc; i += 2) {
+        if (i + 1 < req->argc && strcasecmp(req->argv[i], "LIMIT") == 0 && atol(req->argv[i + 1]) > 0) {
+            limit = atol(req->argv[i + 1]);
+        } else if (i + 1 < req->argc && strcasecmp(req->argv[i], "AFTER") == 0) {
+            range->after = req->argv[i + 1];
+        } else {
+            reply_error(c, "syntax error");
+            return;
+        }
+    }
+    
+    char cursor[MAX_KEY_LEN];
+    size_t mark = c->out_len;
+    long visited = scan_range(table, range, limit, reply_pair, c, cursor);
+    if (visited < 0) {
+        reply_error(c, "out of memory");
+        return;
+    }
+    
+    char header[MAX_KEY_LEN + 64];
+    int len = cursor[0]
+        ? snprintf(header, sizeof(header), "*2\r\n$%zu\r\n%s\r\n*%ld\r\n", strlen(cursor), cursor, visited * 2)
+        : snprintf(header, sizeof(header), "*2\r\n$-1\r\n*%ld\r\n", visited * 2);
+    reply_insert(c, mark, header, len);
+}
+
+void cmd_scan(Conn *c, Request *req) {
+    KeyRange range = { .prefix = req->argv[1] };
+    reply_scan(c, req, &range, 2);
+}
+
+void cmd_range(Conn *c, Request *req) {
+    KeyRange range = { .from = req->argv[1], .to = req->argv[2] };
+    reply_scan(c, req, &range, 3);
+}
+
+void cmd_del(Conn *c, Request *req) {
+    long long deleted = 0;
+    for (int i = 1; i < req->argc; i++) {
+        if (delete_value(req->argv[i])) {
+            wal_append(LOG_DELETE, req->argv[i], NULL);
+            deleted++;
+        }
+    }
+    reply_int(c, deleted);
+}
+
+void cmd_exists(Conn *c, Request *req) {
+    long long found = 0;
+    for (int i = 1; i < req->argc; i++) {
+        found += get_value(req->argv[i]) != NULL;
+    }
+    reply_int(c, found);
+}
+
+void cmd_dbsize(Conn *c, Request *req) {
+    (void)req;
+    reply_int(c, table_count(table));
+}
+
+void cmd_flushall(Conn *c, Request *req) {
+    (void)req;
+    clear_all();
+    wal_append(LOG_CLEAR, NULL, NULL);
+    reply_status(c, "OK");
+}
+
+// STATS [RESET]: table shape, memory, persistence timings and per-command
+// latency percentiles in microseconds
+void cmd_stats(Conn *c, Request *req) {
+    if (req->argc == 2) {
+        if (strcasecmp(req->argv[1], "RESET") != 0) {
+            reply_error(c, "syntax error");
+            return;
+        }
+        stats_reset();
+        reply_status(c, "OK");
+        return;
+    }
+    
+    static char text[16384];
+    int len = format_stats(text, sizeof(text), "\r\n");
+    len += snprintf(text + len, sizeof(text) - len, "# Latency\r\n");
+    for (size_t i = 0; i < server.command_count && len < (int)sizeof(text); i++) {
+        LatencyHist h;
+        stats_op_latency((int)i, &h);
+        if (h.total == 0) {
+            continue;
+        }
+        len += snprintf(text + len, sizeof(text) - len,
+                        "cmd_%s:calls=%llu,mean_us=%.2f,p50_us=%.2f,p99_us=%.2f,p999_us=%.2f,max_us=%.2f\r\n",
+                        server.commands[i].name, (unsigned long long)h.total, h.sum_ns / 1e3 / h.total,
+                        hist_quantile(&h, 0.5) / 1e3, hist_quantile(&h, 0.99) / 1e3,
+                        hist_quantile(&h, 0.999) / 1e3, h.max_ns / 1e3);
+    }
+    if (len >= (int)sizeof(text)) {
+        len = sizeof(text) - 1;
+    }
+    reply_bulk(c, text, len);
+}
+
+void cmd_command(Conn *c, Request *req) {
+    // Enough for redis-cli's handshake
+    (void)req;
+    reply_raw(c, "*0\r\n", 4);
+}
+
+void cmd_quit(Conn *c, Request *req) {
+    (void)req;
+    reply_status(c, "OK");
+    c->closing = 1;
+}
+
+Command commands[] = {
+    { "PING",      1, 2,  cmd_ping,      0 },
+    { "GET",       2, 2,  cmd_get,       0 },
+    { "SET",       3, 5,  cmd_set,       1 },
+    { "MGET",      2, -1, cmd_mget,      0 },
+    { "MSET",      3, -1, cmd_mset,      1 },
+    { "DEL",       2, -1, cmd_del,       1 },
+    { "SCAN",      2, -1, cmd_scan,      0 },
+    { "RANGE",     3, -1, cmd_range,     0 },
+    { "EXISTS",    2, -1, cmd_exists,    0 },
+    { "EXPIRE",    3, 3,  cmd_expire,    1 },
+    { "PEXPIREAT", 3, 3,  cmd_pexpireat, 1 },
+    { "TTL",       2, 2,  cmd_ttl,       0 },
+    { "DBSIZE",    1, 1,  cmd_dbsize,    0 },
+    { "INFO",      1, 2,  cmd_info,      0 },
+    { "STATS",     1, 2,  cmd_stats,     0 },
+    { "FLUSHALL",  1, 1,  cmd_flushall,  1 },
+    { "SYNC",      1, 1,  cmd_sync,      0 },
+    { "COMMAND",   1, -1, cmd_command,   0 },
+    { "QUIT",      1, 1,  cmd_quit,      0 },
+};
+
+_Static_assert(sizeof(commands) / sizeof(commands[0]) <= STATS_MAX_OPS, "raise STATS_MAX_OPS");
+
+void dispatch_command(Conn *c, Request *req) {
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        Command *cmd = &commands[i];
+        if (strcasecmp(req->argv[0], cmd->name) != 0) {
+            continue;
+        }
+        if (req->argc < cmd->min_args || (cmd->max_args >= 0 && req->argc > cmd->max_args)) {
+            char message[128];
+            snprintf(message, sizeof(message), "wrong number of arguments for '%s'", cmd->name);
+            reply_error(c, message);
+            return;
+        }
+        // A replica only takes writes from its primary
+        if (cmd->write && server.primary_host && c->role != CONN_PRIMARY) {
+            reply_raw(c, "-READONLY You can't write against a read only replica.\r\n", 56);
+            return;
+        }
+        uint64_t start = now_ns();
+        cmd->handler(c, req);
+        stats_record_op((int)i, now_ns() - start);
+        return;
+    }
+    
+    char message[128];
+    snprintf(message, sizeof(message), "unknown command '%.64s'", req->argv[0]);
+    reply_error(c, message);
+}
+
+// Parse a decimal length terminated by CRLF. Returns the bytes consumed,
+// 0 if the line is incomplete, or -1 on a malformed line.
+long parse_length_line(const char *p, const char *end, long *value) {
+    const char *cr = memchr(p, '\r', end - p);
+    if (!cr || cr + 1 >= end) {
+        return 0;
+    }
+    if (cr[1] != '\n' || cr == p) {
+        return -1;
+    }
+    
+    long n = 0;
+    int negative = *p == '-';
+    for (const char *q = p + negative; q < cr; q++) {
+        if (*q < '0' || *q > '9' || n > MAX_QUERY_LEN) {
+            return -1;
+        }
+        n = n * 10 + (*q - '0');
+    }
+    *value = negative ? -n : n;
+    return cr + 2 - p;
+}
+
+// Parse one command from buf. RESP arrays of bulk strings and plain inline
+// commands are both accepted. Arguments are NUL-terminated in place.
+// Returns the bytes consumed, 0 if more input is needed, or -1 on error.
+long parse_request(char *buf, size_t len, Request *req) {
+    char *p = buf;
+    char *end = buf + len;
+    req->argc = 0;
+    
+    if (len == 0) {
+        return 0;
+    }
+    
+    if (*p != '*') {
+        // Inline command: whitespace-separated words on one line
+        char *nl = memchr(p, '\n', len);
+        if (!nl) {
+            return len > MAX_QUERY_LEN ? -1 : 0;
+        }
+        char *line_end = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+        while (p < line_end && req->argc < MAX_ARGS) {
+            while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+            if (p == line_end) break;
+            char *word = p;
+            while (p < line_end && *p != ' ' && *p != '\t') p++;
+            req->argv[req->argc] = word;
+            req->argl[req->argc] = p - word;
+            req->argc++;
+            *p++ = '\0';
+        }
+        *line_end = '\0';
+        return nl + 1 - buf;
+    }
+    
+    long count;
+    long n = parse_length_line(p + 1, end, &count);
+    if (n <= 0) {
+        return n;
+    }
+    if (count < 0 || count > MAX_ARGS) {
+        return -1;
+    }
+    p += 1 + n;
+    
+    for (long i = 0; i < count; i++) {
+        if (p >= end) {
+            return 0;
+        }
+        if (*p != '$') {
+            return -1;
+        }
+        long arg_len;
+        n = parse_length_line(p + 1, end, &arg_len);
+        if (n <= 0) {
+            return n;
+        }
+        if (arg_len < 0) {
+            return -1;
+        }
+        p += 1 + n;
+        if (end - p < arg_len + 2) {
+            return 0;
+        }
+        if (p[arg_len] != '\r' || p[arg_len + 1] != '\n') {
+            return -1;
+        }
+        p[arg_len] = '\0';
+        req->argv[req->argc] = p;
+        req->argl[req->argc] = arg_len;
+        req->argc++;
+        p += arg_len + 2;
+    }
+    return p - buf;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+void conn_close(Conn *c) {
+    // Replicas are queued by other connections' writes, so unlink it first
+    if (c->pending) {
+        Conn **p = &server.pending;
+        while (*p != c) {
+            p = &(*p)->next_pending;
+        }
+        *p = c->next_pending;
+    }
+    if (c->role == CONN_REPLICA) {
+        Conn **p = &server.replicas;
+        while (*p != c) {
+            p = &(*p)->next_replica;
+        }
+        *p = c->next_replica;
+    }
+    if (c == server.primary) {
+        server.primary = NULL;
+        if (c->sync_file) {
+            fclose(c->sync_file);
+            unlink(REPL_RECV_FILE);
+        }
+        printf("%sWarning:%s Lost the link to the primary; reconnecting.\n", COLOR_YELLOW COLOR_BOLD, COLOR_RESET);
+        fflush(stdout);
+    }
+    
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+// Arm or disarm EPOLLOUT depending on whether replies are still queued
+void conn_update_events(Conn *c) {
+    int want_write = c->out_sent < c->out_len;
+    if (want_write == c->want_write) {
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | (want_write ? EPOLLOUT : 0), .data.ptr = c };
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_write = want_write;
+}
+
+// Send as much of the reply buffer as the socket takes. Returns 0 if the
+// connection was closed.
+int conn_flush(Conn *c) {
+    // Writes buffered for a replica wait until its snapshot is in front of them
+    if (c->role == CONN_REPLICA && c->repl_state != REPL_ONLINE) {
+        if (c->closing) {
+            conn_close(c);
+            return 0;
+        }
+        return 1;
+    }
+    
+    while (c->out_sent < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            conn_close(c);
+            return 0;
+        }
+        c->out_sent += n;
+    }
+    
+    if (c->out_sent == c->out_len) {
+        c->out_sent = c->out_len = 0;
+        if (c->closing) {
+            conn_close(c);
+            return 0;
+        }
+    }
+    conn_update_events(c);
+    return 1;
+}
+
+// Execute every complete command in the input buffer. Replies pile up in
+// the output buffer and go out in one write after the group commit.
+void conn_process_input(Conn *c) {
+    static Request req;
+    size_t off = 0;
+    
+    while (off < c->in_len && !c->closing && c->role == CONN_CLIENT) {
+        long used = parse_request(c->in + off, c->in_len - off, &req);
+        if (used == 0) {
+            break;
+        }
+        if (used < 0) {
+            reply_error(c, "protocol error");
+            c->closing = 1;
+            break;
+        }
+        off += used;
+        if (req.argc > 0) {
+            dispatch_command(c, &req);
+        }
+    }
+    
+    // A replica has nothing more to say once it sent SYNC
+    if (c->role == CONN_REPLICA) {
+        off = c->in_len;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    
+    // A half-closed peer still gets the replies to what it sent
+    if (c->read_eof) {
+        c->closing = 1;
+    }
+    
+    if (c->out_len > 0 || c->closing) {
+        conn_queue(c);
+    }
+}
+
+// Read everything available. Returns 0 if the connection was closed.
+int conn_read(Conn *c) {
+    size_t start = c->in_len;
+    while (1) {
+        // The snapshot from a primary can be huge; take it in slices and let
+        // the event loop come back for more
+        if (c->role == CONN_PRIMARY && c->in_len - start >= REPL_READ_BATCH) {
+            return 1;
+        }
+        if (!buffer_reserve(&c->in, &c->in_cap, c->in_len + READ_CHUNK)) {
+            conn_close(c);
+            return 0;
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n > 0) {
+            c->in_len += n;
+            if (c->in_len > MAX_QUERY_LEN) {
+                conn_close(c);
+                return 0;
+            }
+            continue;
+        }
+        if (n == 0) {
+            c->read_eof = 1;
+            return 1;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        }
+        conn_close(c);
+        return 0;
+    }
+}
+
+// Swap the table for the snapshot received from the primary
+int replica_load_snapshot() {
+    Snapshot snap;
+    if (!snapshot_open(&snap, REPL_RECV_FILE)) {
+        printf("%sError:%s The primary sent an unreadable snapshot.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        unlink(REPL_RECV_FILE);
+        return 0;
+    }
+    
+    // Replicas of this replica were sent the data set being replaced
+    for (Conn *r = server.replicas; r != NULL; r = r->next_replica) {
+        replica_drop(r);
+    }
+    clear_all();
+    uint64_t start = now_ns();
+    int ok = load_mapped_snapshot(&snap);
+    snapshot_close(&snap);
+    timing_record(&persist_stats.load, start);
+    unlink(REPL_RECV_FILE);
+    
+    // Persist the new data set so a restart does not bring back the old one
+    if (!ok || !checkpoint()) {
+        printf("%sError:%s Failed to apply the snapshot from the primary.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 0;
+    }
+    printf("%s✓ Synced%s %zu entries from %s%s:%d%s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET,
+           table_count(table), COLOR_CYAN, server.primary_host, server.primary_port, COLOR_RESET);
+    fflush(stdout);
+    return 1;
+}
+
+// Handle input on the link to the primary: the snapshot's length, then the
+// snapshot itself, then the stream of writes to apply
+void link_process_input(Conn *c) {
+    static Request req;
+    size_t off = 0;
+    
+    if (c->repl_state == LINK_HANDSHAKE) {
+        char *nl = memchr(c->in, '\n', c->in_len);
+        if (nl != NULL) {
+            char *end;
+            long long len = c->in[0] == '$' ? strtoll(c->in + 1, &end, 10) : -1;
+            if (len < 0 || (*end != '\r' && *end != '\n')) {
+                printf("%sError:%s The primary refused to sync: %.*s\n", COLOR_RED COLOR_BOLD, COLOR_RESET,
+                       (int)(nl - c->in), c->in);
+                conn_close(c);
+                return;
+            }
+            c->sync_file = fopen(REPL_RECV_FILE, "wb");
+            if (!c->sync_file) {
+                printf("%sError:%s Cannot write %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, REPL_RECV_FILE);
+                conn_close(c);
+                return;
+            }
+            c->sync_left = len;
+            c->repl_state = LINK_TRANSFER;
+            off = nl + 1 - c->in;
+        }
+    }
+    
+    if (c->repl_state == LINK_TRANSFER) {
+        size_t n = c->in_len - off;
+        if (n > c->sync_left) {
+            n = c->sync_left;
+        }
+        if (n > 0 && fwrite(c->in + off, 1, n, c->sync_file) != n) {
+            conn_close(c);
+            return;
+        }
+        off += n;
+        c->sync_left -= n;
+        if (c->sync_left == 0) {
+            int ok = fclose(c->sync_file) == 0;
+            c->sync_file = NULL;
+            if (!ok || !replica_load_snapshot()) {
+                conn_close(c);
+                return;
+            }
+            c->repl_state = LINK_STREAM;
+        }
+    }
+    
+    if (c->repl_state == LINK_STREAM) {
+        while (off < c->in_len) {
+            long used = parse_request(c->in + off, c->in_len - off, &req);
+            if (used == 0) {
+                break;
+            }
+            if (used < 0) {
+                conn_close(c);
+                return;
+            }
+            off += used;
+            if (req.argc > 0) {
+                // The primary does not read replies
+                dispatch_command(c, &req);
+                c->out_len = 0;
+            }
+        }
+    }
+    
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    if (c->read_eof) {
+        conn_close(c);
+    }
+}
+
+// Connect to the primary and ask for a full sync. The connect blocks, which
+// is fine for the nearby primaries replication is meant for.
+void replica_connect() {
+    server.next_connect = now_ms() + REPL_RETRY_MS;
+    int fd = connect_to_server(server.primary_host, server.primary_port, NULL);
+    if (fd < 0) {
+        return;
+    }
+    
+    static const char sync_cmd[] = "*1\r\n$4\r\nSYNC\r\n";
+    Conn *c = (Conn*)calloc(1, sizeof(Conn));
+    if (!c || write(fd, sync_cmd, sizeof(sync_cmd) - 1) != (ssize_t)(sizeof(sync_cmd) - 1) || !set_nonblocking(fd)) {
+        free(c);
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->role = CONN_PRIMARY;
+    c->repl_state = LINK_HANDSHAKE;
+    
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        free(c);
+        close(fd);
+        return;
+    }
+    server.primary = c;
+}
+
+void server_accept() {
+    while (1) {
+        int fd = accept(server.listen_fd, NULL, NULL);
+        if (fd < 0) {
+            return;
+        }
+        
+        Conn *c = (Conn*)calloc(1, sizeof(Conn));
+        if (!c || !set_nonblocking(fd)) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            free(c);
+            close(fd);
+        }
+    }
+}
+
+// Commit every write made in this loop iteration with one log write, then
+// release the replies that were waiting on it
+void server_commit_and_flush() {
+    // A replica holds whatever its primary holds
+    if (!server.primary_host) {
+        evict_if_needed();
+    }
+    wal_commit();
+    maybe_compact_log();
+    
+    Conn *c = server.pending;
+    server.pending = NULL;
+    while (c != NULL) {
+        Conn *next = c->next_pending;
+        c->pending = 0;
+        c->next_pending = NULL;
+        conn_flush(c);
+        c = next;
+    }
+}
+
+int server_listen(const char *bind_addr, int port, const char *unix_path) {
+    int fd;
+    
+    if (unix_path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(unix_path) >= sizeof(addr.sun_path)) {
+            printf("%sError:%s Socket path is too long.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return -1;
+        }
+        strcpy(addr.sun_path, unix_path);
+        unlink(unix_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            printf("%sError:%s Failed to bind to %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, unix_path);
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+        if (inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1) {
+            printf("%sError:%s Invalid bind address %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, bind_addr);
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            printf("%sError:%s Failed to bind to port %d. Port may be in use.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, port);
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+    }
+    
+    if (listen(fd, SOMAXCONN) != 0 || !set_nonblocking(fd)) {
+        printf("%sError:%s Failed to listen on socket.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Keep the table resident and serve it over TCP or a Unix socket
+int run_server(const char *bind_addr, int port, const char *unix_path) {
+    server.listen_fd = server_listen(bind_addr, port, unix_path);
+    if (server.listen_fd < 0) {
+        return 1;
+    }
+    server.unix_path = unix_path;
+    
+    server.epoll_fd = epoll_create1(0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (server.epoll_fd < 0 || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &ev) != 0) {
+        printf("%sError:%s Failed to create event loop.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        close(server.listen_fd);
+        return 1;
+    }
+    
+    wal.observer = replicate_record;
+    server.commands = commands;
+    server.command_count = sizeof(commands) / sizeof(commands[0]);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_stop_signal);
+    signal(SIGTERM, handle_stop_signal);
+    
+    if (unix_path) {
+        printf("%s✓ Serving%s %zu entries on %s%s%s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET,
+               table_count(table), COLOR_CYAN, unix_path, COLOR_RESET);
+    } else {
+        printf("%s✓ Serving%s %zu entries on %s%s:%d%s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET,
+               table_count(table), COLOR_CYAN, bind_addr, port, COLOR_RESET);
+    }
+    if (server.primary_host) {
+        printf("%s✓ Replicating%s %s%s:%d%s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET,
+               COLOR_CYAN, server.primary_host, server.primary_port, COLOR_RESET);
+    }
+    fflush(stdout);
+    
+    struct epoll_event events[MAX_EVENTS];
+    while (!server_stop) {
+        if (server.primary_host && !server.primary && now_ms() >= server.next_connect) {
+            replica_connect();
+        }
+        
+        // Wake up in time to honor the fsync interval when writes are unsynced,
+        // and often enough to expire keys close to their deadline
+        int timeout = wal.dirty && wal.policy == FSYNC_INTERVAL ? wal.interval_ms : -1;
+        if (table->wheel.count > 0 && (timeout < 0 || timeout > EXPIRE_CYCLE_MS)) {
+            timeout = EXPIRE_CYCLE_MS;
+        }
+        if (server.primary_host && !server.primary && (timeout < 0 || timeout > REPL_RETRY_MS)) {
+            timeout = REPL_RETRY_MS;
+        }
+        int n = epoll_wait(server.epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        cache_tick();
+        expire_cycle();
+        
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &server.sync_fd) {
+                sync_finish();
+                continue;
+            }
+            Conn *c = (Conn*)events[i].data.ptr;
+            if (c == NULL) {
+                server_accept();
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !conn_flush(c)) {
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && conn_read(c)) {
+                if (c->role == CONN_PRIMARY) {
+                    link_process_input(c);
+                } else {
+                    conn_process_input(c);
+                }
+            }
+        }
+        
+        server_commit_and_flush();
+    }
+    
+    printf("\n%s✓ Shutting down.%s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET);
+    close(server.listen_fd);
+    close(server.epoll_fd);
+    if (unix_path) {
+        unlink(unix_path);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Load generator
+// ---------------------------------------------------------------------------
+
+// Client connection driven by the load generator
+typedef struct {
+    int fd;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    long outstanding;     // Requests sent whose replies have not arrived
+} LoadConn;
+
+typedef struct {
+    const char *host;
+    int port;
+    const char *unix_path;
+    int conns;
+    long requests;
+    int pipeline;
+    long keyspace;
+    int get_percent;
+    int value_size;
+} LoadConfig;
+
+// Length of the first complete reply in buf, or 0 if it is incomplete
+size_t reply_length(const char *buf, size_t len) {
+    const char *nl = memchr(buf, '\n', len);
+    if (!nl) {
+        return 0;
+    }
+    size_t line = nl + 1 - buf;
+    if (buf[0] != '$') {
+        return line;
+    }
+    long bulk = atol(buf + 1);
+    if (bulk < 0) {
+        return line;
+    }
+    return len >= line + bulk + 2 ? line + bulk + 2 : 0;
+}
+
+// Queue one pipeline's worth of random GET/SET commands
+void load_fill(LoadConn *lc, const LoadConfig *cfg, long count, const char *value) {
+    static char cmd[MAX_VAL_LEN + 256];
+    
+    lc->out_len = lc->out_sent = 0;
+    for (long i = 0; i < count; i++) {
+        char key[32];
+        int key_len = snprintf(key, sizeof(key), "key:%ld", random() % cfg->keyspace);
+        int len;
+        if (random() % 100 < cfg->get_percent) {
+            len = snprintf(cmd, sizeof(cmd), "*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n", key_len, key);
+        } else {
+            len = snprintf(cmd, sizeof(cmd), "*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n",
+                           key_len, key, cfg->value_size, value);
+        }
+        memcpy(lc->out + lc->out_len, cmd, len);
+        lc->out_len += len;
+    }
+    lc->outstanding = count;
+}
+
+// Write queued requests; EPOLLOUT stays armed only while some are left
+int load_send(LoadConn *lc, int epoll_fd) {
+    while (lc->out_sent < lc->out_len) {
+        ssize_t w = write(lc->fd, lc->out + lc->out_sent, lc->out_len - lc->out_sent);
+        if (w < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return 0;
+        }
+        lc->out_sent += w;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | (lc->out_sent < lc->out_len ? EPOLLOUT : 0), .data.ptr = lc };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, lc->fd, &ev);
+    return 1;
+}
+
+// Drive the server with pipelined requests over several connections
+int run_loadgen(const LoadConfig *cfg) {
+    char *value = (char*)malloc(cfg->value_size + 1);
+    LoadConn *lcs = (LoadConn*)calloc(cfg->conns, sizeof(LoadConn));
+    int epoll_fd = epoll_create1(0);
+    size_t out_cap = (size_t)cfg->pipeline * (cfg->value_size + 96);
+    if (!value || !lcs || epoll_fd < 0) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 1;
+    }
+    memset(value, 'x', cfg->value_size);
+    value[cfg->value_size] = '\0';
+    
+    long sent = 0;
+    for (int i = 0; i < cfg->conns; i++) {
+        LoadConn *lc = &lcs[i];
+        lc->fd = connect_to_server(cfg->host, cfg->port, cfg->unix_path);
+        lc->out = (char*)malloc(out_cap);
+        if (lc->fd < 0 || !lc->out || !set_nonblocking(lc->fd)) {
+            printf("%sError:%s Failed to connect to server.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = lc };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, lc->fd, &ev);
+    }
+    
+    long done = 0;
+    double start = now_seconds();
+    for (int i = 0; i < cfg->conns && sent < cfg->requests; i++) {
+        long batch = cfg->requests - sent < cfg->pipeline ? cfg->requests - sent : cfg->pipeline;
+        load_fill(&lcs[i], cfg, batch, value);
+        sent += batch;
+        load_send(&lcs[i], epoll_fd);
+    }
+    struct epoll_event events[MAX_EVENTS];
+    
+    while (done < cfg->requests) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 5000);
+        if (n <= 0) {
+            printf("%sError:%s Server stopped responding.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            LoadConn *lc = (LoadConn*)events[i].data.ptr;
+            
+            if ((events[i].events & EPOLLOUT) && !load_send(lc, epoll_fd)) {
+                printf("%sError:%s Failed to send to server.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+                return 1;
+            }
+            
+            while (1) {
+                if (!buffer_reserve(&lc->in, &lc->in_cap, lc->in_len + READ_CHUNK)) {
+                    return 1;
+                }
+                ssize_t r = read(lc->fd, lc->in + lc->in_len, lc->in_cap - lc->in_len);
+                if (r == 0) {
+                    printf("%sError:%s Server closed the connection.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+                    return 1;
+                }
+                if (r < 0) break;
+                lc->in_len += r;
+            }
+            
+            // Count complete replies and start the next pipeline once all are in
+            size_t off = 0, used;
+            while (lc->outstanding > 0 && (used = reply_length(lc->in + off, lc->in_len - off)) > 0) {
+                off += used;
+                lc->outstanding--;
+                done++;
+            }
+            memmove(lc->in, lc->in + off, lc->in_len - off);
+            lc->in_len -= off;
+            
+            if (lc->outstanding == 0 && sent < cfg->requests) {
+                long batch = cfg->requests - sent < cfg->pipeline ? cfg->requests - sent : cfg->pipeline;
+                load_fill(lc, cfg, batch, value);
+                sent += batch;
+                load_send(lc, epoll_fd);
+            }
+        }
+    }
+    
+    double elapsed = now_seconds() - start;
+    printf("%s%ld requests%s in %.2fs over %d connections (pipeline %d, %d%% GET)\n",
+           COLOR_BOLD, done, COLOR_RESET, elapsed, cfg->conns, cfg->pipeline, cfg->get_percent);
+    printf("%s%.0f ops/sec%s\n", COLOR_GREEN COLOR_BOLD, done / elapsed, COLOR_RESET);
+    
+    for (int i = 0; i < cfg->conns; i++) {
+        close(lcs[i].fd);
+        free(lcs[i].out);
+        free(lcs[i].in);
+    }
+    free(lcs);
+    free(value);
+    close(epoll_fd);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Benchmarks
+// ---------------------------------------------------------------------------
+
+#define LEGACY_BUCKETS 101
+#define LEGACY_MAX_KEYS 100000  // The chaining table is quadratic beyond this
+#define LEGACY_VAL_LEN 1024
+
+// The original fixed-size chaining table, kept only as a benchmark baseline
+typedef struct LegacyPair {
+    char key[MAX_KEY_LEN];
+    char value[LEGACY_VAL_LEN];
+    struct LegacyPair *next;
+} LegacyPair;
+
+typedef struct {
+    LegacyPair *buckets[LEGACY_BUCKETS];
+} LegacyTable;
+
+void legacy_set(LegacyTable *lt, const char *key, const char *value) {
+    uint32_t index = hash_djb2(key, strlen(key), 0) % LEGACY_BUCKETS;
+    for (LegacyPair *p = lt->buckets[index]; p != NULL; p = p->next) {
+        if (strcmp(p->key, key) == 0) {
+            strncpy(p->value, value, LEGACY_VAL_LEN - 1);
+            return;
+        }
+    }
+    
+    LegacyPair *pair = (LegacyPair*)calloc(1, sizeof(LegacyPair));
+    if (!pair) {
+        return;
+    }
+    strncpy(pair->key, key, MAX_KEY_LEN - 1);
+    strncpy(pair->value, value, LEGACY_VAL_LEN - 1);
+    pair->next = lt->buckets[index];
+    lt->buckets[index] = pair;
+}
+
+const char* legacy_get(LegacyTable *lt, const char *key) {
+    for (LegacyPair *p = lt->buckets[hash_djb2(key, strlen(key), 0) % LEGACY_BUCKETS]; p != NULL; p = p->next) {
+        if (strcmp(p->key, key) == 0) {
+            return p->value;
+        }
+    }
+    return NULL;
+}
+
+void legacy_free(LegacyTable *lt) {
+    for (int i = 0; i < LEGACY_BUCKETS; i++) {
+        LegacyPair *p = lt->buckets[i];
+        while (p != NULL) {
+            LegacyPair *next = p->next;
+            free(p);
+            p = next;
+        }
+    }
+    free(lt);
+}
+
+#define BENCH_KEY_LEN 48
+
+// Fill keys with n distinct keys shaped like typical namespaced keys
+void make_bench_keys(char *keys, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        snprintf(keys + i * BENCH_KEY_LEN, BENCH_KEY_LEN, "user:%zu:%08zx", i, (i * 2654435761u) & 0xffffffff);
+    }
+}
+
+void print_bench_row(size_t n, const char *engine, double insert_s, double lookup_s, size_t bytes) {
+    printf("%10zu  %-10s %12.2f %12.2f %12.1f\n", n, engine,
+           n / insert_s / 1e6, n / lookup_s / 1e6, (double)bytes / n);
+}
+
+// Compare insert and lookup throughput of the table engine and the old chaining table
+int run_table_bench(size_t max_keys) {
+    char *keys = (char*)malloc(max_keys * BENCH_KEY_LEN);
+    if (!keys) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 1;
+    }
+    make_bench_keys(keys, max_keys);
+    
+    printf("%s%10s  %-10s %12s %12s %12s%s\n", COLOR_BOLD,
+           "keys", "engine", "insert Mop/s", "lookup Mop/s", "bytes/key", COLOR_RESET);
+    
+    for (size_t n = 1000; n <= max_keys; n *= 10) {
+        // Open-addressing table
+        table = create_table();
+        if (!table) {
+            free(keys);
+            return 1;
+        }
+        double t0 = now_seconds();
+        for (size_t i = 0; i < n; i++) {
+            set_value(keys + i * BENCH_KEY_LEN, "value");
+        }
+        double t1 = now_seconds();
+        size_t found = 0;
+        for (size_t i = 0; i < n; i++) {
+            found += get_value(keys + i * BENCH_KEY_LEN) != NULL;
+        }
+        double t2 = now_seconds();
+        size_t bytes = table_memory(table);
+        free_table();
+        if (found != n) {
+            printf("%sError:%s Lookup verification failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        }
+        print_bench_row(n, "open-addr", t1 - t0, t2 - t1, bytes);
+        
+        // Chaining baseline
+        if (n > LEGACY_MAX_KEYS) {
+            printf("%10zu  %-10s %12s %12s %12s\n", n, "chaining", "skipped", "skipped", "-");
+            continue;
+        }
+        LegacyTable *lt = (LegacyTable*)calloc(1, sizeof(LegacyTable));
+        if (!lt) {
+            free(keys);
+            return 1;
+        }
+        t0 = now_seconds();
+        for (size_t i = 0; i < n; i++) {
+            legacy_set(lt, keys + i * BENCH_KEY_LEN, "value");
+        }
+        t1 = now_seconds();
+        for (size_t i = 0; i < n; i++) {
+            found += legacy_get(lt, keys + i * BENCH_KEY_LEN) != NULL;
+        }
+        t2 = now_seconds();
+        legacy_free(lt);
+        print_bench_row(n, "chaining", t1 - t0, t2 - t1, sizeof(LegacyTable) + n * sizeof(LegacyPair));
+    }
+    
+    free(keys);
+    return 0;
+}
+
+#define THREAD_BENCH_MAX 64
+#define THREAD_BENCH_MS 300     // Run time of each thread count / mix pair
+
+// Worker of the multithreaded benchmark, padded to its own cache line
+typedef struct {
+    pthread_t thread;
+    const char *keys;
+    size_t num_keys;
+    int read_percent;
+    uint64_t rng;
+    uint64_t ops;
+} __attribute__((aligned(CACHE_LINE))) BenchWorker;
+
+atomic_int bench_stop;
+
+void* bench_worker(void *arg) {
+    BenchWorker *w = (BenchWorker*)arg;
+    char buf[64];
+    uint64_t ops = 0;
+    
+    while (!atomic_load_explicit(&bench_stop, memory_order_relaxed)) {
+        for (int i = 0; i < 256; i++) {
+            uint64_t r = xorshift64(&w->rng);
+            const char *key = w->keys + (r % w->num_keys) * BENCH_KEY_LEN;
+            if ((int)((r >> 40) % 100) < w->read_percent) {
+                get_value_copy(key, buf, sizeof(buf));
+            } else {
+                set_value(key, "updated");
+            }
+        }
+        ops += 256;
+    }
+    w->ops = ops;
+    return NULL;
+}
+
+// Report ops/sec for 1-64 threads at several read/write mixes
+int run_thread_bench(size_t num_keys) {
+    static const int read_mixes[] = { 100, 95, 50 };
+    static BenchWorker workers[THREAD_BENCH_MAX];
+    
+    char *keys = (char*)malloc(num_keys * BENCH_KEY_LEN);
+    table = create_table();
+    if (!keys || !table) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        free(keys);
+        return 1;
+    }
+    make_bench_keys(keys, num_keys);
+    for (size_t i = 0; i < num_keys; i++) {
+        set_value(keys + i * BENCH_KEY_LEN, "value");
+    }
+    
+    printf("%s%zu keys, %d shards, %ld online CPUs%s\n", COLOR_BOLD, num_keys, NUM_SHARDS,
+           sysconf(_SC_NPROCESSORS_ONLN), COLOR_RESET);
+    printf("%s%8s", COLOR_BOLD, "threads");
+    for (size_t m = 0; m < sizeof(read_mixes) / sizeof(read_mixes[0]); m++) {
+        printf("   %3d%% read Mop/s", read_mixes[m]);
+    }
+    printf("%s\n", COLOR_RESET);
+    
+    for (int threads = 1; threads <= THREAD_BENCH_MAX; threads *= 2) {
+        printf("%8d", threads);
+        for (size_t m = 0; m < sizeof(read_mixes) / sizeof(read_mixes[0]); m++) {
+            atomic_store(&bench_stop, 0);
+            for (int t = 0; t < threads; t++) {
+                workers[t].keys = keys;
+                workers[t].num_keys = num_keys;
+                workers[t].read_percent = read_mixes[m];
+                workers[t].rng = 0x9E3779B97F4A7C15ull * (t + 1);
+                workers[t].ops = 0;
+                pthread_create(&workers[t].thread, NULL, bench_worker, &workers[t]);
+            }
+            
+            double start = now_seconds();
+            struct timespec pause = { 0, THREAD_BENCH_MS * 1000000L };
+            nanosleep(&pause, NULL);
+            atomic_store(&bench_stop, 1);
+            
+            uint64_t total = 0;
+            for (int t = 0; t < threads; t++) {
+                pthread_join(workers[t].thread, NULL);
+                total += workers[t].ops;
+            }
+            printf(" %18.2f", total / (now_seconds() - start) / 1e6);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    
+    free_table();
+    free(keys);
+    return 0;
+}
+
+#define SCAN_BENCH_QUERIES 10000
+
+void count_pair(const char *key, const char *value, size_t val_len, void *ctx) {
+    (void)key;
+    (void)value;
+    (void)val_len;
+    (*(size_t*)ctx)++;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Time a batch of random scans and print their latency distribution. A prefix
+// scan reads one user's fields; a range scan reads limit keys from a random user on.
+void bench_scan_queries(const char *name, size_t users, size_t queries, size_t limit, double *latency) {
+    static const char *fields[] = { "age", "city", "email", "name" };
+    uint64_t rng = 0x2545F4914F6CDD1Dull;
+    size_t results = 0;
+    char key[64], cursor[MAX_KEY_LEN];
+    
+    for (size_t q = 0; q < queries; q++) {
+        size_t user = xorshift64(&rng) % users;
+        KeyRange range = {0};
+        if (limit == 0) {
+            snprintf(key, sizeof(key), "user:%08zu:", user);
+            range.prefix = key;
+        } else {
+            snprintf(key, sizeof(key), "user:%08zu:%s", user, fields[0]);
+            range.from = key;
+        }
+        double start = now_seconds();
+        scan_range(table, &range, limit, count_pair, &results, cursor);
+        latency[q] = (now_seconds() - start) * 1e6;
+    }
+    
+    qsort(latency, queries, sizeof(double), compare_doubles);
+    double total = 0;
+    for (size_t q = 0; q < queries; q++) {
+        total += latency[q];
+    }
+    printf("%-22s %10.1f %10.2f %10.2f %10.2f\n", name, (double)results / queries,
+           total / queries, latency[queries / 2], latency[queries * 99 / 100]);
+}
+
+// Prefix and range scan latency over user:<id>:<field> keys, against the
+// full-table filter that is the only option without the ordered index
+int run_scan_bench(size_t num_keys) {
+    static const char *fields[] = { "age", "city", "email", "name" };
+    size_t users = (num_keys + 3) / 4;
+    double *latency = (double*)malloc(SCAN_BENCH_QUERIES * sizeof(double));
+    table = create_table();
+    if (!latency || !table) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        free(latency);
+        return 1;
+    }
+    
+    char key[64];
+    double start = now_seconds();
+    for (size_t i = 0; i < users * 4; i++) {
+        snprintf(key, sizeof(key), "user:%08zu:%s", i / 4, fields[i % 4]);
+        set_value(key, "value");
+    }
+    double insert_s = now_seconds() - start;
+    
+    start = now_seconds();
+    if (!ordered_build(table)) {
+        free_table();
+        free(latency);
+        return 1;
+    }
+    double build_s = now_seconds() - start;
+    
+    size_t index_bytes = 0;
+    for (SkipNode *node = table->ordered.head; node; node = node->next[0]) {
+        index_bytes += sizeof(SkipNode) + node->level * sizeof(SkipNode*) + node->key_len + 1;
+    }
+    
+    // Inserts now also maintain the index
+    size_t extra = users / 10 ? users / 10 : 1;
+    start = now_seconds();
+    for (size_t i = 0; i < extra; i++) {
+        snprintf(key, sizeof(key), "user:%08zu:zip", i * 10);
+        set_value(key, "value");
+    }
+    double indexed_s = now_seconds() - start;
+    
+    printf("%s%zu keys (%zu users x 4 fields)%s\n", COLOR_BOLD, users * 4, users, COLOR_RESET);
+    printf("Index build: %.2f s, %.1f bytes/key\n", build_s, (double)index_bytes / (users * 4));
+    printf("Inserts: %.2f Mop/s without the index, %.2f Mop/s maintaining it\n\n",
+           users * 4 / insert_s / 1e6, extra / indexed_s / 1e6);
+    
+    printf("%s%-22s %10s %10s %10s %10s%s\n", COLOR_BOLD,
+           "query", "results", "avg us", "p50 us", "p99 us", COLOR_RESET);
+    bench_scan_queries("scan user:<id>:", users, SCAN_BENCH_QUERIES, 0, latency);
+    bench_scan_queries("range, limit 10", users, SCAN_BENCH_QUERIES, 10, latency);
+    bench_scan_queries("range, limit 100", users, SCAN_BENCH_QUERIES, 100, latency);
+    bench_scan_queries("range, limit 1000", users, SCAN_BENCH_QUERIES / 10, 1000, latency);
+    
+    // What a prefix query costs without an ordered index: filter every key
+    size_t queries = 10;
+    start = now_seconds();
+    size_t matches = 0;
+    for (size_t q = 0; q < queries; q++) {
+        snprintf(key, sizeof(key), "user:%08zu:", q * (users / queries));
+        size_t len = strlen(key);
+        TableIter it = {0};
+        Record *rec;
+        while ((rec = table_next(table, &it)) != NULL) {
+            matches += strncmp(record_key(rec), key, len) == 0;
+        }
+    }
+    printf("%-22s %10.1f %10.2f\n", "full-table filter", (double)matches / queries,
+           (now_seconds() - start) * 1e6 / queries);
+    
+    free_table();
+    free(latency);
+    return 0;
+}
+
+#define SNAPSHOT_BENCH_FILE "kvstore-bench.dat"
+#define SNAPSHOT_BENCH_TMP_FILE "kvstore-bench.dat.tmp"
+#define SNAPSHOT_BENCH_LOOKUPS 10000
+
+// Save, load and probe a snapshot of the current table with compression on
+// or off, and print one row of results. data_bytes is the size of the
+// records before compression.
+int bench_snapshot_format(const char *name, int compress, size_t num_keys, size_t data_bytes) {
+    compress_snapshots = compress;
+    double start = now_seconds();
+    if (!save_snapshot(SNAPSHOT_BENCH_FILE, SNAPSHOT_BENCH_TMP_FILE)) {
+        return 0;
+    }
+    double save_s = now_seconds() - start;
+    
+    Snapshot snap;
+    if (!snapshot_open(&snap, SNAPSHOT_BENCH_FILE)) {
+        unlink(SNAPSHOT_BENCH_FILE);
+        return 0;
+    }
+    size_t data_region = snap.header->index_offset - snap.header->data_offset;
+    
+    // Load into a fresh table, as startup would
+    HashTable *saved = table;
+    table = create_table();
+    start = now_seconds();
+    int loaded = table && load_mapped_snapshot(&snap) && table_count(table) == num_keys;
+    double load_s = now_seconds() - start;
+    free_table();
+    table = saved;
+    
+    uint64_t rng = 0x2545F4914F6CDD1Dull;
+    char key[64];
+    int64_t expire_at;
+    size_t found = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < SNAPSHOT_BENCH_LOOKUPS; i++) {
+        snprintf(key, sizeof(key), "user:%zu", (size_t)(xorshift64(&rng) % num_keys));
+        found += snapshot_find(&snap, key, &expire_at) != NULL;
+    }
+    double lookup_s = now_seconds() - start;
+    snapshot_close(&snap);
+    unlink(SNAPSHOT_BENCH_FILE);
+    
+    if (!loaded || found != SNAPSHOT_BENCH_LOOKUPS) {
+        printf("%sError:%s Snapshot verification failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 0;
+    }
+    printf("%-8s %10.1f %8.2fx %12.1f %12.1f %12.2f\n", name, data_region / 1e6,
+           (double)data_bytes / data_region, data_bytes / save_s / 1e6, data_bytes / load_s / 1e6,
+           lookup_s * 1e6 / SNAPSHOT_BENCH_LOOKUPS);
+    return 1;
+}
+
+// Compare block-compressed snapshots with uncompressed ones for JSON-like
+// values: size of the record region, save and load throughput, and the cost
+// of a point lookup through the on-disk index
+int run_snapshot_bench(size_t num_keys) {
+    static const char *plans[] = { "free", "pro", "team", "enterprise" };
+    static const char *tags[] = { "beta", "admin", "mobile", "eu", "us", "trial" };
+    table = create_table();
+    if (!table) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 1;
     }
     
-    if (strlen(value) >= MAX_VAL_LEN) {
-        printf("%sError:%s Value length must be less than %d characters.\n", 
-               COLOR_RED COLOR_BOLD, COLOR_RESET, MAX_VAL_LEN);
-        return 0;
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    char key[64], value[512];
+    size_t data_bytes = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "user:%zu", i);
+        int len = snprintf(value, sizeof(value),
+                           "{\"id\":%zu,\"name\":\"user%zu\",\"email\":\"user%zu@example.com\",\"plan\":\"%s\","
+                           "\"active\":%s,\"score\":%u,\"tags\":[\"%s\",\"%s\"]}",
+                           i, i, i, plans[xorshift64(&rng) % 4], xorshift64(&rng) % 2 ? "true" : "false",
+                           (unsigned)(xorshift64(&rng) % 1000), tags[xorshift64(&rng) % 6], tags[xorshift64(&rng) % 6]);
+        set_value(key, value);
+        data_bytes += SNAPSHOT_RECORD_HEAD + strlen(key) + 1 + len + 1;
     }
     
-    uint32_t index = hash(key);
-    KVPair *current = table->buckets[index];
+    printf("%s%zu keys, %.1f MB of records%s\n", COLOR_BOLD, num_keys, data_bytes / 1e6, COLOR_RESET);
+    printf("%s%-8s %10s %9s %12s %12s %12s%s\n", COLOR_BOLD,
+           "blocks", "data MB", "ratio", "save MB/s", "load MB/s", "lookup us", COLOR_RESET);
+    int ok = bench_snapshot_format("raw", 0, num_keys, data_bytes) &&
+             bench_snapshot_format("lz4", 1, num_keys, data_bytes);
     
-    // Check if key already exists
-    while (current != NULL) {
-        if (strcmp(current->key, key) == 0) {
-            // Update existing value
-            strncpy(current->value, value, MAX_VAL_LEN - 1);
-            current->value[MAX_VAL_LEN - 1] = '\0';
-            return 1;
-        }
-        current = current->next;
+    free_table();
+    return ok ? 0 : 1;
+}
+
+#define HASH_BENCH_KEYS 4096  // Keys per length in the speed test; small enough to stay in cache
+#define NUM_HASH_FUNCTIONS (sizeof(HASH_FUNCTIONS) / sizeof(HASH_FUNCTIONS[0]))
+
+// CPU timestamp counter where there is one, so the speed test can report
+// cycles as well as nanoseconds
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Chi-squared statistic of hashes spread over buckets, divided by its
+// expected value: about 1.0 for a uniform hash, larger for clustering
+double bucket_chi2(const uint32_t *hashes, size_t n, uint32_t *counts, size_t buckets, int shift) {
+    memset(counts, 0, buckets * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        counts[(hashes[i] >> shift) & (buckets - 1)]++;
     }
-    
-    // Key doesn't exist, create new pair
-    KVPair *new_pair = create_pair(key, value);
-    if (!new_pair) {
-        printf("%sError:%s Failed to create key-value pair.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
-        return 0;
+    double expected = (double)n / buckets, chi2 = 0;
+    for (size_t b = 0; b < buckets; b++) {
+        double d = counts[b] - expected;
+        chi2 += d * d / expected;
     }
-    
-    // Insert at head of chain
-    new_pair->next = table->buckets[index];
-    table->buckets[index] = new_pair;
-    table->count++;
-    
-    return 1;
+    return chi2 / (buckets - 1);
 }
 
-// Get value by key
-const char* get_value(const char *key) {
-    if (!table || !key) {
-        return NULL;
+// Hash num_keys keys of three shapes with every hash function and report how
+// evenly they land in slots (low bits) and shards (top bits), and how many
+// full 32-bit hashes collide
+void bench_hash_distribution(size_t num_keys) {
+    static const char *shapes[] = { "user:<id>:<hex>", "<id>", "session:<pad>:<id>" };
+    size_t slots = 1;
+    while (slots < num_keys) {
+        slots *= 2;
+    }
+    uint32_t *hashes = (uint32_t*)malloc(num_keys * sizeof(uint32_t));
+    uint32_t *counts = (uint32_t*)malloc(slots * sizeof(uint32_t));
+    if (!hashes || !counts) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        free(hashes);
+        free(counts);
+        return;
     }
     
-    uint32_t index = hash(key);
-    KVPair *current = table->buckets[index];
-    
-    while (current != NULL) {
-        if (strcmp(current->key, key) == 0) {
-            return current->value;
+    printf("\n%s%-20s %-10s %12s %12s %10s %12s%s\n", COLOR_BOLD,
+           "keys", "hash", "slot chi2", "shard chi2", "max slot", "collisions", COLOR_RESET);
+    for (size_t shape = 0; shape < sizeof(shapes) / sizeof(shapes[0]); shape++) {
+        for (size_t f = 0; f < NUM_HASH_FUNCTIONS; f++) {
+            char key[BENCH_KEY_LEN];
+            for (size_t i = 0; i < num_keys; i++) {
+                int len;
+                if (shape == 0) {
+                    len = snprintf(key, sizeof(key), "user:%zu:%08zx", i, (i * 2654435761u) & 0xffffffff);
+                } else if (shape == 1) {
+                    len = snprintf(key, sizeof(key), "%zu", i);
+                } else {
+                    len = snprintf(key, sizeof(key), "session:0000000000000000:%zu", i);
+                }
+                hashes[i] = HASH_FUNCTIONS[f].fn(key, len, hash_seed);
+            }
+            
+            double slot_chi2 = bucket_chi2(hashes, num_keys, counts, slots, 7);
+            uint32_t max_slot = 0;
+            for (size_t b = 0; b < slots; b++) {
+                max_slot = counts[b] > max_slot ? counts[b] : max_slot;
+            }
+            double shard_chi2 = bucket_chi2(hashes, num_keys, counts, NUM_SHARDS, 32 - SHARD_BITS);
+            
+            qsort(hashes, num_keys, sizeof(uint32_t), compare_u32);
+            size_t collisions = 0;
+            for (size_t i = 1; i < num_keys; i++) {
+                collisions += hashes[i] == hashes[i - 1];
+            }
+            printf("%-20s %-10s %12.2f %12.2f %10u %12zu\n", shapes[shape], HASH_FUNCTIONS[f].name,
+                   slot_chi2, shard_chi2, max_slot, collisions);
         }
-        current = current->next;
     }
+    // Collisions a perfect 32-bit hash would still produce
+    printf("(a uniform hash averages %.0f collisions and chi2 near 1.0)\n",
+           (double)num_keys * (num_keys - 1) / 2 / 4294967296.0);
     
-    return NULL;
+    free(hashes);
+    free(counts);
 }
 
-// Delete a key-value pair
-int delete_value(const char *key) {
-    if (!table || !key) {
-        return 0;
+// Time every hash function over keys of increasing length, then compare
+// how well they spread real-looking keys
+int run_hash_bench(size_t num_keys) {
+    static const size_t lengths[] = { 4, 8, 16, 32, 64, 128, 255 };
+    char *keys = (char*)malloc(HASH_BENCH_KEYS * MAX_KEY_LEN);
+    if (!keys) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 1;
+    }
+    uint64_t rng = 0x2545F4914F6CDD1Dull;
+    for (size_t i = 0; i < HASH_BENCH_KEYS * MAX_KEY_LEN; i++) {
+        keys[i] = 'a' + xorshift64(&rng) % 26;
     }
     
-    uint32_t index = hash(key);
-    KVPair *current = table->buckets[index];
-    KVPair *prev = NULL;
+    printf("%s%-8s", COLOR_BOLD, "key len");
+    for (size_t f = 0; f < NUM_HASH_FUNCTIONS; f++) {
+        printf(" %11s ns %6s cyc", HASH_FUNCTIONS[f].name, "");
+    }
+    printf("%s\n", COLOR_RESET);
     
-    while (current != NULL) {
-        if (strcmp(current->key, key) == 0) {
-            if (prev == NULL) {
-                // First in chain
-                table->buckets[index] = current->next;
-            } else {
-                prev->next = current->next;
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        printf("%-8zu", lengths[l]);
+        for (size_t f = 0; f < NUM_HASH_FUNCTIONS; f++) {
+            HashFn fn = HASH_FUNCTIONS[f].fn;
+            size_t rounds = 1 + (1u << 22) / (HASH_BENCH_KEYS * (lengths[l] + 16));
+            volatile uint32_t sink = 0;
+            uint32_t acc = 0;
+            
+            double start = now_seconds();
+            uint64_t c0 = read_cycles();
+            for (size_t r = 0; r < rounds; r++) {
+                for (size_t i = 0; i < HASH_BENCH_KEYS; i++) {
+                    acc ^= fn(keys + i * MAX_KEY_LEN, lengths[l], hash_seed);
+                }
             }
-            free(current);
-            table->count--;
-            return 1;
+            uint64_t cycles = read_cycles() - c0;
+            double elapsed = now_seconds() - start;
+            sink = acc;
+            (void)sink;
+            
+            double hashed = (double)rounds * HASH_BENCH_KEYS;
+            printf(" %14.2f %10.1f", elapsed * 1e9 / hashed, cycles / hashed);
         }
-        prev = current;
-        current = current->next;
+        printf("\n");
     }
     
+    bench_hash_distribution(num_keys);
+    free(keys);
     return 0;
 }
 
-// List all key-value pairs
-void list_all() {
-    if (!table) {
-        return;
+// ---------------------------------------------------------------------------
+// YCSB workloads
+// ---------------------------------------------------------------------------
+// The core workloads of the Yahoo! Cloud Serving Benchmark, run in process
+// against the table API. Each run starts from a freshly loaded table, and
+// the key choices, values and hash seed all come from --seed, so two runs
+// of the same build differ only by timing noise.
+
+#define YCSB_ZIPF_THETA 0.99    // YCSB's default skew
+#define YCSB_MAX_SCAN 100       // Scan lengths are uniform in 1..100
+
+enum { YCSB_READ, YCSB_UPDATE, YCSB_INSERT, YCSB_SCAN, YCSB_RMW, YCSB_NUM_OPS };
+
+static const char *YCSB_OP_NAMES[YCSB_NUM_OPS] = { "read", "update", "insert", "scan", "read-modify-write" };
+
+// Percent of operations of each kind
+typedef struct {
+    char name;
+    const char *description;
+    int mix[YCSB_NUM_OPS];
+    int latest;           // Reads favor the newest keys (workload D)
+} YcsbWorkload;
+
+static const YcsbWorkload YCSB_WORKLOADS[] = {
+    { 'A', "update heavy",      { 50, 50, 0, 0, 0 },  0 },
+    { 'B', "read mostly",       { 95, 5, 0, 0, 0 },   0 },
+    { 'C', "read only",         { 100, 0, 0, 0, 0 },  0 },
+    { 'D', "read latest",       { 95, 0, 5, 0, 0 },   1 },
+    { 'E', "short ranges",      { 0, 0, 5, 95, 0 },   0 },
+    { 'F', "read-modify-write", { 50, 0, 0, 0, 50 },  0 },
+};
+
+// Zipfian ranks in [0, n) after Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases", as YCSB draws them
+typedef struct {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} Zipfian;
+
+void zipf_init(Zipfian *z, uint64_t n, double theta) {
+    double zeta2 = 1 + pow(0.5, theta);
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+        z->zetan += 1 / pow((double)i, theta);
     }
-    
-    if (table->count == 0) {
-        printf("%sNo entries in store.%s\n", COLOR_YELLOW, COLOR_RESET);
-        return;
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+uint64_t zipf_next(const Zipfian *z, uint64_t *rng) {
+    double u = (xorshift64(rng) >> 11) * (1.0 / 9007199254740992.0);
+    double uz = u * z->zetan;
+    if (uz < 1) {
+        return 0;
     }
-    
-    printf("\n%s%s--- Key-Value Store (%d entries) ---%s\n", COLOR_BOLD, COLOR_CYAN, table->count, COLOR_RESET);
-    
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        KVPair *current = table->buckets[i];
-        while (current != NULL) {
-            printf("%s%s%s: %s%s%s\n", 
-                   COLOR_YELLOW COLOR_BOLD, current->key, COLOR_RESET,
-                   COLOR_CYAN, current->value, COLOR_RESET);
-            current = current->next;
-        }
+    if (uz < 1 + pow(0.5, z->theta)) {
+        return 1;
     }
-    printf("\n");
+    uint64_t rank = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
 }
 
-// Clear all entries
-void clear_all() {
-    if (!table) {
-        return;
+// FNV-1a over the eight bytes of a number. YCSB uses it to scatter key
+// numbers, so consecutive inserts and popular ranks land all over the key
+// space instead of next to each other.
+static inline uint64_t fnv64(uint64_t v) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (int i = 0; i < 8; i++) {
+        h = (h ^ (v & 0xff)) * 0x100000001B3ull;
+        v >>= 8;
     }
-    
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        KVPair *current = table->buckets[i];
-        while (current != NULL) {
-            KVPair *next = current->next;
-            free(current);
-            current = next;
-        }
-        table->buckets[i] = NULL;
+    return h;
+}
+
+static inline void ycsb_key(char *key, uint64_t n) {
+    snprintf(key, 32, "user%llu", (unsigned long long)fnv64(n));
+}
+
+// Vary the head of the value so every write stores something new
+static inline void ycsb_value(char *value, uint64_t *rng) {
+    uint64_t r = xorshift64(rng);
+    for (int i = 0; i < 8 && value[i] != '\0'; i++) {
+        value[i] = 'a' + (r >> (i * 5)) % 26;
     }
-    table->count = 0;
 }
 
-// Save hash table to disk
-int save_to_disk() {
-    FILE *f = fopen(STORAGE_FILE, "wb");
-    if (!f) {
-        printf("%sError:%s Failed to open storage file for writing.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+typedef struct {
+    size_t records;
+    size_t operations;
+    size_t value_size;
+    uint64_t seed;
+    const char *workloads;
+    int zipfian;          // Run with zipfian keys
+    int uniform;          // Run with uniform keys
+    const char *json_path;
+    const char *label;
+} YcsbConfig;
+
+// Outcome of one workload under one key distribution
+typedef struct {
+    const YcsbWorkload *workload;
+    int zipfian;
+    double load_s;
+    double run_s;
+    LatencyHist ops[YCSB_NUM_OPS];
+} YcsbResult;
+
+// Load a fresh table, then run the workload's operation mix
+int ycsb_run(const YcsbConfig *cfg, const YcsbWorkload *wl, int zipfian, const Zipfian *zipf, YcsbResult *res) {
+    uint64_t rng = cfg->seed * 0x9E3779B97F4A7C15ull + 1;
+    char key[32];
+    char *value = (char*)malloc(cfg->value_size + 1);
+    static char buf[MAX_VAL_LEN];
+    table = create_table();
+    if (!value || !table) {
+        free(value);
+        free_table();
         return 0;
     }
+    memset(value, 'x', cfg->value_size);
+    value[cfg->value_size] = '\0';
     
-    // Write count
-    fwrite(&table->count, sizeof(int), 1, f);
+    memset(res, 0, sizeof(*res));
+    res->workload = wl;
+    res->zipfian = zipfian;
     
-    // Write all key-value pairs
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        KVPair *current = table->buckets[i];
-        while (current != NULL) {
-            // Write key length, key, value length, value
-            uint16_t key_len = strlen(current->key);
-            uint16_t val_len = strlen(current->value);
-            
-            fwrite(&key_len, sizeof(uint16_t), 1, f);
-            fwrite(current->key, sizeof(char), key_len, f);
-            fwrite(&val_len, sizeof(uint16_t), 1, f);
-            fwrite(current->value, sizeof(char), val_len, f);
-            
-            current = current->next;
+    double start = now_seconds();
+    table_reserve(table, cfg->records + cfg->operations / 10);
+    for (size_t i = 0; i < cfg->records; i++) {
+        ycsb_key(key, i);
+        ycsb_value(value, &rng);
+        set_value(key, value);
+    }
+    if (wl->mix[YCSB_SCAN] > 0 && !ordered_build(table)) {
+        free(value);
+        free_table();
+        return 0;
+    }
+    res->load_s = now_seconds() - start;
+    
+    uint64_t count = cfg->records;
+    size_t results = 0;
+    char cursor[MAX_KEY_LEN];
+    start = now_seconds();
+    for (size_t i = 0; i < cfg->operations; i++) {
+        int dice = (int)(xorshift64(&rng) % 100);
+        int op = 0;
+        while (op < YCSB_NUM_OPS - 1 && dice >= wl->mix[op]) {
+            dice -= wl->mix[op];
+            op++;
+        }
+        
+        // Pick the key before the clock starts; inserts always take a new one
+        uint64_t n;
+        if (op == YCSB_INSERT) {
+            n = count++;
+        } else if (!zipfian) {
+            n = xorshift64(&rng) % count;
+        } else if (wl->latest) {
+            uint64_t back = zipf_next(zipf, &rng);
+            n = back < count ? count - 1 - back : 0;
+        } else {
+            n = fnv64(zipf_next(zipf, &rng)) % count;
+        }
+        ycsb_key(key, n);
+        if (op != YCSB_READ && op != YCSB_SCAN) {
+            ycsb_value(value, &rng);
+        }
+        size_t scan_len = op == YCSB_SCAN ? 1 + xorshift64(&rng) % YCSB_MAX_SCAN : 0;
+        
+        uint64_t t0 = now_ns();
+        switch (op) {
+            case YCSB_READ:
+                get_value_copy(key, buf, sizeof(buf));
+                break;
+            case YCSB_UPDATE:
+            case YCSB_INSERT:
+                set_value(key, value);
+                break;
+            case YCSB_SCAN: {
+                KeyRange range = { .from = key };
+                scan_range(table, &range, scan_len, count_pair, &results, cursor);
+                break;
+            }
+            case YCSB_RMW:
+                get_value_copy(key, buf, sizeof(buf));
+                set_value(key, value);
+                break;
         }
+        hist_record(&res->ops[op], now_ns() - t0);
     }
+    res->run_s = now_seconds() - start;
     
-    fclose(f);
+    free(value);
+    free_table();
     return 1;
 }
 
-// Load hash table from disk
-int load_from_disk() {
-    FILE *f = fopen(STORAGE_FILE, "rb");
-    if (!f) {
-        // File doesn't exist yet, that's okay
-        return 0;
+const char* ycsb_distribution(const YcsbResult *res) {
+    return res->zipfian ? (res->workload->latest ? "latest" : "zipfian") : "uniform";
+}
+
+void ycsb_print(FILE *out, const YcsbResult *res) {
+    int first = 1;
+    for (int op = 0; op < YCSB_NUM_OPS; op++) {
+        const LatencyHist *h = &res->ops[op];
+        if (h->total == 0) {
+            continue;
+        }
+        if (first) {
+            size_t total = 0;
+            for (int i = 0; i < YCSB_NUM_OPS; i++) {
+                total += res->ops[i].total;
+            }
+            fprintf(out, "%-3c %-8s %10.0f", res->workload->name, ycsb_distribution(res), total / res->run_s);
+        } else {
+            fprintf(out, "%-3s %-8s %10s", "", "", "");
+        }
+        first = 0;
+        fprintf(out, "  %-18s %9.2f %9.2f %9.2f %9.2f\n", YCSB_OP_NAMES[op],
+               hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.99) / 1e3,
+               hist_quantile(h, 0.999) / 1e3, h->max_ns / 1e3);
     }
-    
-    int count;
-    if (fread(&count, sizeof(int), 1, f) != 1) {
-        fclose(f);
+}
+
+// Write every result as one JSON document, for diffing runs across commits
+int ycsb_write_json(const YcsbConfig *cfg, const YcsbResult *results, size_t count) {
+    FILE *f = strcmp(cfg->json_path, "-") == 0 ? stdout : fopen(cfg->json_path, "w");
+    if (!f) {
+        printf("%sError:%s Cannot write %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, cfg->json_path);
         return 0;
     }
     
-    for (int i = 0; i < count; i++) {
-        uint16_t key_len, val_len;
-        
-        if (fread(&key_len, sizeof(uint16_t), 1, f) != 1) break;
-        if (key_len >= MAX_KEY_LEN) {
-            fclose(f);
-            return 0;
+    fprintf(f, "{\n  \"benchmark\": \"ycsb\",\n  \"label\": ");
+    write_json_string(f, cfg->label, strlen(cfg->label));
+    fprintf(f, ",\n  \"records\": %zu,\n  \"operations\": %zu,\n  \"value_size\": %zu,\n"
+            "  \"seed\": %llu,\n  \"threads\": 1,\n  \"results\": [",
+            cfg->records, cfg->operations, cfg->value_size, (unsigned long long)cfg->seed);
+    for (size_t r = 0; r < count; r++) {
+        const YcsbResult *res = &results[r];
+        size_t total = 0;
+        for (int op = 0; op < YCSB_NUM_OPS; op++) {
+            total += res->ops[op].total;
         }
-        
-        char key[MAX_KEY_LEN];
-        if (fread(key, sizeof(char), key_len, f) != key_len) break;
-        key[key_len] = '\0';
-        
-        if (fread(&val_len, sizeof(uint16_t), 1, f) != 1) break;
-        if (val_len >= MAX_VAL_LEN) {
-            fclose(f);
-            return 0;
+        fprintf(f, "%s\n    {\n      \"workload\": \"%c\",\n      \"distribution\": \"%s\",\n"
+                "      \"load_ops_per_sec\": %.0f,\n      \"ops_per_sec\": %.0f,\n      \"latency_us\": {",
+                r ? "," : "", res->workload->name, ycsb_distribution(res),
+                cfg->records / res->load_s, total / res->run_s);
+        int first = 1;
+        for (int op = 0; op < YCSB_NUM_OPS; op++) {
+            const LatencyHist *h = &res->ops[op];
+            if (h->total == 0) {
+                continue;
+            }
+            fprintf(f, "%s\n        \"%s\": { \"count\": %llu, \"mean\": %.3f, \"p50\": %.3f, "
+                    "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }",
+                    first ? "" : ",", YCSB_OP_NAMES[op], (unsigned long long)h->total,
+                    h->sum_ns / 1e3 / h->total, hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.99) / 1e3,
+                    hist_quantile(h, 0.999) / 1e3, h->max_ns / 1e3);
+            first = 0;
         }
-        
-        char value[MAX_VAL_LEN];
-        if (fread(value, sizeof(char), val_len, f) != val_len) break;
-        value[val_len] = '\0';
-        
-        set_value(key, value);
+        fprintf(f, "\n      }\n    }");
     }
+    fprintf(f, "\n  ]\n}\n");
     
-    fclose(f);
-    return 1;
+    int ok = f == stdout ? fflush(f) == 0 : fclose(f) == 0;
+    if (!ok) {
+        printf("%sError:%s Failed to write %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, cfg->json_path);
+    }
+    return ok;
 }
 
-// Free all memory
-void free_table() {
-    if (!table) {
-        return;
+// bench ycsb [records] [--ops n] [--workloads ABCDEF] [--dist zipfian|uniform|both]
+//            [--value-size n] [--seed n] [--json path] [--label text]
+int run_ycsb_bench(size_t records, int argc, char *argv[]) {
+    YcsbConfig cfg = { records, 1000000, 100, 42, "ABCDEF", 1, 1, NULL, "" };
+    for (int i = 3; i < argc; i++) {
+        const char *opt = argv[i];
+        if (opt[0] != '-') {
+            continue;     // The record count
+        }
+        if (i + 1 >= argc) {
+            printf("%sError:%s Missing value for %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, opt);
+            return 1;
+        }
+        const char *arg = argv[++i];
+        if (strcmp(opt, "--ops") == 0) cfg.operations = strtoull(arg, NULL, 10);
+        else if (strcmp(opt, "--workloads") == 0) cfg.workloads = arg;
+        else if (strcmp(opt, "--value-size") == 0) cfg.value_size = strtoull(arg, NULL, 10);
+        else if (strcmp(opt, "--seed") == 0) cfg.seed = strtoull(arg, NULL, 10);
+        else if (strcmp(opt, "--json") == 0) cfg.json_path = arg;
+        else if (strcmp(opt, "--label") == 0) cfg.label = arg;
+        else if (strcmp(opt, "--dist") == 0) {
+            cfg.zipfian = strcmp(arg, "zipfian") == 0 || strcmp(arg, "both") == 0;
+            cfg.uniform = strcmp(arg, "uniform") == 0 || strcmp(arg, "both") == 0;
+        } else {
+            printf("%sError:%s Unknown option %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, opt);
+            return 1;
+        }
+    }
+    if (cfg.operations == 0 || cfg.value_size >= MAX_VAL_LEN || (!cfg.zipfian && !cfg.uniform)) {
+        printf("%sError:%s Invalid YCSB options.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 1;
     }
     
-    clear_all();
-    free(table);
-    table = NULL;
+    // A fixed seed keeps the table layout, and so probe lengths, the same
+    hash_seed = cfg.seed;
+    
+    size_t num_workloads = sizeof(YCSB_WORKLOADS) / sizeof(YCSB_WORKLOADS[0]);
+    YcsbResult *results = (YcsbResult*)calloc(num_workloads * 2, sizeof(YcsbResult));
+    if (!results) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+        return 1;
+    }
+    Zipfian zipf;
+    zipf_init(&zipf, records, YCSB_ZIPF_THETA);
+    
+    // The JSON may go to stdout, so the table goes to stderr then
+    FILE *out = cfg.json_path && strcmp(cfg.json_path, "-") == 0 ? stderr : stdout;
+    fprintf(out, "%s%zu records, %zu operations per run, %zu-byte values, seed %llu%s\n", COLOR_BOLD,
+            cfg.records, cfg.operations, cfg.value_size, (unsigned long long)cfg.seed, COLOR_RESET);
+    fprintf(out, "%s%-3s %-8s %10s  %-18s %9s %9s %9s %9s%s\n", COLOR_BOLD,
+            "wl", "keys", "ops/s", "operation", "p50 us", "p99 us", "p999 us", "max us", COLOR_RESET);
+    fflush(out);
+    
+    size_t count = 0;
+    int ok = 1;
+    for (size_t w = 0; w < num_workloads && ok; w++) {
+        const YcsbWorkload *wl = &YCSB_WORKLOADS[w];
+        if (!strchr(cfg.workloads, wl->name) && !strchr(cfg.workloads, tolower((unsigned char)wl->name))) {
+            continue;
+        }
+        for (int zipfian = 1; zipfian >= 0 && ok; zipfian--) {
+            if (zipfian ? !cfg.zipfian : !cfg.uniform) {
+                continue;
+            }
+            ok = ycsb_run(&cfg, wl, zipfian, &zipf, &results[count]);
+            if (ok) {
+                ycsb_print(out, &results[count]);
+                fflush(out);
+                count++;
+            }
+        }
+    }
+    
+    if (!ok) {
+        printf("%sError:%s Memory allocation failed.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+    } else if (cfg.json_path) {
+        ok = ycsb_write_json(&cfg, results, count);
+    }
+    free(results);
+    return ok ? 0 : 1;
 }
 
 // Print usage information
 void print_usage(const char *progname) {
     printf("%sUsage:%s\n", COLOR_BOLD COLOR_CYAN, COLOR_RESET);
-    printf("  %s%s set <key> <value>%s    - Set or update a key-value pair\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s set <key> <value> [EX <s>|PX <ms>]%s - Set or update a key-value pair\n", COLOR_YELLOW, progname, COLOR_RESET);
     printf("  %s%s get <key>%s            - Get value for a key\n", COLOR_YELLOW, progname, COLOR_RESET);
     printf("  %s%s delete <key>%s         - Delete a key-value pair\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s expire <key> <s>%s     - Delete a key after s seconds\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s ttl <key>%s            - Show the seconds left before a key expires\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s mset <k> <v> [<k> <v> ...]%s - Set several pairs at once\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s mget <key> [key ...]%s - Get several values, one per line\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s mdel <key> [key ...]%s - Delete several keys\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s import [file|-]%s      - Bulk-load pairs from a file or stdin\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s export [file|-]%s      - Write all pairs to a file or stdout\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("      --format tsv|jsonl  (default: from the file extension, else tsv)\n");
+    printf("  %s%s scan <prefix> [limit]%s - List pairs whose key starts with prefix, in key order\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s range <from> <to> [limit]%s - List pairs with from <= key <= to, in key order\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("      --after <cursor>  (resume a scan or range cut short by its limit)\n");
     printf("  %s%s list%s                 - List all key-value pairs\n", COLOR_YELLOW, progname, COLOR_RESET);
     printf("  %s%s clear%s                - Clear all entries\n", COLOR_YELLOW, progname, COLOR_RESET);
     printf("  %s%s count%s                - Show number of entries\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s info%s                 - Show memory use and expiry/eviction counters\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s stats%s                - Show table shape, memory breakdown and load time\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s convert%s              - Rewrite the storage file in the indexed format\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s serve [options]%s      - Serve the store over TCP or a Unix socket\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("      --port <n>  --bind <addr>  --unix <path>\n");
+    printf("      --replicaof <host:port>  (follow a primary as a read-only replica)\n");
+    printf("  %s%s loadgen [options]%s    - Benchmark a running server\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("      --host <addr>  --port <n>  --unix <path>  -c <conns>  -n <requests>\n");
+    printf("      -P <pipeline>  -r <keyspace>  -d <value size>  --get-percent <0-100>\n");
+    printf("  %s%s bench [table] [max_keys]%s - Benchmark the hash table engine\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s bench threads [keys]%s - Benchmark concurrent access from 1-64 threads\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s bench scan [keys]%s    - Benchmark prefix and range scan latency\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s bench hash [keys]%s    - Compare hash functions' speed and distribution\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s bench snapshot [keys]%s - Compare compressed and raw snapshot blocks\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("  %s%s bench ycsb [records]%s - Run YCSB workloads A-F against the table\n", COLOR_YELLOW, progname, COLOR_RESET);
+    printf("      --ops <n>  --workloads <ABCDEF>  --dist <zipfian|uniform|both>\n");
+    printf("      --value-size <n>  --seed <n>  --json <path|->  --label <text>\n");
     printf("  %s%s help%s                 - Show this help message\n", COLOR_YELLOW, progname, COLOR_RESET);
     printf("\n%sExamples:%s\n", COLOR_BOLD, COLOR_RESET);
     printf("  %s%s set name \"John Doe\"%s\n", COLOR_YELLOW, progname, COLOR_RESET);
@@ -311,34 +6028,104 @@ void print_usage(const char *progname) {
 }
 
 int main(int argc, char *argv[]) {
+    init_hash_seed();
+    
+    // Benchmarks build their own tables and never touch the storage file
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        const char *kind = argc >= 3 && !isdigit((unsigned char)argv[2][0]) ? argv[2] : "table";
+        const char *size_arg = argc >= 3 && isdigit((unsigned char)argv[2][0]) ? argv[2] :
+                               (argc >= 4 && isdigit((unsigned char)argv[3][0]) ? argv[3] : NULL);
+        size_t size = size_arg ? strtoull(size_arg, NULL, 10) : 100000;
+        if (size == 0) {
+            printf("%sError:%s Key count must be positive.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
+        }
+        
+        if (strcmp(kind, "table") == 0) {
+            return run_table_bench(size);
+        } else if (strcmp(kind, "threads") == 0) {
+            return run_thread_bench(size);
+        } else if (strcmp(kind, "scan") == 0) {
+            return run_scan_bench(size);
+        } else if (strcmp(kind, "hash") == 0) {
+            return run_hash_bench(size);
+        } else if (strcmp(kind, "snapshot") == 0) {
+            return run_snapshot_bench(size);
+        } else if (strcmp(kind, "ycsb") == 0) {
+            return run_ycsb_bench(size, argc, argv);
+        }
+        printf("%sError:%s Unknown benchmark: %s%s%s\n", COLOR_RED COLOR_BOLD, COLOR_RESET, COLOR_YELLOW, kind, COLOR_RESET);
+        return 1;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "loadgen") == 0) {
+        LoadConfig cfg = { "127.0.0.1", DEFAULT_SERVER_PORT, NULL, 4, 1000000, 64, 100000, 50, 16 };
+        for (int i = 2; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--host") == 0) cfg.host = argv[i + 1];
+            else if (strcmp(argv[i], "--port") == 0) cfg.port = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "--unix") == 0) cfg.unix_path = argv[i + 1];
+            else if (strcmp(argv[i], "-c") == 0) cfg.conns = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-n") == 0) cfg.requests = atol(argv[i + 1]);
+            else if (strcmp(argv[i], "-P") == 0) cfg.pipeline = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-r") == 0) cfg.keyspace = atol(argv[i + 1]);
+            else if (strcmp(argv[i], "-d") == 0) cfg.value_size = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "--get-percent") == 0) cfg.get_percent = atoi(argv[i + 1]);
+        }
+        if (cfg.conns <= 0 || cfg.requests <= 0 || cfg.pipeline <= 0 || cfg.keyspace <= 0 ||
+            cfg.value_size < 0 || cfg.value_size >= MAX_VAL_LEN) {
+            printf("%sError:%s Invalid load generator options.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            return 1;
+        }
+        return run_loadgen(&cfg);
+    }
+    
     // Initialize table
     table = create_table();
     if (!table) {
         return 1;
     }
     
-    // Load existing data
-    load_from_disk();
-    
     if (argc < 2) {
         print_usage(argv[0]);
         free_table();
         return 1;
     }
     
+    // Load existing data; a single get reads straight from the mapped snapshot
+    configure_wal();
+    configure_cache();
+    if (strcmp(argv[1], "get") != 0) {
+        load_from_disk();
+    }
+    
     int result = 0;
     
     if (strcmp(argv[1], "set") == 0) {
+        int64_t expire_at = argc == 6 ? parse_expiry(argv[4], argv[5]) : 0;
         if (argc < 4) {
             printf("%sError:%s 'set' requires key and value arguments.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
             print_usage(argv[0]);
+        } else if (argc == 5 || argc > 6 || expire_at < 0) {
+            printf("%sError:%s Expected %sEX <seconds>%s or %sPX <milliseconds>%s after the value.\n",
+                   COLOR_RED COLOR_BOLD, COLOR_RESET, COLOR_YELLOW, COLOR_RESET, COLOR_YELLOW, COLOR_RESET);
+            result = 1;
+        } else if (cache.policy == EVICT_NONE && over_memory_limit()) {
+            printf("%sError:%s Memory limit reached.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            result = 1;
         } else {
-            if (set_value(argv[2], argv[3])) {
-                printf("%s✓ Set%s '%s%s%s' = '%s%s%s'\n", 
+            int ok = set_value_expire(argv[2], argv[3], expire_at) && wal_append_set(argv[2], argv[3], expire_at);
+            if (ok) {
+                evict_if_needed();
+            }
+            if (ok && commit_log()) {
+                printf("%s✓ Set%s '%s%s%s' = '%s%s%s'", 
                        COLOR_GREEN COLOR_BOLD, COLOR_RESET,
                        COLOR_YELLOW, argv[2], COLOR_RESET,
                        COLOR_CYAN, argv[3], COLOR_RESET);
-                save_to_disk();
+                if (expire_at) {
+                    printf(" (expires in %lld ms)", (long long)(expire_at - now_ms()));
+                }
+                printf("\n");
             } else {
                 result = 1;
             }
@@ -348,7 +6135,16 @@ int main(int argc, char *argv[]) {
             printf("%sError:%s 'get' requires a key argument.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
             print_usage(argv[0]);
         } else {
-            const char *value = get_value(argv[2]);
+            static char buf[MAX_VAL_LEN];
+            const char *value = NULL;
+            int found = lookup_from_disk(argv[2], buf);
+            if (found < 0) {
+                // Snapshot predates the indexed format
+                load_from_disk();
+                value = get_value(argv[2]);
+            } else if (found) {
+                value = buf;
+            }
             if (value) {
                 printf("%s%s%s\n", COLOR_CYAN, value, COLOR_RESET);
             } else {
@@ -362,23 +6158,230 @@ int main(int argc, char *argv[]) {
             print_usage(argv[0]);
         } else {
             if (delete_value(argv[2])) {
-                printf("%s✓ Deleted%s key '%s%s%s'\n", 
-                       COLOR_GREEN COLOR_BOLD, COLOR_RESET,
-                       COLOR_YELLOW, argv[2], COLOR_RESET);
-                save_to_disk();
+                if (persist(LOG_DELETE, argv[2], NULL)) {
+                    printf("%s✓ Deleted%s key '%s%s%s'\n", 
+                           COLOR_GREEN COLOR_BOLD, COLOR_RESET,
+                           COLOR_YELLOW, argv[2], COLOR_RESET);
+                } else {
+                    result = 1;
+                }
+            } else {
+                printf("%sKey '%s%s%s' not found.%s\n", COLOR_YELLOW, COLOR_BOLD, argv[2], COLOR_YELLOW, COLOR_RESET);
+                result = 1;
+            }
+        }
+    } else if (strcmp(argv[1], "mset") == 0) {
+        if (argc < 4 || argc % 2 != 0) {
+            printf("%sError:%s 'mset' requires key and value pairs.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            print_usage(argv[0]);
+            result = 1;
+        } else {
+            // Check every pair before touching the table, then log them as one group
+            for (int i = 2; i < argc && result == 0; i += 2) {
+                if (!check_pair(strlen(argv[i]), strlen(argv[i + 1]))) {
+                    result = 1;
+                }
+            }
+            if (cache.policy == EVICT_NONE && over_memory_limit()) {
+                printf("%sError:%s Memory limit reached.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+                result = 1;
+            }
+            for (int i = 2; i < argc && result == 0; i += 2) {
+                if (!set_value(argv[i], argv[i + 1]) || !wal_append(LOG_SET, argv[i], argv[i + 1])) {
+                    result = 1;
+                }
+            }
+            if (result == 0) {
+                evict_if_needed();
+            }
+            if (result == 0 && commit_log()) {
+                printf("%s✓ Set%s %d pairs\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET, (argc - 2) / 2);
+            } else {
+                result = 1;
+            }
+        }
+    } else if (strcmp(argv[1], "mget") == 0) {
+        if (argc < 3) {
+            printf("%sError:%s 'mget' requires at least one key.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            print_usage(argv[0]);
+            result = 1;
+        } else {
+            // One line per key, in order, so the output lines up with the arguments
+            for (int i = 2; i < argc; i++) {
+                const char *value = get_value(argv[i]);
+                if (value) {
+                    printf("%s%s%s\n", COLOR_CYAN, value, COLOR_RESET);
+                } else {
+                    printf("%s(nil)%s\n", COLOR_YELLOW, COLOR_RESET);
+                    result = 1;
+                }
+            }
+        }
+    } else if (strcmp(argv[1], "mdel") == 0) {
+        if (argc < 3) {
+            printf("%sError:%s 'mdel' requires at least one key.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            print_usage(argv[0]);
+            result = 1;
+        } else {
+            int deleted = 0;
+            for (int i = 2; i < argc; i++) {
+                if (delete_value(argv[i])) {
+                    wal_append(LOG_DELETE, argv[i], NULL);
+                    deleted++;
+                }
+            }
+            if (commit_log()) {
+                printf("%s✓ Deleted%s %d of %d keys\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET, deleted, argc - 2);
+            } else {
+                result = 1;
+            }
+        }
+    } else if (strcmp(argv[1], "import") == 0 || strcmp(argv[1], "export") == 0) {
+        const char *path = "-";
+        const char *format_name = NULL;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+                format_name = argv[++i];
+            } else {
+                path = argv[i];
+            }
+        }
+        DataFormat format;
+        if (!parse_format(format_name, path, &format)) {
+            result = 1;
+        } else if (argv[1][0] == 'i') {
+            result = !import_pairs(path, format);
+        } else {
+            result = !export_pairs(path, format);
+        }
+    } else if (strcmp(argv[1], "scan") == 0 || strcmp(argv[1], "range") == 0) {
+        // scan <prefix> [limit] and range <from> <to> [limit], plus --after <cursor>
+        int bounds = strcmp(argv[1], "range") == 0 ? 2 : 1;
+        const char *args[3] = { NULL, NULL, NULL };
+        int nargs = 0;
+        KeyRange range = {0};
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--after") == 0 && i + 1 < argc) {
+                range.after = argv[++i];
+            } else if (nargs < 3) {
+                args[nargs++] = argv[i];
+            }
+        }
+        if (nargs < bounds) {
+            printf("%sError:%s '%s' requires %s.\n", COLOR_RED COLOR_BOLD, COLOR_RESET, argv[1],
+                   bounds == 2 ? "from and to keys" : "a key prefix");
+            print_usage(argv[0]);
+            result = 1;
+        } else {
+            if (bounds == 2) {
+                range.from = args[0];
+                range.to = args[1];
+            } else {
+                range.prefix = args[0];
+            }
+            size_t limit = args[bounds] ? strtoull(args[bounds], NULL, 10) : 0;
+            char cursor[MAX_KEY_LEN];
+            long visited = scan_range(table, &range, limit, print_pair, NULL, cursor);
+            if (visited < 0) {
+                result = 1;
+            } else if (visited == 0) {
+                printf("%sNo matching entries.%s\n", COLOR_YELLOW, COLOR_RESET);
+            } else if (cursor[0]) {
+                printf("%sMore entries follow; continue with --after '%s'%s\n", COLOR_YELLOW, cursor, COLOR_RESET);
+            }
+        }
+    } else if (strcmp(argv[1], "expire") == 0) {
+        char *end = NULL;
+        long long seconds = argc >= 4 ? strtoll(argv[3], &end, 10) : 0;
+        if (argc < 4 || *end != '\0' || end == argv[3]) {
+            printf("%sError:%s 'expire' requires a key and a number of seconds.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            print_usage(argv[0]);
+            result = 1;
+        } else {
+            int64_t expire_at = now_ms() + seconds * 1000;
+            char text[24];
+            snprintf(text, sizeof(text), "%lld", (long long)expire_at);
+            if (!expire_value(argv[2], expire_at)) {
+                printf("%sKey '%s%s%s' not found.%s\n", COLOR_YELLOW, COLOR_BOLD, argv[2], COLOR_YELLOW, COLOR_RESET);
+                result = 1;
+            } else if (persist(LOG_EXPIRE, argv[2], text)) {
+                printf("%s✓ Key%s '%s%s%s' expires in %lld s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET,
+                       COLOR_YELLOW, argv[2], COLOR_RESET, seconds > 0 ? seconds : 0);
             } else {
+                result = 1;
+            }
+        }
+    } else if (strcmp(argv[1], "ttl") == 0) {
+        if (argc < 3) {
+            printf("%sError:%s 'ttl' requires a key argument.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            print_usage(argv[0]);
+            result = 1;
+        } else {
+            int64_t ttl = ttl_value(argv[2]);
+            if (ttl == -2) {
                 printf("%sKey '%s%s%s' not found.%s\n", COLOR_YELLOW, COLOR_BOLD, argv[2], COLOR_YELLOW, COLOR_RESET);
                 result = 1;
+            } else if (ttl == -1) {
+                printf("%sKey '%s%s%s' does not expire.%s\n", COLOR_YELLOW, COLOR_BOLD, argv[2], COLOR_YELLOW, COLOR_RESET);
+            } else {
+                printf("%s%lld%s s\n", COLOR_CYAN, (long long)(ttl + 999) / 1000, COLOR_RESET);
             }
         }
+    } else if (strcmp(argv[1], "info") == 0) {
+        char text[1024];
+        format_info(text, sizeof(text), "\n");
+        printf("%s", text);
+    } else if (strcmp(argv[1], "stats") == 0) {
+        static char text[8192];
+        format_stats(text, sizeof(text), "\n");
+        printf("%s", text);
     } else if (strcmp(argv[1], "list") == 0) {
         list_all();
     } else if (strcmp(argv[1], "clear") == 0) {
         clear_all();
-        save_to_disk();
-        printf("%s✓ Cleared all entries.%s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET);
+        if (persist(LOG_CLEAR, NULL, NULL)) {
+            printf("%s✓ Cleared all entries.%s\n", COLOR_GREEN COLOR_BOLD, COLOR_RESET);
+        } else {
+            result = 1;
+        }
+    } else if (strcmp(argv[1], "convert") == 0) {
+        // Everything is loaded, so the logs are folded into the new snapshot
+        if (checkpoint()) {
+            printf("%s✓ Converted%s %zu entries to the indexed snapshot format.\n",
+                   COLOR_GREEN COLOR_BOLD, COLOR_RESET, table_count(table));
+        } else {
+            result = 1;
+        }
+    } else if (strcmp(argv[1], "serve") == 0) {
+        const char *bind_addr = "127.0.0.1";
+        const char *unix_path = NULL;
+        int port = DEFAULT_SERVER_PORT;
+        for (int i = 2; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--port") == 0) port = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "--bind") == 0) bind_addr = argv[i + 1];
+            else if (strcmp(argv[i], "--unix") == 0) unix_path = argv[i + 1];
+            else if (strcmp(argv[i], "--replicaof") == 0) {
+                char *colon = strrchr(argv[i + 1], ':');
+                if (colon) {
+                    *colon = '\0';
+                    server.primary_host = argv[i + 1];
+                    server.primary_port = atoi(colon + 1);
+                } else {
+                    server.primary_port = -1;
+                }
+            }
+        }
+        if (port <= 0 || port > 65535) {
+            printf("%sError:%s Invalid port number.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            result = 1;
+        } else if (server.primary_port < 0 || server.primary_port > 65535 || (server.primary_host && server.primary_port == 0)) {
+            printf("%sError:%s --replicaof expects <host:port>.\n", COLOR_RED COLOR_BOLD, COLOR_RESET);
+            result = 1;
+        } else {
+            result = run_server(bind_addr, port, unix_path);
+        }
     } else if (strcmp(argv[1], "count") == 0) {
-        printf("%s%d%s entries in store.\n", COLOR_CYAN COLOR_BOLD, table->count, COLOR_RESET);
+        printf("%s%zu%s entries in store.\n", COLOR_CYAN COLOR_BOLD, table_count(table), COLOR_RESET);
     } else if (strcmp(argv[1], "help") == 0 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
         print_usage(argv[0]);
     } else {